@@ -0,0 +1,656 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+#include "CpuMath.h"
+#include "CpuRayTracer.h"
+#include "CpuSimd.h"
+#include "ThreadPool.h"
+
+/*
+ ------------------------------BVH------------------------------------
+ Bounding volume hierarchy over the triangles of a MeshData, what CreateBlas asks the driver for, on the CPU.
+ Builders (BvhSahBuilder.h, BvhLbvhBuilder.h, BvhBuilder.h picks one) produce a tree of BvhBuildNodes in a BvhArena, Flatten turns it into the compact
+ node array traversal runs on:
+	- an interior node's children are adjacent, 'offset' is the left one and 'offset' + 1 the right one
+	- children come after their parent, Flatten lays sibling pairs out depth first, Relayout (BvhLayout.h) can reorder them
+	- leaves reference 'count' triangles starting at 'offset' in the reordered triangle array
+ 32 byte nodes, two per cache line, BvhNodeAllocator lines them up so siblings share one.
+ Traversal reads the arrays through BvhSpans: the Bvh's own vectors, or a mapped cache file (BvhDiskCache.h).
+*/
+
+namespace CpuRt
+{
+	struct Aabb
+	{
+		Float3 min = { std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+		Float3 max = { -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max() };
+
+		void Grow(const Float3& p) { min = Min(min, p); max = Max(max, p); }
+		void Grow(const Aabb& b) { min = Min(min, b.min); max = Max(max, b.max); }
+		bool Empty() const { return min.x > max.x; }
+		Float3 Extent() const { return max - min; }
+		Float3 Centroid() const { return (min + max) * 0.5f; }
+
+		float HalfArea() const
+		{
+			if (Empty()) return 0.0f;
+			const Float3 e = Extent();
+			return e.x * e.y + e.y * e.z + e.z * e.x;
+		}
+
+		int LargestAxis() const
+		{
+			const Float3 e = Extent();
+			return (e.x >= e.y && e.x >= e.z) ? 0 : (e.y >= e.z ? 1 : 2);
+		}
+	};
+
+	// What builders sort and partition: a triangle's bounds and index together, so binning streams through memory
+	struct BvhPrimitiveRef
+	{
+		Float3 boundsMin;
+		uint32_t primitive;
+		Float3 boundsMax;
+		uint32_t padding;
+
+		Float3 Centroid() const { return (boundsMin + boundsMax) * 0.5f; }
+	};
+
+	struct BvhNode
+	{
+		Float3 boundsMin;
+		uint32_t offset;		// interior: left child, the right one at offset + 1; leaf: first triangle
+		Float3 boundsMax;
+		uint16_t count;			// 0 for interior nodes
+		uint16_t axis;			// split axis, traversal visits the child on the ray's side first
+
+		bool IsLeaf() const { return count != 0; }
+	};
+
+	static_assert(sizeof(BvhNode) == 32, "BvhNode should stay half a cache line");
+
+	// Node storage starts half way into a cache line: node 0 is the root, sibling pairs start at odd indices, so every
+	// pair fills exactly one line
+	template<typename T>
+	struct BvhNodeAllocator
+	{
+		using value_type = T;
+		static constexpr size_t gLineBytes = 64;
+
+		BvhNodeAllocator() = default;
+		template<typename U> BvhNodeAllocator(const BvhNodeAllocator<U>&) {}
+
+		T* allocate(size_t count)
+		{
+			char* line = static_cast<char*>(::operator new(count * sizeof(T) + gLineBytes, std::align_val_t(gLineBytes)));
+			return reinterpret_cast<T*>(line + gLineBytes / 2);
+		}
+
+		void deallocate(T* pointer, size_t)
+		{
+			::operator delete(reinterpret_cast<char*>(pointer) - gLineBytes / 2, std::align_val_t(gLineBytes));
+		}
+
+		template<typename U> bool operator==(const BvhNodeAllocator<U>&) const { return true; }
+		template<typename U> bool operator!=(const BvhNodeAllocator<U>&) const { return false; }
+	};
+
+	using BvhNodeArray = std::vector<BvhNode, BvhNodeAllocator<BvhNode>>;
+
+	// Pointer and count of an array the span does not own, what code that only reads nodes takes
+	template<typename T>
+	class BvhSpan
+	{
+	public:
+		BvhSpan() = default;
+		BvhSpan(T* first, size_t count) : first(first), count(count) {}
+		template<typename U> BvhSpan(const BvhSpan<U>& other) : first(other.data()), count(other.size()) {}
+		template<typename Container> BvhSpan(Container& container) : first(container.data()), count(container.size()) {}
+
+		T* data() const { return first; }
+		size_t size() const { return count; }
+		bool empty() const { return count == 0; }
+		T* begin() const { return first; }
+		T* end() const { return first + count; }
+		T& operator[](size_t index) const { return first[index]; }
+
+	private:
+		T* first = nullptr;
+		size_t count = 0;
+	};
+
+	using BvhNodeSpan = BvhSpan<const BvhNode>;
+
+	struct BvhSettings
+	{
+		uint32_t binCount = 32;					// SAH bins per axis
+		uint32_t maxLeafSize = 8;				// larger nodes are always split
+		float traversalCost = 1.0f;				// SAH cost of visiting a node ...
+		float intersectionCost = 1.0f;			// ... and of intersecting a triangle
+		uint32_t taskThreshold = 4096;			// nodes with more triangles build their children as separate tasks
+		uint32_t parallelBinThreshold = 65536;	// nodes with more triangles bin and partition data parallel
+		uint32_t mortonBits = 30;				// LBVH: 30 (10 per axis) or 63 (21 per axis) bit Morton codes
+		uint32_t treeletRounds = 0;				// LBVH: treelet restructuring passes, 0 to skip
+		float rebuildThreshold = 1.5f;			// refit: rebuild once the SAH cost grew past this times the built tree's
+		float spatialSplitAlpha = 1e-5f;		// SBVH: try spatial splits where object split children overlap by more than this times the root area
+		float splitBudget = 0.3f;				// SBVH: duplicated references, as a fraction of the triangle count
+	};
+
+	struct BvhStats
+	{
+		double buildMilliseconds = 0.0;
+		size_t nodes = 0;
+		size_t leaves = 0;
+		uint32_t maxDepth = 0;
+		float sahCost = 0.0f;			// current, refits update it
+		float builtSahCost = 0.0f;		// right after the build
+		uint32_t refits = 0;			// since the build
+	};
+
+	constexpr uint32_t gBvhRefitTaskDepth = 6;	// refit subtrees below this depth run as one task each
+
+	/*
+	 Build time tree. Nodes come from a BvhArena.
+	*/
+	struct BvhBuildNode
+	{
+		Aabb bounds;
+		uint32_t children[2];		// arena indices, interior nodes only
+		uint32_t first;				// leaf: first entry of the builder's primitive index array
+		uint32_t count;				// leaf: triangle count, 0 for interior nodes
+		uint32_t axis;
+		uint32_t subtreeSize;		// nodes in this subtree including itself, filled in by the builder
+	};
+
+	// Bump allocator over storage sized for the worst case (2N - 1 nodes), safe to allocate from any task
+	class BvhArena
+	{
+	public:
+		void Reset(size_t primitiveCount)
+		{
+			nodes.resize(std::max<size_t>(1, 2 * primitiveCount));
+			next = 0;
+		}
+
+		uint32_t Allocate(uint32_t count)
+		{
+			const uint32_t index = next.fetch_add(count, std::memory_order_relaxed);
+			if (size_t(index) + count > nodes.size())
+			{
+				throw std::runtime_error("Error: BVH arena exhausted");
+			}
+			return index;
+		}
+
+		BvhBuildNode& operator[](uint32_t index) { return nodes[index]; }
+		const BvhBuildNode& operator[](uint32_t index) const { return nodes[index]; }
+		uint32_t Size() const { return next.load(); }
+
+	private:
+		std::vector<BvhBuildNode> nodes;
+		std::atomic<uint32_t> next{ 0 };
+	};
+
+	class Bvh
+	{
+	public:
+		Bvh() = default;
+		Bvh(const Bvh& other) { *this = other; }
+		Bvh(Bvh&& other) noexcept { *this = std::move(other); }
+
+		// Copies own their arrays, a copy of a mapped tree too
+		Bvh& operator=(const Bvh& other)
+		{
+			if (this == &other) return *this;
+			nodeStorage.assign(other.nodes.begin(), other.nodes.end());
+			primitiveIdStorage.assign(other.primitiveIds.begin(), other.primitiveIds.end());
+			triangleStorage.assign(other.triangles.begin(), other.triangles.end());
+			backing.reset();
+			BindStorage();
+			stats = other.stats;
+			prefetchFarChild = other.prefetchFarChild;
+			return *this;
+		}
+
+		// Moved vectors keep their buffers, the spans stay valid
+		Bvh& operator=(Bvh&& other) noexcept
+		{
+			if (this == &other) return *this;
+			nodeStorage = std::move(other.nodeStorage);
+			primitiveIdStorage = std::move(other.primitiveIdStorage);
+			triangleStorage = std::move(other.triangleStorage);
+			backing = std::move(other.backing);
+			nodes = other.nodes;
+			primitiveIds = other.primitiveIds;
+			triangles = other.triangles;
+			stats = other.stats;
+			prefetchFarChild = other.prefetchFarChild;
+			other.nodes = {};
+			other.primitiveIds = {};
+			other.triangles = {};
+			return *this;
+		}
+
+		bool Empty() const { return nodes.empty(); }
+		BvhNodeSpan Nodes() const { return nodes; }
+		uint32_t PrimitiveId(uint32_t triangle) const { return primitiveIds[triangle]; }
+		size_t TriangleCount() const { return primitiveIds.size(); }		// triangle references, spatial splits duplicate some
+		const BvhStats& Stats() const { return stats; }
+		const Float3* TrianglePositions(uint32_t triangle) const { return &triangles[size_t(triangle) * 3]; }
+
+		// Traversal prefetches what the far child references (its children or triangles) when it pushes it
+		bool PrefetchFarChild() const { return prefetchFarChild; }
+		void SetPrefetchFarChild(bool enable) { prefetchFarChild = enable; }
+
+		// Closest hit, or the first one found with RayFlagAcceptFirstHitAndEndSearch. Runs the traversal instantiated for the flags.
+		bool Intersect(const Ray& ray, uint32_t rayFlags, RayHit& hit) const
+		{
+			hit.t = ray.tMax;
+			if (nodes.empty()) return false;
+			return IntersectSubtree(0, ray, rayFlags, hit);
+		}
+
+		// Same below 'root' only, for hits nearer than hit.t. Packet traversal (BvhPacket.h) finishes diverged rays with it.
+		bool IntersectSubtree(uint32_t root, const Ray& ray, uint32_t rayFlags, RayHit& hit) const
+		{
+			return DispatchRayFlags(rayFlags, [&](auto flags) { return Traverse(root, ray, flags, hit, [](uint32_t) {}); });
+		}
+
+		// 'visit' sees the index of every node the traversal loads, BvhLayout.h profiles and replays those
+		template<typename NodeVisitor>
+		bool IntersectSubtree(uint32_t root, const Ray& ray, uint32_t rayFlags, RayHit& hit, NodeVisitor&& visit) const
+		{
+			return Traverse(root, ray, RuntimeRayFlags{ rayFlags }, hit, visit);
+		}
+
+		/*
+		 Any hit in (tMin, tMax): the search ends on the first triangle that is hit, the interval never shrinks so
+		 which child goes first does not matter and children are taken in memory order.
+		*/
+		bool Occluded(const Ray& ray, uint32_t rayFlags) const
+		{
+			RayHit hit;
+			hit.t = ray.tMax;
+			if (nodes.empty()) return false;
+			return IntersectSubtree(0, ray, rayFlags | RayFlagAcceptFirstHitAndEndSearch | RayFlagSkipClosestHitShader, hit);
+		}
+
+		// The traversal kernel, over RuntimeRayFlags or one of the StaticRayFlags (CpuRayTracer.h)
+		template<typename RayFlags, typename NodeVisitor>
+		bool Traverse(uint32_t root, const Ray& ray, const RayFlags& rayFlags, RayHit& hit, NodeVisitor&& visit) const
+		{
+			const Float3 invDir = { 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z };
+			const uint32_t dirNegative[3] = { invDir.x < 0.0f, invDir.y < 0.0f, invDir.z < 0.0f };
+
+			// LBVH trees can get as deep as their key bits plus the bits of the duplicate key tie break
+			uint32_t stack[128];
+			uint32_t stackSize = 0;
+			uint32_t current = root;
+			bool found = false;
+
+			for (;;)
+			{
+				const BvhNode& node = nodes[current];
+				visit(current);
+				if (IntersectBounds(node, ray.origin, invDir, ray.tMin, hit.t))
+				{
+					if (node.IsLeaf())
+					{
+						for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+						{
+							if (IntersectTriangle(ray, rayFlags, triangles[i * 3], triangles[i * 3 + 1], triangles[i * 3 + 2], ray.tMin, hit, primitiveIds[i]))
+							{
+								found = true;
+								if (rayFlags.AcceptFirstHit()) return true;
+							}
+						}
+					}
+					else
+					{
+						// Near child next, far child on the stack. The far child sits next to the near one, the line it
+						// needs once popped is the one it points to. Any hit searches skip the ordering.
+						const uint32_t left = node.offset, right = node.offset + 1;
+						const bool rightFirst = !rayFlags.AcceptFirstHit() && dirNegative[node.axis] != 0;
+						const uint32_t far = rightFirst ? left : right;
+						if (prefetchFarChild) PrefetchFarChildData(far);
+						stack[stackSize++] = far;
+						current = rightFirst ? right : left;
+						continue;
+					}
+				}
+
+				if (stackSize == 0) break;
+				current = stack[--stackSize];
+			}
+			return found;
+		}
+
+		// Surface area heuristic cost of the flattened tree, relative to the root
+		float ComputeSahCost(const BvhSettings& settings = {}) const
+		{
+			if (nodes.empty()) return 0.0f;
+			const float rootArea = std::max(NodeBounds(0).HalfArea(), std::numeric_limits<float>::min());
+			double cost = 0.0;
+			for (size_t i = 0; i < nodes.size(); i++)
+			{
+				const float area = NodeBounds(uint32_t(i)).HalfArea() / rootArea;
+				cost += nodes[i].IsLeaf() ? area * nodes[i].count * settings.intersectionCost : area * settings.traversalCost;
+			}
+			return static_cast<float>(cost);
+		}
+
+		// Surface area of the boxes shared by sibling pairs over the total area of those pairs: 0 when no two siblings
+		// overlap (touching does not count), 1 when every pair is two copies of the same box
+		float ComputeChildOverlap() const
+		{
+			double shared = 0.0, total = 0.0;
+			for (const BvhNode& node : nodes)
+			{
+				if (node.IsLeaf()) continue;
+				const Aabb left = NodeBounds(node.offset), right = NodeBounds(node.offset + 1);
+				Aabb overlap;
+				overlap.min = Max(left.min, right.min);
+				overlap.max = Min(left.max, right.max);
+				if (overlap.min.x < overlap.max.x && overlap.min.y < overlap.max.y && overlap.min.z < overlap.max.z) shared += 2.0 * overlap.HalfArea();
+				total += double(left.HalfArea()) + right.HalfArea();
+			}
+			return total > 0.0 ? static_cast<float>(shared / total) : 0.0f;
+		}
+
+		Aabb NodeBounds(uint32_t index) const
+		{
+			Aabb bounds;
+			bounds.min = nodes[index].boundsMin;
+			bounds.max = nodes[index].boundsMax;
+			return bounds;
+		}
+
+		/*
+		 Turns a builder's tree into the node array. 'order' maps leaf triangle ranges to mesh triangles, an empty
+		 'mesh' leaves the tree without triangles (built over boxes, not traceable by itself).
+		 Subtrees above the task threshold are flattened in parallel, every subtree knows where it goes from subtreeSize.
+		*/
+		void Flatten(const BvhArena& arena, uint32_t root, const MeshData& mesh, const std::vector<uint32_t>& order, const BvhSettings& settings, ThreadPool& pool)
+		{
+			nodeStorage.resize(arena[root].subtreeSize);
+			primitiveIdStorage = order;
+			triangleStorage.resize(mesh.indices.empty() ? 0 : order.size() * 3);
+			backing.reset();
+			BindStorage();
+
+			if (!triangles.empty()) pool.ParallelFor(order.size(), 4096, [&](size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					const uint32_t* indices = &mesh.indices[size_t(order[i]) * 3];
+					triangles[i * 3 + 0] = mesh.vertices[indices[0]].position;
+					triangles[i * 3 + 1] = mesh.vertices[indices[1]].position;
+					triangles[i * 3 + 2] = mesh.vertices[indices[2]].position;
+				}
+			});
+
+			TaskGroup group;
+			FlattenSubtree(arena, root, 0, 1, settings, pool, group);
+			pool.Wait(group);
+
+			stats.nodes = nodes.size();
+			stats.leaves = 0;
+			for (const BvhNode& node : nodes) stats.leaves += node.IsLeaf();
+			stats.maxDepth = ComputeDepth();
+			stats.sahCost = ComputeSahCost(settings);
+			stats.builtSahCost = stats.sahCost;
+			stats.refits = 0;
+		}
+
+		/*
+		 Refit to moved vertices of the mesh the tree was built for: the topology stays, bounds are recomputed
+		 bottom up, the top gBvhRefitTaskDepth levels fork into tasks. Cheap, but the tree only gets worse as the
+		 mesh deforms, SahDegradation tells how much.
+		*/
+		void Refit(const MeshData& mesh, const BvhSettings& settings, ThreadPool& pool)
+		{
+			if (nodes.empty()) return;
+			if (mesh.TriangleCount() != primitiveIds.size())
+			{
+				throw std::runtime_error("Error: BVH refit with a different triangle count than the build");
+			}
+
+			pool.ParallelFor(primitiveIds.size(), 4096, [&](size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					const uint32_t* indices = &mesh.indices[size_t(primitiveIds[i]) * 3];
+					triangles[i * 3 + 0] = mesh.vertices[indices[0]].position;
+					triangles[i * 3 + 1] = mesh.vertices[indices[1]].position;
+					triangles[i * 3 + 2] = mesh.vertices[indices[2]].position;
+				}
+			});
+
+			const double cost = RefitSubtree(0, 0, settings, pool);
+			stats.sahCost = static_cast<float>(cost / std::max(NodeBounds(0).HalfArea(), std::numeric_limits<float>::min()));
+			stats.refits++;
+		}
+
+		// Current SAH cost over the cost right after the build, 1 for a fresh tree
+		float SahDegradation() const
+		{
+			return stats.builtSahCost > 0.0f ? stats.sahCost / stats.builtSahCost : 1.0f;
+		}
+
+		void SetBuildTime(double milliseconds) { stats.buildMilliseconds = milliseconds; }
+
+		/*
+		 Traces out of arrays someone else owns, laid out as Flatten leaves them: BvhDiskCache.h hands in a mapped
+		 cache file this way, 'backing' keeps the mapping alive as long as the tree (and its moves) point into it.
+		 Refit writes through the spans, so the memory has to be writable (the cache maps copy on write), Flatten
+		 and Relayout go back to owned vectors.
+		*/
+		void Attach(BvhSpan<BvhNode> mappedNodes, BvhSpan<uint32_t> mappedPrimitiveIds, BvhSpan<Float3> mappedTriangles, const BvhStats& mappedStats,
+			std::shared_ptr<const void> mappedBacking)
+		{
+			nodeStorage = {};
+			primitiveIdStorage = {};
+			triangleStorage = {};
+			nodes = mappedNodes;
+			primitiveIds = mappedPrimitiveIds;
+			triangles = mappedTriangles;
+			backing = std::move(mappedBacking);
+			stats = mappedStats;
+		}
+
+		// Whether the arrays are the tree's own or attached ones
+		bool IsAttached() const { return backing != nullptr; }
+
+		/*
+		 Moves the nodes into a new order, 'order' lists the current node indices in the order they should end up in.
+		 Sibling pairs have to stay adjacent, left first, and follow their parent, the root stays first.
+		*/
+		void Relayout(const std::vector<uint32_t>& order)
+		{
+			if (order.size() != nodes.size() || (!order.empty() && order[0] != 0))
+			{
+				throw std::runtime_error("Error: BVH relayout order does not cover the tree");
+			}
+
+			std::vector<uint32_t> newIndex(nodes.size(), std::numeric_limits<uint32_t>::max());
+			for (size_t i = 0; i < order.size(); i++)
+			{
+				if (order[i] >= nodes.size() || newIndex[order[i]] != std::numeric_limits<uint32_t>::max())
+				{
+					throw std::runtime_error("Error: BVH relayout order does not cover the tree");
+				}
+				newIndex[order[i]] = static_cast<uint32_t>(i);
+			}
+
+			BvhNodeArray reordered(nodes.size());
+			for (size_t i = 0; i < order.size(); i++)
+			{
+				BvhNode node = nodes[order[i]];
+				if (!node.IsLeaf())
+				{
+					const uint32_t left = newIndex[node.offset];
+					if (newIndex[node.offset + 1] != left + 1 || left <= i)
+					{
+						throw std::runtime_error("Error: BVH relayout separates siblings or puts a child before its parent");
+					}
+					node.offset = left;
+				}
+				reordered[i] = node;
+			}
+			nodeStorage.swap(reordered);
+			nodes = nodeStorage;
+		}
+
+	private:
+		void BindStorage()
+		{
+			nodes = nodeStorage;
+			primitiveIds = primitiveIdStorage;
+			triangles = triangleStorage;
+		}
+
+		static bool IntersectBounds(const BvhNode& node, const Float3& origin, const Float3& invDir, float tMin, float tMax)
+		{
+			const float tx0 = (node.boundsMin.x - origin.x) * invDir.x, tx1 = (node.boundsMax.x - origin.x) * invDir.x;
+			const float ty0 = (node.boundsMin.y - origin.y) * invDir.y, ty1 = (node.boundsMax.y - origin.y) * invDir.y;
+			const float tz0 = (node.boundsMin.z - origin.z) * invDir.z, tz1 = (node.boundsMax.z - origin.z) * invDir.z;
+			const float tNear = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), tMin));
+			const float tFar = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), tMax));
+			return tNear <= tFar;
+		}
+
+		void PrefetchFarChildData(uint32_t index) const
+		{
+			const BvhNode& node = nodes[index];
+			if (node.IsLeaf()) Prefetch(&triangles[size_t(node.offset) * 3]);
+			else Prefetch(&nodes[node.offset]);
+		}
+
+		// 'childIndex' is where the node's children go, the rest of its subtree follows them: left subtree, then right
+		void FlattenSubtree(const BvhArena& arena, uint32_t buildIndex, uint32_t nodeIndex, uint32_t childIndex, const BvhSettings& settings, ThreadPool& pool, TaskGroup& group)
+		{
+			for (;;)
+			{
+				const BvhBuildNode& build = arena[buildIndex];
+				BvhNode& node = nodes[nodeIndex];
+				node.boundsMin = build.bounds.min;
+				node.boundsMax = build.bounds.max;
+				node.axis = static_cast<uint16_t>(build.axis);
+
+				if (build.count > 0)
+				{
+					node.offset = build.first;
+					node.count = static_cast<uint16_t>(build.count);
+					return;
+				}
+
+				const uint32_t left = build.children[0], right = build.children[1];
+				node.offset = childIndex;
+				node.count = 0;
+				const uint32_t leftChildren = childIndex + 2;
+				const uint32_t rightChildren = leftChildren + arena[left].subtreeSize - 1;
+
+				// Right subtree as a task when it is big enough, continue down the left one here
+				if (arena[right].subtreeSize > settings.taskThreshold / settings.maxLeafSize)
+				{
+					const uint32_t rightIndex = childIndex + 1;
+					pool.Run(group, [this, &arena, right, rightIndex, rightChildren, &settings, &pool, &group]()
+					{
+						FlattenSubtree(arena, right, rightIndex, rightChildren, settings, pool, group);
+					});
+				}
+				else
+				{
+					FlattenSubtree(arena, right, childIndex + 1, rightChildren, settings, pool, group);
+				}
+
+				buildIndex = left;
+				nodeIndex = childIndex;
+				childIndex = leftChildren;
+			}
+		}
+
+		// Returns the subtree's SAH cost, not yet divided by the root area
+		double RefitSubtree(uint32_t index, uint32_t depth, const BvhSettings& settings, ThreadPool& pool)
+		{
+			BvhNode& node = nodes[index];
+			Aabb bounds;
+			double cost;
+			if (node.IsLeaf())
+			{
+				for (uint32_t i = node.offset * 3; i < (node.offset + node.count) * 3; i++) bounds.Grow(triangles[i]);
+				cost = double(bounds.HalfArea()) * node.count * settings.intersectionCost;
+			}
+			else
+			{
+				const uint32_t left = node.offset, right = node.offset + 1;
+				double leftCost = 0.0, rightCost = 0.0;
+				if (depth < gBvhRefitTaskDepth)
+				{
+					TaskGroup group;
+					pool.Run(group, [&]() { leftCost = RefitSubtree(left, depth + 1, settings, pool); });
+					rightCost = RefitSubtree(right, depth + 1, settings, pool);
+					pool.Wait(group);
+				}
+				else
+				{
+					leftCost = RefitSubtree(left, depth + 1, settings, pool);
+					rightCost = RefitSubtree(right, depth + 1, settings, pool);
+				}
+
+				bounds = NodeBounds(left);
+				bounds.Grow(NodeBounds(right));
+				cost = double(bounds.HalfArea()) * settings.traversalCost + leftCost + rightCost;
+			}
+
+			node.boundsMin = bounds.min;
+			node.boundsMax = bounds.max;
+			return cost;
+		}
+
+		uint32_t ComputeDepth() const
+		{
+			std::vector<std::pair<uint32_t, uint32_t>> stack = { { 0u, 1u } };
+			uint32_t depth = 0;
+			while (!stack.empty())
+			{
+				const auto entry = stack.back();
+				stack.pop_back();
+				depth = std::max(depth, entry.second);
+				const BvhNode& node = nodes[entry.first];
+				if (!node.IsLeaf())
+				{
+					stack.push_back({ node.offset, entry.second + 1 });
+					stack.push_back({ node.offset + 1, entry.second + 1 });
+				}
+			}
+			return depth;
+		}
+
+		BvhNodeArray nodeStorage;
+		std::vector<uint32_t> primitiveIdStorage;
+		std::vector<Float3> triangleStorage;
+		std::shared_ptr<const void> backing;	// what attached spans point into
+
+		// What traversal reads, the storage above or attached arrays
+		BvhSpan<BvhNode> nodes;
+		BvhSpan<uint32_t> primitiveIds;			// mesh triangle of every reordered triangle
+		BvhSpan<Float3> triangles;				// 3 positions per triangle, in leaf order
+		BvhStats stats;
+		bool prefetchFarChild = false;
+	};
+
+	// Occlusion queries on a Bvh take its any hit traversal
+	inline bool Occluded(const Bvh& bvh, const Ray& ray, uint32_t rayFlags)
+	{
+		return bvh.Occluded(ray, rayFlags);
+	}
+}
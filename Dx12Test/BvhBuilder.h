@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "BvhLbvhBuilder.h"
+#include "BvhSahBuilder.h"
+#include "BvhSbvhBuilder.h"
+
+/*
+ ------------------------------BVH Builder------------------------------------
+ One entry point over the builders, picked per mesh the way CreateBlas picks build flags, and UpdateBvh for
+ deforming meshes (ALLOW_UPDATE / PERFORM_UPDATE):
+	- Sah:  binned SAH, slower to build, faster to trace (PREFER_FAST_TRACE), static geometry
+	- Lbvh: Morton code LBVH, a fraction of the build time (PREFER_FAST_BUILD), geometry rebuilt every frame
+	- Sbvh: binned SAH plus spatial splits, slowest to build, for long thin triangles that overlap under object splits
+*/
+
+namespace CpuRt
+{
+	enum class BvhBuildMode
+	{
+		Sah,
+		Lbvh,
+		Sbvh,
+	};
+
+	inline const char* BvhBuildModeName(BvhBuildMode mode)
+	{
+		switch (mode)
+		{
+		case BvhBuildMode::Sah: return "sah";
+		case BvhBuildMode::Lbvh: return "lbvh";
+		case BvhBuildMode::Sbvh: return "sbvh";
+		}
+		return "unknown";
+	}
+
+	inline BvhBuildMode ParseBvhBuildMode(const char* name)
+	{
+		if (!strcmp(name, "sah")) return BvhBuildMode::Sah;
+		if (!strcmp(name, "lbvh")) return BvhBuildMode::Lbvh;
+		if (!strcmp(name, "sbvh")) return BvhBuildMode::Sbvh;
+		throw std::runtime_error(std::string("Error: unknown BVH builder ") + name);
+	}
+
+	inline Bvh BuildBvh(const MeshData& mesh, BvhBuildMode mode, const BvhSettings& settings = {}, ThreadPool& pool = ThreadPool::Default())
+	{
+		switch (mode)
+		{
+		case BvhBuildMode::Lbvh: return BuildLbvh(mesh, settings, pool);
+		case BvhBuildMode::Sbvh: return BuildSbvh(mesh, settings, pool);
+		case BvhBuildMode::Sah: break;
+		}
+		return BuildSahBvh(mesh, settings, pool);
+	}
+
+	// For meshes whose vertices move between frames: refit, and rebuild from scratch with 'mode' once refitting has
+	// let the SAH cost drift past settings.rebuildThreshold. Returns true when it rebuilt. Trees with duplicated
+	// references (Sbvh) cannot refit to the mesh and always rebuild.
+	inline bool UpdateBvh(Bvh& bvh, const MeshData& mesh, BvhBuildMode mode, const BvhSettings& settings = {}, ThreadPool& pool = ThreadPool::Default())
+	{
+		if (!bvh.Empty() && bvh.TriangleCount() == mesh.TriangleCount())
+		{
+			bvh.Refit(mesh, settings, pool);
+			if (bvh.SahDegradation() <= settings.rebuildThreshold) return false;
+		}
+		bvh = BuildBvh(mesh, mode, settings, pool);
+		return true;
+	}
+}
@@ -0,0 +1,469 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "Bvh.h"
+#include "BvhBuilder.h"
+#include "CpuScene.h"
+
+/*
+ ------------------------------BVH Disk Cache------------------------------------
+ Built BLASes on disk, what D3D12's serialized acceleration structures are for: a mesh that did not change is not
+ built again, its file is mapped and Bvh::Attach points traversal straight at the mapping. Nothing is deserialized,
+ pages fault in as rays reach them, the top of the tree first.
+
+ Layout: header | nodes | primitive ids | triangles | instance descs
+ Every array is the one Flatten leaves in memory, references between them are indices (node offsets, triangle
+ ranges, InstanceDesc::accelerationStructure), so the file means the same wherever it is mapped. Nodes start 32
+ bytes into a cache line like BvhNodeAllocator's, sibling pairs share a line in the mapping too. The optional
+ instance table is the scene's instances of the BLAS (BLAS 0 for all of them), Tlas::Build takes it straight from
+ the mapping.
+
+ Files are keyed on a hash of the mesh content (positions and indices), one of the builder and the settings that
+ shape its tree and one of the instance table, a file written for another key, version or a different layout is a
+ miss and gets rebuilt. Little endian, for this
+ machine, like the serialized structures D3D12 only loads on the driver that wrote them. The node and triangle
+ arrays themselves are trusted, validating them would fault in the whole file.
+*/
+
+namespace CpuRt
+{
+	constexpr uint32_t gBvhDiskCacheMagic = 0x4856424B;		// "KBVH"
+	constexpr uint32_t gBvhDiskCacheVersion = 2;
+	constexpr uint64_t gBvhDiskCacheLineSize = 64;
+
+	struct BvhDiskCacheKey
+	{
+		uint64_t mesh = 0;		// HashMeshContent
+		uint64_t build = 0;		// HashBvhBuild
+		uint64_t instances = 0;	// HashInstances, 0 without an instance table
+
+		bool operator==(const BvhDiskCacheKey& other) const { return mesh == other.mesh && build == other.build && instances == other.instances; }
+		bool operator!=(const BvhDiskCacheKey& other) const { return !(*this == other); }
+	};
+
+	struct BvhDiskCacheHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		BvhDiskCacheKey key;
+		uint32_t nodeCount;
+		uint32_t triangleCount;			// references: primitive ids, 3 positions each
+		uint32_t instanceCount;
+		uint32_t maxDepth;
+		uint32_t leaves;
+		float sahCost;
+		float builtSahCost;
+		uint32_t padding;
+		uint64_t nodeOffset;			// from the start of the file
+		uint64_t primitiveIdOffset;
+		uint64_t triangleOffset;
+		uint64_t instanceOffset;
+		uint64_t fileSize;
+	};
+
+	static_assert(sizeof(BvhDiskCacheHeader) == 104, "BVH cache header layout changed");
+
+	struct BvhDiskCacheStats
+	{
+		bool hit = false;
+		double keyMilliseconds = 0.0;		// hashing the mesh
+		double loadMilliseconds = 0.0;		// mapping, hits only
+		double buildMilliseconds = 0.0;		// misses only
+		double writeMilliseconds = 0.0;		// misses only
+		uint64_t fileBytes = 0;				// written, misses only
+	};
+
+	namespace Detail
+	{
+		// One 64 bit word into the hash, a multiply and xorshift round (MurmurHash3's fmix64 constants). Not
+		// cryptographic, enough to tell meshes apart.
+		inline uint64_t HashWord(uint64_t hash, uint64_t word)
+		{
+			hash ^= word * 0x9E3779B97F4A7C15ull;
+			hash = (hash ^ (hash >> 33)) * 0xFF51AFD7ED558CCDull;
+			return hash ^ (hash >> 33);
+		}
+
+		inline uint64_t HashBytes(uint64_t hash, const void* data, size_t size)
+		{
+			const uint8_t* bytes = static_cast<const uint8_t*>(data);
+			for (; size >= 8; size -= 8, bytes += 8)
+			{
+				uint64_t word;
+				memcpy(&word, bytes, 8);
+				hash = HashWord(hash, word);
+			}
+			uint64_t tail = 0;
+			memcpy(&tail, bytes, size);
+			return HashWord(hash, tail ^ (uint64_t(size) << 56));
+		}
+
+		inline uint64_t AlignCacheOffset(uint64_t offset, uint64_t alignment)
+		{
+			return (offset + alignment - 1) / alignment * alignment;
+		}
+
+		inline void WriteZeros(FILE* file, uint64_t& position, uint64_t target)
+		{
+			static const uint8_t zeros[gBvhDiskCacheLineSize] = {};
+			while (position < target)
+			{
+				const size_t count = static_cast<size_t>(std::min<uint64_t>(target - position, sizeof(zeros)));
+				fwrite(zeros, 1, count, file);
+				position += count;
+			}
+		}
+	}
+
+	// Positions and indices, what a BVH is built from. Normals do not change the tree and are left out.
+	inline uint64_t HashMeshContent(const MeshData& mesh)
+	{
+		uint64_t hash = Detail::HashWord(mesh.vertices.size(), mesh.indices.size());
+		for (const Vertex& vertex : mesh.vertices) hash = Detail::HashBytes(hash, &vertex.position, sizeof(vertex.position));
+		return Detail::HashBytes(hash, mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+	}
+
+	// The builder and the settings it places splits with. taskThreshold and parallelBinThreshold only cut the same
+	// build into jobs and rebuildThreshold is for refits, they are left out so changing them is not a miss.
+	inline uint64_t HashBvhBuild(BvhBuildMode mode, const BvhSettings& settings)
+	{
+		uint64_t hash = Detail::HashWord(gBvhDiskCacheVersion, uint64_t(mode));
+		const auto add = [&](const auto& field) { hash = Detail::HashBytes(hash, &field, sizeof(field)); };
+		add(settings.maxLeafSize);
+		add(settings.traversalCost);
+		add(settings.intersectionCost);
+		switch (mode)
+		{
+		case BvhBuildMode::Sah:
+			add(settings.binCount);
+			break;
+		case BvhBuildMode::Lbvh:
+			add(settings.mortonBits);
+			add(settings.treeletRounds);
+			break;
+		case BvhBuildMode::Sbvh:
+			add(settings.binCount);
+			add(settings.spatialSplitAlpha);
+			add(settings.splitBudget);
+			break;
+		}
+		return hash;
+	}
+
+	// InstanceDesc is 64 bytes without padding, hashed as it is written
+	inline uint64_t HashInstances(BvhSpan<const InstanceDesc> instances)
+	{
+		if (instances.size() == 0) return 0;
+		return Detail::HashBytes(Detail::HashWord(gBvhDiskCacheVersion, instances.size()), instances.data(), instances.size() * sizeof(InstanceDesc));
+	}
+
+	inline BvhDiskCacheKey MakeBvhDiskCacheKey(const MeshData& mesh, BvhBuildMode mode, const BvhSettings& settings, BvhSpan<const InstanceDesc> instances = {})
+	{
+		return { HashMeshContent(mesh), HashBvhBuild(mode, settings), HashInstances(instances) };
+	}
+
+	// <directory>/<mesh hash>-<build hash>[-<instances hash>].kbvh, a scene's file never replaces its BLAS's
+	inline std::string BvhDiskCachePath(const std::string& directory, const BvhDiskCacheKey& key)
+	{
+		char name[96];
+		if (key.instances == 0) snprintf(name, sizeof(name), "%016llx-%016llx.kbvh", static_cast<unsigned long long>(key.mesh), static_cast<unsigned long long>(key.build));
+		else snprintf(name, sizeof(name), "%016llx-%016llx-%016llx.kbvh", static_cast<unsigned long long>(key.mesh), static_cast<unsigned long long>(key.build), static_cast<unsigned long long>(key.instances));
+		if (directory.empty()) return name;
+		const char last = directory.back();
+		return directory + (last == '/' || last == '\\' ? "" : "/") + name;
+	}
+
+	/*
+	 Writes 'bvh' and the scene's 'instances' of it, returns the file size. The file is written next to 'filepath'
+	 and renamed over it, a reader never maps half a file. Missing directories are created.
+	*/
+	inline uint64_t WriteBvhDiskCache(const std::string& filepath, const BvhDiskCacheKey& key, const Bvh& bvh, BvhSpan<const InstanceDesc> instances = {})
+	{
+		if (bvh.Empty())
+		{
+			throw std::runtime_error("Error: an empty BVH has nothing to cache");
+		}
+		for (const InstanceDesc& instance : instances)
+		{
+			if (instance.accelerationStructure != 0)
+			{
+				throw std::runtime_error("Error: cached instances can only reference the cached BLAS");
+			}
+		}
+		if (key.instances != HashInstances(instances))
+		{
+			throw std::runtime_error("Error: the cache key was made for another instance table");
+		}
+		const BvhNodeSpan nodes = bvh.Nodes();
+		const uint32_t triangleCount = static_cast<uint32_t>(bvh.TriangleCount());
+
+		BvhDiskCacheHeader header = {};
+		header.magic = gBvhDiskCacheMagic;
+		header.version = gBvhDiskCacheVersion;
+		header.key = key;
+		header.nodeCount = static_cast<uint32_t>(nodes.size());
+		header.triangleCount = triangleCount;
+		header.instanceCount = static_cast<uint32_t>(instances.size());
+		header.maxDepth = bvh.Stats().maxDepth;
+		header.leaves = static_cast<uint32_t>(bvh.Stats().leaves);
+		header.sahCost = bvh.Stats().sahCost;
+		header.builtSahCost = bvh.Stats().builtSahCost;
+
+		// Nodes half way into a line, the other arrays on a line of their own
+		header.nodeOffset = Detail::AlignCacheOffset(sizeof(BvhDiskCacheHeader) + gBvhDiskCacheLineSize / 2, gBvhDiskCacheLineSize) - gBvhDiskCacheLineSize / 2;
+		header.primitiveIdOffset = Detail::AlignCacheOffset(header.nodeOffset + nodes.size() * sizeof(BvhNode), gBvhDiskCacheLineSize);
+		header.triangleOffset = Detail::AlignCacheOffset(header.primitiveIdOffset + uint64_t(triangleCount) * sizeof(uint32_t), gBvhDiskCacheLineSize);
+		header.instanceOffset = Detail::AlignCacheOffset(header.triangleOffset + uint64_t(triangleCount) * 3 * sizeof(Float3), gBvhDiskCacheLineSize);
+		header.fileSize = header.instanceOffset + instances.size() * sizeof(InstanceDesc);
+
+		const std::filesystem::path directory = std::filesystem::path(filepath).parent_path();
+		std::error_code error;
+		if (!directory.empty()) std::filesystem::create_directories(directory, error);
+
+		const std::string temporaryPath = filepath + ".tmp";
+		FILE* file = fopen(temporaryPath.c_str(), "wb");
+		if (!file)
+		{
+			throw std::runtime_error("Error: failed to create " + temporaryPath);
+		}
+
+		uint64_t position = sizeof(header);
+		fwrite(&header, sizeof(header), 1, file);
+		Detail::WriteZeros(file, position, header.nodeOffset);
+		fwrite(nodes.data(), sizeof(BvhNode), nodes.size(), file);
+		position += nodes.size() * sizeof(BvhNode);
+		Detail::WriteZeros(file, position, header.primitiveIdOffset);
+		for (uint32_t i = 0; i < triangleCount; i++)
+		{
+			const uint32_t primitive = bvh.PrimitiveId(i);
+			fwrite(&primitive, sizeof(primitive), 1, file);
+		}
+		position += uint64_t(triangleCount) * sizeof(uint32_t);
+		Detail::WriteZeros(file, position, header.triangleOffset);
+		if (triangleCount > 0) fwrite(bvh.TrianglePositions(0), sizeof(Float3), size_t(triangleCount) * 3, file);
+		position += uint64_t(triangleCount) * 3 * sizeof(Float3);
+		Detail::WriteZeros(file, position, header.instanceOffset);
+		fwrite(instances.data(), sizeof(InstanceDesc), instances.size(), file);
+
+		const bool failed = ferror(file) != 0;
+		fclose(file);
+		if (failed)
+		{
+			remove(temporaryPath.c_str());
+			throw std::runtime_error("Error: failed to write " + temporaryPath);
+		}
+
+#ifdef _WIN32
+		remove(filepath.c_str());		// rename does not replace on Windows
+#endif
+		if (rename(temporaryPath.c_str(), filepath.c_str()) != 0)
+		{
+			remove(temporaryPath.c_str());
+			throw std::runtime_error("Error: failed to replace " + filepath);
+		}
+		return header.fileSize;
+	}
+
+	/*
+	 A cache file mapped copy on write: traversal reads it in place, a Refit of the attached tree writes private
+	 copies of the pages it touches and the file stays as it was written.
+	*/
+	class BvhDiskCacheMapping
+	{
+	public:
+		BvhDiskCacheMapping() = default;
+		~BvhDiskCacheMapping() { Close(); }
+
+		BvhDiskCacheMapping(const BvhDiskCacheMapping&) = delete;
+		BvhDiskCacheMapping& operator=(const BvhDiskCacheMapping&) = delete;
+
+		// False when the file does not exist or is not a cache file of this version, a miss rather than an error
+		bool Open(const std::string& filepath)
+		{
+			Close();
+
+#ifdef _WIN32
+			fileHandle = CreateFileA(filepath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			LARGE_INTEGER fileSize = {};
+			if (fileHandle == INVALID_HANDLE_VALUE || !GetFileSizeEx(fileHandle, &fileSize))
+			{
+				Close();
+				return false;
+			}
+			size = static_cast<uint64_t>(fileSize.QuadPart);
+
+			mappingHandle = size ? CreateFileMappingA(fileHandle, nullptr, PAGE_WRITECOPY, 0, 0, nullptr) : nullptr;
+			data = mappingHandle ? static_cast<uint8_t*>(MapViewOfFile(mappingHandle, FILE_MAP_COPY, 0, 0, 0)) : nullptr;
+#else
+			fileHandle = open(filepath.c_str(), O_RDONLY);
+			struct stat fileStat = {};
+			if (fileHandle < 0 || fstat(fileHandle, &fileStat) != 0)
+			{
+				Close();
+				return false;
+			}
+			size = static_cast<uint64_t>(fileStat.st_size);
+
+			void* mapping = size ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileHandle, 0) : MAP_FAILED;
+			data = (mapping == MAP_FAILED) ? nullptr : static_cast<uint8_t*>(mapping);
+#endif
+
+			if (!data || !Validate())
+			{
+				Close();
+				return false;
+			}
+
+			// The first rays go through the top of the tree, start reading the nodes before they fault
+			const uint64_t pageBegin = header->nodeOffset / 4096 * 4096;
+			const uint64_t nodeEnd = header->nodeOffset + uint64_t(header->nodeCount) * sizeof(BvhNode);
+#ifdef _WIN32
+			WIN32_MEMORY_RANGE_ENTRY range = { data + pageBegin, static_cast<SIZE_T>(nodeEnd - pageBegin) };
+			PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+			madvise(data + pageBegin, nodeEnd - pageBegin, MADV_WILLNEED);
+#endif
+			return true;
+		}
+
+		void Close()
+		{
+#ifdef _WIN32
+			if (data) UnmapViewOfFile(data);
+			if (mappingHandle) CloseHandle(mappingHandle);
+			if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+			mappingHandle = nullptr;
+			fileHandle = INVALID_HANDLE_VALUE;
+#else
+			if (data) munmap(data, size);
+			if (fileHandle >= 0) close(fileHandle);
+			fileHandle = -1;
+#endif
+			data = nullptr;
+			size = 0;
+			header = nullptr;
+		}
+
+		bool IsOpen() const { return data != nullptr; }
+		uint64_t FileSize() const { return size; }
+		const BvhDiskCacheHeader& Header() const { return *header; }
+
+		BvhSpan<BvhNode> Nodes() const { return { reinterpret_cast<BvhNode*>(data + header->nodeOffset), header->nodeCount }; }
+		BvhSpan<uint32_t> PrimitiveIds() const { return { reinterpret_cast<uint32_t*>(data + header->primitiveIdOffset), header->triangleCount }; }
+		BvhSpan<Float3> Triangles() const { return { reinterpret_cast<Float3*>(data + header->triangleOffset), size_t(header->triangleCount) * 3 }; }
+		BvhSpan<const InstanceDesc> Instances() const { return { reinterpret_cast<const InstanceDesc*>(data + header->instanceOffset), header->instanceCount }; }
+
+		BvhStats Stats() const
+		{
+			BvhStats stats;
+			stats.nodes = header->nodeCount;
+			stats.leaves = header->leaves;
+			stats.maxDepth = header->maxDepth;
+			stats.sahCost = header->sahCost;
+			stats.builtSahCost = header->builtSahCost;
+			return stats;
+		}
+
+	private:
+		// The header and where the arrays are, not what is in them
+		bool Validate()
+		{
+			if (size < sizeof(BvhDiskCacheHeader)) return false;
+			header = reinterpret_cast<const BvhDiskCacheHeader*>(data);
+			if (header->magic != gBvhDiskCacheMagic || header->version != gBvhDiskCacheVersion || header->fileSize > size || header->nodeCount == 0) return false;
+
+			const auto fits = [&](uint64_t offset, uint64_t bytes, uint64_t alignment)
+			{
+				return offset >= sizeof(BvhDiskCacheHeader) && offset % alignment == 0 && offset + bytes <= header->fileSize;
+			};
+			return (header->nodeOffset + gBvhDiskCacheLineSize / 2) % gBvhDiskCacheLineSize == 0 &&
+				fits(header->nodeOffset, uint64_t(header->nodeCount) * sizeof(BvhNode), alignof(BvhNode)) &&
+				fits(header->primitiveIdOffset, uint64_t(header->triangleCount) * sizeof(uint32_t), alignof(uint32_t)) &&
+				fits(header->triangleOffset, uint64_t(header->triangleCount) * 3 * sizeof(Float3), alignof(Float3)) &&
+				fits(header->instanceOffset, uint64_t(header->instanceCount) * sizeof(InstanceDesc), alignof(InstanceDesc));
+		}
+
+#ifdef _WIN32
+		HANDLE fileHandle = INVALID_HANDLE_VALUE;
+		HANDLE mappingHandle = nullptr;
+#else
+		int fileHandle = -1;
+#endif
+		uint8_t* data = nullptr;
+		uint64_t size = 0;
+		const BvhDiskCacheHeader* header = nullptr;
+	};
+
+	/*
+	 Maps 'filepath' and attaches 'bvh' to it when the file was written for 'key', false (and 'bvh' untouched)
+	 otherwise. 'instances' gets the file's instance table, valid as long as 'bvh' is attached.
+	*/
+	inline bool LoadBvhDiskCache(const std::string& filepath, const BvhDiskCacheKey& key, Bvh& bvh, BvhSpan<const InstanceDesc>* instances = nullptr)
+	{
+		auto mapping = std::make_shared<BvhDiskCacheMapping>();
+		if (!mapping->Open(filepath) || mapping->Header().key != key) return false;
+		if (instances) *instances = mapping->Instances();
+		bvh.Attach(mapping->Nodes(), mapping->PrimitiveIds(), mapping->Triangles(), mapping->Stats(), mapping);
+		return true;
+	}
+
+	/*
+	 BuildBvh through the cache in 'directory': the mapped file when there is one for the mesh, settings and
+	 'instances', otherwise a build that is written there with them for the next run.
+	*/
+	inline Bvh BuildBvhCached(const std::string& directory, const MeshData& mesh, BvhBuildMode mode, const BvhSettings& settings = {},
+		BvhSpan<const InstanceDesc> instances = {}, BvhDiskCacheStats* cacheStats = nullptr, ThreadPool& pool = ThreadPool::Default())
+	{
+		BvhDiskCacheStats stats;
+		auto start = std::chrono::high_resolution_clock::now();
+		const auto elapsed = [&]()
+		{
+			const auto now = std::chrono::high_resolution_clock::now();
+			const double milliseconds = std::chrono::duration<double, std::milli>(now - start).count();
+			start = now;
+			return milliseconds;
+		};
+
+		const BvhDiskCacheKey key = MakeBvhDiskCacheKey(mesh, mode, settings, instances);
+		const std::string path = BvhDiskCachePath(directory, key);
+		stats.keyMilliseconds = elapsed();
+
+		Bvh bvh;
+		stats.hit = LoadBvhDiskCache(path, key, bvh);
+		if (stats.hit)
+		{
+			stats.loadMilliseconds = elapsed();
+		}
+		else
+		{
+			bvh = BuildBvh(mesh, mode, settings, pool);
+			stats.buildMilliseconds = elapsed();
+			stats.fileBytes = WriteBvhDiskCache(path, key, bvh, instances);
+			stats.writeMilliseconds = elapsed();
+		}
+
+		if (cacheStats) *cacheStats = stats;
+		return bvh;
+	}
+}
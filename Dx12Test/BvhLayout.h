@@ -0,0 +1,300 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Bvh.h"
+
+/*
+ ------------------------------BVH Layout------------------------------------
+ Post-build node orders for a Bvh. Every layout keeps siblings adjacent (one fetch brings both children in) and
+ children after their parent, they differ in which pairs end up near each other:
+	- DepthFirst:  what Flatten writes, a subtree's pairs are contiguous, the top of the tree is spread over the array
+	- VanEmdeBoas: recursive treelets (van Emde Boas 1975, cache oblivious layouts as in Yoon & Manocha 2006): the top
+	  half of the levels of a subtree first, then every subtree hanging below it the same way, so any cache line or
+	  page size catches a few levels of whatever path a ray takes
+	- HotFirst:    greedy from the root by how often a traversal profile visited a pair, following the hotter child
+	  down, so the paths most rays take pack into the first few pages. Below the hot part it is VanEmdeBoas.
+ ProfileBvhVisits records the visit counts HotFirst wants, SimulateBvhNodeCache replays traversals through simulated
+ caches to count the node line misses a layout causes.
+*/
+
+namespace CpuRt
+{
+	enum class BvhLayout
+	{
+		DepthFirst,
+		VanEmdeBoas,
+		HotFirst,
+	};
+
+	inline const char* BvhLayoutName(BvhLayout layout)
+	{
+		switch (layout)
+		{
+		case BvhLayout::DepthFirst: return "dfs";
+		case BvhLayout::VanEmdeBoas: return "veb";
+		case BvhLayout::HotFirst: return "hot";
+		}
+		return "unknown";
+	}
+
+	inline BvhLayout ParseBvhLayout(const char* name)
+	{
+		if (!strcmp(name, "dfs")) return BvhLayout::DepthFirst;
+		if (!strcmp(name, "veb")) return BvhLayout::VanEmdeBoas;
+		if (!strcmp(name, "hot")) return BvhLayout::HotFirst;
+		throw std::runtime_error(std::string("Error: unknown BVH layout ") + name);
+	}
+
+	namespace Detail
+	{
+		// Appends the children pairs of the subtree at 'root' depth first, left pair before right pair
+		inline void AppendDepthFirst(BvhNodeSpan nodes, uint32_t root, std::vector<uint32_t>& order)
+		{
+			std::vector<uint32_t> stack = { root };
+			while (!stack.empty())
+			{
+				const uint32_t index = stack.back();
+				stack.pop_back();
+				if (nodes[index].IsLeaf()) continue;
+				const uint32_t left = nodes[index].offset;
+				order.push_back(left);
+				order.push_back(left + 1);
+				stack.push_back(left + 1);
+				stack.push_back(left);
+			}
+		}
+
+		// Appends the children pairs of the subtree at 'root': the pairs of its top ceil(height / 2) levels breadth
+		// first, then every subtree below them recursively
+		inline void AppendVanEmdeBoas(BvhNodeSpan nodes, const std::vector<uint32_t>& heights, uint32_t root, std::vector<uint32_t>& order)
+		{
+			if (nodes[root].IsLeaf()) return;
+			const uint32_t topLevels = (heights[root] + 1) / 2;
+			std::vector<uint32_t> level = { root }, next;
+			for (uint32_t depth = 0; depth < topLevels && !level.empty(); depth++)
+			{
+				next.clear();
+				for (uint32_t index : level)
+				{
+					if (nodes[index].IsLeaf()) continue;
+					const uint32_t left = nodes[index].offset;
+					order.push_back(left);
+					order.push_back(left + 1);
+					next.push_back(left);
+					next.push_back(left + 1);
+				}
+				level.swap(next);
+			}
+			for (uint32_t index : level) AppendVanEmdeBoas(nodes, heights, index, order);
+		}
+
+		inline std::vector<uint32_t> SubtreeHeights(BvhNodeSpan nodes)
+		{
+			// Levels below every node, children come after their parent so one backwards sweep fills it
+			std::vector<uint32_t> heights(nodes.size(), 0);
+			for (size_t i = nodes.size(); i-- > 0; )
+			{
+				if (!nodes[i].IsLeaf()) heights[i] = 1 + std::max(heights[nodes[i].offset], heights[nodes[i].offset + 1]);
+			}
+			return heights;
+		}
+
+		// Visits of the children pair of 'parent', 0 for a leaf
+		inline uint64_t PairVisits(BvhNodeSpan nodes, const std::vector<uint32_t>& visits, uint32_t parent)
+		{
+			if (nodes[parent].IsLeaf()) return 0;
+			return uint64_t(visits[nodes[parent].offset]) + visits[nodes[parent].offset + 1];
+		}
+
+		inline void AppendHotFirst(BvhNodeSpan nodes, const std::vector<uint32_t>& visits, double hotFraction, std::vector<uint32_t>& order)
+		{
+			// Pairs by visits, ties in the order they became placeable
+			struct Pair
+			{
+				uint64_t visits;
+				uint32_t sequence;
+				uint32_t parent;
+				bool operator<(const Pair& other) const { return visits != other.visits ? visits < other.visits : sequence > other.sequence; }
+			};
+			std::priority_queue<Pair> queue;
+			uint32_t sequence = 0;
+			const auto push = [&](uint32_t parent)
+			{
+				if (!nodes[parent].IsLeaf()) queue.push({ PairVisits(nodes, visits, parent), sequence++, parent });
+			};
+
+			push(0);
+			const double hotVisits = std::max(1.0, visits[0] * hotFraction);
+			while (!queue.empty() && double(queue.top().visits) >= hotVisits)
+			{
+				uint32_t left = nodes[queue.top().parent].offset;
+				queue.pop();
+				for (;;)
+				{
+					// Follow the hotter child's pair right away, so hot paths are contiguous
+					order.push_back(left);
+					order.push_back(left + 1);
+					const uint64_t heat[2] = { PairVisits(nodes, visits, left), PairVisits(nodes, visits, left + 1) };
+					const uint32_t hotter = heat[1] > heat[0] ? 1 : 0;
+					if (double(heat[hotter]) < hotVisits)
+					{
+						push(left);
+						push(left + 1);
+						break;
+					}
+					push(left + 1 - hotter);
+					left = nodes[left + hotter].offset;
+				}
+			}
+
+			// The rest, each remaining subtree as van Emde Boas treelets
+			const std::vector<uint32_t> heights = SubtreeHeights(nodes);
+			std::vector<Pair> cold;
+			for (; !queue.empty(); queue.pop()) cold.push_back(queue.top());
+			std::sort(cold.begin(), cold.end(), [](const Pair& a, const Pair& b) { return a.sequence < b.sequence; });
+			for (const Pair& pair : cold) AppendVanEmdeBoas(nodes, heights, pair.parent, order);
+		}
+	}
+
+	/*
+	 Node order for Bvh::Relayout. HotFirst needs 'visits' from ProfileBvhVisits on the same tree, pairs visited by at
+	 least 'hotFraction' of the rays that reached the root go first.
+	*/
+	inline std::vector<uint32_t> ComputeBvhLayout(const Bvh& bvh, BvhLayout layout, const std::vector<uint32_t>& visits = {}, double hotFraction = 0.01)
+	{
+		const BvhNodeSpan nodes = bvh.Nodes();
+		std::vector<uint32_t> order;
+		if (nodes.empty()) return order;
+		order.reserve(nodes.size());
+		order.push_back(0);
+
+		switch (layout)
+		{
+		case BvhLayout::DepthFirst:
+			Detail::AppendDepthFirst(nodes, 0, order);
+			break;
+		case BvhLayout::VanEmdeBoas:
+			Detail::AppendVanEmdeBoas(nodes, Detail::SubtreeHeights(nodes), 0, order);
+			break;
+		case BvhLayout::HotFirst:
+			if (visits.size() != nodes.size())
+			{
+				throw std::runtime_error("Error: hot first BVH layout needs a visit profile of the same tree");
+			}
+			Detail::AppendHotFirst(nodes, visits, hotFraction, order);
+			break;
+		}
+		return order;
+	}
+
+	inline void RelayoutBvh(Bvh& bvh, BvhLayout layout, const std::vector<uint32_t>& visits = {}, double hotFraction = 0.01)
+	{
+		bvh.Relayout(ComputeBvhLayout(bvh, layout, visits, hotFraction));
+	}
+
+	// How many times traversing 'rays' loads every node, on the calling thread. A sample of the rays a frame
+	// traces is enough, only the order of the counts matters.
+	inline std::vector<uint32_t> ProfileBvhVisits(const Bvh& bvh, const std::vector<Ray>& rays, uint32_t rayFlags = RayFlagNone)
+	{
+		std::vector<uint32_t> visits(bvh.Nodes().size(), 0);
+		if (bvh.Empty()) return visits;
+		for (const Ray& ray : rays)
+		{
+			RayHit hit;
+			hit.t = ray.tMax;
+			bvh.IntersectSubtree(0, ray, rayFlags, hit, [&](uint32_t node) { if (visits[node] != UINT32_MAX) visits[node]++; });
+		}
+		return visits;
+	}
+
+	// Set associative cache with LRU replacement over line addresses
+	class CacheSimulator
+	{
+	public:
+		CacheSimulator(size_t bytes, uint32_t ways, uint32_t lineBytes = 64)
+			: ways(ways), lineBytes(lineBytes), sets(std::max<size_t>(1, bytes / (size_t(lineBytes) * ways))),
+			tags(sets * ways, UINT64_MAX), lastUse(sets * ways, 0)
+		{
+		}
+
+		// True on a miss, the line is resident afterwards
+		bool Access(const void* address)
+		{
+			const uint64_t line = uint64_t(reinterpret_cast<uintptr_t>(address)) / lineBytes;
+			const size_t set = size_t(line % sets) * ways;
+			clock++;
+			size_t victim = set;
+			for (size_t way = set; way < set + ways; way++)
+			{
+				if (tags[way] == line)
+				{
+					lastUse[way] = clock;
+					return false;
+				}
+				if (lastUse[way] < lastUse[victim]) victim = way;
+			}
+			tags[victim] = line;
+			lastUse[victim] = clock;
+			return true;
+		}
+
+	private:
+		uint32_t ways;
+		uint32_t lineBytes;
+		size_t sets;
+		std::vector<uint64_t> tags;
+		std::vector<uint64_t> lastUse;
+		uint64_t clock = 0;
+	};
+
+	struct BvhCacheStats
+	{
+		double nodesPerRay = 0.0;
+		double l1MissesPerRay = 0.0;
+		double l2MissesPerRay = 0.0;
+		double tlbMissesPerRay = 0.0;		// 4 KB pages
+	};
+
+	/*
+	 Replays the node loads of tracing 'rays' in order through an L1 and an L2 sized cache (64 byte lines, 8 and 16
+	 ways) and a 64 entry TLB of 4 KB pages, all holding nodes only. Triangle loads do not depend on the layout and are
+	 left out, so are prefetches. A sibling pair is one line in every layout, so layouts mostly differ in how many
+	 pages and how much of the L2 the lines a ray needs are spread over.
+	*/
+	inline BvhCacheStats SimulateBvhNodeCache(const Bvh& bvh, const std::vector<Ray>& rays, uint32_t rayFlags = RayFlagNone,
+		size_t l1Bytes = 32 * 1024, size_t l2Bytes = 1024 * 1024)
+	{
+		BvhCacheStats stats;
+		if (bvh.Empty() || rays.empty()) return stats;
+		CacheSimulator l1(l1Bytes, 8), l2(l2Bytes, 16), tlb(64 * 4096, 4, 4096);
+		const BvhNode* nodes = bvh.Nodes().data();
+		uint64_t visits = 0, l1Misses = 0, l2Misses = 0, tlbMisses = 0;
+		for (const Ray& ray : rays)
+		{
+			RayHit hit;
+			hit.t = ray.tMax;
+			bvh.IntersectSubtree(0, ray, rayFlags, hit, [&](uint32_t node)
+			{
+				visits++;
+				tlbMisses += tlb.Access(nodes + node);
+				if (l1.Access(nodes + node))
+				{
+					l1Misses++;
+					l2Misses += l2.Access(nodes + node);
+				}
+			});
+		}
+		stats.nodesPerRay = double(visits) / rays.size();
+		stats.l1MissesPerRay = double(l1Misses) / rays.size();
+		stats.l2MissesPerRay = double(l2Misses) / rays.size();
+		stats.tlbMissesPerRay = double(tlbMisses) / rays.size();
+		return stats;
+	}
+}
@@ -0,0 +1,541 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "Bvh.h"
+
+/*
+ ------------------------------LBVH Builder------------------------------------
+ Linear BVH for geometry rebuilt every frame (Karras 2012, "Maximizing Parallelism in the Construction of BVHs,
+ Octrees, and k-d Trees"), the CPU counterpart of a PREFER_FAST_BUILD acceleration structure:
+	1. Morton codes of the triangle centroids, 30 bit (10 per axis) or 63 bit (21 per axis)
+	2. parallel LSD radix sort, 8 bits per pass
+	3. every internal node finds its key range and split from the sorted codes alone, all in parallel
+	4. bottom-up pass from the leaves for bounds and SAH costs, the second thread to reach a node continues up
+	5. optional treelet restructuring (Karras & Aila 2013): rebuilds 7 leaf treelets with their optimal topology
+	6. subtrees that are cheaper as one leaf are collapsed, up to maxLeafSize triangles
+ Much cheaper than a SAH build, traces slower: the splits follow the Morton curve, not the geometry.
+*/
+
+namespace CpuRt
+{
+	constexpr uint32_t gLbvhTreeletSize = 7;
+
+	inline uint32_t CountLeadingZeros64(uint64_t x)
+	{
+		if (x == 0) return 64;
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanReverse64(&index, x);
+		return 63 - index;
+#else
+		return static_cast<uint32_t>(__builtin_clzll(x));
+#endif
+	}
+
+	// Spreads the low 21 bits of v to every third bit
+	inline uint64_t ExpandMortonBits(uint64_t v)
+	{
+		v &= 0x1FFFFF;
+		v = (v | v << 32) & 0x1F00000000FFFFull;
+		v = (v | v << 16) & 0x1F0000FF0000FFull;
+		v = (v | v << 8) & 0x100F00F00F00F00Full;
+		v = (v | v << 4) & 0x10C30C30C30C30C3ull;
+		v = (v | v << 2) & 0x1249249249249249ull;
+		return v;
+	}
+
+	// 'bitsPerAxis' bits of each coordinate in [0, 1], interleaved xyz
+	inline uint64_t MortonCode(const Float3& p, uint32_t bitsPerAxis)
+	{
+		const float scale = static_cast<float>((1u << bitsPerAxis) - 1);
+		const uint64_t x = static_cast<uint64_t>(std::min(std::max(p.x * scale, 0.0f), scale));
+		const uint64_t y = static_cast<uint64_t>(std::min(std::max(p.y * scale, 0.0f), scale));
+		const uint64_t z = static_cast<uint64_t>(std::min(std::max(p.z * scale, 0.0f), scale));
+		return ExpandMortonBits(x) << 2 | ExpandMortonBits(y) << 1 | ExpandMortonBits(z);
+	}
+
+	/*
+	 Stable LSD radix sort of (key, value) pairs over the low 'keyBits' bits, in as few passes of up to 11 bits as
+	 cover them (30 bit Morton codes: 3 passes of 10): per chunk histograms, a prefix sum over (digit, chunk),
+	 scatter. Passes where every key has the same digit are skipped. The scratch vectors are resized to the key
+	 count, callers that sort every frame keep them to reuse the memory.
+	*/
+	template<typename Key>
+	inline void RadixSortPairs(std::vector<Key>& keys, std::vector<uint32_t>& values, uint32_t keyBits, ThreadPool& pool,
+		std::vector<Key>& keysOut, std::vector<uint32_t>& valuesOut)
+	{
+		const size_t count = keys.size();
+		keysOut.resize(count);
+		valuesOut.resize(count);
+		const uint32_t passes = std::max((keyBits + 10) / 11, 1u);
+		const uint32_t digitBits = (keyBits + passes - 1) / passes;
+		const uint32_t radix = 1u << digitBits;
+		const size_t grain = std::max<size_t>(count / (pool.ThreadCount() * 4), 16384);
+		const size_t chunks = (count + grain - 1) / grain;
+		std::vector<uint32_t> histograms(chunks * radix);
+
+		for (uint32_t shift = 0; shift < keyBits; shift += digitBits)
+		{
+			pool.ParallelFor(chunks, 1, [&](size_t begin, size_t end)
+			{
+				for (size_t chunk = begin; chunk < end; chunk++)
+				{
+					uint32_t* histogram = histograms.data() + chunk * radix;
+					std::fill(histogram, histogram + radix, 0u);
+					const size_t last = std::min<size_t>(count, (chunk + 1) * grain);
+					for (size_t i = chunk * grain; i < last; i++) histogram[(keys[i] >> shift) & (radix - 1)]++;
+				}
+			});
+
+			uint32_t offset = 0;
+			bool skip = false;
+			for (uint32_t digit = 0; digit < radix && !skip; digit++)
+			{
+				uint32_t digitCount = 0;
+				for (size_t chunk = 0; chunk < chunks; chunk++)
+				{
+					const uint32_t n = histograms[chunk * radix + digit];
+					histograms[chunk * radix + digit] = offset;
+					offset += n;
+					digitCount += n;
+				}
+				skip = digitCount == count;
+			}
+			if (skip) continue;
+
+			pool.ParallelFor(chunks, 1, [&](size_t begin, size_t end)
+			{
+				for (size_t chunk = begin; chunk < end; chunk++)
+				{
+					uint32_t* offsets = histograms.data() + chunk * radix;
+					const size_t last = std::min<size_t>(count, (chunk + 1) * grain);
+					for (size_t i = chunk * grain; i < last; i++)
+					{
+						const uint32_t destination = offsets[(keys[i] >> shift) & (radix - 1)]++;
+						keysOut[destination] = keys[i];
+						valuesOut[destination] = values[i];
+					}
+				}
+			});
+			keys.swap(keysOut);
+			values.swap(valuesOut);
+		}
+	}
+
+	template<typename Key>
+	inline void RadixSortPairs(std::vector<Key>& keys, std::vector<uint32_t>& values, uint32_t keyBits, ThreadPool& pool)
+	{
+		std::vector<Key> keysOut;
+		std::vector<uint32_t> valuesOut;
+		RadixSortPairs(keys, values, keyBits, pool, keysOut, valuesOut);
+	}
+
+	// Children of a Karras internal node: sorted index 'split' goes left, 'split + 1' right, either a leaf or the
+	// internal node of that index
+	struct KarrasNode
+	{
+		uint32_t split;
+		bool leftIsLeaf;
+		bool rightIsLeaf;
+	};
+
+	// Length of the common prefix of sorted keys i and j, duplicates told apart by their index. -1 out of range.
+	template<typename Key>
+	inline int KarrasDelta(const Key* keys, uint32_t count, int64_t i, int64_t j)
+	{
+		if (j < 0 || j >= int64_t(count)) return -1;
+		const uint64_t x = uint64_t(keys[i]) ^ uint64_t(keys[j]);
+		if (x != 0) return static_cast<int>(CountLeadingZeros64(x));
+		return 64 + static_cast<int>(CountLeadingZeros64(static_cast<uint64_t>(i ^ j))) - 32;
+	}
+
+	// Internal node i of 'count' sorted keys: the direction of its range from the neighbors, the range's length by
+	// exponential then binary search, the split where the common prefix changes
+	template<typename Key>
+	inline KarrasNode FindKarrasChildren(const Key* keys, uint32_t count, uint32_t index)
+	{
+		const int64_t i = index;
+		const int direction = KarrasDelta(keys, count, i, i + 1) - KarrasDelta(keys, count, i, i - 1) > 0 ? 1 : -1;
+		const int minDelta = KarrasDelta(keys, count, i, i - direction);
+
+		int64_t maxLength = 2;
+		while (KarrasDelta(keys, count, i, i + maxLength * direction) > minDelta) maxLength *= 2;
+
+		int64_t length = 0;
+		for (int64_t step = maxLength / 2; step >= 1; step /= 2)
+		{
+			if (KarrasDelta(keys, count, i, i + (length + step) * direction) > minDelta) length += step;
+		}
+		const int64_t j = i + length * direction;
+
+		const int nodeDelta = KarrasDelta(keys, count, i, j);
+		int64_t split = 0;
+		int64_t step = length;
+		do
+		{
+			step = (step + 1) / 2;
+			if (split + step < length && KarrasDelta(keys, count, i, i + (split + step) * direction) > nodeDelta) split += step;
+		} while (step > 1);
+		const int64_t gamma = i + split * direction + std::min(direction, 0);
+
+		return { uint32_t(gamma), std::min(i, j) == gamma, std::max(i, j) == gamma + 1 };
+	}
+
+	class BvhLbvhBuilder
+	{
+	public:
+		BvhLbvhBuilder(const MeshData& mesh, const BvhSettings& settings, ThreadPool& pool)
+			: mesh(mesh), settings(settings), pool(pool)
+		{
+			this->settings.mortonBits = settings.mortonBits > 30 ? 63u : 30u;
+			this->settings.maxLeafSize = std::min(std::max(settings.maxLeafSize, 1u), 0xFFFFu);
+		}
+
+		Bvh Build()
+		{
+			const auto start = std::chrono::high_resolution_clock::now();
+			Bvh bvh;
+			count = static_cast<uint32_t>(mesh.TriangleCount());
+			if (count == 0) return bvh;
+
+			ComputeMortonCodes();
+			RadixSortPairs(keys, values, settings.mortonBits, pool);
+
+			// Internal nodes are arena[0, count - 1), leaf j is arena[count - 1 + j] and holds sorted triangle j
+			arena.Reset(count);
+			arena.Allocate(2 * count - 1);
+			parents.assign(2 * count - 1, gInvalidPrimitive);
+			primitives.resize(2 * count - 1);
+			costs.resize(2 * count - 1);
+
+			InitializeLeaves();
+			pool.ParallelFor(count - 1, 4096, [&](size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					const KarrasNode split = FindKarrasChildren(keys.data(), count, static_cast<uint32_t>(i));
+					const uint32_t left = split.leftIsLeaf ? LeafNode(split.split) : split.split;
+					const uint32_t right = split.rightIsLeaf ? LeafNode(split.split + 1) : split.split + 1;
+					arena[uint32_t(i)].children[0] = left;
+					arena[uint32_t(i)].children[1] = right;
+					parents[left] = uint32_t(i);
+					parents[right] = uint32_t(i);
+				}
+			});
+
+			BottomUp(0, [&](uint32_t node) { UpdateNode(node); });
+			for (uint32_t round = 0; round < settings.treeletRounds; round++)
+			{
+				// Later rounds only revisit the bigger subtrees, that is where most of the cost sits
+				const uint32_t minPrimitives = gLbvhTreeletSize << round;
+				BottomUp(minPrimitives, [&](uint32_t node) { OptimizeTreelet(node); });
+			}
+
+			std::vector<uint32_t> order(count);
+			TaskGroup group;
+			AssignRanges(0, 0, order, group);
+			pool.Wait(group);
+
+			bvh.Flatten(arena, 0, mesh, order, settings, pool);
+			bvh.SetBuildTime(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+			return bvh;
+		}
+
+	private:
+		uint32_t LeafNode(uint32_t sortedIndex) const { return count - 1 + sortedIndex; }
+		bool IsPrimitiveLeaf(uint32_t node) const { return node >= count - 1; }
+
+		void ComputeMortonCodes()
+		{
+			keys.resize(count);
+			values.resize(count);
+
+			std::mutex boundsLock;
+			Aabb centroidBounds;
+			pool.ParallelFor(count, 16384, [&](size_t begin, size_t end)
+			{
+				Aabb local;
+				for (size_t i = begin; i < end; i++) local.Grow(Centroid(static_cast<uint32_t>(i)));
+				std::lock_guard<std::mutex> lock(boundsLock);
+				centroidBounds.Grow(local);
+			});
+
+			const Float3 extent = centroidBounds.Extent();
+			const Float3 invExtent = {
+				extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+				extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+				extent.z > 0.0f ? 1.0f / extent.z : 0.0f };
+			const uint32_t bitsPerAxis = settings.mortonBits / 3;
+
+			pool.ParallelFor(count, 16384, [&](size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					keys[i] = MortonCode((Centroid(static_cast<uint32_t>(i)) - centroidBounds.min) * invExtent, bitsPerAxis);
+					values[i] = static_cast<uint32_t>(i);
+				}
+			});
+		}
+
+		Float3 Centroid(uint32_t triangle) const
+		{
+			const uint32_t* indices = &mesh.indices[size_t(triangle) * 3];
+			return (mesh.vertices[indices[0]].position + mesh.vertices[indices[1]].position + mesh.vertices[indices[2]].position) * (1.0f / 3.0f);
+		}
+
+		void InitializeLeaves()
+		{
+			pool.ParallelFor(count, 16384, [&](size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					const uint32_t node = LeafNode(static_cast<uint32_t>(i));
+					const uint32_t* indices = &mesh.indices[size_t(values[i]) * 3];
+					BvhBuildNode& leaf = arena[node];
+					leaf.bounds = Aabb();
+					for (int v = 0; v < 3; v++) leaf.bounds.Grow(mesh.vertices[indices[v]].position);
+					leaf.first = static_cast<uint32_t>(i);
+					leaf.count = 1;
+					leaf.axis = 0;
+					leaf.subtreeSize = 1;
+					primitives[node] = 1;
+					costs[node] = settings.intersectionCost * leaf.bounds.HalfArea();
+				}
+			});
+		}
+
+		// Walks up from every leaf, a node is processed by whichever thread arrives second, after both children.
+		// Only nodes with at least 'minPrimitives' triangles are processed, the walk goes on regardless.
+		template<typename Process>
+		void BottomUp(uint32_t minPrimitives, const Process& process)
+		{
+			std::vector<std::atomic<uint32_t>> visits(count);
+			pool.ParallelFor(count, 4096, [&](size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					uint32_t node = parents[LeafNode(static_cast<uint32_t>(i))];
+					while (node != gInvalidPrimitive)
+					{
+						if (visits[node].fetch_add(1, std::memory_order_acq_rel) == 0) break;
+						if (primitives[arena[node].children[0]] + primitives[arena[node].children[1]] >= minPrimitives) process(node);
+						node = parents[node];
+					}
+				}
+			});
+		}
+
+		// Bounds, SAH cost and collapse decision from the children. The child on the positive side of the
+		// axis that separates them best goes right, which is what traversal order expects.
+		void UpdateNode(uint32_t index)
+		{
+			BvhBuildNode& node = arena[index];
+			uint32_t& left = node.children[0];
+			uint32_t& right = node.children[1];
+
+			node.bounds = arena[left].bounds;
+			node.bounds.Grow(arena[right].bounds);
+			primitives[index] = primitives[left] + primitives[right];
+
+			const float area = node.bounds.HalfArea();
+			const float splitCost = settings.traversalCost * area + costs[left] + costs[right];
+			const float leafCost = settings.intersectionCost * area * primitives[index];
+			const bool collapse = primitives[index] <= settings.maxLeafSize && leafCost <= splitCost;
+			costs[index] = collapse ? leafCost : splitCost;
+			node.count = collapse ? primitives[index] : 0;
+			node.subtreeSize = collapse ? 1 : 1 + arena[left].subtreeSize + arena[right].subtreeSize;
+
+			const Float3 separation = arena[right].bounds.Centroid() - arena[left].bounds.Centroid();
+			const Float3 magnitude = { std::abs(separation.x), std::abs(separation.y), std::abs(separation.z) };
+			node.axis = (magnitude.x >= magnitude.y && magnitude.x >= magnitude.z) ? 0 : (magnitude.y >= magnitude.z ? 1 : 2);
+			if (separation[static_cast<int>(node.axis)] < 0.0f) std::swap(left, right);
+		}
+
+		/*
+		 Treelet rooted at 'root': grown by repeatedly expanding the leaf with the largest surface area, then
+		 rebuilt with the topology of least SAH cost over all ways to split its leaves (dynamic programming over
+		 leaf subsets), reusing its own internal nodes.
+		*/
+		void OptimizeTreelet(uint32_t root)
+		{
+			uint32_t leaves[gLbvhTreeletSize];
+			uint32_t internals[gLbvhTreeletSize - 1];
+			uint32_t leafCount = 2, internalCount = 1;
+			leaves[0] = arena[root].children[0];
+			leaves[1] = arena[root].children[1];
+			internals[0] = root;
+
+			while (leafCount < gLbvhTreeletSize)
+			{
+				int largest = -1;
+				float largestArea = -1.0f;
+				for (uint32_t i = 0; i < leafCount; i++)
+				{
+					if (IsPrimitiveLeaf(leaves[i])) continue;
+					const float area = arena[leaves[i]].bounds.HalfArea();
+					if (area > largestArea)
+					{
+						largestArea = area;
+						largest = int(i);
+					}
+				}
+				if (largest < 0) break;
+
+				const uint32_t expanded = leaves[largest];
+				internals[internalCount++] = expanded;
+				leaves[largest] = arena[expanded].children[0];
+				leaves[leafCount++] = arena[expanded].children[1];
+			}
+			if (leafCount < 3)
+			{
+				UpdateNode(root);
+				return;
+			}
+
+			constexpr uint32_t subsetCount = 1u << gLbvhTreeletSize;
+			float subsetCost[subsetCount];
+			float subsetArea[subsetCount];
+			uint8_t bestPartition[subsetCount];
+
+			const uint32_t full = (1u << leafCount) - 1;
+			for (uint32_t subset = 1; subset <= full; subset++)
+			{
+				Aabb bounds;
+				uint32_t subsetPrimitiveCount = 0;
+				for (uint32_t i = 0; i < leafCount; i++)
+				{
+					if (!(subset & (1u << i))) continue;
+					bounds.Grow(arena[leaves[i]].bounds);
+					subsetPrimitiveCount += primitives[leaves[i]];
+				}
+				subsetArea[subset] = bounds.HalfArea();
+
+				if ((subset & (subset - 1)) == 0)
+				{
+					subsetCost[subset] = costs[leaves[CountLeadingZeros64(subset) ^ 63]];
+					continue;
+				}
+
+				// Every split of the subset once: the partitions that hold its lowest leaf
+				const uint32_t delta = (subset - 1) & subset;
+				uint32_t partition = (0u - delta) & subset;
+				float best = std::numeric_limits<float>::max();
+				uint32_t bestSide = 0;
+				while (partition != 0)
+				{
+					const float cost = subsetCost[partition] + subsetCost[subset ^ partition];
+					if (cost < best)
+					{
+						best = cost;
+						bestSide = partition;
+					}
+					partition = (partition - delta) & subset;
+				}
+
+				float cost = settings.traversalCost * subsetArea[subset] + best;
+				if (subsetPrimitiveCount <= settings.maxLeafSize)
+				{
+					cost = std::min(cost, settings.intersectionCost * subsetArea[subset] * subsetPrimitiveCount);
+				}
+				subsetCost[subset] = cost;
+				bestPartition[subset] = static_cast<uint8_t>(bestSide);
+			}
+
+			if (subsetCost[full] >= costs[root])
+			{
+				UpdateNode(root);
+				return;
+			}
+
+			uint32_t nextInternal = 1;
+			RebuildTreelet(root, full, leaves, internals, nextInternal, bestPartition);
+		}
+
+		void RebuildTreelet(uint32_t node, uint32_t subset, const uint32_t* leaves, const uint32_t* internals, uint32_t& nextInternal, const uint8_t* bestPartition)
+		{
+			const uint32_t sides[2] = { bestPartition[subset], subset ^ bestPartition[subset] };
+			for (int side = 0; side < 2; side++)
+			{
+				uint32_t child;
+				if ((sides[side] & (sides[side] - 1)) == 0)
+				{
+					child = leaves[CountLeadingZeros64(sides[side]) ^ 63];
+				}
+				else
+				{
+					child = internals[nextInternal++];
+					RebuildTreelet(child, sides[side], leaves, internals, nextInternal, bestPartition);
+				}
+				arena[node].children[side] = child;
+				parents[child] = node;
+			}
+			UpdateNode(node);
+		}
+
+		// Depth first leaf order, so every node (and every collapsed subtree) owns a contiguous triangle range
+		void AssignRanges(uint32_t node, uint32_t first, std::vector<uint32_t>& order, TaskGroup& group)
+		{
+			for (;;)
+			{
+				BvhBuildNode& build = arena[node];
+				if (build.count > 0)
+				{
+					uint32_t next = first;
+					CollectPrimitives(node, order, next);
+					build.first = first;
+					return;
+				}
+
+				const uint32_t left = build.children[0], right = build.children[1];
+				const uint32_t rightFirst = first + primitives[left];
+				if (primitives[right] > settings.taskThreshold)
+				{
+					pool.Run(group, [this, right, rightFirst, &order, &group]() { AssignRanges(right, rightFirst, order, group); });
+				}
+				else
+				{
+					AssignRanges(right, rightFirst, order, group);
+				}
+				node = left;
+			}
+		}
+
+		void CollectPrimitives(uint32_t node, std::vector<uint32_t>& order, uint32_t& next) const
+		{
+			if (IsPrimitiveLeaf(node))
+			{
+				order[next++] = values[node - (count - 1)];
+				return;
+			}
+			CollectPrimitives(arena[node].children[0], order, next);
+			CollectPrimitives(arena[node].children[1], order, next);
+		}
+
+		const MeshData& mesh;
+		BvhSettings settings;
+		ThreadPool& pool;
+
+		uint32_t count = 0;
+		std::vector<uint64_t> keys;				// Morton codes, sorted
+		std::vector<uint32_t> values;			// triangle of every sorted code
+		BvhArena arena;
+		std::vector<uint32_t> parents;
+		std::vector<uint32_t> primitives;		// triangles under every node
+		std::vector<float> costs;				// SAH cost of every subtree, unnormalized
+	};
+
+	inline Bvh BuildLbvh(const MeshData& mesh, const BvhSettings& settings = {}, ThreadPool& pool = ThreadPool::Default())
+	{
+		return BvhLbvhBuilder(mesh, settings, pool).Build();
+	}
+}
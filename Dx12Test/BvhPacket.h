@@ -0,0 +1,397 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "Bvh.h"
+#include "CpuRayTracer.h"
+#include "CpuSimd.h"
+
+/*
+ ------------------------------Packet Traversal------------------------------------
+ W rays through a Bvh at once, for the coherent camera rays of RayGen: every node is fetched once for the whole
+ packet and the slab and triangle tests run one ray per SIMD lane (CpuSimd.h, 8 lanes on AVX2, 16 on AVX-512).
+ Work is skipped for whole packets two ways:
+	- lanes that miss a node drop out of the mask its subtree is traversed with
+	- optional interval culling: the packet's origins and inverse directions as intervals bound every ray's slab
+	  distances, one scalar test rejects a node for all rays (the frustum test of Wald et al. 2006/2007). Off by
+	  default: with one SIMD register of rays the lane by lane test costs about as much, and the bounds are those of
+	  the whole packet, loose once lanes dropped out. `kepler-headless packet` measures both.
+ Packets whose rays do not share direction signs, and subtrees only a few lanes still reach, go ray by ray through
+ Bvh::IntersectSubtree. Hits are the ones Bvh::Intersect finds, same tests in the same float order.
+*/
+
+namespace CpuRt
+{
+	template<int W>
+	struct RayPacket
+	{
+		float origin[3][W];
+		float direction[3][W];
+		float tMin[W];
+		float tMax[W];
+		uint32_t active = 0;		// lanes holding a ray
+
+		void Set(int lane, const Ray& ray)
+		{
+			origin[0][lane] = ray.origin.x; origin[1][lane] = ray.origin.y; origin[2][lane] = ray.origin.z;
+			direction[0][lane] = ray.direction.x; direction[1][lane] = ray.direction.y; direction[2][lane] = ray.direction.z;
+			tMin[lane] = ray.tMin;
+			tMax[lane] = ray.tMax;
+			active |= 1u << lane;
+		}
+
+		Ray Get(int lane) const
+		{
+			Ray ray;
+			ray.origin = { origin[0][lane], origin[1][lane], origin[2][lane] };
+			ray.direction = { direction[0][lane], direction[1][lane], direction[2][lane] };
+			ray.tMin = tMin[lane];
+			ray.tMax = tMax[lane];
+			return ray;
+		}
+	};
+
+	template<int W>
+	struct PacketHit
+	{
+		float t[W];
+		float u[W];
+		float v[W];
+		uint32_t primitive[W];
+
+		RayHit Get(int lane) const
+		{
+			RayHit hit;
+			hit.t = t[lane];
+			hit.primitive = primitive[lane];
+			hit.barycentrics = { u[lane], v[lane] };
+			return hit;
+		}
+	};
+
+	// Lanes with fewer active rays than this finish their subtree ray by ray
+	template<int W>
+	constexpr uint32_t PacketMinActiveRays() { return W / 4 + 1; }
+
+	template<int W>
+	class PacketTraversal
+	{
+	public:
+		using Vector = SimdFloat<W>;
+
+		PacketTraversal(const Bvh& bvh, const RayPacket<W>& packet, uint32_t rayFlags, bool intervalCulling, PacketHit<W>& hit)
+			: bvh(bvh), packet(packet), rayFlags(rayFlags), intervalCulling(intervalCulling), hit(hit)
+		{
+		}
+
+		// Closest hit of every active lane, or the first found with RayFlagAcceptFirstHitAndEndSearch. Returns the lanes that hit.
+		uint32_t Run()
+		{
+			for (int i = 0; i < W; i++)
+			{
+				hit.t[i] = packet.tMax[i];
+				hit.u[i] = hit.v[i] = 0.0f;
+				hit.primitive[i] = gInvalidPrimitive;
+			}
+			if (bvh.Empty() || packet.active == 0) return 0;
+
+			for (int axis = 0; axis < 3; axis++)
+			{
+				origin[axis] = Vector::Load(packet.origin[axis]);
+				direction[axis] = Vector::Load(packet.direction[axis]);
+				invDirection[axis] = Vector::Broadcast(1.0f) / direction[axis];
+			}
+			tMin = Vector::Load(packet.tMin);
+			t = Vector::Load(hit.t);
+			u = v = Vector::Broadcast(0.0f);
+
+			// The near child is the same for every ray only if they all point the same way
+			for (int axis = 0; axis < 3; axis++)
+			{
+				const uint32_t negative = LessMask(invDirection[axis], Vector::Broadcast(0.0f)) & packet.active;
+				if (negative != 0 && negative != packet.active) return TraceRays(0, packet.active);
+				dirNegative[axis] = negative != 0;
+			}
+			if (intervalCulling) SetupIntervals();
+
+			struct Entry { uint32_t node; uint32_t mask; };
+			Entry stack[128];
+			uint32_t stackSize = 0;
+			uint32_t current = 0;
+			uint32_t mask = packet.active;
+			const BvhNodeSpan nodes = bvh.Nodes();
+
+			for (;;)
+			{
+				mask &= ~finished;
+				const BvhNode& node = nodes[current];
+				if (mask != 0 && !CulledByIntervals(node)) mask &= IntersectBounds(node);
+				else mask = 0;
+
+				if (mask != 0)
+				{
+					if (PopCount(mask) < PacketMinActiveRays<W>())
+					{
+						TraceRays(current, mask);
+					}
+					else if (node.IsLeaf())
+					{
+						for (uint32_t i = node.offset; i < node.offset + node.count; i++) IntersectTriangle(i, mask);
+						if (finished == packet.active) break;
+					}
+					else
+					{
+						// Near child next, far child on the stack
+						const uint32_t left = node.offset, right = node.offset + 1;
+						const bool rightFirst = dirNegative[node.axis];
+						stack[stackSize++] = { rightFirst ? left : right, mask };
+						current = rightFirst ? right : left;
+						continue;
+					}
+				}
+
+				if (stackSize == 0) break;
+				stackSize--;
+				current = stack[stackSize].node;
+				mask = stack[stackSize].mask;
+			}
+
+			t.Store(hit.t);
+			u.Store(hit.u);
+			v.Store(hit.v);
+			return found;
+		}
+
+	private:
+		// Interval bounds over the active lanes
+		void SetupIntervals()
+		{
+			const Vector infinity = Vector::Broadcast(std::numeric_limits<float>::infinity());
+			intervalsUsable = true;
+			for (int axis = 0; axis < 3; axis++)
+			{
+				originLo[axis] = ReduceMin(Select(packet.active, origin[axis], infinity));
+				originHi[axis] = -ReduceMin(Select(packet.active, Vector::Broadcast(0.0f) - origin[axis], infinity));
+				invLo[axis] = ReduceMin(Select(packet.active, invDirection[axis], infinity));
+				invHi[axis] = -ReduceMin(Select(packet.active, Vector::Broadcast(0.0f) - invDirection[axis], infinity));
+				// An axis parallel ray has no finite slab distances to bound
+				intervalsUsable &= std::isfinite(invLo[axis]) && std::isfinite(invHi[axis]);
+			}
+			if (!intervalsUsable) return;
+			tMinLo = ReduceMin(Select(packet.active, tMin, infinity));
+			UpdateFarthestHit();
+		}
+
+		void UpdateFarthestHit()
+		{
+			if (!intervalsUsable) return;
+			tMaxHi = -ReduceMin(Select(packet.active & ~finished, Vector::Broadcast(0.0f) - t, Vector::Broadcast(std::numeric_limits<float>::infinity())));
+		}
+
+		// Lowest and highest (plane - origin) * invDirection over the packet: interval multiplication, where with the sign
+		// of invDirection known only one corner of the product can be the bound
+		float SlabLo(int axis, float plane) const
+		{
+			const float n = dirNegative[axis] ? plane - originLo[axis] : plane - originHi[axis];
+			return n * (n >= 0.0f ? invLo[axis] : invHi[axis]);
+		}
+
+		float SlabHi(int axis, float plane) const
+		{
+			const float n = dirNegative[axis] ? plane - originHi[axis] : plane - originLo[axis];
+			return n * (n >= 0.0f ? invHi[axis] : invLo[axis]);
+		}
+
+		// True if no ray of the packet can hit the node: the latest possible entry is still after the earliest possible exit
+		bool CulledByIntervals(const BvhNode& node) const
+		{
+			if (!intervalsUsable) return false;
+			const float boundsMin[3] = { node.boundsMin.x, node.boundsMin.y, node.boundsMin.z };
+			const float boundsMax[3] = { node.boundsMax.x, node.boundsMax.y, node.boundsMax.z };
+			float nearLo = tMinLo, farHi = tMaxHi;
+			for (int axis = 0; axis < 3; axis++)
+			{
+				nearLo = std::max(nearLo, SlabLo(axis, dirNegative[axis] ? boundsMax[axis] : boundsMin[axis]));
+				farHi = std::min(farHi, SlabHi(axis, dirNegative[axis] ? boundsMin[axis] : boundsMax[axis]));
+			}
+			return nearLo > farHi;
+		}
+
+		// Bvh::IntersectBounds, lane by lane
+		uint32_t IntersectBounds(const BvhNode& node) const
+		{
+			const Vector tx0 = (Vector::Broadcast(node.boundsMin.x) - origin[0]) * invDirection[0], tx1 = (Vector::Broadcast(node.boundsMax.x) - origin[0]) * invDirection[0];
+			const Vector ty0 = (Vector::Broadcast(node.boundsMin.y) - origin[1]) * invDirection[1], ty1 = (Vector::Broadcast(node.boundsMax.y) - origin[1]) * invDirection[1];
+			const Vector tz0 = (Vector::Broadcast(node.boundsMin.z) - origin[2]) * invDirection[2], tz1 = (Vector::Broadcast(node.boundsMax.z) - origin[2]) * invDirection[2];
+			const Vector tNear = Max(Max(Min(tx0, tx1), Min(ty0, ty1)), Max(Min(tz0, tz1), tMin));
+			const Vector tFar = Min(Min(Max(tx0, tx1), Max(ty0, ty1)), Min(Max(tz0, tz1), t));
+			return LessEqualMask(tNear, tFar);
+		}
+
+		// CpuRt::IntersectTriangle, lane by lane
+		void IntersectTriangle(uint32_t triangle, uint32_t mask)
+		{
+			const Float3* p = bvh.TrianglePositions(triangle);
+			const Float3 edge1 = p[1] - p[0], edge2 = p[2] - p[0];
+			const Vector e1[3] = { Vector::Broadcast(edge1.x), Vector::Broadcast(edge1.y), Vector::Broadcast(edge1.z) };
+			const Vector e2[3] = { Vector::Broadcast(edge2.x), Vector::Broadcast(edge2.y), Vector::Broadcast(edge2.z) };
+			const Vector zero = Vector::Broadcast(0.0f), one = Vector::Broadcast(1.0f);
+
+			const Vector pv[3] = {
+				direction[1] * e2[2] - direction[2] * e2[1],
+				direction[2] * e2[0] - direction[0] * e2[2],
+				direction[0] * e2[1] - direction[1] * e2[0] };
+			const Vector det = e1[0] * pv[0] + e1[1] * pv[1] + e1[2] * pv[2];
+
+			mask &= NotEqualMask(det, zero);
+			if (rayFlags & RayFlagCullBackFacingTriangles) mask &= ~LessMask(det, zero);
+			if (rayFlags & RayFlagCullFrontFacingTriangles) mask &= ~LessMask(zero, det);
+			if (mask == 0) return;
+
+			const Vector invDet = one / det;
+			const Vector s[3] = { origin[0] - Vector::Broadcast(p[0].x), origin[1] - Vector::Broadcast(p[0].y), origin[2] - Vector::Broadcast(p[0].z) };
+			const Vector hitU = (s[0] * pv[0] + s[1] * pv[1] + s[2] * pv[2]) * invDet;
+			mask &= ~LessMask(hitU, zero) & ~LessMask(one, hitU);
+			if (mask == 0) return;
+
+			const Vector q[3] = {
+				s[1] * e1[2] - s[2] * e1[1],
+				s[2] * e1[0] - s[0] * e1[2],
+				s[0] * e1[1] - s[1] * e1[0] };
+			const Vector hitV = (direction[0] * q[0] + direction[1] * q[1] + direction[2] * q[2]) * invDet;
+			mask &= ~LessMask(hitV, zero) & ~LessMask(one, hitU + hitV);
+			if (mask == 0) return;
+
+			const Vector hitT = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * invDet;
+			mask &= ~LessEqualMask(hitT, tMin) & ~LessEqualMask(t, hitT);
+			if (mask == 0) return;
+
+			t = Select(mask, hitT, t);
+			u = Select(mask, hitU, u);
+			v = Select(mask, hitV, v);
+			for (uint32_t lanes = mask; lanes != 0; lanes &= lanes - 1) hit.primitive[CountTrailingZeros(lanes)] = bvh.PrimitiveId(triangle);
+			found |= mask;
+			if (rayFlags & RayFlagAcceptFirstHitAndEndSearch) finished |= mask;
+			UpdateFarthestHit();
+		}
+
+		// The lanes in 'mask' one at a time below 'root', for packets that no longer share much of their path
+		uint32_t TraceRays(uint32_t root, uint32_t mask)
+		{
+			t.Store(hit.t);
+			u.Store(hit.u);
+			v.Store(hit.v);
+			for (; mask != 0; mask &= mask - 1)
+			{
+				const int lane = static_cast<int>(CountTrailingZeros(mask));
+				RayHit rayHit = hit.Get(lane);
+				if (bvh.IntersectSubtree(root, packet.Get(lane), rayFlags, rayHit))
+				{
+					hit.t[lane] = rayHit.t;
+					hit.u[lane] = rayHit.barycentrics.x;
+					hit.v[lane] = rayHit.barycentrics.y;
+					hit.primitive[lane] = rayHit.primitive;
+					found |= 1u << lane;
+					if (rayFlags & RayFlagAcceptFirstHitAndEndSearch) finished |= 1u << lane;
+				}
+			}
+			t = Vector::Load(hit.t);
+			u = Vector::Load(hit.u);
+			v = Vector::Load(hit.v);
+			UpdateFarthestHit();
+			return found;
+		}
+
+		const Bvh& bvh;
+		const RayPacket<W>& packet;
+		const uint32_t rayFlags;
+		const bool intervalCulling;
+		PacketHit<W>& hit;
+
+		Vector origin[3], direction[3], invDirection[3], tMin;
+		Vector t, u, v;					// closest hit so far
+		bool dirNegative[3] = {};
+		uint32_t found = 0;				// lanes with a hit
+		uint32_t finished = 0;			// lanes done early, RayFlagAcceptFirstHitAndEndSearch
+
+		bool intervalsUsable = false;
+		float originLo[3], originHi[3], invLo[3], invHi[3];
+		float tMinLo = 0.0f, tMaxHi = 0.0f;
+	};
+
+	template<int W>
+	inline uint32_t IntersectPacket(const Bvh& bvh, const RayPacket<W>& packet, uint32_t rayFlags, PacketHit<W>& hit, bool intervalCulling = false)
+	{
+		return PacketTraversal<W>(bvh, packet, rayFlags, intervalCulling, hit).Run();
+	}
+
+	// Pixel block a packet covers, 4x2 for 8 lanes, 4x4 for 16
+	template<int W>
+	constexpr uint32_t PacketBlockWidth() { return W >= 4 ? 4 : W; }
+
+	/*
+	 Render with W wide packets of camera rays: RayGen's rays and shaders, only the TraceRay of a block of pixels
+	 goes through IntersectPacket together.
+	*/
+	template<int W>
+	inline RenderStats RenderPackets(const Bvh& bvh, const MeshData& mesh, const SceneConstants& scene, const RenderSettings& settings,
+		std::vector<Float4>& output, bool intervalCulling = false, ThreadPool& pool = ThreadPool::Default())
+	{
+		static_assert(W <= 32, "Packet lanes are bits of a uint32_t");
+		const ShaderContext context = { &mesh, &scene, settings.width, settings.height, nullptr };
+		constexpr uint32_t blockWidth = PacketBlockWidth<W>(), blockHeight = W / blockWidth;
+		output.resize(size_t(settings.width) * settings.height);
+
+		const auto start = std::chrono::high_resolution_clock::now();
+		ForEachTile(settings, pool, [&](uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1)
+		{
+			RayPacket<W> packet;
+			PacketHit<W> hit;
+			for (uint32_t by = y0; by < y1; by += blockHeight)
+			{
+				for (uint32_t bx = x0; bx < x1; bx += blockWidth)
+				{
+					packet.active = 0;
+					for (int lane = 0; lane < W; lane++)
+					{
+						const uint32_t x = bx + lane % blockWidth, y = by + lane / blockWidth;
+						Ray ray = { { 0.0f, 0.0f, 0.0f }, 0.0f, { 1.0f, 0.0f, 0.0f }, 0.0f };
+						if (x < x1 && y < y1)
+						{
+							GenerateCameraRay(context, x, y, ray.origin, ray.direction);
+							ray.tMin = 0.001f;
+							ray.tMax = 10000.0f;
+							packet.Set(lane, ray);
+						}
+						else
+						{
+							packet.Set(lane, ray);
+							packet.active &= ~(1u << lane);
+						}
+					}
+
+					const uint32_t hits = IntersectPacket(bvh, packet, RayFlagCullBackFacingTriangles, hit, intervalCulling);
+					for (uint32_t lanes = packet.active; lanes != 0; lanes &= lanes - 1)
+					{
+						const int lane = static_cast<int>(CountTrailingZeros(lanes));
+						HitInfo payload;
+						payload.ShadedColorAndHitT = { 0.0f, 0.0f, 0.0f, 0.0f };
+						if (hits & (1u << lane)) ClosestHit(context, bvh, packet.Get(lane), hit.Get(lane), payload);
+						else Miss(payload);
+						output[size_t(by + lane / blockWidth) * settings.width + bx + lane % blockWidth] = payload.ShadedColorAndHitT;
+					}
+				}
+			}
+		});
+
+		RenderStats stats;
+		stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		stats.rays = uint64_t(settings.width) * settings.height;
+		return stats;
+	}
+}
@@ -0,0 +1,546 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "Bvh.h"
+#include "BvhLbvhBuilder.h"
+#include "TriangleBlocks.h"
+
+/*
+ ------------------------------BVH Paging------------------------------------
+ Out of core tracing for a BLAS bigger than the memory it may use (Pharr et al. 1997, "Rendering Complex Scenes
+ with Memory-Coherent Ray Tracing"). WritePagedBvh cuts a built Bvh into
+	- the top tree: the nodes above subtrees of at most 'treeletBytes', always resident, a few KB
+	- treelets: those subtrees with their triangles and primitive ids, one page aligned record each in the file
+ A TreeletCache keeps the treelets a memory budget allows and evicts the least recently used. TraceOutOfCore
+ traces a batch of rays in two passes:
+	1. every ray walks the top tree, treelets that are resident are traced right away, the others get the ray queued
+	2. the queues sorted by treelet, resident ones first, then each missing treelet is read once and traces all of
+	   its rays before the next one can evict it
+ A ray tests deferred treelets against the closest hit it has so far, the result is the resident Bvh's closest hit
+ (ties between equally near triangles aside). Only traversal and triangle data are paged, shading attributes stay
+ with the caller, and the paged file is cut from a tree built in memory.
+*/
+
+namespace CpuRt
+{
+	constexpr uint32_t gPagedBvhMagic = 0x4750424B;			// "KBPG"
+	constexpr uint32_t gPagedBvhVersion = 1;
+	constexpr uint32_t gPagedBvhPageSize = 4096;
+	constexpr uint32_t gPagedBvhTreeletBytes = 64 * 1024;
+	constexpr uint32_t gPagedBvhLineSize = 64;
+
+	struct PagedBvhHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t topNodeCount;
+		uint32_t treeletCount;
+		uint32_t triangleCount;
+		uint32_t pageSize;
+		uint64_t treeletTableOffset;	// top nodes follow the header, the table follows them
+		uint64_t fileSize;
+	};
+
+	// A treelet's record: 32 bytes of padding so the nodes start half way into a line (BvhNodeAllocator), nodes,
+	// primitive ids and triangles, the last two line aligned. Offsets are from the start of the record.
+	struct PagedBvhTreelet
+	{
+		uint64_t offset;				// from the start of the file, page aligned
+		uint32_t bytes;
+		uint32_t nodeCount;
+		uint32_t triangleCount;
+		uint32_t primitiveIdOffset;
+		uint32_t triangleOffset;
+		uint32_t padding;
+	};
+
+	static_assert(sizeof(PagedBvhHeader) == 40, "paged BVH header layout changed");
+	static_assert(sizeof(PagedBvhTreelet) == 32, "paged BVH treelet layout changed");
+
+	/*
+	 Writes 'bvh' cut into treelets of at most 'treeletBytes' (a leaf bigger than that is a treelet of its own),
+	 returns the file size. Top tree leaves are the treelets: 'count' is 1 and 'offset' the treelet index.
+	*/
+	inline uint64_t WritePagedBvh(const std::string& filepath, const Bvh& bvh, uint32_t treeletBytes = gPagedBvhTreeletBytes)
+	{
+		if (bvh.Empty())
+		{
+			throw std::runtime_error("Error: an empty BVH has nothing to page");
+		}
+		const BvhNodeSpan nodes = bvh.Nodes();
+		const uint64_t triangleBytes = 3 * sizeof(Float3) + sizeof(uint32_t);
+
+		// Bytes and triangle range under every node, children come after their parent in every layout
+		std::vector<uint64_t> subtreeBytes(nodes.size());
+		std::vector<uint32_t> first(nodes.size()), count(nodes.size());
+		for (size_t i = nodes.size(); i-- > 0; )
+		{
+			const BvhNode& node = nodes[i];
+			if (node.IsLeaf())
+			{
+				subtreeBytes[i] = sizeof(BvhNode) + node.count * triangleBytes;
+				first[i] = node.offset;
+				count[i] = node.count;
+			}
+			else
+			{
+				subtreeBytes[i] = sizeof(BvhNode) + subtreeBytes[node.offset] + subtreeBytes[node.offset + 1];
+				first[i] = first[node.offset];
+				count[i] = count[node.offset] + count[node.offset + 1];
+			}
+		}
+
+		// Top tree breadth first, sibling pairs adjacent, cut where a subtree fits a treelet
+		std::vector<BvhNode> topNodes = { nodes[0] };
+		std::vector<uint32_t> treeletRoots;
+		struct Pending { uint32_t source; uint32_t node; };
+		std::vector<Pending> queue = { { 0u, 0u } };
+		for (size_t q = 0; q < queue.size(); q++)
+		{
+			const uint32_t source = queue[q].source, node = queue[q].node;
+			if (nodes[source].IsLeaf() || subtreeBytes[source] + gPagedBvhLineSize <= treeletBytes)
+			{
+				topNodes[node].offset = static_cast<uint32_t>(treeletRoots.size());
+				topNodes[node].count = 1;
+				treeletRoots.push_back(source);
+				continue;
+			}
+			const uint32_t left = static_cast<uint32_t>(topNodes.size());
+			topNodes[node].offset = left;
+			const uint32_t sourceLeft = nodes[source].offset;
+			topNodes.push_back(nodes[sourceLeft]);
+			topNodes.push_back(nodes[sourceLeft + 1]);
+			queue.push_back({ sourceLeft, left });
+			queue.push_back({ sourceLeft + 1, left + 1 });
+		}
+
+		PagedBvhHeader header = {};
+		header.magic = gPagedBvhMagic;
+		header.version = gPagedBvhVersion;
+		header.topNodeCount = static_cast<uint32_t>(topNodes.size());
+		header.treeletCount = static_cast<uint32_t>(treeletRoots.size());
+		header.triangleCount = static_cast<uint32_t>(bvh.TriangleCount());
+		header.pageSize = gPagedBvhPageSize;
+		header.treeletTableOffset = sizeof(PagedBvhHeader) + topNodes.size() * sizeof(BvhNode);
+
+		const auto align = [](uint64_t value, uint64_t alignment) { return (value + alignment - 1) / alignment * alignment; };
+		std::vector<PagedBvhTreelet> treelets(treeletRoots.size());
+		uint64_t offset = align(header.treeletTableOffset + treelets.size() * sizeof(PagedBvhTreelet), gPagedBvhPageSize);
+		for (size_t t = 0; t < treeletRoots.size(); t++)
+		{
+			const uint32_t root = treeletRoots[t];
+			PagedBvhTreelet& treelet = treelets[t];
+			treelet.offset = offset;
+			treelet.nodeCount = static_cast<uint32_t>((subtreeBytes[root] - count[root] * triangleBytes) / sizeof(BvhNode));
+			treelet.triangleCount = count[root];
+			treelet.primitiveIdOffset = static_cast<uint32_t>(align(gPagedBvhLineSize / 2 + treelet.nodeCount * sizeof(BvhNode), gPagedBvhLineSize));
+			treelet.triangleOffset = static_cast<uint32_t>(align(treelet.primitiveIdOffset + treelet.triangleCount * sizeof(uint32_t), gPagedBvhLineSize));
+			treelet.bytes = static_cast<uint32_t>(treelet.triangleOffset + treelet.triangleCount * 3 * sizeof(Float3));
+			offset = align(offset + treelet.bytes, gPagedBvhPageSize);
+		}
+		header.fileSize = offset;
+
+		FILE* file = fopen(filepath.c_str(), "wb");
+		if (!file)
+		{
+			throw std::runtime_error("Error: failed to create " + filepath);
+		}
+		fwrite(&header, sizeof(header), 1, file);
+		fwrite(topNodes.data(), sizeof(BvhNode), topNodes.size(), file);
+		fwrite(treelets.data(), sizeof(PagedBvhTreelet), treelets.size(), file);
+
+		// Every record renumbers its subtree breadth first like the top tree, leaves point into its own triangles
+		std::vector<uint8_t> record;
+		std::vector<Pending> subtree;
+		uint64_t position = header.treeletTableOffset + treelets.size() * sizeof(PagedBvhTreelet);
+		for (size_t t = 0; t < treeletRoots.size(); t++)
+		{
+			const PagedBvhTreelet& treelet = treelets[t];
+			const uint32_t root = treeletRoots[t], base = first[root];
+			record.assign(align(treelet.bytes, gPagedBvhPageSize), 0);
+			BvhNode* local = reinterpret_cast<BvhNode*>(record.data() + gPagedBvhLineSize / 2);
+			uint32_t* primitiveIds = reinterpret_cast<uint32_t*>(record.data() + treelet.primitiveIdOffset);
+			Float3* triangles = reinterpret_cast<Float3*>(record.data() + treelet.triangleOffset);
+
+			uint32_t nodeCount = 1;
+			local[0] = nodes[root];
+			subtree.assign(1, { root, 0u });
+			for (size_t q = 0; q < subtree.size(); q++)
+			{
+				const uint32_t source = subtree[q].source, node = subtree[q].node;
+				if (nodes[source].IsLeaf())
+				{
+					local[node].offset = nodes[source].offset - base;
+					continue;
+				}
+				local[node].offset = nodeCount;
+				local[nodeCount] = nodes[nodes[source].offset];
+				local[nodeCount + 1] = nodes[nodes[source].offset + 1];
+				subtree.push_back({ nodes[source].offset, nodeCount });
+				subtree.push_back({ nodes[source].offset + 1, nodeCount + 1 });
+				nodeCount += 2;
+			}
+			for (uint32_t i = 0; i < treelet.triangleCount; i++)
+			{
+				primitiveIds[i] = bvh.PrimitiveId(base + i);
+				std::copy(bvh.TrianglePositions(base + i), bvh.TrianglePositions(base + i) + 3, triangles + size_t(i) * 3);
+			}
+
+			while (position < treelet.offset)
+			{
+				fputc(0, file);
+				position++;
+			}
+			fwrite(record.data(), 1, record.size(), file);
+			position += record.size();
+		}
+
+		const bool failed = ferror(file) != 0;
+		fclose(file);
+		if (failed)
+		{
+			throw std::runtime_error("Error: failed to write " + filepath);
+		}
+		return header.fileSize;
+	}
+
+	// The top tree and treelet table of a paged file, the records stay on disk until a TreeletCache reads them
+	class PagedBvh
+	{
+	public:
+		PagedBvh() = default;
+		~PagedBvh() { Close(); }
+
+		PagedBvh(const PagedBvh&) = delete;
+		PagedBvh& operator=(const PagedBvh&) = delete;
+
+		void Open(const std::string& filepath)
+		{
+			Close();
+#ifdef _WIN32
+			fileHandle = CreateFileA(filepath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			const bool opened = fileHandle != INVALID_HANDLE_VALUE;
+#else
+			fileHandle = open(filepath.c_str(), O_RDONLY);
+			const bool opened = fileHandle >= 0;
+#endif
+			if (!opened)
+			{
+				Close();
+				throw std::runtime_error("Error: failed to open " + filepath);
+			}
+
+			if (!Read(0, &header, sizeof(header)) || header.magic != gPagedBvhMagic || header.version != gPagedBvhVersion || header.topNodeCount == 0)
+			{
+				Close();
+				throw std::runtime_error("Error: " + filepath + " is not a valid paged BVH");
+			}
+			topNodes.resize(header.topNodeCount);
+			treelets.resize(header.treeletCount);
+			if (!Read(sizeof(header), topNodes.data(), topNodes.size() * sizeof(BvhNode)) ||
+				!Read(header.treeletTableOffset, treelets.data(), treelets.size() * sizeof(PagedBvhTreelet)))
+			{
+				Close();
+				throw std::runtime_error("Error: " + filepath + " is not a valid paged BVH");
+			}
+
+			treeletBytes = 0;
+			for (const PagedBvhTreelet& treelet : treelets)
+			{
+				if (treelet.offset + treelet.bytes > header.fileSize || treelet.triangleOffset + uint64_t(treelet.triangleCount) * 3 * sizeof(Float3) > treelet.bytes)
+				{
+					Close();
+					throw std::runtime_error("Error: " + filepath + " is not a valid paged BVH");
+				}
+				treeletBytes += treelet.bytes;
+			}
+		}
+
+		void Close()
+		{
+#ifdef _WIN32
+			if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+			fileHandle = INVALID_HANDLE_VALUE;
+#else
+			if (fileHandle >= 0) close(fileHandle);
+			fileHandle = -1;
+#endif
+			topNodes.clear();
+			treelets.clear();
+			treeletBytes = 0;
+		}
+
+		BvhNodeSpan TopNodes() const { return topNodes; }
+		uint32_t TreeletCount() const { return header.treeletCount; }
+		const PagedBvhTreelet& Treelet(uint32_t index) const { return treelets[index]; }
+		uint64_t TreeletBytes() const { return treeletBytes; }			// all records, what a fully resident cache holds
+		size_t TriangleCount() const { return header.triangleCount; }
+
+		// A treelet's record into 'buffer' (Treelet(index).bytes), safe from any thread
+		void ReadTreelet(uint32_t index, uint8_t* buffer) const
+		{
+			if (!Read(treelets[index].offset, buffer, treelets[index].bytes))
+			{
+				throw std::runtime_error("Error: failed to read BVH treelet " + std::to_string(index));
+			}
+		}
+
+	private:
+		bool Read(uint64_t offset, void* buffer, size_t size) const
+		{
+			uint8_t* bytes = static_cast<uint8_t*>(buffer);
+			while (size > 0)
+			{
+				const uint32_t chunk = static_cast<uint32_t>(std::min<size_t>(size, 1u << 30));
+#ifdef _WIN32
+				OVERLAPPED overlapped = {};
+				overlapped.Offset = static_cast<DWORD>(offset);
+				overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+				DWORD read = 0;
+				if (!ReadFile(fileHandle, bytes, chunk, &read, &overlapped) || read == 0) return false;
+#else
+				const ssize_t read = pread(fileHandle, bytes, chunk, static_cast<off_t>(offset));
+				if (read <= 0) return false;
+#endif
+				bytes += read;
+				offset += read;
+				size -= read;
+			}
+			return true;
+		}
+
+#ifdef _WIN32
+		HANDLE fileHandle = INVALID_HANDLE_VALUE;
+#else
+		int fileHandle = -1;
+#endif
+		PagedBvhHeader header = {};
+		std::vector<BvhNode> topNodes;
+		std::vector<PagedBvhTreelet> treelets;
+		uint64_t treeletBytes = 0;
+	};
+
+	struct TreeletCacheStats
+	{
+		uint64_t visits = 0;			// treelets a batch needed, each counted once per batch however many rays reached it
+		uint64_t visitedBytes = 0;		// ... and their record bytes
+		uint64_t loads = 0;
+		uint64_t evictions = 0;
+		uint64_t bytesRead = 0;
+		double loadMilliseconds = 0.0;
+
+		// Per treelet visit and per byte: what the resident set saved, the rays a load serves do not count as hits
+		double HitRate() const { return visits ? 1.0 - double(loads) / visits : 1.0; }
+		double ByteHitRate() const { return visitedBytes ? 1.0 - double(bytesRead) / visitedBytes : 1.0; }
+	};
+
+	/*
+	 Treelets of a PagedBvh resident under 'budgetBytes', each one a Bvh attached to its record. Least recently used
+	 goes first when a load needs room, one treelet is always allowed even when it alone is over the budget.
+	 Resident and Touch may run on any thread while nothing loads, Load only between passes.
+	*/
+	class TreeletCache
+	{
+	public:
+		TreeletCache(const PagedBvh& paged, uint64_t budgetBytes)
+			: paged(paged), budgetBytes(budgetBytes), treelets(paged.TreeletCount()), lastUse(paged.TreeletCount())
+		{
+		}
+
+		const Bvh* Resident(uint32_t treelet) const { return treelets[treelet].get(); }
+		void Touch(uint32_t treelet, uint64_t time) { lastUse[treelet].store(time, std::memory_order_relaxed); }
+		uint64_t NextTime() { return ++time; }
+
+		const Bvh& Load(uint32_t treelet, uint64_t time)
+		{
+			Touch(treelet, time);
+			if (treelets[treelet]) return *treelets[treelet];
+
+			const auto start = std::chrono::high_resolution_clock::now();
+			const PagedBvhTreelet& entry = paged.Treelet(treelet);
+			while (!resident.empty() && residentBytes + entry.bytes > budgetBytes) Evict();
+
+			std::shared_ptr<uint8_t> record(static_cast<uint8_t*>(::operator new(entry.bytes, std::align_val_t(gPagedBvhLineSize))),
+				[](uint8_t* pointer) { ::operator delete(pointer, std::align_val_t(gPagedBvhLineSize)); });
+			paged.ReadTreelet(treelet, record.get());
+
+			BvhStats bvhStats;
+			bvhStats.nodes = entry.nodeCount;
+			auto bvh = std::make_unique<Bvh>();
+			bvh->Attach({ reinterpret_cast<BvhNode*>(record.get() + gPagedBvhLineSize / 2), entry.nodeCount },
+				{ reinterpret_cast<uint32_t*>(record.get() + entry.primitiveIdOffset), entry.triangleCount },
+				{ reinterpret_cast<Float3*>(record.get() + entry.triangleOffset), size_t(entry.triangleCount) * 3 }, bvhStats, record);
+
+			treelets[treelet] = std::move(bvh);
+			resident.push_back(treelet);
+			residentBytes += entry.bytes;
+			stats.loads++;
+			stats.bytesRead += entry.bytes;
+			stats.loadMilliseconds += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+			return *treelets[treelet];
+		}
+
+		// Resident treelets last touched at 'time' and their bytes, what one pass visited
+		uint64_t TouchedTreelets(uint64_t time, uint64_t& bytes) const
+		{
+			uint64_t count = 0;
+			for (uint32_t treelet : resident)
+			{
+				if (lastUse[treelet].load(std::memory_order_relaxed) != time) continue;
+				count++;
+				bytes += paged.Treelet(treelet).bytes;
+			}
+			return count;
+		}
+
+		uint64_t ResidentBytes() const { return residentBytes; }
+		uint64_t BudgetBytes() const { return budgetBytes; }
+		TreeletCacheStats& Stats() { return stats; }
+
+	private:
+		void Evict()
+		{
+			size_t oldest = 0;
+			for (size_t i = 1; i < resident.size(); i++)
+			{
+				if (lastUse[resident[i]].load(std::memory_order_relaxed) < lastUse[resident[oldest]].load(std::memory_order_relaxed)) oldest = i;
+			}
+			const uint32_t treelet = resident[oldest];
+			resident[oldest] = resident.back();
+			resident.pop_back();
+			residentBytes -= paged.Treelet(treelet).bytes;
+			treelets[treelet].reset();
+			stats.evictions++;
+		}
+
+		const PagedBvh& paged;
+		uint64_t budgetBytes;
+		uint64_t residentBytes = 0;
+		uint64_t time = 0;
+		std::vector<std::unique_ptr<Bvh>> treelets;		// null where not resident
+		std::vector<std::atomic<uint64_t>> lastUse;		// pass 1 stamps the batch, pass 2 every treelet it processes
+		std::vector<uint32_t> resident;
+		TreeletCacheStats stats;
+	};
+
+	struct OutOfCoreStats
+	{
+		uint64_t rays = 0;
+		uint64_t deferred = 0;			// (ray, treelet) pairs queued in pass 1
+		double milliseconds = 0.0;
+
+		double MRaysPerSecond() const { return milliseconds > 0.0 ? rays / (milliseconds * 1000.0) : 0.0; }
+	};
+
+	// Closest hits (any hits with RayFlagAcceptFirstHitAndEndSearch) of 'rays' through 'paged', one batch
+	inline OutOfCoreStats TraceOutOfCore(const PagedBvh& paged, TreeletCache& cache, const std::vector<Ray>& rays, uint32_t rayFlags,
+		std::vector<RayHit>& hits, ThreadPool& pool = ThreadPool::Default())
+	{
+		const auto start = std::chrono::high_resolution_clock::now();
+		OutOfCoreStats stats;
+		stats.rays = rays.size();
+		hits.resize(rays.size());
+		const bool anyHit = (rayFlags & RayFlagAcceptFirstHitAndEndSearch) != 0;
+		const uint64_t time = cache.NextTime();
+
+		// The rest of a ray's hit search inside one treelet, against the nearest hit so far
+		const auto traceTreelet = [rayFlags](const Bvh& treelet, const Ray& ray, RayHit& hit)
+		{
+			Ray clipped = ray;
+			clipped.tMax = hit.t;
+			RayHit local;
+			if (!treelet.Intersect(clipped, rayFlags, local)) return false;
+			hit = local;
+			return true;
+		};
+
+		// Pass 1: top tree, resident treelets now, the others queued as (treelet, ray)
+		std::vector<uint32_t> keys, values;
+		std::mutex queueLock;
+		pool.ParallelFor(rays.size(), 1024, [&](size_t begin, size_t end)
+		{
+			std::vector<uint32_t> localKeys, localValues;
+			for (size_t i = begin; i < end; i++)
+			{
+				RayHit& hit = hits[i];
+				hit = RayHit();
+				Detail::IntersectCollapsedBvh(paged.TopNodes(), rays[i], rayFlags, hit, [&](const BvhNode& node)
+				{
+					const Bvh* treelet = cache.Resident(node.offset);
+					if (!treelet)
+					{
+						localKeys.push_back(node.offset);
+						localValues.push_back(static_cast<uint32_t>(i));
+						return false;
+					}
+					cache.Touch(node.offset, time);
+					return traceTreelet(*treelet, rays[i], hit);
+				});
+			}
+			std::lock_guard<std::mutex> lock(queueLock);
+			keys.insert(keys.end(), localKeys.begin(), localKeys.end());
+			values.insert(values.end(), localValues.begin(), localValues.end());
+		});
+		stats.deferred = keys.size();
+
+		// Pass 1 never loads, the treelets it stamped with 'time' are the resident ones this batch visited
+		cache.Stats().visits += cache.TouchedTreelets(time, cache.Stats().visitedBytes);
+
+		// Pass 2: queues by treelet, rays in each in the order pass 1 met them. Treelets still resident go first so
+		// the loads after them cannot evict what is about to be used.
+		uint32_t treeletBits = 0;
+		while (treeletBits < 32 && (paged.TreeletCount() >> treeletBits) != 0) treeletBits++;
+		RadixSortPairs(keys, values, treeletBits, pool);
+
+		struct Run { uint32_t treelet; size_t first, last; };
+		std::vector<Run> runs;
+		for (size_t first = 0; first < keys.size();)
+		{
+			size_t last = first + 1;
+			while (last < keys.size() && keys[last] == keys[first]) last++;
+			runs.push_back({ keys[first], first, last });
+			first = last;
+		}
+		std::stable_partition(runs.begin(), runs.end(), [&](const Run& run) { return cache.Resident(run.treelet) != nullptr; });
+
+		for (const Run& run : runs)
+		{
+			const Bvh& treelet = cache.Load(run.treelet, cache.NextTime());
+			cache.Stats().visits++;
+			cache.Stats().visitedBytes += paged.Treelet(run.treelet).bytes;
+			pool.ParallelFor(run.last - run.first, 256, [&](size_t begin, size_t end)
+			{
+				for (size_t i = run.first + begin; i < run.first + end; i++)
+				{
+					RayHit& hit = hits[values[i]];
+					if (anyHit && hit.Hit()) continue;
+					traceTreelet(treelet, rays[values[i]], hit);
+				}
+			});
+		}
+
+		stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		return stats;
+	}
+}
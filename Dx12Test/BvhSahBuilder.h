@@ -0,0 +1,419 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "Bvh.h"
+
+/*
+ ------------------------------Binned SAH BVH Builder------------------------------------
+ Top down build, every node picks the best of binCount candidate planes per axis by surface area heuristic.
+ Two kinds of parallelism:
+	- task parallel: children of nodes above taskThreshold triangles are built as separate pool tasks
+	- data parallel: nodes above parallelBinThreshold (only the first few levels) bin and partition in chunks,
+	  which is where a purely task parallel build would leave all but one core idle
+ Below depth gBvhMedianSplitDepth the builder falls back to object median splits, which keeps the tree within the
+ traversal stack whatever the input.
+*/
+
+namespace CpuRt
+{
+	constexpr uint32_t gBvhMedianSplitDepth = 32;
+	constexpr uint32_t gBvhMaxBins = 64;
+
+	class BvhSahBuilder
+	{
+	public:
+		BvhSahBuilder(const MeshData& mesh, const BvhSettings& settings, ThreadPool& pool)
+			: mesh(mesh), settings(settings), pool(pool)
+		{
+			this->settings.binCount = std::min(std::max(settings.binCount, 2u), gBvhMaxBins);
+			this->settings.maxLeafSize = std::min(std::max(settings.maxLeafSize, 1u), 0xFFFFu);
+		}
+
+		// Over primitives that are only boxes (triangle pairs, TrianglePairs.h): the Bvh gets no triangles, leaves
+		// reference ranges of PrimitiveId()s for whoever keeps the primitives
+		BvhSahBuilder(const std::vector<Aabb>& primitiveBounds, const BvhSettings& settings, ThreadPool& pool)
+			: BvhSahBuilder(emptyMesh, settings, pool)
+		{
+			this->primitiveBounds = &primitiveBounds;
+		}
+
+		Bvh Build()
+		{
+			const auto start = std::chrono::high_resolution_clock::now();
+			Bvh bvh;
+			const size_t count = primitiveBounds ? primitiveBounds->size() : mesh.TriangleCount();
+			if (count == 0) return bvh;
+
+			// Triangle references, root bounds reduced per chunk
+			refs.resize(count);
+			scratch.resize(count);
+
+			std::mutex rootLock;
+			Aabb rootBounds, rootCentroids;
+			pool.ParallelFor(count, 16384, [&](size_t begin, size_t end)
+			{
+				Aabb bounds, centroidBounds;
+				for (size_t i = begin; i < end; i++)
+				{
+					Aabb box;
+					if (primitiveBounds) box = (*primitiveBounds)[i];
+					else for (int v = 0; v < 3; v++) box.Grow(mesh.vertices[mesh.indices[i * 3 + v]].position);
+					refs[i] = { box.min, static_cast<uint32_t>(i), box.max, 0 };
+					bounds.Grow(box);
+					centroidBounds.Grow(refs[i].Centroid());
+				}
+				std::lock_guard<std::mutex> lock(rootLock);
+				rootBounds.Grow(bounds);
+				rootCentroids.Grow(centroidBounds);
+			});
+
+			arena.Reset(count);
+			const uint32_t root = arena.Allocate(1);
+			BuildNode(root, 0, static_cast<uint32_t>(count), rootBounds, rootCentroids, 0);
+
+			std::vector<uint32_t> order(count);
+			for (size_t i = 0; i < count; i++) order[i] = refs[i].primitive;
+			bvh.Flatten(arena, root, mesh, order, settings, pool);
+			bvh.SetBuildTime(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+			return bvh;
+		}
+
+	private:
+		// No default member initializers: a node only resets the bins it uses, constructing all of them cost more than binning
+		struct Bin
+		{
+			Float3 boundsMin, boundsMax;
+			Float3 centroidMin, centroidMax;
+			uint32_t count;
+
+			void Reset()
+			{
+				const Aabb empty;
+				boundsMin = centroidMin = empty.min;
+				boundsMax = centroidMax = empty.max;
+				count = 0;
+			}
+
+			void Merge(const Bin& other)
+			{
+				boundsMin = Min(boundsMin, other.boundsMin);
+				boundsMax = Max(boundsMax, other.boundsMax);
+				centroidMin = Min(centroidMin, other.centroidMin);
+				centroidMax = Max(centroidMax, other.centroidMax);
+				count += other.count;
+			}
+
+			Aabb Bounds() const { Aabb box; box.min = boundsMin; box.max = boundsMax; return box; }
+			Aabb CentroidBounds() const { Aabb box; box.min = centroidMin; box.max = centroidMax; return box; }
+		};
+
+		struct Split
+		{
+			int axis = -1;
+			uint32_t bin = 0;				// first bin of the right side
+			uint32_t binCount = 0;
+			float cost = std::numeric_limits<float>::max();
+			Aabb bounds[2];
+			Aabb centroidBounds[2];
+			uint32_t leftCount = 0;
+		};
+
+		// Small nodes get fewer bins, there is nothing to gain from more planes than triangles
+		uint32_t BinCount(uint32_t count) const
+		{
+			return std::min(settings.binCount, std::max(4u, count));
+		}
+
+		static uint32_t BinIndex(const Float3& centroid, int axis, const Aabb& centroidBounds, float scale, uint32_t binCount)
+		{
+			const int bin = static_cast<int>((centroid[axis] - centroidBounds.min[axis]) * scale);
+			return static_cast<uint32_t>(std::min(std::max(bin, 0), static_cast<int>(binCount) - 1));
+		}
+
+		void BinRange(uint32_t first, uint32_t last, const Aabb& centroidBounds, const float scale[3], uint32_t binCount, Bin (&bins)[3][gBvhMaxBins]) const
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				for (uint32_t b = 0; b < binCount; b++) bins[axis][b].Reset();
+			}
+
+			for (uint32_t i = first; i < last; i++)
+			{
+				const BvhPrimitiveRef& ref = refs[i];
+				const Float3 centroid = ref.Centroid();
+				for (int axis = 0; axis < 3; axis++)
+				{
+					if (scale[axis] == 0.0f) continue;
+					Bin& bin = bins[axis][BinIndex(centroid, axis, centroidBounds, scale[axis], binCount)];
+					bin.boundsMin = Min(bin.boundsMin, ref.boundsMin);
+					bin.boundsMax = Max(bin.boundsMax, ref.boundsMax);
+					bin.centroidMin = Min(bin.centroidMin, centroid);
+					bin.centroidMax = Max(bin.centroidMax, centroid);
+					bin.count++;
+				}
+			}
+		}
+
+		Split FindSplit(uint32_t first, uint32_t count, const Aabb& bounds, const Aabb& centroidBounds) const
+		{
+			const uint32_t binCount = BinCount(count);
+			const Float3 extent = centroidBounds.Extent();
+			float scale[3];
+			for (int axis = 0; axis < 3; axis++) scale[axis] = extent[axis] > 0.0f ? binCount / extent[axis] : 0.0f;
+
+			Bin bins[3][gBvhMaxBins];
+			if (count >= settings.parallelBinThreshold)
+			{
+				// Each chunk bins into its own copy, merged under a lock, there are only a handful of chunks
+				for (int axis = 0; axis < 3; axis++)
+				{
+					for (uint32_t b = 0; b < binCount; b++) bins[axis][b].Reset();
+				}
+
+				std::mutex binLock;
+				const size_t grain = std::max<size_t>(count / (pool.ThreadCount() * 4), 16384);
+				pool.ParallelFor(count, grain, [&](size_t begin, size_t end)
+				{
+					Bin local[3][gBvhMaxBins];
+					BinRange(first + static_cast<uint32_t>(begin), first + static_cast<uint32_t>(end), centroidBounds, scale, binCount, local);
+					std::lock_guard<std::mutex> lock(binLock);
+					for (int axis = 0; axis < 3; axis++)
+					{
+						for (uint32_t b = 0; b < binCount; b++) bins[axis][b].Merge(local[axis][b]);
+					}
+				});
+			}
+			else
+			{
+				BinRange(first, first + count, centroidBounds, scale, binCount, bins);
+			}
+
+			// Sweep from the right storing suffix areas, then from the left evaluating every plane
+			Split best;
+			const float invArea = 1.0f / std::max(bounds.HalfArea(), std::numeric_limits<float>::min());
+			for (int axis = 0; axis < 3; axis++)
+			{
+				if (scale[axis] == 0.0f) continue;
+
+				float rightArea[gBvhMaxBins];
+				uint32_t rightCount[gBvhMaxBins];
+				Aabb accumulated;
+				uint32_t accumulatedCount = 0;
+				for (uint32_t b = binCount - 1; b > 0; b--)
+				{
+					accumulated.Grow(bins[axis][b].Bounds());
+					accumulatedCount += bins[axis][b].count;
+					rightArea[b] = accumulated.HalfArea();
+					rightCount[b] = accumulatedCount;
+				}
+
+				accumulated = Aabb();
+				accumulatedCount = 0;
+				for (uint32_t b = 1; b < binCount; b++)
+				{
+					accumulated.Grow(bins[axis][b - 1].Bounds());
+					accumulatedCount += bins[axis][b - 1].count;
+					if (accumulatedCount == 0 || rightCount[b] == 0) continue;
+
+					const float cost = settings.traversalCost + settings.intersectionCost * invArea *
+						(accumulated.HalfArea() * accumulatedCount + rightArea[b] * rightCount[b]);
+					if (cost < best.cost)
+					{
+						best.cost = cost;
+						best.axis = axis;
+						best.bin = b;
+					}
+				}
+			}
+
+			// Child bounds straight from the bins, no second pass over the triangles
+			if (best.axis >= 0)
+			{
+				best.binCount = binCount;
+				for (uint32_t b = 0; b < binCount; b++)
+				{
+					const int side = b < best.bin ? 0 : 1;
+					best.bounds[side].Grow(bins[best.axis][b].Bounds());
+					best.centroidBounds[side].Grow(bins[best.axis][b].CentroidBounds());
+					if (side == 0) best.leftCount += bins[best.axis][b].count;
+				}
+			}
+			return best;
+		}
+
+		// Stable two pass partition through 'scratch', chunk offsets from a prefix sum of per chunk left counts
+		void ParallelPartition(uint32_t first, uint32_t count, const Split& split, const Aabb& centroidBounds)
+		{
+			const float scale = split.binCount / centroidBounds.Extent()[split.axis];
+			const size_t grain = std::max<size_t>(count / (pool.ThreadCount() * 4), 16384);
+			const size_t chunks = (count + grain - 1) / grain;
+			std::vector<uint32_t> leftCounts(chunks, 0);
+
+			auto isLeft = [&](const BvhPrimitiveRef& ref) { return BinIndex(ref.Centroid(), split.axis, centroidBounds, scale, split.binCount) < split.bin; };
+
+			pool.ParallelFor(chunks, 1, [&](size_t begin, size_t end)
+			{
+				for (size_t chunk = begin; chunk < end; chunk++)
+				{
+					const uint32_t chunkEnd = first + static_cast<uint32_t>(std::min<size_t>(count, (chunk + 1) * grain));
+					for (uint32_t i = first + static_cast<uint32_t>(chunk * grain); i < chunkEnd; i++) leftCounts[chunk] += isLeft(refs[i]);
+				}
+			});
+
+			std::vector<uint32_t> leftOffsets(chunks), rightOffsets(chunks);
+			uint32_t leftTotal = 0, rightTotal = 0;
+			for (size_t chunk = 0; chunk < chunks; chunk++)
+			{
+				const uint32_t chunkSize = static_cast<uint32_t>(std::min<size_t>(count, (chunk + 1) * grain) - chunk * grain);
+				leftOffsets[chunk] = leftTotal;
+				rightOffsets[chunk] = rightTotal;
+				leftTotal += leftCounts[chunk];
+				rightTotal += chunkSize - leftCounts[chunk];
+			}
+
+			pool.ParallelFor(chunks, 1, [&](size_t begin, size_t end)
+			{
+				for (size_t chunk = begin; chunk < end; chunk++)
+				{
+					uint32_t left = first + leftOffsets[chunk];
+					uint32_t right = first + leftTotal + rightOffsets[chunk];
+					const uint32_t chunkEnd = first + static_cast<uint32_t>(std::min<size_t>(count, (chunk + 1) * grain));
+					for (uint32_t i = first + static_cast<uint32_t>(chunk * grain); i < chunkEnd; i++)
+					{
+						scratch[isLeft(refs[i]) ? left++ : right++] = refs[i];
+					}
+				}
+			});
+
+			pool.ParallelFor(count, grain, [&](size_t begin, size_t end)
+			{
+				std::copy(scratch.begin() + first + begin, scratch.begin() + first + end, refs.begin() + first + begin);
+			});
+		}
+
+		void MakeLeaf(BvhBuildNode& node, uint32_t first, uint32_t count)
+		{
+			node.first = first;
+			node.count = count;
+			node.subtreeSize = 1;
+		}
+
+		void BuildNode(uint32_t nodeIndex, uint32_t first, uint32_t count, const Aabb& bounds, const Aabb& centroidBounds, uint32_t depth)
+		{
+			BvhBuildNode& node = arena[nodeIndex];
+			node.bounds = bounds;
+			node.axis = static_cast<uint32_t>(centroidBounds.LargestAxis());
+			node.count = 0;
+
+			if (count == 1)
+			{
+				MakeLeaf(node, first, count);
+				return;
+			}
+
+			Split split;
+			const bool degenerate = centroidBounds.Extent()[node.axis] <= 0.0f;
+			if (!degenerate && depth < gBvhMedianSplitDepth)
+			{
+				split = FindSplit(first, count, bounds, centroidBounds);
+
+				const float leafCost = settings.intersectionCost * count;
+				if (count <= settings.maxLeafSize && leafCost <= split.cost)
+				{
+					MakeLeaf(node, first, count);
+					return;
+				}
+			}
+
+			if (split.axis >= 0)
+			{
+				node.axis = static_cast<uint32_t>(split.axis);
+				if (count >= settings.parallelBinThreshold)
+				{
+					ParallelPartition(first, count, split, centroidBounds);
+				}
+				else
+				{
+					const float scale = split.binCount / centroidBounds.Extent()[split.axis];
+					std::partition(refs.begin() + first, refs.begin() + first + count, [&](const BvhPrimitiveRef& ref)
+					{
+						return BinIndex(ref.Centroid(), split.axis, centroidBounds, scale, split.binCount) < split.bin;
+					});
+				}
+			}
+			else
+			{
+				// All centroids in one spot or too deep: object median, children bounds recomputed
+				if (count <= settings.maxLeafSize)
+				{
+					MakeLeaf(node, first, count);
+					return;
+				}
+
+				const int axis = static_cast<int>(node.axis);
+				std::nth_element(refs.begin() + first, refs.begin() + first + count / 2, refs.begin() + first + count, [&](const BvhPrimitiveRef& a, const BvhPrimitiveRef& b)
+				{
+					return a.Centroid()[axis] < b.Centroid()[axis];
+				});
+
+				split.leftCount = count / 2;
+				for (uint32_t i = 0; i < count; i++)
+				{
+					const BvhPrimitiveRef& ref = refs[first + i];
+					const int side = i < split.leftCount ? 0 : 1;
+					split.bounds[side].Grow(ref.boundsMin);
+					split.bounds[side].Grow(ref.boundsMax);
+					split.centroidBounds[side].Grow(ref.Centroid());
+				}
+			}
+
+			const uint32_t children = arena.Allocate(2);
+			node.children[0] = children;
+			node.children[1] = children + 1;
+
+			// Left child as a task for big nodes, right child on this thread
+			TaskGroup group;
+			if (count > settings.taskThreshold)
+			{
+				pool.Run(group, [=]()
+				{
+					BuildNode(children, first, split.leftCount, split.bounds[0], split.centroidBounds[0], depth + 1);
+				});
+			}
+			else
+			{
+				BuildNode(children, first, split.leftCount, split.bounds[0], split.centroidBounds[0], depth + 1);
+			}
+			BuildNode(children + 1, first + split.leftCount, count - split.leftCount, split.bounds[1], split.centroidBounds[1], depth + 1);
+			pool.Wait(group);
+
+			arena[nodeIndex].subtreeSize = 1 + arena[children].subtreeSize + arena[children + 1].subtreeSize;
+		}
+
+		static inline const MeshData emptyMesh{};
+
+		const MeshData& mesh;
+		const std::vector<Aabb>* primitiveBounds = nullptr;
+		BvhSettings settings;
+		ThreadPool& pool;
+
+		BvhArena arena;
+		std::vector<BvhPrimitiveRef> refs;		// partitioned in place, leaves own contiguous ranges
+		std::vector<BvhPrimitiveRef> scratch;
+	};
+
+	inline Bvh BuildSahBvh(const MeshData& mesh, const BvhSettings& settings = {}, ThreadPool& pool = ThreadPool::Default())
+	{
+		return BvhSahBuilder(mesh, settings, pool).Build();
+	}
+
+	inline Bvh BuildSahBvh(const std::vector<Aabb>& primitiveBounds, const BvhSettings& settings = {}, ThreadPool& pool = ThreadPool::Default())
+	{
+		return BvhSahBuilder(primitiveBounds, settings, pool).Build();
+	}
+}
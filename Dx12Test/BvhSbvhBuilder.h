@@ -0,0 +1,615 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "Bvh.h"
+
+/*
+ ------------------------------SBVH Builder------------------------------------
+ Binned SAH with spatial splits (Stich et al. 2009, "Spatial Splits in Bounding Volume Hierarchies"), for scenes
+ of long thin triangles (walls, floors) whose boxes overlap badly under object splits alone:
+	- every node bins object splits on the centroids, like BvhSahBuilder
+	- where the object split's children overlap by more than spatialSplitAlpha of the root area, it also bins
+	  spatial planes over the node bounds: a reference crossing several bins is clipped to each, so bins see the
+	  part of the triangle inside them
+	- a winning spatial split duplicates the references it cuts, clipped to either side, unless moving one
+	  whole to a side is cheaper (reference unsplitting)
+	- duplicates are capped at splitBudget times the triangle count. The root gets the whole budget, a node passes
+	  what its split did not use on to its children in proportion to their references, so a subtree built first
+	  cannot take it all and the tree does not depend on task order.
+ Nodes above parallelBinThreshold references bin in parallel chunks, children above taskThreshold build as tasks.
+ The Bvh references duplicated triangles once per leaf that holds them, TriangleCount() counts references.
+*/
+
+namespace CpuRt
+{
+	class BvhSbvhBuilder
+	{
+	public:
+		BvhSbvhBuilder(const MeshData& mesh, const BvhSettings& settings, ThreadPool& pool)
+			: mesh(mesh), settings(settings), pool(pool)
+		{
+			this->settings.binCount = std::min(std::max(settings.binCount, 2u), gBvhMaxBins);
+			this->settings.maxLeafSize = std::min(std::max(settings.maxLeafSize, 1u), 0xFFFFu);
+			this->settings.splitBudget = std::max(settings.splitBudget, 0.0f);
+		}
+
+		Bvh Build()
+		{
+			const auto start = std::chrono::high_resolution_clock::now();
+			Bvh bvh;
+			const size_t count = mesh.TriangleCount();
+			if (count == 0) return bvh;
+
+			std::vector<BvhPrimitiveRef> refs(count);
+			std::mutex rootLock;
+			Aabb rootBounds;
+			pool.ParallelFor(count, 16384, [&](size_t begin, size_t end)
+			{
+				Aabb bounds;
+				for (size_t i = begin; i < end; i++)
+				{
+					Aabb box;
+					for (int v = 0; v < 3; v++) box.Grow(mesh.vertices[mesh.indices[i * 3 + v]].position);
+					refs[i] = { box.min, static_cast<uint32_t>(i), box.max, 0 };
+					bounds.Grow(box);
+				}
+				std::lock_guard<std::mutex> lock(rootLock);
+				rootBounds.Grow(bounds);
+			});
+
+			maxReferences = count + static_cast<size_t>(count * double(settings.splitBudget));
+			rootArea = std::max(rootBounds.HalfArea(), std::numeric_limits<float>::min());
+			leafPrimitives.resize(maxReferences);
+			leafNext = 0;
+
+			arena.Reset(maxReferences);
+			const uint32_t root = arena.Allocate(1);
+			BuildNode(root, refs, rootBounds, maxReferences - count, 0);
+
+			// Leaves took their ranges in whatever order tasks finished, Flatten wants them depth first
+			std::vector<uint32_t> order;
+			order.reserve(leafNext.load());
+			OrderLeaves(root, order);
+			bvh.Flatten(arena, root, mesh, order, settings, pool);
+			bvh.SetBuildTime(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+			return bvh;
+		}
+
+	private:
+		struct ObjectBin
+		{
+			Aabb bounds;
+			uint32_t count = 0;
+		};
+
+		struct SpatialBin
+		{
+			Aabb bounds;
+			uint32_t entries = 0;		// references starting in this bin
+			uint32_t exits = 0;			// references ending in this bin
+		};
+
+		struct Split
+		{
+			int axis = -1;
+			bool spatial = false;
+			uint32_t bin = 0;			// first bin of the right side
+			uint32_t binCount = 0;
+			float scale = 0.0f;			// object: bins per unit along the axis, from the centroid bounds' min
+			float plane = 0.0f;			// spatial
+			float cost = std::numeric_limits<float>::max();
+			Aabb bounds[2];
+			uint32_t counts[2] = { 0, 0 };
+		};
+
+		using ObjectBins = ObjectBin[3][gBvhMaxBins];
+		using SpatialBins = SpatialBin[3][gBvhMaxBins];
+
+		const Float3& Vertex(uint32_t primitive, int corner) const
+		{
+			return mesh.vertices[mesh.indices[size_t(primitive) * 3 + corner]].position;
+		}
+
+		// Bounds of the part of a reference's triangle between 'lo' and 'hi' on 'axis', within the reference's bounds
+		Aabb ClipReference(const BvhPrimitiveRef& ref, int axis, float lo, float hi) const
+		{
+			Aabb clipped;
+			for (int edge = 0; edge < 3; edge++)
+			{
+				const Float3& a = Vertex(ref.primitive, edge);
+				const Float3& b = Vertex(ref.primitive, (edge + 1) % 3);
+				if (a[axis] >= lo && a[axis] <= hi) clipped.Grow(a);
+				for (float plane : { lo, hi })
+				{
+					if ((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane))
+					{
+						const float t = (plane - a[axis]) / (b[axis] - a[axis]);
+						Float3 p = a + (b - a) * t;
+						p[axis] = plane;
+						clipped.Grow(p);
+					}
+				}
+			}
+			clipped.min = Max(clipped.min, ref.boundsMin);
+			clipped.max = Min(clipped.max, ref.boundsMax);
+			clipped.min[axis] = std::max(clipped.min[axis], lo);
+			clipped.max[axis] = std::min(clipped.max[axis], hi);
+			return clipped;
+		}
+
+		/*
+		 Clips a reference to every bin from 'first' to 'last' it spans on 'axis' in one walk over the triangle's
+		 edges: each edge grows the bins of its end points and both bins at every plane it crosses.
+		*/
+		void ClipToBins(const BvhPrimitiveRef& ref, int axis, float origin, float scale, uint32_t first, uint32_t last, Aabb* parts) const
+		{
+			for (uint32_t b = first; b <= last; b++) parts[b] = Aabb();
+			for (int edge = 0; edge < 3; edge++)
+			{
+				Float3 a = Vertex(ref.primitive, edge), b = Vertex(ref.primitive, (edge + 1) % 3);
+				if (a[axis] > b[axis]) std::swap(a, b);
+				const uint32_t binA = std::min(std::max(BinIndex(a[axis], origin, scale, last + 1), first), last);
+				const uint32_t binB = std::min(std::max(BinIndex(b[axis], origin, scale, last + 1), first), last);
+				parts[binA].Grow(a);
+				parts[binB].Grow(b);
+				for (uint32_t k = binA + 1; k <= binB; k++)
+				{
+					const float plane = origin + k / scale;
+					const float t = b[axis] > a[axis] ? (plane - a[axis]) / (b[axis] - a[axis]) : 0.0f;
+					Float3 p = a + (b - a) * t;
+					p[axis] = plane;
+					parts[k - 1].Grow(p);
+					parts[k].Grow(p);
+				}
+			}
+			for (uint32_t b = first; b <= last; b++)
+			{
+				parts[b].min = Max(parts[b].min, ref.boundsMin);
+				parts[b].max = Min(parts[b].max, ref.boundsMax);
+				parts[b].min[axis] = std::max(parts[b].min[axis], origin + b / scale);
+				parts[b].max[axis] = std::min(parts[b].max[axis], origin + (b + 1) / scale);
+			}
+		}
+
+		static float SplitCost(const BvhSettings& settings, float invArea, const Aabb& left, uint32_t leftCount, const Aabb& right, uint32_t rightCount)
+		{
+			return settings.traversalCost + settings.intersectionCost * invArea * (left.HalfArea() * leftCount + right.HalfArea() * rightCount);
+		}
+
+		static uint32_t BinIndex(float x, float origin, float scale, uint32_t binCount)
+		{
+			const int bin = static_cast<int>((x - origin) * scale);
+			return static_cast<uint32_t>(std::min(std::max(bin, 0), static_cast<int>(binCount) - 1));
+		}
+
+		// Runs 'bin(begin, end, bins)' over the references, chunked in parallel for big nodes, and merges the chunks
+		template<typename Bins, typename BinRange, typename Merge>
+		void BinParallel(size_t count, Bins& bins, BinRange binRange, Merge merge)
+		{
+			if (count < settings.parallelBinThreshold)
+			{
+				binRange(size_t(0), count, bins);
+				return;
+			}
+			std::mutex binLock;
+			const size_t grain = std::max<size_t>(count / (pool.ThreadCount() * 4), 16384);
+			pool.ParallelFor(count, grain, [&](size_t begin, size_t end)
+			{
+				Bins local;
+				binRange(begin, end, local);
+				std::lock_guard<std::mutex> lock(binLock);
+				merge(local);
+			});
+		}
+
+		Split FindObjectSplit(const std::vector<BvhPrimitiveRef>& refs, const Aabb& bounds, const Aabb& centroidBounds)
+		{
+			const uint32_t binCount = std::min(settings.binCount, std::max(4u, uint32_t(refs.size())));
+			const Float3 extent = centroidBounds.Extent();
+			float scale[3];
+			for (int axis = 0; axis < 3; axis++) scale[axis] = extent[axis] > 0.0f ? binCount / extent[axis] : 0.0f;
+
+			ObjectBins bins;
+			BinParallel(refs.size(), bins, [&](size_t begin, size_t end, ObjectBins& out)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					const Float3 centroid = refs[i].Centroid();
+					for (int axis = 0; axis < 3; axis++)
+					{
+						if (scale[axis] == 0.0f) continue;
+						ObjectBin& bin = out[axis][BinIndex(centroid[axis], centroidBounds.min[axis], scale[axis], binCount)];
+						bin.bounds.Grow(refs[i].boundsMin);
+						bin.bounds.Grow(refs[i].boundsMax);
+						bin.count++;
+					}
+				}
+			}, [&](const ObjectBins& local)
+			{
+				for (int axis = 0; axis < 3; axis++)
+				{
+					for (uint32_t b = 0; b < binCount; b++)
+					{
+						bins[axis][b].bounds.Grow(local[axis][b].bounds);
+						bins[axis][b].count += local[axis][b].count;
+					}
+				}
+			});
+
+			Split best;
+			const float invArea = 1.0f / std::max(bounds.HalfArea(), std::numeric_limits<float>::min());
+			for (int axis = 0; axis < 3; axis++)
+			{
+				if (scale[axis] == 0.0f) continue;
+				Aabb rightBounds[gBvhMaxBins];
+				uint32_t rightCount[gBvhMaxBins];
+				Aabb accumulated;
+				uint32_t accumulatedCount = 0;
+				for (uint32_t b = binCount - 1; b > 0; b--)
+				{
+					accumulated.Grow(bins[axis][b].bounds);
+					accumulatedCount += bins[axis][b].count;
+					rightBounds[b] = accumulated;
+					rightCount[b] = accumulatedCount;
+				}
+
+				accumulated = Aabb();
+				accumulatedCount = 0;
+				for (uint32_t b = 1; b < binCount; b++)
+				{
+					accumulated.Grow(bins[axis][b - 1].bounds);
+					accumulatedCount += bins[axis][b - 1].count;
+					if (accumulatedCount == 0 || rightCount[b] == 0) continue;
+					const float cost = SplitCost(settings, invArea, accumulated, accumulatedCount, rightBounds[b], rightCount[b]);
+					if (cost < best.cost)
+					{
+						best.cost = cost;
+						best.axis = axis;
+						best.bin = b;
+						best.binCount = binCount;
+						best.scale = scale[axis];
+						best.bounds[0] = accumulated;
+						best.bounds[1] = rightBounds[b];
+						best.counts[0] = accumulatedCount;
+						best.counts[1] = rightCount[b];
+					}
+				}
+			}
+			return best;
+		}
+
+		Split FindSpatialSplit(const std::vector<BvhPrimitiveRef>& refs, const Aabb& bounds)
+		{
+			// As for object splits, small nodes get fewer planes: every bin a reference spans costs a clip
+			const uint32_t binCount = std::min(settings.binCount, std::max(4u, uint32_t(refs.size())));
+			const Float3 extent = bounds.Extent();
+			float scale[3];
+			for (int axis = 0; axis < 3; axis++) scale[axis] = extent[axis] > 0.0f ? binCount / extent[axis] : 0.0f;
+
+			SpatialBins bins;
+			BinParallel(refs.size(), bins, [&](size_t begin, size_t end, SpatialBins& out)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					const BvhPrimitiveRef& ref = refs[i];
+					for (int axis = 0; axis < 3; axis++)
+					{
+						if (scale[axis] == 0.0f) continue;
+						const uint32_t first = BinIndex(ref.boundsMin[axis], bounds.min[axis], scale[axis], binCount);
+						const uint32_t last = BinIndex(ref.boundsMax[axis], bounds.min[axis], scale[axis], binCount);
+						if (first == last)
+						{
+							out[axis][first].bounds.Grow(ref.boundsMin);
+							out[axis][first].bounds.Grow(ref.boundsMax);
+						}
+						else
+						{
+							Aabb parts[gBvhMaxBins];
+							ClipToBins(ref, axis, bounds.min[axis], scale[axis], first, last, parts);
+							for (uint32_t b = first; b <= last; b++) out[axis][b].bounds.Grow(parts[b]);
+						}
+						out[axis][first].entries++;
+						out[axis][last].exits++;
+					}
+				}
+			}, [&](const SpatialBins& local)
+			{
+				for (int axis = 0; axis < 3; axis++)
+				{
+					for (uint32_t b = 0; b < binCount; b++)
+					{
+						bins[axis][b].bounds.Grow(local[axis][b].bounds);
+						bins[axis][b].entries += local[axis][b].entries;
+						bins[axis][b].exits += local[axis][b].exits;
+					}
+				}
+			});
+
+			Split best;
+			best.spatial = true;
+			const float invArea = 1.0f / std::max(bounds.HalfArea(), std::numeric_limits<float>::min());
+			for (int axis = 0; axis < 3; axis++)
+			{
+				if (scale[axis] == 0.0f) continue;
+				Aabb rightBounds[gBvhMaxBins];
+				uint32_t rightCount[gBvhMaxBins];
+				Aabb accumulated;
+				uint32_t accumulatedCount = 0;
+				for (uint32_t b = binCount - 1; b > 0; b--)
+				{
+					accumulated.Grow(bins[axis][b].bounds);
+					accumulatedCount += bins[axis][b].exits;
+					rightBounds[b] = accumulated;
+					rightCount[b] = accumulatedCount;
+				}
+
+				accumulated = Aabb();
+				accumulatedCount = 0;
+				for (uint32_t b = 1; b < binCount; b++)
+				{
+					accumulated.Grow(bins[axis][b - 1].bounds);
+					accumulatedCount += bins[axis][b - 1].entries;
+					if (accumulatedCount == 0 || rightCount[b] == 0) continue;
+					const float cost = SplitCost(settings, invArea, accumulated, accumulatedCount, rightBounds[b], rightCount[b]);
+					if (cost < best.cost)
+					{
+						best.cost = cost;
+						best.axis = axis;
+						best.bin = b;
+						best.plane = bounds.min[axis] + b / scale[axis];
+						best.bounds[0] = accumulated;
+						best.bounds[1] = rightBounds[b];
+						best.counts[0] = accumulatedCount;
+						best.counts[1] = rightCount[b];
+					}
+				}
+			}
+			return best;
+		}
+
+		// Splits 'refs' at the spatial plane into left and right, cut references go to both sides clipped unless
+		// moving them whole is cheaper. Returns false and leaves 'refs' alone when the cut references could need more
+		// than 'budget' duplicates, or clipping left one side empty.
+		bool PartitionSpatial(std::vector<BvhPrimitiveRef>& refs, const Split& split, size_t budget, std::vector<BvhPrimitiveRef>& left, std::vector<BvhPrimitiveRef>& right,
+			Aabb (&bounds)[2], size_t& duplicated)
+		{
+			const int axis = split.axis;
+			const float plane = split.plane;
+			const size_t straddling = size_t(split.counts[0]) + split.counts[1] - refs.size();
+			if (straddling > budget) return false;
+
+			// Unsplitting weighs the side areas and counts the bins predicted
+			const float leftArea = split.bounds[0].HalfArea(), rightArea = split.bounds[1].HalfArea();
+			const float leftCount = float(split.counts[0]), rightCount = float(split.counts[1]);
+			duplicated = 0;
+			for (const BvhPrimitiveRef& ref : refs)
+			{
+				if (ref.boundsMax[axis] <= plane)
+				{
+					left.push_back(ref);
+				}
+				else if (ref.boundsMin[axis] >= plane)
+				{
+					right.push_back(ref);
+				}
+				else
+				{
+					Aabb leftWith = split.bounds[0], rightWith = split.bounds[1];
+					leftWith.Grow(ref.boundsMin);
+					leftWith.Grow(ref.boundsMax);
+					rightWith.Grow(ref.boundsMin);
+					rightWith.Grow(ref.boundsMax);
+					const float splitCost = leftArea * leftCount + rightArea * rightCount;
+					const float leftCost = leftWith.HalfArea() * leftCount + rightArea * (rightCount - 1.0f);
+					const float rightCost = leftArea * (leftCount - 1.0f) + rightWith.HalfArea() * rightCount;
+					if (leftCost < splitCost && leftCost <= rightCost)
+					{
+						left.push_back(ref);
+					}
+					else if (rightCost < splitCost)
+					{
+						right.push_back(ref);
+					}
+					else
+					{
+						const Aabb leftPart = ClipReference(ref, axis, ref.boundsMin[axis], plane);
+						const Aabb rightPart = ClipReference(ref, axis, plane, ref.boundsMax[axis]);
+						if (!leftPart.Empty()) left.push_back({ leftPart.min, ref.primitive, leftPart.max, 0 });
+						if (!rightPart.Empty()) right.push_back({ rightPart.min, ref.primitive, rightPart.max, 0 });
+						if (leftPart.Empty() && rightPart.Empty()) (ref.Centroid()[axis] < plane ? left : right).push_back(ref);
+						duplicated += !leftPart.Empty() && !rightPart.Empty();
+					}
+				}
+			}
+			if (left.empty() || right.empty())
+			{
+				left.clear();
+				right.clear();
+				return false;
+			}
+
+			bounds[0] = bounds[1] = Aabb();
+			for (const BvhPrimitiveRef& ref : left) { bounds[0].Grow(ref.boundsMin); bounds[0].Grow(ref.boundsMax); }
+			for (const BvhPrimitiveRef& ref : right) { bounds[1].Grow(ref.boundsMin); bounds[1].Grow(ref.boundsMax); }
+			std::vector<BvhPrimitiveRef>().swap(refs);
+			return true;
+		}
+
+		void PartitionObject(std::vector<BvhPrimitiveRef>& refs, const Split& split, const Aabb& centroidBounds, std::vector<BvhPrimitiveRef>& left, std::vector<BvhPrimitiveRef>& right, Aabb (&bounds)[2])
+		{
+			const int axis = split.axis;
+			const auto middle = std::partition(refs.begin(), refs.end(), [&](const BvhPrimitiveRef& ref)
+			{
+				return BinIndex(ref.Centroid()[axis], centroidBounds.min[axis], split.scale, split.binCount) < split.bin;
+			});
+			left.assign(refs.begin(), middle);
+			right.assign(middle, refs.end());
+			bounds[0] = split.bounds[0];
+			bounds[1] = split.bounds[1];
+			std::vector<BvhPrimitiveRef>().swap(refs);
+		}
+
+		void PartitionMedian(std::vector<BvhPrimitiveRef>& refs, int axis, std::vector<BvhPrimitiveRef>& left, std::vector<BvhPrimitiveRef>& right, Aabb (&bounds)[2])
+		{
+			const auto middle = refs.begin() + refs.size() / 2;
+			std::nth_element(refs.begin(), middle, refs.end(), [&](const BvhPrimitiveRef& a, const BvhPrimitiveRef& b)
+			{
+				return a.Centroid()[axis] < b.Centroid()[axis];
+			});
+			left.assign(refs.begin(), middle);
+			right.assign(middle, refs.end());
+			bounds[0] = bounds[1] = Aabb();
+			for (const BvhPrimitiveRef& ref : left) { bounds[0].Grow(ref.boundsMin); bounds[0].Grow(ref.boundsMax); }
+			for (const BvhPrimitiveRef& ref : right) { bounds[1].Grow(ref.boundsMin); bounds[1].Grow(ref.boundsMax); }
+			std::vector<BvhPrimitiveRef>().swap(refs);
+		}
+
+		void MakeLeaf(BvhBuildNode& node, std::vector<BvhPrimitiveRef>& refs)
+		{
+			node.first = leafNext.fetch_add(static_cast<uint32_t>(refs.size()));
+			node.count = static_cast<uint32_t>(refs.size());
+			node.subtreeSize = 1;
+			for (size_t i = 0; i < refs.size(); i++) leafPrimitives[node.first + i] = refs[i].primitive;
+			std::vector<BvhPrimitiveRef>().swap(refs);
+		}
+
+		// 'budget' is how many duplicates the subtree may still make
+		void BuildNode(uint32_t nodeIndex, std::vector<BvhPrimitiveRef>& refs, const Aabb& bounds, size_t budget, uint32_t depth)
+		{
+			const uint32_t count = static_cast<uint32_t>(refs.size());
+			Aabb centroidBounds;
+			for (const BvhPrimitiveRef& ref : refs) centroidBounds.Grow(ref.Centroid());
+
+			BvhBuildNode& node = arena[nodeIndex];
+			node.bounds = bounds;
+			node.axis = static_cast<uint32_t>(centroidBounds.LargestAxis());
+			node.count = 0;
+			if (count == 1)
+			{
+				MakeLeaf(node, refs);
+				return;
+			}
+
+			Split split, objectSplit;
+			if (depth < gBvhMedianSplitDepth)
+			{
+				if (centroidBounds.Extent()[node.axis] > 0.0f) split = objectSplit = FindObjectSplit(refs, bounds, centroidBounds);
+
+				// Spatial splits only where the object split leaves the children overlapping, or has none
+				Aabb overlap;
+				if (split.axis >= 0)
+				{
+					overlap.min = Max(split.bounds[0].min, split.bounds[1].min);
+					overlap.max = Min(split.bounds[0].max, split.bounds[1].max);
+				}
+				const bool overlapping = split.axis < 0 || (overlap.min.x <= overlap.max.x && overlap.min.y <= overlap.max.y && overlap.min.z <= overlap.max.z &&
+					overlap.HalfArea() > settings.spatialSplitAlpha * rootArea);
+				if (overlapping && budget > 0)
+				{
+					const Split spatial = FindSpatialSplit(refs, bounds);
+					if (spatial.axis >= 0 && spatial.cost < split.cost) split = spatial;
+				}
+
+				const float leafCost = settings.intersectionCost * count;
+				if (count <= settings.maxLeafSize && leafCost <= split.cost)
+				{
+					MakeLeaf(node, refs);
+					return;
+				}
+			}
+
+			std::vector<BvhPrimitiveRef> left, right;
+			Aabb childBounds[2];
+			size_t duplicated = 0;
+			bool partitioned = split.spatial && PartitionSpatial(refs, split, budget, left, right, childBounds, duplicated);
+			if (!partitioned && objectSplit.axis >= 0)
+			{
+				split = objectSplit;
+				PartitionObject(refs, split, centroidBounds, left, right, childBounds);
+				partitioned = true;
+			}
+			if (!partitioned)
+			{
+				// Too deep, centroids in one spot or a spatial split that did not fit the budget: object median
+				if (count <= settings.maxLeafSize)
+				{
+					MakeLeaf(node, refs);
+					return;
+				}
+				PartitionMedian(refs, static_cast<int>(node.axis), left, right, childBounds);
+			}
+			else
+			{
+				node.axis = static_cast<uint32_t>(split.axis);
+			}
+
+			const uint32_t children = arena.Allocate(2);
+			node.children[0] = children;
+			node.children[1] = children + 1;
+
+			budget -= duplicated;
+			const size_t leftBudget = static_cast<size_t>(double(budget) * left.size() / (left.size() + right.size()));
+			const size_t rightBudget = budget - leftBudget;
+
+			// Left child as a task for big nodes, right child on this thread. The task owns its references.
+			TaskGroup group;
+			if (left.size() + right.size() > settings.taskThreshold)
+			{
+				pool.Run(group, [this, children, refs = std::move(left), bounds = childBounds[0], leftBudget, depth]() mutable
+				{
+					BuildNode(children, refs, bounds, leftBudget, depth + 1);
+				});
+			}
+			else
+			{
+				BuildNode(children, left, childBounds[0], leftBudget, depth + 1);
+			}
+			BuildNode(children + 1, right, childBounds[1], rightBudget, depth + 1);
+			pool.Wait(group);
+
+			arena[nodeIndex].subtreeSize = 1 + arena[children].subtreeSize + arena[children + 1].subtreeSize;
+		}
+
+		void OrderLeaves(uint32_t root, std::vector<uint32_t>& order)
+		{
+			std::vector<uint32_t> stack = { root };
+			while (!stack.empty())
+			{
+				BvhBuildNode& node = arena[stack.back()];
+				stack.pop_back();
+				if (node.count > 0)
+				{
+					const uint32_t first = static_cast<uint32_t>(order.size());
+					order.insert(order.end(), leafPrimitives.begin() + node.first, leafPrimitives.begin() + node.first + node.count);
+					node.first = first;
+				}
+				else
+				{
+					stack.push_back(node.children[1]);
+					stack.push_back(node.children[0]);
+				}
+			}
+		}
+
+		const MeshData& mesh;
+		BvhSettings settings;
+		ThreadPool& pool;
+
+		BvhArena arena;
+		size_t maxReferences = 0;
+		float rootArea = 1.0f;
+		std::vector<uint32_t> leafPrimitives;	// leaf ranges as they are built
+		std::atomic<uint32_t> leafNext{ 0 };
+	};
+
+	inline Bvh BuildSbvh(const MeshData& mesh, const BvhSettings& settings = {}, ThreadPool& pool = ThreadPool::Default())
+	{
+		return BvhSbvhBuilder(mesh, settings, pool).Build();
+	}
+}
@@ -0,0 +1,341 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "Bvh.h"
+#include "CpuSimd.h"
+
+/*
+ ------------------------------Wide BVH------------------------------------
+ A binary Bvh collapsed into N wide nodes (N = 4 or 8, BVH4 / BVH8): one SIMD slab test checks every child of a node,
+ so a ray visits a fraction of the binary tree's nodes and each visit uses all lanes of a vector.
+	- Collapse: a node starts from a binary interior node and keeps opening the child with the largest surface
+	  area until it has N children (Wald et al. 2008, "Getting Rid of Packets").
+	- Child bounds are 8 bits per plane relative to the node's bounds, with a power of two scale per axis (Ylitie
+	  et al. 2017, "Efficient Incoherent Ray Traversal on GPUs Through Compressed Wide BVHs"): 6 bytes a child
+	  instead of 24. Quantization rounds outwards, a child's box only ever grows.
+	- Traversal visits the children a ray hits front to back by entry distance, and skips stack entries whose
+	  entry distance is past the closest hit found since they were pushed.
+ Triangles are copied from the Bvh in its leaf order, leaf children reference ranges of them.
+*/
+
+namespace CpuRt
+{
+	template<int N>
+	struct alignas(64) WideBvhNode
+	{
+		Float3 origin;				// bounds min of the node
+		int8_t exponent[3];			// child bounds are origin + q * 2^exponent, per axis
+		uint8_t childCount;			// children are packed to the front
+		uint8_t qMin[3][N];			// per axis, per child
+		uint8_t qMax[3][N];
+		uint8_t count[N];			// triangles of a leaf child, 0 for an interior child
+		uint32_t child[N];			// interior: node index, leaf: first triangle
+	};
+
+	static_assert(sizeof(WideBvhNode<4>) == 64, "BVH4 nodes should stay one cache line");
+	static_assert(sizeof(WideBvhNode<8>) == 128, "BVH8 nodes should stay two cache lines");
+
+	struct WideBvhStats
+	{
+		double collapseMilliseconds = 0.0;
+		size_t nodes = 0;
+		size_t leaves = 0;				// leaf children
+		double averageChildren = 0.0;
+		size_t nodeBytes = 0;
+		size_t triangleBytes = 0;		// positions and primitive ids
+	};
+
+	// 2^exponent, exponent in [-126, 127]
+	inline float ExponentScale(int exponent)
+	{
+		const uint32_t bits = uint32_t(exponent + 127) << 23;
+		float scale;
+		memcpy(&scale, &bits, sizeof(scale));
+		return scale;
+	}
+
+	template<int N>
+	class WideBvh
+	{
+	public:
+		static_assert(N == 4 || N == 8, "Wide BVH nodes have 4 or 8 children");
+		using Node = WideBvhNode<N>;
+		using Vector = SimdFloat<N>;
+
+		bool Empty() const { return nodes.empty(); }
+		const WideBvhStats& Stats() const { return stats; }
+
+		// Subtrees of at most 'maxLeafSize' triangles become one leaf child, their triangles are contiguous in the Bvh
+		void Build(const Bvh& bvh, uint32_t maxLeafSize = 4)
+		{
+			const auto start = std::chrono::high_resolution_clock::now();
+			nodes.clear();
+			primitiveIds.resize(bvh.TriangleCount());
+			triangles.resize(bvh.TriangleCount() * 3);
+			for (uint32_t i = 0; i < bvh.TriangleCount(); i++)
+			{
+				std::copy(bvh.TrianglePositions(i), bvh.TrianglePositions(i) + 3, &triangles[size_t(i) * 3]);
+				primitiveIds[i] = bvh.PrimitiveId(i);
+			}
+
+			stats = WideBvhStats();
+			if (!bvh.Empty())
+			{
+				// Breadth first: a node's children are allocated when it is collapsed, filled when their turn comes
+				const BinaryTree binary(bvh.Nodes(), std::min(maxLeafSize, 255u));
+				std::vector<PendingNode> queue = { { 0u, 0u } };
+				nodes.emplace_back();
+				for (size_t i = 0; i < queue.size(); i++) Collapse(binary, queue[i].binary, queue[i].wide, queue);
+			}
+
+			stats.collapseMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+			stats.nodes = nodes.size();
+			size_t children = 0;
+			for (const Node& node : nodes)
+			{
+				children += node.childCount;
+				for (uint32_t c = 0; c < node.childCount; c++) stats.leaves += node.count[c] != 0;
+			}
+			stats.averageChildren = nodes.empty() ? 0.0 : double(children) / nodes.size();
+			stats.nodeBytes = nodes.size() * sizeof(Node);
+			stats.triangleBytes = triangles.size() * sizeof(Float3) + primitiveIds.size() * sizeof(uint32_t);
+		}
+
+		// Closest hit, or the first one found with RayFlagAcceptFirstHitAndEndSearch. Runs the traversal instantiated for the flags.
+		bool Intersect(const Ray& ray, uint32_t rayFlags, RayHit& hit) const
+		{
+			return DispatchRayFlags(rayFlags, [&](auto flags) { return Traverse(ray, flags, hit); });
+		}
+
+		// The traversal kernel, over RuntimeRayFlags or one of the StaticRayFlags (CpuRayTracer.h)
+		template<typename RayFlags>
+		bool Traverse(const Ray& ray, const RayFlags& rayFlags, RayHit& hit) const
+		{
+			hit.t = ray.tMax;
+			if (nodes.empty()) return false;
+
+			const Float3 invDir = { 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z };
+			const bool dirNegative[3] = { invDir.x < 0.0f, invDir.y < 0.0f, invDir.z < 0.0f };
+
+			// Up to N - 1 entries per level, no deeper than the binary tree
+			struct Entry { uint32_t ref; uint32_t count; float tNear; };
+			Entry stack[(N - 1) * 128 + 1];
+			uint32_t stackSize = 0;
+			Entry current = { 0, 0, ray.tMin };
+			bool found = false;
+
+			for (;;)
+			{
+				if (current.count == 0)
+				{
+					const Node& node = nodes[current.ref];
+					Vector tNear = Vector::Broadcast(ray.tMin), tFar = Vector::Broadcast(hit.t);
+					for (int axis = 0; axis < 3; axis++)
+					{
+						// (origin + q * scale - rayOrigin) * invDir as q * a + b, the near plane is the max one for negative directions
+						const Vector a = Vector::Broadcast(ExponentScale(node.exponent[axis]) * invDir[axis]);
+						const Vector b = Vector::Broadcast((node.origin[axis] - ray.origin[axis]) * invDir[axis]);
+						tNear = Max(tNear, Vector::LoadBytes(dirNegative[axis] ? node.qMax[axis] : node.qMin[axis]) * a + b);
+						tFar = Min(tFar, Vector::LoadBytes(dirNegative[axis] ? node.qMin[axis] : node.qMax[axis]) * a + b);
+					}
+
+					uint32_t mask = LessEqualMask(tNear, tFar) & ((1u << node.childCount) - 1);
+					if (mask != 0)
+					{
+						float distances[N];
+						tNear.Store(distances);
+
+						// One child hit, the common case deep in the tree
+						if ((mask & (mask - 1)) == 0)
+						{
+							const uint32_t c = CountTrailingZeros(mask);
+							current = { node.child[c], node.count[c], distances[c] };
+							continue;
+						}
+
+						// Front to back: farthest pushed first, the nearest is visited next
+						Entry hits[N];
+						uint32_t hitCount = 0;
+						for (; mask != 0; mask &= mask - 1)
+						{
+							const uint32_t c = CountTrailingZeros(mask);
+							const Entry entry = { node.child[c], node.count[c], distances[c] };
+							uint32_t j = hitCount++;
+							if (!rayFlags.AcceptFirstHit())		// any hit searches take them as they come
+							{
+								for (; j > 0 && hits[j - 1].tNear < entry.tNear; j--) hits[j] = hits[j - 1];
+							}
+							hits[j] = entry;
+						}
+						for (uint32_t j = 0; j + 1 < hitCount; j++) stack[stackSize++] = hits[j];
+						current = hits[hitCount - 1];
+						continue;
+					}
+				}
+				else
+				{
+					for (uint32_t i = current.ref; i < current.ref + current.count; i++)
+					{
+						if (IntersectTriangle(ray, rayFlags, triangles[i * 3], triangles[i * 3 + 1], triangles[i * 3 + 2], ray.tMin, hit, primitiveIds[i]))
+						{
+							found = true;
+							if (rayFlags.AcceptFirstHit()) return true;
+						}
+					}
+				}
+
+				// Entries behind the closest hit found since they were pushed are skipped
+				do
+				{
+					if (stackSize == 0) return found;
+					current = stack[--stackSize];
+				} while (current.tNear > hit.t);
+			}
+		}
+
+	private:
+		// The Bvh's nodes plus the triangle range under every node
+		struct BinaryTree
+		{
+			BinaryTree(BvhNodeSpan nodes, uint32_t maxLeafSize)
+				: nodes(nodes), first(nodes.size()), count(nodes.size()), maxLeafSize(maxLeafSize)
+			{
+				// Children come after their parent in every layout
+				for (size_t i = nodes.size(); i-- > 0; )
+				{
+					const uint32_t left = nodes[i].offset;
+					first[i] = nodes[i].IsLeaf() ? left : first[left];
+					count[i] = nodes[i].IsLeaf() ? nodes[i].count : count[left] + count[left + 1];
+				}
+			}
+
+			bool IsLeaf(uint32_t i) const { return nodes[i].IsLeaf() || count[i] <= maxLeafSize; }
+
+			Aabb Bounds(uint32_t i) const
+			{
+				Aabb bounds;
+				bounds.min = nodes[i].boundsMin;
+				bounds.max = nodes[i].boundsMax;
+				return bounds;
+			}
+
+			BvhNodeSpan nodes;
+			std::vector<uint32_t> first;
+			std::vector<uint32_t> count;
+			uint32_t maxLeafSize;
+		};
+
+		struct PendingNode
+		{
+			uint32_t binary;		// binary interior node the wide node starts from
+			uint32_t wide;			// allocated, not yet filled
+		};
+
+		// Fills wide node 'wide' from the binary subtree at 'root', queues its interior children
+		void Collapse(const BinaryTree& binary, uint32_t root, uint32_t wide, std::vector<PendingNode>& queue)
+		{
+			uint32_t children[N];
+			uint32_t childCount = 0;
+			if (binary.IsLeaf(root))
+			{
+				children[childCount++] = root;
+			}
+			else
+			{
+				children[childCount++] = binary.nodes[root].offset;
+				children[childCount++] = binary.nodes[root].offset + 1;
+				while (childCount < N)
+				{
+					// Open the interior child with the largest surface area
+					int largest = -1;
+					float largestArea = -1.0f;
+					for (uint32_t c = 0; c < childCount; c++)
+					{
+						if (binary.IsLeaf(children[c])) continue;
+						const float area = binary.Bounds(children[c]).HalfArea();
+						if (area > largestArea) { largest = int(c); largestArea = area; }
+					}
+					if (largest < 0) break;
+					const uint32_t opened = children[largest];
+					children[largest] = binary.nodes[opened].offset;
+					children[childCount++] = binary.nodes[opened].offset + 1;
+				}
+			}
+
+			Aabb childBounds[N], bounds;
+			for (uint32_t c = 0; c < childCount; c++)
+			{
+				childBounds[c] = binary.Bounds(children[c]);
+				bounds.Grow(childBounds[c]);
+			}
+
+			Node node = {};
+			node.childCount = static_cast<uint8_t>(childCount);
+			Quantize(node, bounds, childBounds, childCount);
+			for (uint32_t c = 0; c < childCount; c++)
+			{
+				if (binary.IsLeaf(children[c]))
+				{
+					if (binary.count[children[c]] > 255) throw std::runtime_error("Error: wide BVH leaves hold at most 255 triangles");
+					node.child[c] = binary.first[children[c]];
+					node.count[c] = static_cast<uint8_t>(binary.count[children[c]]);
+				}
+				else
+				{
+					node.child[c] = static_cast<uint32_t>(nodes.size());
+					nodes.emplace_back();
+					queue.push_back({ children[c], node.child[c] });
+				}
+			}
+			nodes[wide] = node;
+		}
+
+		// Smallest scale that spans the node in 255 steps, one step coarser where rounding outwards ran out of range
+		static void Quantize(Node& node, const Aabb& bounds, const Aabb* childBounds, uint32_t childCount)
+		{
+			node.origin = bounds.min;
+			for (int axis = 0; axis < 3; axis++)
+			{
+				const float extent = bounds.max[axis] - bounds.min[axis];
+				int exponent = -126;
+				if (extent > 0.0f)
+				{
+					int e;
+					std::frexp(extent / 255.0f, &e);		// extent / 255 < 2^e
+					exponent = std::max(e, -126);
+				}
+				while (!QuantizeAxis(node, axis, exponent, childBounds, childCount)) exponent++;
+				node.exponent[axis] = static_cast<int8_t>(exponent);
+			}
+		}
+
+		static bool QuantizeAxis(Node& node, int axis, int exponent, const Aabb* childBounds, uint32_t childCount)
+		{
+			const float origin = node.origin[axis], scale = ExponentScale(exponent);
+			for (uint32_t c = 0; c < childCount; c++)
+			{
+				const float lo = childBounds[c].min[axis], hi = childBounds[c].max[axis];
+				int qMin = std::min(std::max(int(std::floor((lo - origin) / scale)), 0), 255);
+				int qMax = std::min(std::max(int(std::ceil((hi - origin) / scale)), 0), 255);
+				while (qMin > 0 && origin + qMin * scale > lo) qMin--;
+				while (qMax < 255 && origin + qMax * scale < hi) qMax++;
+				if (origin + qMax * scale < hi) return false;
+				node.qMin[axis][c] = static_cast<uint8_t>(qMin);
+				node.qMax[axis][c] = static_cast<uint8_t>(qMax);
+			}
+			return true;
+		}
+
+		std::vector<Node> nodes;				// root at 0
+		std::vector<uint32_t> primitiveIds;		// mesh triangle of every triangle
+		std::vector<Float3> triangles;			// 3 positions per triangle, in the Bvh's leaf order
+		WideBvhStats stats;
+	};
+}
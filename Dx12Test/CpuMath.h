@@ -0,0 +1,220 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+/*
+ ------------------------------CPU Math------------------------------------
+ The small part of DirectXMath the CPU ray tracing path needs, portable so it also builds on Linux.
+ Same conventions as DirectXMath: row vectors (v * M), left handed, matrices stored row major like XMMATRIX,
+ so a Float4x4 has the same bytes as the XMMATRIX the app puts in a constant buffer.
+*/
+
+namespace CpuRt
+{
+	struct Float2
+	{
+		float x, y;
+	};
+
+	struct Float3
+	{
+		float x, y, z;
+
+		float& operator[](int i) { return (&x)[i]; }
+		float operator[](int i) const { return (&x)[i]; }
+	};
+
+	struct Float4
+	{
+		float x, y, z, w;
+
+		Float3 xyz() const { return { x, y, z }; }
+	};
+
+	struct Float4x4
+	{
+		float m[4][4];
+	};
+
+	// Affine transform in the D3D12 instance layout: three rows, column vectors, p' = m * (p, 1)
+	struct Float3x4
+	{
+		float m[3][4];
+	};
+
+	inline Float3 operator+(const Float3& a, const Float3& b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+	inline Float3 operator-(const Float3& a, const Float3& b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+	inline Float3 operator-(const Float3& a) { return { -a.x, -a.y, -a.z }; }
+	inline Float3 operator*(const Float3& a, const Float3& b) { return { a.x * b.x, a.y * b.y, a.z * b.z }; }
+	inline Float3 operator*(const Float3& a, float s) { return { a.x * s, a.y * s, a.z * s }; }
+	inline Float3 operator*(float s, const Float3& a) { return a * s; }
+	inline Float3 operator/(const Float3& a, float s) { return a * (1.0f / s); }
+	inline Float3& operator+=(Float3& a, const Float3& b) { a = a + b; return a; }
+
+	inline Float4 operator+(const Float4& a, const Float4& b) { return { a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w }; }
+	inline Float4 operator*(const Float4& a, const Float4& b) { return { a.x * b.x, a.y * b.y, a.z * b.z, a.w * b.w }; }
+	inline Float4 operator*(const Float4& a, float s) { return { a.x * s, a.y * s, a.z * s, a.w * s }; }
+
+	inline float Dot(const Float3& a, const Float3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+	inline Float3 Cross(const Float3& a, const Float3& b) { return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x }; }
+	inline float Length(const Float3& a) { return std::sqrt(Dot(a, a)); }
+	inline Float3 Normalize(const Float3& a) { const float length = Length(a); return length > 0.0f ? a / length : a; }
+	inline Float3 Min(const Float3& a, const Float3& b) { return { std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z) }; }
+	inline Float3 Max(const Float3& a, const Float3& b) { return { std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z) }; }
+
+	// XMVector4Transform
+	inline Float4 Transform(const Float4& v, const Float4x4& m)
+	{
+		Float4 r;
+		r.x = v.x * m.m[0][0] + v.y * m.m[1][0] + v.z * m.m[2][0] + v.w * m.m[3][0];
+		r.y = v.x * m.m[0][1] + v.y * m.m[1][1] + v.z * m.m[2][1] + v.w * m.m[3][1];
+		r.z = v.x * m.m[0][2] + v.y * m.m[1][2] + v.z * m.m[2][2] + v.w * m.m[3][2];
+		r.w = v.x * m.m[0][3] + v.y * m.m[1][3] + v.z * m.m[2][3] + v.w * m.m[3][3];
+		return r;
+	}
+
+	// XMVector3Transform: w = 1, result not divided by w
+	inline Float3 TransformPoint(const Float3& v, const Float4x4& m)
+	{
+		return Transform({ v.x, v.y, v.z, 1.0f }, m).xyz();
+	}
+
+	inline Float4x4 Multiply(const Float4x4& a, const Float4x4& b)
+	{
+		Float4x4 r = {};
+		for (int i = 0; i < 4; i++)
+		{
+			for (int j = 0; j < 4; j++)
+			{
+				r.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j] + a.m[i][3] * b.m[3][j];
+			}
+		}
+		return r;
+	}
+
+	// General inverse by cofactors, identity when singular
+	inline Float4x4 Inverse(const Float4x4& a)
+	{
+		const float* m = &a.m[0][0];
+		float inv[16];
+		inv[0] = m[5] * m[10] * m[15] - m[5] * m[11] * m[14] - m[9] * m[6] * m[15] + m[9] * m[7] * m[14] + m[13] * m[6] * m[11] - m[13] * m[7] * m[10];
+		inv[4] = -m[4] * m[10] * m[15] + m[4] * m[11] * m[14] + m[8] * m[6] * m[15] - m[8] * m[7] * m[14] - m[12] * m[6] * m[11] + m[12] * m[7] * m[10];
+		inv[8] = m[4] * m[9] * m[15] - m[4] * m[11] * m[13] - m[8] * m[5] * m[15] + m[8] * m[7] * m[13] + m[12] * m[5] * m[11] - m[12] * m[7] * m[9];
+		inv[12] = -m[4] * m[9] * m[14] + m[4] * m[10] * m[13] + m[8] * m[5] * m[14] - m[8] * m[6] * m[13] - m[12] * m[5] * m[10] + m[12] * m[6] * m[9];
+		inv[1] = -m[1] * m[10] * m[15] + m[1] * m[11] * m[14] + m[9] * m[2] * m[15] - m[9] * m[3] * m[14] - m[13] * m[2] * m[11] + m[13] * m[3] * m[10];
+		inv[5] = m[0] * m[10] * m[15] - m[0] * m[11] * m[14] - m[8] * m[2] * m[15] + m[8] * m[3] * m[14] + m[12] * m[2] * m[11] - m[12] * m[3] * m[10];
+		inv[9] = -m[0] * m[9] * m[15] + m[0] * m[11] * m[13] + m[8] * m[1] * m[15] - m[8] * m[3] * m[13] - m[12] * m[1] * m[11] + m[12] * m[3] * m[9];
+		inv[13] = m[0] * m[9] * m[14] - m[0] * m[10] * m[13] - m[8] * m[1] * m[14] + m[8] * m[2] * m[13] + m[12] * m[1] * m[10] - m[12] * m[2] * m[9];
+		inv[2] = m[1] * m[6] * m[15] - m[1] * m[7] * m[14] - m[5] * m[2] * m[15] + m[5] * m[3] * m[14] + m[13] * m[2] * m[7] - m[13] * m[3] * m[6];
+		inv[6] = -m[0] * m[6] * m[15] + m[0] * m[7] * m[14] + m[4] * m[2] * m[15] - m[4] * m[3] * m[14] - m[12] * m[2] * m[7] + m[12] * m[3] * m[6];
+		inv[10] = m[0] * m[5] * m[15] - m[0] * m[7] * m[13] - m[4] * m[1] * m[15] + m[4] * m[3] * m[13] + m[12] * m[1] * m[7] - m[12] * m[3] * m[5];
+		inv[14] = -m[0] * m[5] * m[14] + m[0] * m[6] * m[13] + m[4] * m[1] * m[14] - m[4] * m[2] * m[13] - m[12] * m[1] * m[6] + m[12] * m[2] * m[5];
+		inv[3] = -m[1] * m[6] * m[11] + m[1] * m[7] * m[10] + m[5] * m[2] * m[11] - m[5] * m[3] * m[10] - m[9] * m[2] * m[7] + m[9] * m[3] * m[6];
+		inv[7] = m[0] * m[6] * m[11] - m[0] * m[7] * m[10] - m[4] * m[2] * m[11] + m[4] * m[3] * m[10] + m[8] * m[2] * m[7] - m[8] * m[3] * m[6];
+		inv[11] = -m[0] * m[5] * m[11] + m[0] * m[7] * m[9] + m[4] * m[1] * m[11] - m[4] * m[3] * m[9] - m[8] * m[1] * m[7] + m[8] * m[3] * m[5];
+		inv[15] = m[0] * m[5] * m[10] - m[0] * m[6] * m[9] - m[4] * m[1] * m[10] + m[4] * m[2] * m[9] + m[8] * m[1] * m[6] - m[8] * m[2] * m[5];
+
+		const float det = m[0] * inv[0] + m[1] * inv[4] + m[2] * inv[8] + m[3] * inv[12];
+		Float4x4 r = {};
+		if (det == 0.0f)
+		{
+			r.m[0][0] = r.m[1][1] = r.m[2][2] = r.m[3][3] = 1.0f;
+			return r;
+		}
+		for (int i = 0; i < 16; i++) (&r.m[0][0])[i] = inv[i] / det;
+		return r;
+	}
+
+	// XMMatrixRotationY
+	inline Float4x4 MatrixRotationY(float angle)
+	{
+		const float s = std::sin(angle), c = std::cos(angle);
+		return { { { c, 0.0f, -s, 0.0f }, { 0.0f, 1.0f, 0.0f, 0.0f }, { s, 0.0f, c, 0.0f }, { 0.0f, 0.0f, 0.0f, 1.0f } } };
+	}
+
+	// XMMatrixLookAtLH
+	inline Float4x4 MatrixLookAtLH(const Float3& eye, const Float3& at, const Float3& up)
+	{
+		const Float3 zAxis = Normalize(at - eye);
+		const Float3 xAxis = Normalize(Cross(up, zAxis));
+		const Float3 yAxis = Cross(zAxis, xAxis);
+		return { {
+			{ xAxis.x, yAxis.x, zAxis.x, 0.0f },
+			{ xAxis.y, yAxis.y, zAxis.y, 0.0f },
+			{ xAxis.z, yAxis.z, zAxis.z, 0.0f },
+			{ -Dot(xAxis, eye), -Dot(yAxis, eye), -Dot(zAxis, eye), 1.0f } } };
+	}
+
+	// XMMatrixPerspectiveFovLH
+	inline Float4x4 MatrixPerspectiveFovLH(float fovAngleY, float aspectRatio, float nearZ, float farZ)
+	{
+		const float height = 1.0f / std::tan(0.5f * fovAngleY);
+		const float width = height / aspectRatio;
+		const float range = farZ / (farZ - nearZ);
+		return { {
+			{ width, 0.0f, 0.0f, 0.0f },
+			{ 0.0f, height, 0.0f, 0.0f },
+			{ 0.0f, 0.0f, range, 1.0f },
+			{ 0.0f, 0.0f, -range * nearZ, 0.0f } } };
+	}
+
+	inline Float3 TransformPoint(const Float3x4& t, const Float3& p)
+	{
+		return {
+			t.m[0][0] * p.x + t.m[0][1] * p.y + t.m[0][2] * p.z + t.m[0][3],
+			t.m[1][0] * p.x + t.m[1][1] * p.y + t.m[1][2] * p.z + t.m[1][3],
+			t.m[2][0] * p.x + t.m[2][1] * p.y + t.m[2][2] * p.z + t.m[2][3] };
+	}
+
+	inline Float3 TransformVector(const Float3x4& t, const Float3& v)
+	{
+		return {
+			t.m[0][0] * v.x + t.m[0][1] * v.y + t.m[0][2] * v.z,
+			t.m[1][0] * v.x + t.m[1][1] * v.y + t.m[1][2] * v.z,
+			t.m[2][0] * v.x + t.m[2][1] * v.y + t.m[2][2] * v.z };
+	}
+
+	// HLSL mul(n, (float3x3)WorldToObject3x4()) up to a positive scale, t = ObjectToWorld3x4(): the inverse transpose
+	// keeps normals perpendicular under non-uniform scale. The cofactor matrix is det * that, so no inverse is needed,
+	// callers normalize. Linear, so vertex normals may be transformed before interpolation.
+	inline Float3 TransformNormal(const Float3x4& t, const Float3& n)
+	{
+		const Float3 row0 = { t.m[0][0], t.m[0][1], t.m[0][2] };
+		const Float3 row1 = { t.m[1][0], t.m[1][1], t.m[1][2] };
+		const Float3 row2 = { t.m[2][0], t.m[2][1], t.m[2][2] };
+		const Float3 cofactor0 = Cross(row1, row2);
+		const Float3 r = { Dot(cofactor0, n), Dot(Cross(row2, row0), n), Dot(Cross(row0, row1), n) };
+		return Dot(row0, cofactor0) < 0.0f ? -r : r;
+	}
+
+	// Inverse of an affine 3x4, zero when singular
+	inline Float3x4 InverseAffine(const Float3x4& t)
+	{
+		const float (*m)[4] = t.m;
+		const float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+		const float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+		const float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+		const float det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+		Float3x4 r = {};
+		if (det == 0.0f) return r;
+
+		const float invDet = 1.0f / det;
+		r.m[0][0] = c00 * invDet;
+		r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * invDet;
+		r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invDet;
+		r.m[1][0] = c01 * invDet;
+		r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invDet;
+		r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * invDet;
+		r.m[2][0] = c02 * invDet;
+		r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * invDet;
+		r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invDet;
+		for (int i = 0; i < 3; i++)
+		{
+			r.m[i][3] = -(r.m[i][0] * m[0][3] + r.m[i][1] * m[1][3] + r.m[i][2] * m[2][3]);
+		}
+		return r;
+	}
+
+	inline float ConvertToRadians(float degrees) { return degrees * (3.14159265358979f / 180.0f); }
+}
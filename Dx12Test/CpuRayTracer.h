@@ -0,0 +1,410 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#include "CpuMath.h"
+#include "CpuSampling.h"
+#include "CpuScene.h"
+#include "ThreadPool.h"
+
+/*
+ ------------------------------CPU Ray Tracer------------------------------------
+ Reference implementation of the DXR pipeline in shaders/ for machines without a DXR device: the same
+ RayGen -> TraceRay -> ClosestHit / Miss steps, function for function, run over image tiles on the ThreadPool.
+ Output is the float4 the shaders write to RTOutput.
+
+ The acceleration structure is a template parameter, anything with
+	bool Intersect(const Ray& ray, uint32_t rayFlags, RayHit& hit) const
+ that reports the closest hit (TriangleList below is the brute force one). Two-level structures (Tlas.h) fill in
+ RayHit::instance, the vertex and index buffers are still the one mesh bound for the whole dispatch, as in the app.
+*/
+
+namespace CpuRt
+{
+	// D3D12_RAY_FLAGS values
+	enum RayFlag : uint32_t
+	{
+		RayFlagNone = 0x00,
+		RayFlagForceOpaque = 0x01,
+		RayFlagAcceptFirstHitAndEndSearch = 0x04,
+		RayFlagSkipClosestHitShader = 0x08,
+		RayFlagCullBackFacingTriangles = 0x10,
+		RayFlagCullFrontFacingTriangles = 0x20,
+	};
+
+	constexpr uint32_t gInvalidPrimitive = ~0u;
+
+	// RayDesc
+	struct Ray
+	{
+		Float3 origin;
+		float tMin;
+		Float3 direction;
+		float tMax;
+	};
+
+	struct RayHit
+	{
+		float t = std::numeric_limits<float>::infinity();
+		uint32_t primitive = gInvalidPrimitive;
+		Float2 barycentrics = { 0.0f, 0.0f };		// BuiltInTriangleIntersectionAttributes: weights of vertex 1 and 2
+		uint32_t instance = gInvalidPrimitive;		// InstanceIndex(), only set by two-level structures
+
+		bool Hit() const { return primitive != gInvalidPrimitive; }
+	};
+
+	/*
+	 Ray flags for the traversal and intersection kernels, which are templates over one of two types:
+		RuntimeRayFlags     the flags as TraceRay got them, every test is a branch
+		StaticRayFlags<F>   the flags as a type, the tests are constants and fold away in the instantiation
+	 DispatchRayFlags calls a function with the StaticRayFlags matching runtime flags. Only the bits traversal looks at
+	 pick the instantiation, ForceOpaque and SkipClosestHitShader change nothing without any hit shaders.
+	*/
+	constexpr uint32_t gTraversalRayFlags = RayFlagAcceptFirstHitAndEndSearch | RayFlagCullBackFacingTriangles | RayFlagCullFrontFacingTriangles;
+
+	struct RuntimeRayFlags
+	{
+		uint32_t value;
+
+		bool AcceptFirstHit() const { return (value & RayFlagAcceptFirstHitAndEndSearch) != 0; }
+		bool CullBack() const { return (value & RayFlagCullBackFacingTriangles) != 0; }
+		bool CullFront() const { return (value & RayFlagCullFrontFacingTriangles) != 0; }
+	};
+
+	template<uint32_t Flags>
+	struct StaticRayFlags
+	{
+		static constexpr uint32_t value = Flags;
+
+		static constexpr bool AcceptFirstHit() { return (Flags & RayFlagAcceptFirstHitAndEndSearch) != 0; }
+		static constexpr bool CullBack() { return (Flags & RayFlagCullBackFacingTriangles) != 0; }
+		static constexpr bool CullFront() { return (Flags & RayFlagCullFrontFacingTriangles) != 0; }
+	};
+
+	template<typename Function>
+	inline decltype(auto) DispatchRayFlags(uint32_t rayFlags, Function&& function)
+	{
+		constexpr uint32_t first = RayFlagAcceptFirstHitAndEndSearch, back = RayFlagCullBackFacingTriangles, front = RayFlagCullFrontFacingTriangles;
+		switch (rayFlags & gTraversalRayFlags)
+		{
+		case RayFlagNone: return function(StaticRayFlags<RayFlagNone>{});
+		case back: return function(StaticRayFlags<back>{});
+		case front: return function(StaticRayFlags<front>{});
+		case back | front: return function(StaticRayFlags<back | front>{});
+		case first: return function(StaticRayFlags<first>{});
+		case first | back: return function(StaticRayFlags<first | back>{});
+		case first | front: return function(StaticRayFlags<first | front>{});
+		default: return function(StaticRayFlags<first | back | front>{});
+		}
+	}
+
+	// Möller-Trumbore. Front faces are clockwise as seen from the ray origin (DXR default), which is det > 0 here.
+	// Only hits in (tMin, hit.t) are taken, hit.t is updated on success.
+	template<typename RayFlags, std::enable_if_t<!std::is_integral_v<RayFlags> && !std::is_enum_v<RayFlags>, int> = 0>
+	inline bool IntersectTriangle(const Ray& ray, const RayFlags& rayFlags, const Float3& p0, const Float3& p1, const Float3& p2, float tMin, RayHit& hit, uint32_t primitive)
+	{
+		const Float3 e1 = p1 - p0;
+		const Float3 e2 = p2 - p0;
+		const Float3 p = Cross(ray.direction, e2);
+		const float det = Dot(e1, p);
+
+		if (det == 0.0f) return false;
+		if (rayFlags.CullBack() && det < 0.0f) return false;
+		if (rayFlags.CullFront() && det > 0.0f) return false;
+
+		const float invDet = 1.0f / det;
+		const Float3 s = ray.origin - p0;
+		const float u = Dot(s, p) * invDet;
+		if (u < 0.0f || u > 1.0f) return false;
+
+		const Float3 q = Cross(s, e1);
+		const float v = Dot(ray.direction, q) * invDet;
+		if (v < 0.0f || u + v > 1.0f) return false;
+
+		const float t = Dot(e2, q) * invDet;
+		if (t <= tMin || t >= hit.t) return false;
+
+		hit.t = t;
+		hit.primitive = primitive;
+		hit.barycentrics = { u, v };
+		return true;
+	}
+
+	inline bool IntersectTriangle(const Ray& ray, uint32_t rayFlags, const Float3& p0, const Float3& p1, const Float3& p2, float tMin, RayHit& hit, uint32_t primitive)
+	{
+		return IntersectTriangle(ray, RuntimeRayFlags{ rayFlags }, p0, p1, p2, tMin, hit, primitive);
+	}
+
+	// Every triangle against every ray, the baseline the acceleration structures are checked against
+	class TriangleList
+	{
+	public:
+		explicit TriangleList(const MeshData& mesh)
+		{
+			positions.reserve(mesh.indices.size());
+			for (uint32_t index : mesh.indices) positions.push_back(mesh.vertices[index].position);
+		}
+
+		bool Intersect(const Ray& ray, uint32_t rayFlags, RayHit& hit) const
+		{
+			hit.t = ray.tMax;
+			bool found = false;
+			for (size_t i = 0; i + 2 < positions.size(); i += 3)
+			{
+				found |= IntersectTriangle(ray, rayFlags, positions[i], positions[i + 1], positions[i + 2], ray.tMin, hit, static_cast<uint32_t>(i / 3));
+				if (found && (rayFlags & RayFlagAcceptFirstHitAndEndSearch)) break;
+			}
+			return found;
+		}
+
+	private:
+		std::vector<Float3> positions;
+	};
+
+	/*
+	 ------------------------------Shaders------------------------------------
+	 Common.hlsl, RayGen.hlsl, Miss.hlsl and ClosestHit.hlsl. Keep in sync with the HLSL, the shading math itself
+	 (CameraRayDirection, HitAttribute, CalculateDiffuseLighting, CombineLighting) is shaders/Shading.h on both sides.
+	*/
+
+	// HitInfo
+	struct HitInfo
+	{
+		Float4 ShadedColorAndHitT;
+		Float2 lightSample = { 0.5f, 0.5f };		// RayGen's light sample for the shadow ray of ClosestHit
+	};
+
+	// ShadowHitInfo
+	struct ShadowHitInfo
+	{
+		bool isOccluded;
+	};
+
+	// What the shaders get from bindings and system values
+	struct ShaderContext
+	{
+		const MeshData* mesh;
+		const SceneConstants* scene;
+		uint32_t width;					// DispatchRaysDimensions()
+		uint32_t height;
+		const InstanceDesc* instances;	// ObjectToWorld3x4() of a hit's instance, null when tracing a single BLAS
+	};
+
+	// Instances behind an acceleration structure, two-level structures overload this
+	template<typename Accel>
+	inline const InstanceDesc* AccelInstances(const Accel&)
+	{
+		return nullptr;
+	}
+
+	// 'jitter' in [0, 1)^2 is the sample position in the pixel, (0.5, 0.5) its center
+	inline void GenerateCameraRay(const ShaderContext& context, uint32_t x, uint32_t y, const Float2& jitter, Float3& origin, Float3& direction)
+	{
+		origin = context.scene->cameraPosition.xyz();
+		direction = CameraRayDirection<float>(*context.scene, float(x) + jitter.x - 0.5f, float(y) + jitter.y - 0.5f, float(context.width), float(context.height));
+	}
+
+	inline void GenerateCameraRay(const ShaderContext& context, uint32_t x, uint32_t y, Float3& origin, Float3& direction)
+	{
+		GenerateCameraRay(context, x, y, { 0.5f, 0.5f }, origin, direction);
+	}
+
+	inline void Miss(HitInfo& payload)
+	{
+		payload.ShadedColorAndHitT = { 0.0f, 0.2f, 0.4f, 1.0f };
+	}
+
+	inline void ShadowMiss(ShadowHitInfo& payload)
+	{
+		payload.isOccluded = false;
+	}
+
+	/*
+	 Occlusion query, TraceRay with RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH | RAY_FLAG_SKIP_CLOSEST_HIT_SHADER: true
+	 if anything lies in (tMin, tMax). Any structure answers it through Intersect, the ones with a cheaper any hit
+	 traversal (Bvh::Occluded) overload this.
+	*/
+	template<typename Accel>
+	inline bool Occluded(const Accel& accel, const Ray& ray, uint32_t rayFlags)
+	{
+		RayHit hit;
+		return accel.Intersect(ray, rayFlags | RayFlagAcceptFirstHitAndEndSearch | RayFlagSkipClosestHitShader, hit);
+	}
+
+	// Occlusion of a batch of rays, occluded[i] is 0 or 1
+	template<typename Accel>
+	inline void TraceOcclusionRays(const Accel& accel, const std::vector<Ray>& rays, uint32_t rayFlags, std::vector<uint8_t>& occluded,
+		ThreadPool& pool = ThreadPool::Default())
+	{
+		occluded.resize(rays.size());
+		pool.ParallelFor(rays.size(), 4096, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++) occluded[i] = Occluded(accel, rays[i], rayFlags) ? 1 : 0;
+		});
+	}
+
+	// TraceShadowRay, the ShadowMiss shader (miss index 1) is the only one that runs
+	template<typename Accel>
+	inline bool TraceShadowRay(const Accel& accel, const Float3& origin, const Float3& target)
+	{
+		const Float3 toTarget = target - origin;
+		const float distance = Length(toTarget);
+
+		Ray ray;
+		ray.origin = origin;
+		ray.direction = toTarget / distance;
+		ray.tMin = 0.001f;
+		ray.tMax = distance;
+
+		ShadowHitInfo payload;
+		payload.isOccluded = true;
+		if (!Occluded(accel, ray, RayFlagForceOpaque)) ShadowMiss(payload);
+		return payload.isOccluded;
+	}
+
+	template<typename Accel>
+	inline void ClosestHit(const ShaderContext& context, const Accel& accel, const Ray& ray, const RayHit& hit, HitInfo& payload)
+	{
+		// HitWorldPosition
+		const Float3 hitPosition = ray.origin + hit.t * ray.direction;
+
+		const uint32_t* indices = &context.mesh->indices[hit.primitive * 3];
+		Float3 vertexNormals[3] = {
+			context.mesh->vertices[indices[0]].normal,
+			context.mesh->vertices[indices[1]].normal,
+			context.mesh->vertices[indices[2]].normal
+		};
+
+		Float3 triangleNormal = HitAttribute<float>(vertexNormals, hit.barycentrics);
+		if (context.instances && hit.instance != gInvalidPrimitive)
+		{
+			triangleNormal = TransformNormal(context.instances[hit.instance].transform, triangleNormal);
+		}
+		triangleNormal = Normalize(triangleNormal);		// every DXR hit is instanced, ClosestHit.hlsl always normalizes
+
+		const Float4 diffuseColor = CalculateDiffuseLighting<float>(*context.scene, hitPosition, triangleNormal);
+
+		// Only surfaces facing the light need to know whether it is blocked, towards the point of RayGen's light sample
+		float lightVisibility = 1.0f;
+		const Float3 lightTarget = LightSamplePosition<float>(*context.scene, payload.lightSample.x, payload.lightSample.y);
+		if ((diffuseColor.x > 0.0f || diffuseColor.y > 0.0f || diffuseColor.z > 0.0f) && TraceShadowRay(accel, hitPosition, lightTarget))
+		{
+			lightVisibility = 0.0f;
+		}
+		payload.ShadedColorAndHitT = CombineLighting<float>(*context.scene, diffuseColor, lightVisibility);
+	}
+
+	// TraceRay with a single hit group and miss shader, as in CreateShaderTable
+	template<typename Accel>
+	inline void TraceRay(const ShaderContext& context, const Accel& accel, uint32_t rayFlags, const Ray& ray, HitInfo& payload)
+	{
+		RayHit hit;
+		if (accel.Intersect(ray, rayFlags, hit)) ClosestHit(context, accel, ray, hit, payload);
+		else Miss(payload);
+	}
+
+	template<typename Accel>
+	inline Float4 RayGen(const ShaderContext& context, const Accel& accel, uint32_t x, uint32_t y)
+	{
+		const SceneConstants& scene = *context.scene;
+		const uint32_t samples = std::max(1u, scene.samplesPerPixel);
+		const uint32_t pixelSeed = PixelSeed(scene.samplerSeed, x, y);
+		Float4 color = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+		for (uint32_t sampleIndex = 0; sampleIndex < samples; sampleIndex++)
+		{
+			Float3 rayDir;
+			Float3 origin;
+
+			const Float2 jitter = { PixelSample(scene, x, y, pixelSeed, sampleIndex, 0), PixelSample(scene, x, y, pixelSeed, sampleIndex, 1) };
+			GenerateCameraRay(context, x, y, jitter, origin, rayDir);
+
+			// Setup the ray
+			Ray ray;
+			ray.origin = origin;
+			ray.direction = rayDir;
+			ray.tMin = 0.001f;
+			ray.tMax = 10000.0f;
+
+			// Trace the ray
+			HitInfo payload;
+			payload.ShadedColorAndHitT = { 0.0f, 0.0f, 0.0f, 0.0f };
+			payload.lightSample = { PixelSample(scene, x, y, pixelSeed, sampleIndex, 2), PixelSample(scene, x, y, pixelSeed, sampleIndex, 3) };
+
+			TraceRay(context, accel, RayFlagCullBackFacingTriangles, ray, payload);
+
+			color = color + payload.ShadedColorAndHitT;
+		}
+
+		return color * (1.0f / float(samples));
+	}
+
+	/*
+	 ------------------------------Renderer------------------------------------
+	*/
+
+	struct RenderSettings
+	{
+		uint32_t width = 1280;			// gAppState defaults
+		uint32_t height = 720;
+		uint32_t tileSize = 16;			// square tiles, the unit of work handed to the pool
+	};
+
+	struct RenderStats
+	{
+		double milliseconds = 0.0;
+		uint64_t rays = 0;
+
+		// Primary rays only, the same number CalculateFrameStats puts in the window title
+		double MRaysPerSecond() const { return milliseconds > 0.0 ? rays / (milliseconds * 1000.0) : 0.0; }
+	};
+
+	// Hands the tiles of the image to the pool, tileFunction(x0, y0, x1, y1) covers [x0, x1) x [y0, y1)
+	template<typename TileFunction>
+	inline void ForEachTile(const RenderSettings& settings, ThreadPool& pool, const TileFunction& tileFunction)
+	{
+		const uint32_t tileSize = std::max(1u, settings.tileSize);
+		const uint32_t tilesX = (settings.width + tileSize - 1) / tileSize;
+		const uint32_t tilesY = (settings.height + tileSize - 1) / tileSize;
+		pool.ParallelFor(size_t(tilesX) * tilesY, 1, [&](size_t begin, size_t end)
+		{
+			for (size_t tile = begin; tile < end; tile++)
+			{
+				const uint32_t x0 = static_cast<uint32_t>(tile % tilesX) * tileSize;
+				const uint32_t y0 = static_cast<uint32_t>(tile / tilesX) * tileSize;
+				tileFunction(x0, y0, std::min(x0 + tileSize, settings.width), std::min(y0 + tileSize, settings.height));
+			}
+		});
+	}
+
+	// DispatchRays over width x height, output is RTOutput (row major, width * height)
+	template<typename Accel>
+	inline RenderStats Render(const Accel& accel, const MeshData& mesh, const SceneConstants& scene, const RenderSettings& settings,
+		std::vector<Float4>& output, ThreadPool& pool = ThreadPool::Default())
+	{
+		const ShaderContext context = { &mesh, &scene, settings.width, settings.height, AccelInstances(accel) };
+		output.resize(size_t(settings.width) * settings.height);
+
+		const auto start = std::chrono::high_resolution_clock::now();
+		ForEachTile(settings, pool, [&](uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1)
+		{
+			for (uint32_t y = y0; y < y1; y++)
+			{
+				for (uint32_t x = x0; x < x1; x++)
+				{
+					output[size_t(y) * settings.width + x] = RayGen(context, accel, x, y);
+				}
+			}
+		});
+
+		RenderStats stats;
+		stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		stats.rays = uint64_t(settings.width) * settings.height;
+		return stats;
+	}
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "CpuScene.h"
+
+/*
+ ------------------------------CPU Sampling------------------------------------
+ The C++ side of shaders/Sampling.h: 'reversebits', the compile time check of its Sobol table and the blue noise tile
+ RayGen.hlsl reads from the BlueNoise buffer, generated here once per process (void and cluster over 64x64 texels
+ is too much for constant evaluation) and uploaded by main.cpp. PixelSample is Common.hlsl's.
+*/
+
+namespace CpuRt
+{
+	// HLSL reversebits
+	inline UINT reversebits(UINT x)
+	{
+		x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+		x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+		x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+		x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+		return (x >> 16) | (x << 16);
+	}
+
+	// Samplers, SobolSample, NestedUniformScramble, LatticeSample, PixelSampleDimension, ...
+#define SHADING_CPU
+#include "shaders/Sampling.h"
+#undef SHADING_CPU
+
+	inline UINT ParseSampler(const char* name)
+	{
+		if (!strcmp(name, "center")) return gSamplerCenter;
+		if (!strcmp(name, "random")) return gSamplerRandom;
+		if (!strcmp(name, "sobol")) return gSamplerSobol;
+		if (!strcmp(name, "lattice")) return gSamplerLattice;
+		if (!strcmp(name, "bluenoise")) return gSamplerBlueNoise;
+		throw std::runtime_error(std::string("Error: unknown sampler ") + name);
+	}
+
+	namespace SamplingDetail
+	{
+		// Bratley & Fox 1988 from Joe & Kuo's primitive polynomials (degree, coefficients) and initial numbers m
+		constexpr UINT SobolDirection(UINT dimension, UINT bit)
+		{
+			const UINT degree[4] = { 0, 1, 2, 3 };
+			const UINT coefficients[4] = { 0, 0, 1, 1 };
+			const UINT initial[4][3] = { { 0, 0, 0 }, { 1, 0, 0 }, { 1, 3, 0 }, { 1, 3, 1 } };
+			if (dimension == 0) return 1u << (31 - bit);
+
+			const UINT s = degree[dimension];
+			UINT v[32] = {};
+			for (UINT i = 0; i <= bit; i++)
+			{
+				if (i < s)
+				{
+					v[i] = initial[dimension][i] << (31 - i);
+					continue;
+				}
+				v[i] = v[i - s] ^ (v[i - s] >> s);
+				for (UINT k = 1; k < s; k++) v[i] ^= ((coefficients[dimension] >> (s - 1 - k)) & 1u) * v[i - k];
+			}
+			return v[bit];
+		}
+
+		constexpr bool SobolTableMatches()
+		{
+			for (UINT dimension = 0; dimension < gSamplingDimensions; dimension++)
+			{
+				for (UINT bit = 0; bit < 32; bit++)
+				{
+					if (gSobolDirections[dimension * 32 + bit] != SobolDirection(dimension, bit)) return false;
+				}
+			}
+			return true;
+		}
+	}
+
+	static_assert(SamplingDetail::SobolTableMatches(), "gSobolDirections differs from the Joe & Kuo direction numbers");
+
+	/*
+	 Void and cluster (Ulichney 1993) on a size x size torus, 'size' a power of two: rank of every texel, 0 to size^2 - 1.
+	 Energy is a Gaussian of the toroidal distance to the texels set so far. A tenth of the texels, hashed, are relaxed
+	 until the tightest cluster is the largest void, ranked down by removing tightest clusters, then every other texel
+	 ranked up by filling the largest void. The kernel sums to a constant, so the largest void among the texels not set
+	 is also the tightest cluster of them.
+	*/
+	inline std::vector<uint32_t> GenerateBlueNoiseRanks(uint32_t size = gBlueNoiseTileSize, float sigma = 1.5f, uint32_t seed = 1)
+	{
+		if (size == 0 || (size & (size - 1)) != 0) throw std::runtime_error("Error: blue noise tile size must be a power of two");
+		const uint32_t count = size * size, mask = size - 1;
+
+		std::vector<float> kernel(count);
+		for (uint32_t dy = 0; dy < size; dy++)
+		{
+			for (uint32_t dx = 0; dx < size; dx++)
+			{
+				const float x = float(std::min(dx, size - dx)), y = float(std::min(dy, size - dy));
+				kernel[dy * size + dx] = std::exp(-(x * x + y * y) / (2.0f * sigma * sigma));
+			}
+		}
+
+		std::vector<float> energy(count, 0.0f);
+		std::vector<uint8_t> pattern(count, 0);
+		const auto set = [&](uint32_t texel, uint8_t value)
+		{
+			const float sign = value ? 1.0f : -1.0f;
+			const uint32_t px = texel & mask, py = texel / size;
+			pattern[texel] = value;
+			for (uint32_t q = 0; q < count; q++) energy[q] += sign * kernel[(((q / size) - py) & mask) * size + (((q & mask) - px) & mask)];
+		};
+		const auto tightestCluster = [&]()
+		{
+			uint32_t best = 0;
+			float bestEnergy = -1.0f;
+			for (uint32_t q = 0; q < count; q++)
+			{
+				if (pattern[q] && energy[q] > bestEnergy) { best = q; bestEnergy = energy[q]; }
+			}
+			return best;
+		};
+		const auto largestVoid = [&]()
+		{
+			uint32_t best = 0;
+			float bestEnergy = INFINITY;
+			for (uint32_t q = 0; q < count; q++)
+			{
+				if (!pattern[q] && energy[q] < bestEnergy) { best = q; bestEnergy = energy[q]; }
+			}
+			return best;
+		};
+
+		const uint32_t initial = std::max(1u, count / 10);
+		for (uint32_t placed = 0, i = 0; placed < initial; i++)
+		{
+			const uint32_t texel = HashCombine(seed, i) & (count - 1);
+			if (!pattern[texel]) { set(texel, 1); placed++; }
+		}
+		for (uint32_t iteration = 0; iteration < count; iteration++)
+		{
+			const uint32_t cluster = tightestCluster();
+			set(cluster, 0);
+			const uint32_t hole = largestVoid();
+			set(hole, 1);
+			if (hole == cluster) break;
+		}
+
+		std::vector<uint32_t> rank(count);
+		const std::vector<uint8_t> initialPattern = pattern;
+		const std::vector<float> initialEnergy = energy;
+		for (uint32_t r = initial; r-- > 0;)
+		{
+			const uint32_t cluster = tightestCluster();
+			set(cluster, 0);
+			rank[cluster] = r;
+		}
+		pattern = initialPattern;
+		energy = initialEnergy;
+		for (uint32_t r = initial; r < count; r++)
+		{
+			const uint32_t hole = largestVoid();
+			set(hole, 1);
+			rank[hole] = r;
+		}
+		return rank;
+	}
+
+	// The BlueNoise buffer: gBlueNoiseTileSize^2 rotations, the 32 bit fraction at the center of each texel's rank
+	inline const std::vector<UINT>& BlueNoiseTile()
+	{
+		static const std::vector<UINT> tile = []
+		{
+			const std::vector<uint32_t> ranks = GenerateBlueNoiseRanks();
+			uint32_t bits = 0;
+			while ((1u << bits) < ranks.size()) bits++;
+			std::vector<UINT> rotations(ranks.size());
+			for (size_t i = 0; i < ranks.size(); i++) rotations[i] = (ranks[i] << (32 - bits)) | (1u << (31 - bits));
+			return rotations;
+		}();
+		return tile;
+	}
+
+	// Common.hlsl's PixelSample for pixel (x, y), 'pixelSeed' its PixelSeed
+	inline float PixelSample(const SceneConstants& scene, uint32_t x, uint32_t y, uint32_t pixelSeed, uint32_t sampleIndex, uint32_t dimension)
+	{
+		const UINT blueNoise = scene.sampler == gSamplerBlueNoise ? BlueNoiseTile()[BlueNoiseTexel(x, y, dimension)] : 0u;
+		return PixelSampleDimension(scene.sampler, pixelSeed, sampleIndex, dimension, blueNoise);
+	}
+}
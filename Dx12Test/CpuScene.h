@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "CpuMath.h"
+#include "CpuShading.h"
+
+/*
+ ------------------------------CPU Scene------------------------------------
+ Mesh and scene constants for the CPU ray tracing path, the Vertex and SceneConstantBuffer of shaders/Shading.h
+ that the app and the shaders use, so data can be copied over as is. The loaders mirror Mesh::LoadCube /
+ Mesh::LoadModel and the camera and lights set up by Application::InitializeSceneParams, so headless renders
+ match what the app shows.
+ LoadObjMesh needs tiny_obj_loader.h included before this header.
+*/
+
+namespace CpuRt
+{
+	struct MeshData
+	{
+		std::vector<Vertex> vertices;
+		std::vector<uint32_t> indices;		// 3 per triangle, front faces clockwise
+
+		size_t TriangleCount() const { return indices.size() / 3; }
+	};
+
+	using SceneConstants = SceneConstantBuffer;
+
+	// D3D12_RAYTRACING_INSTANCE_FLAGS
+	enum InstanceFlag : uint32_t
+	{
+		InstanceFlagNone = 0x0,
+		InstanceFlagTriangleCullDisable = 0x1,
+		InstanceFlagTriangleFrontCounterclockwise = 0x2,
+		InstanceFlagForceOpaque = 0x4,
+		InstanceFlagForceNonOpaque = 0x8,
+	};
+
+	// D3D12_RAYTRACING_INSTANCE_DESC, the BLAS is an index into the two-level structure's BLAS list instead of a GPU address
+	struct InstanceDesc
+	{
+		Float3x4 transform;								// object to world
+		uint32_t instanceID : 24;						// InstanceID()
+		uint32_t instanceMask : 8;						// ANDed with TraceRay's InstanceInclusionMask
+		uint32_t instanceContributionToHitGroupIndex : 24;
+		uint32_t flags : 8;								// InstanceFlag
+		uint64_t accelerationStructure;
+	};
+
+	static_assert(sizeof(InstanceDesc) == 64, "InstanceDesc should match D3D12_RAYTRACING_INSTANCE_DESC");
+
+	// Mesh::LoadCube
+	inline MeshData LoadCubeMesh()
+	{
+		MeshData mesh;
+		mesh.indices = {
+			3,1,0, 2,1,3,
+			6,4,5, 7,4,6,
+			11,9,8, 10,9,11,
+			14,12,13, 15,12,14,
+			19,17,16, 18,17,19,
+			22,20,21, 23,20,22
+		};
+
+		mesh.vertices = {
+			{ { -1.0f, 1.0f, -1.0f }, { 0.0f, 1.0f, 0.0f } },
+			{ { 1.0f, 1.0f, -1.0f }, { 0.0f, 1.0f, 0.0f } },
+			{ { 1.0f, 1.0f, 1.0f }, { 0.0f, 1.0f, 0.0f } },
+			{ { -1.0f, 1.0f, 1.0f }, { 0.0f, 1.0f, 0.0f } },
+
+			{ { -1.0f, -1.0f, -1.0f }, { 0.0f, -1.0f, 0.0f } },
+			{ { 1.0f, -1.0f, -1.0f }, { 0.0f, -1.0f, 0.0f } },
+			{ { 1.0f, -1.0f, 1.0f }, { 0.0f, -1.0f, 0.0f } },
+			{ { -1.0f, -1.0f, 1.0f }, { 0.0f, -1.0f, 0.0f } },
+
+			{ { -1.0f, -1.0f, 1.0f }, { -1.0f, 0.0f, 0.0f } },
+			{ { -1.0f, -1.0f, -1.0f }, { -1.0f, 0.0f, 0.0f } },
+			{ { -1.0f, 1.0f, -1.0f }, { -1.0f, 0.0f, 0.0f } },
+			{ { -1.0f, 1.0f, 1.0f }, { -1.0f, 0.0f, 0.0f } },
+
+			{ { 1.0f, -1.0f, 1.0f }, { 1.0f, 0.0f, 0.0f } },
+			{ { 1.0f, -1.0f, -1.0f }, { 1.0f, 0.0f, 0.0f } },
+			{ { 1.0f, 1.0f, -1.0f }, { 1.0f, 0.0f, 0.0f } },
+			{ { 1.0f, 1.0f, 1.0f }, { 1.0f, 0.0f, 0.0f } },
+
+			{ { -1.0f, -1.0f, -1.0f }, { 0.0f, 0.0f, -1.0f } },
+			{ { 1.0f, -1.0f, -1.0f }, { 0.0f, 0.0f, -1.0f } },
+			{ { 1.0f, 1.0f, -1.0f }, { 0.0f, 0.0f, -1.0f } },
+			{ { -1.0f, 1.0f, -1.0f }, { 0.0f, 0.0f, -1.0f } },
+
+			{ { -1.0f, -1.0f, 1.0f }, { 0.0f, 0.0f, 1.0f } },
+			{ { 1.0f, -1.0f, 1.0f }, { 0.0f, 0.0f, 1.0f } },
+			{ { 1.0f, 1.0f, 1.0f }, { 0.0f, 0.0f, 1.0f } },
+			{ { -1.0f, 1.0f, 1.0f }, { 0.0f, 0.0f, 1.0f } },
+		};
+		return mesh;
+	}
+
+#ifdef TINY_OBJ_LOADER_H_
+	// Mesh::LoadModel: x and z swapped into the app's left handed space, vertices welded.
+	// Unlike the app it keeps the OBJ normals when there are some, they go through the same swizzle.
+	inline MeshData LoadObjMesh(const std::string& filepath, const std::string& mtlDirectory = "")
+	{
+		tinyobj::attrib_t attrib;
+		std::vector<tinyobj::shape_t> shapes;
+		std::vector<tinyobj::material_t> materials;
+		std::string err;
+		std::string warn;
+
+		if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, filepath.c_str(), mtlDirectory.empty() ? nullptr : mtlDirectory.c_str()))
+		{
+			throw std::runtime_error(err);
+		}
+
+		struct VertexHash
+		{
+			size_t operator()(const Vertex& v) const
+			{
+				size_t seed = 0;
+				for (float f : { v.position.x, v.position.y, v.position.z, v.normal.x, v.normal.y, v.normal.z })
+				{
+					seed ^= std::hash<float>()(f) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+				}
+				return seed;
+			}
+		};
+		struct VertexEqual
+		{
+			bool operator()(const Vertex& a, const Vertex& b) const { return memcmp(&a, &b, sizeof(Vertex)) == 0; }
+		};
+
+		MeshData mesh;
+		std::unordered_map<Vertex, uint32_t, VertexHash, VertexEqual> uniqueVertices;
+		for (const auto& shape : shapes)
+		{
+			for (const auto& index : shape.mesh.indices)
+			{
+				Vertex vertex = {};
+				vertex.position =
+				{
+					attrib.vertices[3 * index.vertex_index + 2],
+					attrib.vertices[3 * index.vertex_index + 1],
+					attrib.vertices[3 * index.vertex_index + 0]
+				};
+
+				if (index.normal_index >= 0)
+				{
+					vertex.normal =
+					{
+						attrib.normals[3 * index.normal_index + 2],
+						attrib.normals[3 * index.normal_index + 1],
+						attrib.normals[3 * index.normal_index + 0]
+					};
+				}
+
+				auto it = uniqueVertices.find(vertex);
+				if (it == uniqueVertices.end())
+				{
+					it = uniqueVertices.emplace(vertex, static_cast<uint32_t>(mesh.vertices.size())).first;
+					mesh.vertices.push_back(vertex);
+				}
+				mesh.indices.push_back(it->second);
+			}
+		}
+		return mesh;
+	}
+#endif
+
+	// Bumpy UV sphere of about 'triangleCount' triangles around the origin, in view of the default camera.
+	// Stand in for real assets in the acceleration structure benchmarks.
+	inline MeshData CreateSphereMesh(uint32_t triangleCount, float radius = 1.5f)
+	{
+		const uint32_t rings = std::max(2u, static_cast<uint32_t>(std::sqrt(triangleCount / 4.0f)));
+		const uint32_t sectors = rings * 2;
+		const float pi = 3.14159265358979f;
+
+		MeshData mesh;
+		for (uint32_t r = 0; r <= rings; r++)
+		{
+			for (uint32_t s = 0; s <= sectors; s++)
+			{
+				const float theta = pi * r / rings, phi = 2.0f * pi * s / sectors;
+				const Float3 normal = { std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi) };
+				const float bump = 1.0f + 0.05f * std::sin(8.0f * theta) * std::sin(8.0f * phi);
+				mesh.vertices.push_back({ normal * (radius * bump), normal });
+			}
+		}
+
+		auto addTriangle = [&](uint32_t a, uint32_t b, uint32_t c)
+		{
+			// Front faces clockwise seen from outside
+			const Float3& p0 = mesh.vertices[a].position;
+			const Float3 n = Cross(mesh.vertices[b].position - p0, mesh.vertices[c].position - p0);
+			if (Dot(n, p0 + mesh.vertices[b].position + mesh.vertices[c].position) < 0.0f) std::swap(b, c);
+			mesh.indices.insert(mesh.indices.end(), { a, b, c });
+		};
+
+		for (uint32_t r = 0; r < rings; r++)
+		{
+			for (uint32_t s = 0; s < sectors; s++)
+			{
+				const uint32_t a = r * (sectors + 1) + s, b = a + 1, c = a + sectors + 1, d = c + 1;
+				if (r > 0) addTriangle(a, c, b);
+				if (r + 1 < rings) addTriangle(b, c, d);
+			}
+		}
+		return mesh;
+	}
+
+	// Application::InitializeSceneParams + UpdateCameraMatrices
+	inline SceneConstants DefaultSceneConstants(uint32_t width, uint32_t height)
+	{
+		Float3 eye = { 0.0f, 2.0f, -5.0f };
+		const Float3 at = { 0.0f, 0.0f, 0.0f };
+		const Float3 right = { 1.0f, 0.0f, 0.0f };
+
+		const Float3 direction = Normalize(at - eye);
+		Float3 up = Normalize(Cross(direction, right));
+
+		// Rotate camera around Y axis
+		const Float4x4 rotate = MatrixRotationY(ConvertToRadians(45.0f));
+		eye = TransformPoint(eye, rotate);
+		up = TransformPoint(up, rotate);
+
+		const float aspectRatio = static_cast<float>(width) / static_cast<float>(height);
+		const Float4x4 view = MatrixLookAtLH(eye, at, up);
+		const Float4x4 proj = MatrixPerspectiveFovLH(ConvertToRadians(45.0f), aspectRatio, 1.0f, 125.0f);
+
+		SceneConstants scene;
+		scene.projectionToWorld = Inverse(Multiply(view, proj));
+		scene.cameraPosition = { eye.x, eye.y, eye.z, 1.0f };
+		scene.lightPosition = { 0.0f, 1.8f, -3.0f, 0.0f };
+		scene.lightAmbientColor = { 0.5f, 0.5f, 0.5f, 1.0f };
+		scene.lightDiffuseColor = { 0.5f, 0.0f, 0.3f, 1.0f };
+
+		// One camera ray through the pixel center and a point light, what the CPU benchmarks measure. The app sets
+		// its own sampling (InitializeSceneParams).
+		scene.samplesPerPixel = 1;
+		scene.sampler = 0;				// gSamplerCenter (CpuSampling.h)
+		scene.samplerSeed = 0;
+		scene.lightSize = 0.0f;
+		return scene;
+	}
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+#include "CpuMath.h"
+#include "CpuSimd.h"
+
+/*
+ ------------------------------CPU Shading------------------------------------
+ The C++ side of shaders/Shading.h: the XM* names of its layouts and the HLSL vector types and intrinsics its
+ functions are written with, for two kinds of 'real':
+	float          float2..float4 are the CpuMath.h types and the intrinsics forward to Dot, Normalize, Transform,
+	               so the scalar tracer computes exactly what it did before the functions were shared
+	SimdFloat<W>   ShadingFloat2..4, one SIMD register per component: the functions shade W hits per call
+ The lanes are independent and every operation is the one the scalar instantiation does, in the same order, so
+ lane i of a SIMD call equals the float call on hit i (up to FMA contraction when the compiler fuses one side).
+*/
+
+namespace CpuRt
+{
+	using XMFLOAT3 = Float3;
+	using XMFLOAT4 = Float4;
+	using XMVECTOR = Float4;
+	using XMMATRIX = Float4x4;
+	using UINT = uint32_t;
+
+	template<typename real> struct ShadingFloat2 { real x, y; };
+	template<typename real> struct ShadingFloat3 { real x, y, z; };
+	template<typename real> struct ShadingFloat4 { real x, y, z, w; };
+
+	// float2..float4 of the shared functions
+	template<typename real>
+	struct ShadingTypes
+	{
+		using Float2 = ShadingFloat2<real>;
+		using Float3 = ShadingFloat3<real>;
+		using Float4 = ShadingFloat4<real>;
+	};
+
+	template<>
+	struct ShadingTypes<float>
+	{
+		using Float2 = CpuRt::Float2;
+		using Float3 = CpuRt::Float3;
+		using Float4 = CpuRt::Float4;
+	};
+
+	// Scalars into every lane of 'real', constants and constant buffer values are uniform
+	template<typename real> struct Lanes;
+
+	template<>
+	struct Lanes<float>
+	{
+		static float From(float x) { return x; }
+	};
+
+	template<int W>
+	struct Lanes<SimdFloat<W>>
+	{
+		static SimdFloat<W> From(float x) { return SimdFloat<W>::Broadcast(x); }
+		static const SimdFloat<W>& From(const SimdFloat<W>& x) { return x; }
+	};
+
+	// SimdFloat mixed with float literals, as HLSL scalars mix with vectors. -0 - a is -a including the sign of zero.
+	template<int W> inline SimdFloat<W> operator-(const SimdFloat<W>& a) { return SimdFloat<W>::Broadcast(-0.0f) - a; }
+	template<int W> inline SimdFloat<W> operator+(const SimdFloat<W>& a, float b) { return a + SimdFloat<W>::Broadcast(b); }
+	template<int W> inline SimdFloat<W> operator-(const SimdFloat<W>& a, float b) { return a - SimdFloat<W>::Broadcast(b); }
+	template<int W> inline SimdFloat<W> operator*(const SimdFloat<W>& a, float b) { return a * SimdFloat<W>::Broadcast(b); }
+	template<int W> inline SimdFloat<W> operator/(const SimdFloat<W>& a, float b) { return a / SimdFloat<W>::Broadcast(b); }
+	template<int W> inline SimdFloat<W> operator/(float a, const SimdFloat<W>& b) { return SimdFloat<W>::Broadcast(a) / b; }
+
+	template<typename real> inline ShadingFloat3<real> operator+(const ShadingFloat3<real>& a, const ShadingFloat3<real>& b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+	template<typename real> inline ShadingFloat3<real> operator-(const ShadingFloat3<real>& a, const ShadingFloat3<real>& b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+	template<typename real> inline ShadingFloat3<real> operator*(const ShadingFloat3<real>& a, const real& s) { return { a.x * s, a.y * s, a.z * s }; }
+	template<typename real> inline ShadingFloat3<real> operator*(const real& s, const ShadingFloat3<real>& a) { return a * s; }
+
+	template<typename real> inline ShadingFloat4<real> operator+(const ShadingFloat4<real>& a, const ShadingFloat4<real>& b) { return { a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w }; }
+	template<typename real> inline ShadingFloat4<real> operator*(const ShadingFloat4<real>& a, const ShadingFloat4<real>& b) { return { a.x * b.x, a.y * b.y, a.z * b.z, a.w * b.w }; }
+	template<typename real> inline ShadingFloat4<real> operator*(const ShadingFloat4<real>& a, const real& s) { return { a.x * s, a.y * s, a.z * s, a.w * s }; }
+
+	/*
+	 HLSL intrinsics. normalize keeps Normalize's zero length case (the vector unchanged) in every lane, where HLSL
+	 would return NaN, mul(m, v) is v * m as in Transform.
+	*/
+	inline float dot(const Float3& a, const Float3& b) { return Dot(a, b); }
+	inline Float3 normalize(const Float3& a) { return Normalize(a); }
+	inline float max(float a, float b) { return std::max(a, b); }
+	inline Float4 mul(const Float4x4& m, const Float4& v) { return Transform(v, m); }
+
+	template<int W>
+	inline SimdFloat<W> dot(const ShadingFloat3<SimdFloat<W>>& a, const ShadingFloat3<SimdFloat<W>>& b)
+	{
+		return a.x * b.x + a.y * b.y + a.z * b.z;
+	}
+
+	template<int W>
+	inline ShadingFloat3<SimdFloat<W>> normalize(const ShadingFloat3<SimdFloat<W>>& a)
+	{
+		const SimdFloat<W> length = Sqrt(dot(a, a));
+		const ShadingFloat3<SimdFloat<W>> n = a * (1.0f / length);
+		const uint32_t nonZero = LessMask(SimdFloat<W>::Broadcast(0.0f), length);
+		return { Select(nonZero, n.x, a.x), Select(nonZero, n.y, a.y), Select(nonZero, n.z, a.z) };
+	}
+
+	// std::max(a, b) lane by lane, Max keeps std::max's result for NaN
+	template<int W>
+	inline SimdFloat<W> max(float a, const SimdFloat<W>& b)
+	{
+		return Max(SimdFloat<W>::Broadcast(a), b);
+	}
+
+	template<int W>
+	inline ShadingFloat4<SimdFloat<W>> mul(const Float4x4& m, const ShadingFloat4<SimdFloat<W>>& v)
+	{
+		const auto column = [&](int c)
+		{
+			return v.x * SimdFloat<W>::Broadcast(m.m[0][c]) + v.y * SimdFloat<W>::Broadcast(m.m[1][c]) +
+				v.z * SimdFloat<W>::Broadcast(m.m[2][c]) + v.w * SimdFloat<W>::Broadcast(m.m[3][c]);
+		};
+		return { column(0), column(1), column(2), column(3) };
+	}
+
+	// Layouts and functions, SceneConstantBuffer, Vertex, CameraRayDirection, HitAttribute, CalculateDiffuseLighting, ...
+#define SHADING_CPU
+#include "shaders/Shading.h"
+#undef SHADING_CPU
+}
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CPURT_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#define CPURT_AVX2 1
+#endif
+#if defined(__AVX512F__)
+#define CPURT_AVX512 1
+#endif
+#if defined(CPURT_AVX2) || defined(CPURT_AVX512)
+#include <immintrin.h>
+#endif
+
+/*
+ ------------------------------SIMD------------------------------------
+ W wide float vectors for the CPU tracer's packet and wide node code. SimdFloat<4> is SSE2 on any x86-64 target,
+ SimdFloat<8> AVX2 and SimdFloat<16> AVX-512 when the compiler targets them (/arch:AVX2, /arch:AVX512, -mavx2 -mfma,
+ -mavx512f or -march=native), any other width or target is a plain loop the compiler vectorizes as well as it can, so
+ every width builds everywhere.
+ Comparisons return bitmasks, lane i is bit i.
+*/
+
+namespace CpuRt
+{
+	// Widest packet the build target has registers for
+#if defined(CPURT_AVX512)
+	constexpr int gNativeSimdWidth = 16;
+#elif defined(CPURT_AVX2)
+	constexpr int gNativeSimdWidth = 8;
+#else
+	constexpr int gNativeSimdWidth = 4;
+#endif
+
+	inline uint32_t PopCount(uint32_t x)
+	{
+#ifdef _MSC_VER
+		return __popcnt(x);
+#else
+		return static_cast<uint32_t>(__builtin_popcount(x));
+#endif
+	}
+
+	// x != 0
+	inline uint32_t CountTrailingZeros(uint32_t x)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward(&index, x);
+		return index;
+#else
+		return static_cast<uint32_t>(__builtin_ctz(x));
+#endif
+	}
+
+	// Hint to pull the cache line holding 'address' into all cache levels
+	inline void Prefetch(const void* address)
+	{
+#if defined(CPURT_SSE2)
+		_mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#elif defined(__GNUC__)
+		__builtin_prefetch(address);
+#else
+		(void)address;
+#endif
+	}
+
+	template<int W>
+	struct SimdFloat
+	{
+		float v[W];
+
+		static SimdFloat Broadcast(float x) { SimdFloat r; for (int i = 0; i < W; i++) r.v[i] = x; return r; }
+		static SimdFloat Load(const float* p) { SimdFloat r; for (int i = 0; i < W; i++) r.v[i] = p[i]; return r; }
+		static SimdFloat LoadBytes(const uint8_t* p) { SimdFloat r; for (int i = 0; i < W; i++) r.v[i] = float(p[i]); return r; }
+		void Store(float* p) const { for (int i = 0; i < W; i++) p[i] = v[i]; }
+	};
+
+	template<int W, typename Op>
+	inline SimdFloat<W> SimdMap(const SimdFloat<W>& a, const SimdFloat<W>& b, Op op)
+	{
+		SimdFloat<W> r;
+		for (int i = 0; i < W; i++) r.v[i] = op(a.v[i], b.v[i]);
+		return r;
+	}
+
+	template<int W, typename Op>
+	inline uint32_t SimdCompare(const SimdFloat<W>& a, const SimdFloat<W>& b, Op op)
+	{
+		uint32_t mask = 0;
+		for (int i = 0; i < W; i++) mask |= uint32_t(op(a.v[i], b.v[i])) << i;
+		return mask;
+	}
+
+	template<int W> inline SimdFloat<W> operator+(const SimdFloat<W>& a, const SimdFloat<W>& b) { return SimdMap(a, b, [](float x, float y) { return x + y; }); }
+	template<int W> inline SimdFloat<W> operator-(const SimdFloat<W>& a, const SimdFloat<W>& b) { return SimdMap(a, b, [](float x, float y) { return x - y; }); }
+	template<int W> inline SimdFloat<W> operator*(const SimdFloat<W>& a, const SimdFloat<W>& b) { return SimdMap(a, b, [](float x, float y) { return x * y; }); }
+	template<int W> inline SimdFloat<W> operator/(const SimdFloat<W>& a, const SimdFloat<W>& b) { return SimdMap(a, b, [](float x, float y) { return x / y; }); }
+	template<int W> inline SimdFloat<W> Sqrt(const SimdFloat<W>& a) { return SimdMap(a, a, [](float x, float) { return std::sqrt(x); }); }
+	template<int W> inline SimdFloat<W> Min(const SimdFloat<W>& a, const SimdFloat<W>& b) { return SimdMap(a, b, [](float x, float y) { return std::min(x, y); }); }
+	template<int W> inline SimdFloat<W> Max(const SimdFloat<W>& a, const SimdFloat<W>& b) { return SimdMap(a, b, [](float x, float y) { return std::max(x, y); }); }
+	template<int W> inline uint32_t LessMask(const SimdFloat<W>& a, const SimdFloat<W>& b) { return SimdCompare(a, b, [](float x, float y) { return x < y; }); }
+	template<int W> inline uint32_t LessEqualMask(const SimdFloat<W>& a, const SimdFloat<W>& b) { return SimdCompare(a, b, [](float x, float y) { return x <= y; }); }
+	template<int W> inline uint32_t NotEqualMask(const SimdFloat<W>& a, const SimdFloat<W>& b) { return SimdCompare(a, b, [](float x, float y) { return x != y; }); }
+
+	// mask ? a : b, lane by lane
+	template<int W>
+	inline SimdFloat<W> Select(uint32_t mask, const SimdFloat<W>& a, const SimdFloat<W>& b)
+	{
+		SimdFloat<W> r;
+		for (int i = 0; i < W; i++) r.v[i] = (mask >> i) & 1 ? a.v[i] : b.v[i];
+		return r;
+	}
+
+	template<int W>
+	inline float ReduceMin(const SimdFloat<W>& a)
+	{
+		float r = a.v[0];
+		for (int i = 1; i < W; i++) r = std::min(r, a.v[i]);
+		return r;
+	}
+
+	template<int W>
+	inline float ReduceMax(const SimdFloat<W>& a)
+	{
+		float r = a.v[0];
+		for (int i = 1; i < W; i++) r = std::max(r, a.v[i]);
+		return r;
+	}
+
+#ifdef CPURT_SSE2
+	template<>
+	struct SimdFloat<4>
+	{
+		__m128 v;
+
+		static SimdFloat Broadcast(float x) { return { _mm_set1_ps(x) }; }
+		static SimdFloat Load(const float* p) { return { _mm_loadu_ps(p) }; }
+		static SimdFloat LoadBytes(const uint8_t* p)
+		{
+			int32_t bytes;
+			memcpy(&bytes, p, sizeof(bytes));
+			const __m128i zero = _mm_setzero_si128();
+			return { _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero)) };
+		}
+		void Store(float* p) const { _mm_storeu_ps(p, v); }
+	};
+
+	inline SimdFloat<4> operator+(const SimdFloat<4>& a, const SimdFloat<4>& b) { return { _mm_add_ps(a.v, b.v) }; }
+	inline SimdFloat<4> operator-(const SimdFloat<4>& a, const SimdFloat<4>& b) { return { _mm_sub_ps(a.v, b.v) }; }
+	inline SimdFloat<4> operator*(const SimdFloat<4>& a, const SimdFloat<4>& b) { return { _mm_mul_ps(a.v, b.v) }; }
+	inline SimdFloat<4> operator/(const SimdFloat<4>& a, const SimdFloat<4>& b) { return { _mm_div_ps(a.v, b.v) }; }
+	inline SimdFloat<4> Sqrt(const SimdFloat<4>& a) { return { _mm_sqrt_ps(a.v) }; }
+	// Operands swapped: minps/maxps return their second operand on ties and NaN, std::min/std::max their first
+	inline SimdFloat<4> Min(const SimdFloat<4>& a, const SimdFloat<4>& b) { return { _mm_min_ps(b.v, a.v) }; }
+	inline SimdFloat<4> Max(const SimdFloat<4>& a, const SimdFloat<4>& b) { return { _mm_max_ps(b.v, a.v) }; }
+	inline uint32_t LessMask(const SimdFloat<4>& a, const SimdFloat<4>& b) { return uint32_t(_mm_movemask_ps(_mm_cmplt_ps(a.v, b.v))); }
+	inline uint32_t LessEqualMask(const SimdFloat<4>& a, const SimdFloat<4>& b) { return uint32_t(_mm_movemask_ps(_mm_cmple_ps(a.v, b.v))); }
+	inline uint32_t NotEqualMask(const SimdFloat<4>& a, const SimdFloat<4>& b) { return uint32_t(_mm_movemask_ps(_mm_cmpneq_ps(a.v, b.v))); }
+
+	inline SimdFloat<4> Select(uint32_t mask, const SimdFloat<4>& a, const SimdFloat<4>& b)
+	{
+		const __m128i bits = _mm_setr_epi32(1, 2, 4, 8);
+		const __m128 lanes = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(int(mask)), bits), bits));
+		return { _mm_or_ps(_mm_and_ps(lanes, a.v), _mm_andnot_ps(lanes, b.v)) };
+	}
+
+	inline float ReduceMin(const SimdFloat<4>& a)
+	{
+		const __m128 m = _mm_min_ps(a.v, _mm_movehl_ps(a.v, a.v));
+		return _mm_cvtss_f32(_mm_min_ss(m, _mm_shuffle_ps(m, m, 1)));
+	}
+
+	inline float ReduceMax(const SimdFloat<4>& a)
+	{
+		const __m128 m = _mm_max_ps(a.v, _mm_movehl_ps(a.v, a.v));
+		return _mm_cvtss_f32(_mm_max_ss(m, _mm_shuffle_ps(m, m, 1)));
+	}
+#endif
+
+#ifdef CPURT_AVX2
+	template<>
+	struct SimdFloat<8>
+	{
+		__m256 v;
+
+		static SimdFloat Broadcast(float x) { return { _mm256_set1_ps(x) }; }
+		static SimdFloat Load(const float* p) { return { _mm256_loadu_ps(p) }; }
+		static SimdFloat LoadBytes(const uint8_t* p) { return { _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)))) }; }
+		void Store(float* p) const { _mm256_storeu_ps(p, v); }
+	};
+
+	inline SimdFloat<8> operator+(const SimdFloat<8>& a, const SimdFloat<8>& b) { return { _mm256_add_ps(a.v, b.v) }; }
+	inline SimdFloat<8> operator-(const SimdFloat<8>& a, const SimdFloat<8>& b) { return { _mm256_sub_ps(a.v, b.v) }; }
+	inline SimdFloat<8> operator*(const SimdFloat<8>& a, const SimdFloat<8>& b) { return { _mm256_mul_ps(a.v, b.v) }; }
+	inline SimdFloat<8> operator/(const SimdFloat<8>& a, const SimdFloat<8>& b) { return { _mm256_div_ps(a.v, b.v) }; }
+	inline SimdFloat<8> Sqrt(const SimdFloat<8>& a) { return { _mm256_sqrt_ps(a.v) }; }
+	// Operands swapped: minps/maxps return their second operand on ties and NaN, std::min/std::max their first
+	inline SimdFloat<8> Min(const SimdFloat<8>& a, const SimdFloat<8>& b) { return { _mm256_min_ps(b.v, a.v) }; }
+	inline SimdFloat<8> Max(const SimdFloat<8>& a, const SimdFloat<8>& b) { return { _mm256_max_ps(b.v, a.v) }; }
+	inline uint32_t LessMask(const SimdFloat<8>& a, const SimdFloat<8>& b) { return uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ))); }
+	inline uint32_t LessEqualMask(const SimdFloat<8>& a, const SimdFloat<8>& b) { return uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ))); }
+	inline uint32_t NotEqualMask(const SimdFloat<8>& a, const SimdFloat<8>& b) { return uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_NEQ_UQ))); }
+
+	inline SimdFloat<8> Select(uint32_t mask, const SimdFloat<8>& a, const SimdFloat<8>& b)
+	{
+		const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+		const __m256i lanes = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(int(mask)), bits), bits);
+		return { _mm256_blendv_ps(b.v, a.v, _mm256_castsi256_ps(lanes)) };
+	}
+
+	inline float ReduceMin(const SimdFloat<8>& a)
+	{
+		__m128 m = _mm_min_ps(_mm256_castps256_ps128(a.v), _mm256_extractf128_ps(a.v, 1));
+		m = _mm_min_ps(m, _mm_movehl_ps(m, m));
+		return _mm_cvtss_f32(_mm_min_ss(m, _mm_shuffle_ps(m, m, 1)));
+	}
+
+	inline float ReduceMax(const SimdFloat<8>& a)
+	{
+		__m128 m = _mm_max_ps(_mm256_castps256_ps128(a.v), _mm256_extractf128_ps(a.v, 1));
+		m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+		return _mm_cvtss_f32(_mm_max_ss(m, _mm_shuffle_ps(m, m, 1)));
+	}
+#endif
+
+#ifdef CPURT_AVX512
+	template<>
+	struct SimdFloat<16>
+	{
+		__m512 v;
+
+		static SimdFloat Broadcast(float x) { return { _mm512_set1_ps(x) }; }
+		static SimdFloat Load(const float* p) { return { _mm512_loadu_ps(p) }; }
+		static SimdFloat LoadBytes(const uint8_t* p) { return { _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)))) }; }
+		void Store(float* p) const { _mm512_storeu_ps(p, v); }
+	};
+
+	inline SimdFloat<16> operator+(const SimdFloat<16>& a, const SimdFloat<16>& b) { return { _mm512_add_ps(a.v, b.v) }; }
+	inline SimdFloat<16> operator-(const SimdFloat<16>& a, const SimdFloat<16>& b) { return { _mm512_sub_ps(a.v, b.v) }; }
+	inline SimdFloat<16> operator*(const SimdFloat<16>& a, const SimdFloat<16>& b) { return { _mm512_mul_ps(a.v, b.v) }; }
+	inline SimdFloat<16> operator/(const SimdFloat<16>& a, const SimdFloat<16>& b) { return { _mm512_div_ps(a.v, b.v) }; }
+	inline SimdFloat<16> Sqrt(const SimdFloat<16>& a) { return { _mm512_sqrt_ps(a.v) }; }
+	inline SimdFloat<16> Min(const SimdFloat<16>& a, const SimdFloat<16>& b) { return { _mm512_min_ps(b.v, a.v) }; }
+	inline SimdFloat<16> Max(const SimdFloat<16>& a, const SimdFloat<16>& b) { return { _mm512_max_ps(b.v, a.v) }; }
+	inline uint32_t LessMask(const SimdFloat<16>& a, const SimdFloat<16>& b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ); }
+	inline uint32_t LessEqualMask(const SimdFloat<16>& a, const SimdFloat<16>& b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ); }
+	inline uint32_t NotEqualMask(const SimdFloat<16>& a, const SimdFloat<16>& b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_NEQ_UQ); }
+	inline SimdFloat<16> Select(uint32_t mask, const SimdFloat<16>& a, const SimdFloat<16>& b) { return { _mm512_mask_blend_ps(__mmask16(mask), b.v, a.v) }; }
+
+	inline float ReduceMin(const SimdFloat<16>& a) { return _mm512_reduce_min_ps(a.v); }
+	inline float ReduceMax(const SimdFloat<16>& a) { return _mm512_reduce_max_ps(a.v); }
+#endif
+}
@@ -0,0 +1,2834 @@
+/*
+ Headless entry point for the parts of Kepler that do not need a DXR device: offline asset tooling,
+ to be run on the Linux build farm as well as on Windows.
+
+ Build (no project file needed):
+	g++ -std=c++17 -O2 -pthread Headless.cpp -o kepler-headless
+	(add -mavx2 -mfma, -mavx512f or -march=native for the SIMD packet kernels)
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "tiny_obj_loader.h"
+#include "TextureLoader.h"
+#include "TextureAtlas.h"
+#include "TexturePack.h"
+#include "CpuRayTracer.h"
+#include "BvhBuilder.h"
+#include "Tlas.h"
+#include "BvhPacket.h"
+#include "BvhWide.h"
+#include "BvhLayout.h"
+#include "TriangleBlocks.h"
+#include "TrianglePairs.h"
+#include "RaySort.h"
+#include "PathTracer.h"
+#include "ShadingBatch.h"
+#include "ShaderTable.h"
+#include "VisibilityBuffer.h"
+#include "BvhDiskCache.h"
+#include "BvhPaging.h"
+#include "NumaRender.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+/*
+ ------------------------------Helpers------------------------------------
+*/
+
+static bool WriteTga(const string& path, const TextureInfo& texture)
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file) return false;
+
+	// Uncompressed 32 bit true color, top-left origin
+	uint8_t header[18] = {};
+	header[2] = 2;
+	header[12] = texture.width & 0xFF;
+	header[13] = (texture.width >> 8) & 0xFF;
+	header[14] = texture.height & 0xFF;
+	header[15] = (texture.height >> 8) & 0xFF;
+	header[16] = 32;
+	header[17] = 0x28;
+	fwrite(header, 1, sizeof(header), file);
+
+	vector<uint8_t> row(texture.width * 4);
+	for (int y = 0; y < texture.height; y++)
+	{
+		const uint8_t* src = texture.pixels.data() + size_t(y) * texture.width * texture.stride;
+		for (int x = 0; x < texture.width; x++)
+		{
+			row[x * 4 + 0] = src[x * texture.stride + 2];
+			row[x * 4 + 1] = src[x * texture.stride + 1];
+			row[x * 4 + 2] = src[x * texture.stride + 0];
+			row[x * 4 + 3] = src[x * texture.stride + 3];
+		}
+		fwrite(row.data(), 1, row.size(), file);
+	}
+
+	fclose(file);
+	return true;
+}
+
+// Random 64-256 px textures with a handful of recurring sizes, stands in for a material library
+static vector<TextureInfo> CreateSyntheticTextures(int count)
+{
+	const int commonSizes[] = { 64, 128, 256 };
+	mt19937 rng(1234);
+	vector<TextureInfo> textures(count);
+
+	for (int i = 0; i < count; i++)
+	{
+		TextureInfo& tex = textures[i];
+		if (rng() % 2)
+		{
+			tex.width = commonSizes[rng() % 3];
+			tex.height = tex.width;
+		}
+		else
+		{
+			tex.width = 64 + rng() % 193;
+			tex.height = 64 + rng() % 193;
+		}
+		tex.stride = 4;
+		tex.pixels.resize(size_t(tex.width) * tex.height * 4);
+
+		const uint8_t r = rng() & 0xFF, g = rng() & 0xFF, b = rng() & 0xFF;
+		for (size_t p = 0; p < tex.pixels.size(); p += 4)
+		{
+			tex.pixels[p] = r; tex.pixels[p + 1] = g; tex.pixels[p + 2] = b; tex.pixels[p + 3] = 0xFF;
+		}
+	}
+	return textures;
+}
+
+static double ElapsedMs(chrono::high_resolution_clock::time_point start)
+{
+	return chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+}
+
+// RTOutput is DXGI_FORMAT_R8G8B8A8_UNORM: saturate and round to nearest
+static TextureInfo ToTexture(const vector<CpuRt::Float4>& pixels, uint32_t width, uint32_t height)
+{
+	auto unorm = [](float value) { return static_cast<uint8_t>(min(max(value, 0.0f), 1.0f) * 255.0f + 0.5f); };
+
+	TextureInfo texture;
+	texture.width = int(width);
+	texture.height = int(height);
+	texture.stride = 4;
+	texture.pixels.resize(pixels.size() * 4);
+	for (size_t i = 0; i < pixels.size(); i++)
+	{
+		texture.pixels[i * 4 + 0] = unorm(pixels[i].x);
+		texture.pixels[i * 4 + 1] = unorm(pixels[i].y);
+		texture.pixels[i * 4 + 2] = unorm(pixels[i].z);
+		texture.pixels[i * 4 + 3] = unorm(pixels[i].w);
+	}
+	return texture;
+}
+
+struct MaterialTexture
+{
+	string name;		// path as written in the .mtl
+	string filepath;	// where to load it from
+	int resolution;		// -texres, 0 for full size
+};
+
+// Diffuse textures of every material, .mtl paths are relative to 'root' (the app's working directory)
+static vector<MaterialTexture> CollectMaterialTextures(const vector<string>& mtlPaths, const string& root)
+{
+	vector<MaterialTexture> result;
+	for (const string& mtlPath : mtlPaths)
+	{
+		ifstream stream(mtlPath);
+		if (!stream)
+		{
+			throw runtime_error("Error: failed to open " + mtlPath);
+		}
+
+		map<string, int> materialMap;
+		vector<tinyobj::material_t> materials;
+		string warn, err;
+		tinyobj::LoadMtl(&materialMap, &materials, &stream, &warn, &err);
+
+		for (const tinyobj::material_t& material : materials)
+		{
+			if (material.diffuse_texname.empty()) continue;
+
+			const string name = Utility::NormalizeTexturePath(material.diffuse_texname);
+			bool duplicate = false;
+			for (const MaterialTexture& texture : result) duplicate |= (texture.name == name);
+			if (duplicate) continue;
+
+			string filepath = material.diffuse_texname;
+			replace(filepath.begin(), filepath.end(), '\\', '/');
+			result.push_back({ name, root.empty() ? filepath : root + "/" + filepath, max(material.diffuse_texopt.texture_resolution, 0) });
+		}
+	}
+	return result;
+}
+
+// Drops the file from the page cache so the next read comes from disk, only on Linux
+static void EvictFromPageCache(const string& path)
+{
+#ifdef __linux__
+	const int file = open(path.c_str(), O_RDONLY);
+	if (file < 0) return;
+	fdatasync(file);
+	posix_fadvise(file, 0, 0, POSIX_FADV_DONTNEED);
+	close(file);
+#else
+	(void)path;
+#endif
+}
+
+/*
+ ------------------------------Commands------------------------------------
+*/
+
+// atlas [-page N] [-padding N] [-mips N] [-out prefix] [-synthetic N] textures...
+static int RunAtlas(int argc, char** argv)
+{
+	AtlasSettings settings;
+	string outPrefix;
+	vector<string> paths;
+	int syntheticCount = 0;
+
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-page") && i + 1 < argc) settings.pageSize = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-padding") && i + 1 < argc) settings.padding = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-mips") && i + 1 < argc) settings.atlasMipLevels = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-out") && i + 1 < argc) outPrefix = argv[++i];
+		else if (!strcmp(argv[i], "-synthetic") && i + 1 < argc) syntheticCount = atoi(argv[++i]);
+		else paths.push_back(argv[i]);
+	}
+
+	vector<TextureInfo> textures = CreateSyntheticTextures(syntheticCount);
+	for (const string& path : paths)
+	{
+		textures.push_back(Utility::LoadTexture(path));
+	}
+
+	TextureAtlas atlas = Utility::PackTextures(textures, settings);
+	Utility::PrintAtlasStats(atlas.stats);
+
+	if (outPrefix.empty()) return 0;
+
+	// One TGA per slice and mip plus the remap table: name placement group slice scaleU scaleV offsetU offsetV
+	for (size_t g = 0; g < atlas.groups.size(); g++)
+	{
+		for (size_t s = 0; s < atlas.groups[g].slices.size(); s++)
+		{
+			const string slicePrefix = outPrefix + "_g" + to_string(g) + "_s" + to_string(s);
+			WriteTga(slicePrefix + ".tga", atlas.groups[g].slices[s]);
+			for (size_t m = 0; m < atlas.groups[g].mips[s].size(); m++)
+			{
+				WriteTga(slicePrefix + "_m" + to_string(m + 1) + ".tga", atlas.groups[g].mips[s][m]);
+			}
+		}
+	}
+
+	FILE* table = fopen((outPrefix + ".atlas.txt").c_str(), "w");
+	if (!table)
+	{
+		fprintf(stderr, "Failed to write %s.atlas.txt\n", outPrefix.c_str());
+		return 1;
+	}
+
+	const char* placementNames[] = { "standalone", "array", "atlas" };
+	for (size_t i = 0; i < atlas.remap.size(); i++)
+	{
+		const AtlasRemap& remap = atlas.remap[i];
+		const bool synthetic = i < size_t(syntheticCount);
+		const string name = synthetic ? "synthetic" + to_string(i) : paths[i - syntheticCount];
+		fprintf(table, "%s %s %d %d %.8f %.8f %.8f %.8f\n", name.c_str(), placementNames[uint32_t(remap.placement)],
+			remap.group, remap.slice, remap.uvScale[0], remap.uvScale[1], remap.uvOffset[0], remap.uvOffset[1]);
+	}
+	fclose(table);
+	return 0;
+}
+
+// jpeg [-iterations N] files... : full stb_image decode + box filter vs DCT scaled decode at 1/2, 1/4, 1/8
+static int RunJpegBenchmark(int argc, char** argv)
+{
+	int iterations = 5;
+	vector<string> paths;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-iterations") && i + 1 < argc) iterations = max(1, atoi(argv[++i]));
+		else paths.push_back(argv[i]);
+	}
+
+	printf("%u threads\n", ThreadPool::Default().ThreadCount());
+	for (const string& path : paths)
+	{
+		const vector<uint8_t> file = Utility::ReadBinaryFile(path);
+		int width = 0, height = 0;
+		if (!Jpeg::ReadSize(file.data(), file.size(), width, height))
+		{
+			printf("%s: not a supported JPEG\n", path.c_str());
+			continue;
+		}
+		printf("%s %dx%d\n", path.c_str(), width, height);
+
+		for (int scale = 2; scale <= 8; scale *= 2)
+		{
+			double fullMs = 0.0, scaledMs = 0.0;
+			TextureInfo full, scaled;
+			for (int i = 0; i < iterations; i++)
+			{
+				auto start = chrono::high_resolution_clock::now();
+				full = TextureInfo();
+				int channels = 0;
+				uint8_t* pixels = stbi_load_from_memory(file.data(), int(file.size()), &full.width, &full.height, &channels, 4);
+				full.stride = 4;
+				full.pixels.assign(pixels, pixels + size_t(full.width) * full.height * 4);
+				stbi_image_free(pixels);
+				Utility::DownsampleTexture(full, scale);
+				fullMs += ElapsedMs(start);
+
+				start = chrono::high_resolution_clock::now();
+				if (!Jpeg::DecodeScaled(file.data(), file.size(), scale, scaled.pixels, scaled.width, scaled.height))
+				{
+					printf("  1/%d: unsupported stream\n", scale);
+					break;
+				}
+				scaledMs += ElapsedMs(start);
+			}
+
+			// Working set: full decode holds the whole RGBA image, the scaled path K*K coefficients + its planes per block
+			const double blocks = ceil(width / 8.0) * ceil(height / 8.0);
+			const double fullMB = (double(width) * height * 4) / (1024.0 * 1024.0);
+			const double k = 8.0 / scale;
+			const double scaledMB = (blocks * 3 * (k * k * 3) + double(scaled.width) * scaled.height * 4) / (1024.0 * 1024.0);
+
+			double error = 0.0;
+			for (size_t i = 0; i < scaled.pixels.size() && scaled.pixels.size() == full.pixels.size(); i++)
+			{
+				error += abs(int(scaled.pixels[i]) - int(full.pixels[i]));
+			}
+
+			printf("  1/%d -> %dx%d: full decode + box %.2f ms (%.1f MB), DCT scaled %.2f ms (~%.1f MB), speedup %.1fx, mean abs diff %.2f\n",
+				scale, scaled.width, scaled.height, fullMs / iterations, fullMB, scaledMs / iterations, scaledMB,
+				fullMs / max(scaledMs, 1e-6), error / max<size_t>(scaled.pixels.size(), 1));
+		}
+	}
+	return 0;
+}
+
+// pack [-out file] [-root dir] [-page N] materials.mtl... : every diffuse texture of the materials into one texture pack
+static int RunPack(int argc, char** argv)
+{
+	string outPath = "textures.kpack", root;
+	uint32_t pageSize = gTexturePackPageSize;
+	vector<string> mtlPaths;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-out") && i + 1 < argc) outPath = argv[++i];
+		else if (!strcmp(argv[i], "-root") && i + 1 < argc) root = argv[++i];
+		else if (!strcmp(argv[i], "-page") && i + 1 < argc) pageSize = uint32_t(atoi(argv[++i]));
+		else mtlPaths.push_back(argv[i]);
+	}
+
+	const vector<MaterialTexture> materialTextures = CollectMaterialTextures(mtlPaths, root);
+	vector<TextureInfo> textures(materialTextures.size());
+	vector<bool> loaded(materialTextures.size(), false);
+	ThreadPool::Default().ParallelFor(materialTextures.size(), 1, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			try
+			{
+				textures[i] = Utility::LoadTexture(materialTextures[i].filepath, materialTextures[i].resolution);
+				loaded[i] = true;
+			}
+			catch (const exception&) {}
+		}
+	});
+
+	vector<string> names;
+	vector<TextureInfo> packed;
+	for (size_t i = 0; i < materialTextures.size(); i++)
+	{
+		if (!loaded[i])
+		{
+			printf("skipping %s: failed to load %s\n", materialTextures[i].name.c_str(), materialTextures[i].filepath.c_str());
+			continue;
+		}
+		names.push_back(materialTextures[i].name);
+		packed.push_back(move(textures[i]));
+	}
+
+	const TexturePackStats stats = Utility::WriteTexturePack(outPath, names, packed, pageSize);
+	printf("%s: %zu textures, %zu mips, %.2f MB texels, %.2f MB file (%.1f%% padding)\n", outPath.c_str(), stats.textures, stats.mips,
+		stats.payloadBytes / (1024.0 * 1024.0), stats.fileBytes / (1024.0 * 1024.0), 100.0 * (1.0 - double(stats.payloadBytes) / max<uint64_t>(stats.fileBytes, 1)));
+	return 0;
+}
+
+// ttff [-first N] [-root dir] [-iterations N] [-warm] pack materials.mtl... : time until every texture has the mips for a first frame,
+// loose files (decode + mip chain) vs the texture pack (map + copy the coarse mips), cold page cache unless -warm
+static int RunTimeToFirstFrame(int argc, char** argv)
+{
+	uint32_t firstFrameSize = 128;
+	int iterations = 3;
+	bool warm = false;
+	string root, packPath;
+	vector<string> mtlPaths;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-first") && i + 1 < argc) firstFrameSize = uint32_t(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-root") && i + 1 < argc) root = argv[++i];
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc) iterations = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-warm")) warm = true;
+		else if (packPath.empty()) packPath = argv[i];
+		else mtlPaths.push_back(argv[i]);
+	}
+
+	// Only what made it into the pack is compared
+	vector<MaterialTexture> materialTextures;
+	{
+		TexturePack pack;
+		pack.Open(packPath);
+		for (const MaterialTexture& texture : CollectMaterialTextures(mtlPaths, root))
+		{
+			if (pack.Find(texture.name) >= 0) materialTextures.push_back(texture);
+			else printf("skipping %s: not in %s\n", texture.name.c_str(), packPath.c_str());
+		}
+	}
+
+	ThreadPool& pool = ThreadPool::Default();
+	printf("%zu textures, first frame mips up to %u px, %s page cache, %u threads\n", materialTextures.size(), firstFrameSize, warm ? "warm" : "cold", pool.ThreadCount());
+
+	double filesMs = 0.0, packMs = 0.0, streamMs = 0.0;
+	uint64_t filesBytes = 0, firstFrameBytes = 0, streamedBytes = 0, packBytes = 0;
+	for (int iteration = 0; iteration < iterations; iteration++)
+	{
+		// Loose files: every texture decoded at its -texres, first frame mips generated from it
+		if (!warm) for (const MaterialTexture& texture : materialTextures) EvictFromPageCache(texture.filepath);
+		vector<uint64_t> bytes(materialTextures.size(), 0);
+		auto start = chrono::high_resolution_clock::now();
+		pool.ParallelFor(materialTextures.size(), 1, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				const TextureInfo texture = Utility::LoadTexture(materialTextures[i].filepath, materialTextures[i].resolution);
+				for (const TextureInfo& mip : Utility::GenerateMipChain(texture))
+				{
+					if (uint32_t(max(mip.width, mip.height)) <= firstFrameSize || (mip.width == 1 && mip.height == 1)) bytes[i] += mip.pixels.size();
+				}
+			}
+		});
+		filesMs += ElapsedMs(start);
+		filesBytes = 0;
+		for (uint64_t b : bytes) filesBytes += b;
+
+		// Texture pack: map, look up, copy the first frame mips to where an upload buffer would be
+		if (!warm) EvictFromPageCache(packPath);
+		start = chrono::high_resolution_clock::now();
+		TexturePack pack;
+		pack.Open(packPath);
+		vector<MipStreamRequest> topMips;
+		for (const MaterialTexture& texture : materialTextures)
+		{
+			const int index = pack.Find(texture.name);
+			topMips.push_back({ uint32_t(index), Utility::FirstMipForResolution(pack.Texture(uint32_t(index)), texture.resolution) });
+		}
+
+		TextureStreamer streamer;
+		streamer.Schedule(pack, topMips, firstFrameSize);
+		vector<uint8_t> upload;
+		firstFrameBytes = 0;
+		for (const MipStreamRequest& request : streamer.FirstFrame())
+		{
+			const TexturePackMip& mip = pack.Mip(pack.Texture(request.texture), request.mip);
+			upload.resize(mip.size);
+			memcpy(upload.data(), pack.Data(mip), mip.size);
+			firstFrameBytes += mip.size;
+		}
+		packMs += ElapsedMs(start);
+
+		// Everything finer, streamed after the first frame
+		start = chrono::high_resolution_clock::now();
+		streamedBytes = 0;
+		MipStreamRequest request;
+		while (streamer.Next(request))
+		{
+			const TexturePackMip& mip = pack.Mip(pack.Texture(request.texture), request.mip);
+			upload.resize(mip.size);
+			memcpy(upload.data(), pack.Data(mip), mip.size);
+			pack.Release(mip);
+			streamedBytes += mip.size;
+		}
+		streamMs += ElapsedMs(start);
+		packBytes = pack.FileSize();
+	}
+
+	printf("  loose files : first frame %.2f ms (%.2f MB of first frame mips, full decode of every texture)\n", filesMs / iterations, filesBytes / (1024.0 * 1024.0));
+	printf("  texture pack: first frame %.2f ms (%.2f MB touched of a %.2f MB pack), remaining mips streamed in %.2f ms (%.2f MB)\n",
+		packMs / iterations, firstFrameBytes / (1024.0 * 1024.0), packBytes / (1024.0 * 1024.0), streamMs / iterations, streamedBytes / (1024.0 * 1024.0));
+	printf("  speedup %.1fx\n", filesMs / max(packMs, 1e-6));
+	return 0;
+}
+
+// trace [-width N] [-height N] [-tile N] [-iterations N] [-obj file] [-out file.tga] : CPU reference render of the app's scene
+static int RunTrace(int argc, char** argv)
+{
+	CpuRt::RenderSettings settings;
+	int iterations = 3;
+	string objPath, outPath = "trace.tga";
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-width") && i + 1 < argc) settings.width = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-height") && i + 1 < argc) settings.height = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-tile") && i + 1 < argc) settings.tileSize = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc) iterations = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-obj") && i + 1 < argc) objPath = argv[++i];
+		else if (!strcmp(argv[i], "-out") && i + 1 < argc) outPath = argv[++i];
+	}
+
+	// The app renders the cube unless a mesh is given
+	const CpuRt::MeshData mesh = objPath.empty() ? CpuRt::LoadCubeMesh() : CpuRt::LoadObjMesh(objPath);
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(settings.width, settings.height);
+	const CpuRt::TriangleList accel(mesh);
+
+	vector<CpuRt::Float4> output;
+	double milliseconds = 0.0;
+	uint64_t rays = 0;
+	for (int i = 0; i < iterations; i++)
+	{
+		const CpuRt::RenderStats stats = CpuRt::Render(accel, mesh, scene, settings, output);
+		milliseconds += stats.milliseconds;
+		rays += stats.rays;
+	}
+
+	printf("%ux%u, %zu triangles, %u threads: %.2f ms/frame, ~Million Primary Rays/s: %.2f\n", settings.width, settings.height, mesh.TriangleCount(),
+		ThreadPool::Default().ThreadCount(), milliseconds / iterations, rays / (milliseconds * 1000.0));
+
+	if (!WriteTga(outPath, ToTexture(output, settings.width, settings.height)))
+	{
+		fprintf(stderr, "Failed to write %s\n", outPath.c_str());
+		return 1;
+	}
+	return 0;
+}
+
+// "a,b,c"
+static vector<string> SplitList(const char* list)
+{
+	vector<string> items;
+	for (const char* p = list; *p; )
+	{
+		const char* end = p;
+		while (*end && *end != ',') end++;
+		items.emplace_back(p, end);
+		p = *end ? end + 1 : end;
+	}
+	return items;
+}
+
+// Comma separated thread counts, "1,8,32", 0 is every hardware thread
+static vector<unsigned> ParseThreadCounts(const char* list)
+{
+	vector<unsigned> counts;
+	for (const string& item : SplitList(list)) counts.push_back(unsigned(atoi(item.c_str())));
+	return counts;
+}
+
+static CpuRt::MeshData LoadBenchmarkMesh(const string& objPath, uint32_t triangles)
+{
+	return objPath.empty() ? CpuRt::CreateSphereMesh(triangles) : CpuRt::LoadObjMesh(objPath);
+}
+
+// bvh [-obj file | -triangles N] [-builder sah,lbvh,sbvh] [-threads 1,2,...] [-iterations N] [-bins N] [-leaf N] [-morton 30|63] [-treelets N] [-validate]
+// : build throughput and trace speed of every builder, to pick one per mesh
+static int RunBvhBenchmark(int argc, char** argv)
+{
+	CpuRt::BvhSettings settings;
+	CpuRt::RenderSettings render;
+	string objPath;
+	uint32_t triangles = 1000000;
+	vector<unsigned> threadCounts = { 0 };
+	vector<CpuRt::BvhBuildMode> builders = { CpuRt::BvhBuildMode::Sah, CpuRt::BvhBuildMode::Lbvh };
+	int iterations = 3;
+	bool validate = false;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-obj") && i + 1 < argc) objPath = argv[++i];
+		else if (!strcmp(argv[i], "-triangles") && i + 1 < argc) triangles = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threadCounts = ParseThreadCounts(argv[++i]);
+		else if (!strcmp(argv[i], "-builder") && i + 1 < argc)
+		{
+			builders.clear();
+			for (const string& name : SplitList(argv[++i])) builders.push_back(CpuRt::ParseBvhBuildMode(name.c_str()));
+		}
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc) iterations = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-bins") && i + 1 < argc) settings.binCount = uint32_t(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-leaf") && i + 1 < argc) settings.maxLeafSize = uint32_t(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-morton") && i + 1 < argc) settings.mortonBits = uint32_t(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-treelets") && i + 1 < argc) settings.treeletRounds = uint32_t(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-validate")) validate = true;
+	}
+
+	const CpuRt::MeshData mesh = LoadBenchmarkMesh(objPath, triangles);
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+	printf("%zu triangles\n", mesh.TriangleCount());
+
+	for (CpuRt::BvhBuildMode builder : builders)
+	{
+		printf("%s:\n", CpuRt::BvhBuildModeName(builder));
+		double baseline = 0.0;
+		for (unsigned threads : threadCounts)
+		{
+			ThreadPool pool(threads);
+			CpuRt::Bvh bvh;
+			double milliseconds = 0.0;
+			for (int i = 0; i < iterations; i++)
+			{
+				bvh = CpuRt::BuildBvh(mesh, builder, settings, pool);
+				milliseconds += bvh.Stats().buildMilliseconds;
+			}
+			milliseconds /= iterations;
+			if (baseline == 0.0) baseline = milliseconds;
+
+			const CpuRt::BvhStats& stats = bvh.Stats();
+			vector<CpuRt::Float4> output;
+			const CpuRt::RenderStats trace = CpuRt::Render(bvh, mesh, scene, render, output, pool);
+			printf("  %2u threads: build %.2f ms, %.2f Mtris/s, scaling %.2fx | %zu nodes, %zu leaves, depth %u, SAH cost %.2f | trace %.2f MRays/s\n",
+				pool.ThreadCount(), milliseconds, mesh.TriangleCount() / (milliseconds * 1000.0), baseline / milliseconds,
+				stats.nodes, stats.leaves, stats.maxDepth, stats.sahCost, trace.MRaysPerSecond());
+
+			if (validate)
+			{
+				// Same image as the brute force reference, up to ties between triangles at equal distance.
+				// At a fifth of the resolution, brute force over a big mesh takes long enough as it is.
+				CpuRt::RenderSettings small = render;
+				small.width = render.width / 5;
+				small.height = render.height / 5;
+				const CpuRt::SceneConstants smallScene = CpuRt::DefaultSceneConstants(small.width, small.height);
+				vector<CpuRt::Float4> reference;
+				CpuRt::Render(bvh, mesh, smallScene, small, output, pool);
+				CpuRt::Render(CpuRt::TriangleList(mesh), mesh, smallScene, small, reference, pool);
+				size_t mismatches = 0;
+				for (size_t p = 0; p < output.size(); p++)
+				{
+					mismatches += memcmp(&output[p], &reference[p], sizeof(CpuRt::Float4)) != 0;
+				}
+				printf("  validate: %zu of %zu pixels differ from the brute force render\n", mismatches, output.size());
+			}
+		}
+	}
+	return 0;
+}
+
+// Twists 'base' around the Y axis by 'twist' radians per unit of height, the kind of deformation that wrecks a refitted tree
+static void TwistMesh(const CpuRt::MeshData& base, float twist, CpuRt::MeshData& mesh)
+{
+	mesh.indices = base.indices;
+	mesh.vertices.resize(base.vertices.size());
+	for (size_t i = 0; i < base.vertices.size(); i++)
+	{
+		const CpuRt::Float4x4 rotate = CpuRt::MatrixRotationY(twist * base.vertices[i].position.y);
+		mesh.vertices[i].position = CpuRt::TransformPoint(base.vertices[i].position, rotate);
+		mesh.vertices[i].normal = CpuRt::Transform({ base.vertices[i].normal.x, base.vertices[i].normal.y, base.vertices[i].normal.z, 0.0f }, rotate).xyz();
+	}
+}
+
+// refit [-obj file | -triangles N] [-frames N] [-twist radians] [-builder sah|lbvh|sbvh] [-threshold X] [-threads N]
+// : refit against rebuild every frame of a deforming mesh
+static int RunRefitBenchmark(int argc, char** argv)
+{
+	CpuRt::BvhSettings settings;
+	CpuRt::BvhBuildMode builder = CpuRt::BvhBuildMode::Sah;
+	string objPath;
+	uint32_t triangles = 250000;
+	int frames = 20;
+	float twistPerFrame = 0.02f;
+	unsigned threads = 0;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-obj") && i + 1 < argc) objPath = argv[++i];
+		else if (!strcmp(argv[i], "-triangles") && i + 1 < argc) triangles = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-frames") && i + 1 < argc) frames = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-twist") && i + 1 < argc) twistPerFrame = float(atof(argv[++i]));
+		else if (!strcmp(argv[i], "-builder") && i + 1 < argc) builder = CpuRt::ParseBvhBuildMode(argv[++i]);
+		else if (!strcmp(argv[i], "-threshold") && i + 1 < argc) settings.rebuildThreshold = float(atof(argv[++i]));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threads = unsigned(atoi(argv[++i]));
+	}
+
+	ThreadPool pool(threads);
+	const CpuRt::MeshData base = LoadBenchmarkMesh(objPath, triangles);
+	CpuRt::MeshData mesh = base;
+	CpuRt::RenderSettings render;
+	render.width /= 4;
+	render.height /= 4;
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+	printf("%zu triangles, %s, %u threads, rebuild past %.2fx SAH cost\n", mesh.TriangleCount(), CpuRt::BvhBuildModeName(builder),
+		pool.ThreadCount(), settings.rebuildThreshold);
+
+	CpuRt::Bvh bvh = CpuRt::BuildBvh(mesh, builder, settings, pool);
+	double updateMilliseconds = 0.0, rebuildMilliseconds = 0.0;
+	int rebuilds = 0;
+	for (int frame = 1; frame <= frames; frame++)
+	{
+		TwistMesh(base, twistPerFrame * frame, mesh);
+
+		auto start = chrono::high_resolution_clock::now();
+		const bool rebuilt = CpuRt::UpdateBvh(bvh, mesh, builder, settings, pool);
+		const double update = ElapsedMs(start);
+		const float degradation = bvh.SahDegradation();
+
+		// What a rebuild every frame would cost, and the tree quality it would give
+		const CpuRt::Bvh fresh = CpuRt::BuildBvh(mesh, builder, settings, pool);
+		updateMilliseconds += update;
+		rebuildMilliseconds += fresh.Stats().buildMilliseconds;
+		rebuilds += rebuilt;
+
+		vector<CpuRt::Float4> output;
+		const double refitRays = CpuRt::Render(bvh, mesh, scene, render, output, pool).MRaysPerSecond();
+		const double freshRays = CpuRt::Render(fresh, mesh, scene, render, output, pool).MRaysPerSecond();
+		printf("  frame %3d: %s %7.2f ms (rebuild %7.2f ms) | SAH cost %.2f, %.2fx built, %.2fx fresh | trace %.2f MRays/s (fresh %.2f)\n",
+			frame, rebuilt ? "rebuild" : "refit  ", update, fresh.Stats().buildMilliseconds, bvh.Stats().sahCost, degradation,
+			bvh.Stats().sahCost / fresh.Stats().sahCost, refitRays, freshRays);
+	}
+
+	printf("average update %.2f ms, %d rebuilds in %d frames | rebuilding every frame %.2f ms\n",
+		updateMilliseconds / frames, rebuilds, frames, rebuildMilliseconds / frames);
+	return 0;
+}
+
+// 'count' instances of BLAS 0 scattered through the cube [-2, 2]^3 the default camera looks at, randomly rotated
+// about Y and non-uniformly scaled so the full transform path is exercised
+static vector<CpuRt::InstanceDesc> CreateScatteredInstances(uint32_t count)
+{
+	mt19937 rng(4321);
+	uniform_real_distribution<float> position(-2.0f, 2.0f), angle(0.0f, 6.2831853f), stretch(0.7f, 1.3f);
+	const float size = 1.2f / cbrt(float(count));
+
+	vector<CpuRt::InstanceDesc> instances(count);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const float c = cos(angle(rng)), sn = sin(angle(rng));
+		const float sx = size * stretch(rng), sy = size * stretch(rng), sz = size * stretch(rng);
+		CpuRt::InstanceDesc& instance = instances[i];
+		instance.transform = { { { c * sx, 0.0f, sn * sz, position(rng) }, { 0.0f, sy, 0.0f, position(rng) }, { -sn * sx, 0.0f, c * sz, position(rng) } } };
+		instance.instanceID = i;
+		instance.instanceMask = 0xFF;
+		instance.instanceContributionToHitGroupIndex = 0;
+		instance.flags = CpuRt::InstanceFlagNone;
+		instance.accelerationStructure = 0;
+	}
+	return instances;
+}
+
+// Every instance's triangles in world space, one mesh: the single level reference for the two-level structure
+static CpuRt::MeshData FlattenInstances(const CpuRt::MeshData& blas, const vector<CpuRt::InstanceDesc>& instances)
+{
+	CpuRt::MeshData mesh;
+	mesh.vertices.reserve(blas.vertices.size() * instances.size());
+	mesh.indices.reserve(blas.indices.size() * instances.size());
+	for (const CpuRt::InstanceDesc& instance : instances)
+	{
+		const uint32_t base = uint32_t(mesh.vertices.size());
+		for (const CpuRt::Vertex& v : blas.vertices)
+		{
+			mesh.vertices.push_back({ CpuRt::TransformPoint(instance.transform, v.position), CpuRt::TransformNormal(instance.transform, v.normal) });
+		}
+		for (uint32_t index : blas.indices) mesh.indices.push_back(base + index);
+	}
+	return mesh;
+}
+
+// Pixels of two renders whose color differs by more than 'tolerance' in any channel
+static size_t CountMismatches(const vector<CpuRt::Float4>& a, const vector<CpuRt::Float4>& b, float tolerance)
+{
+	size_t mismatches = 0;
+	for (size_t p = 0; p < a.size(); p++)
+	{
+		const float difference = max(max(fabs(a[p].x - b[p].x), fabs(a[p].y - b[p].y)), fabs(a[p].z - b[p].z));
+		mismatches += difference > tolerance;
+	}
+	return mismatches;
+}
+
+// tlas [-instances N] [-triangles N] [-iterations N] [-threads N] [-validate] [-out file.tga]
+// : top level build time over instances of one BLAS, and the render through it
+static int RunTlasBenchmark(int argc, char** argv)
+{
+	uint32_t instanceCount = 100000;
+	uint32_t triangles = 1000;
+	int iterations = 10;
+	unsigned threads = 0;
+	bool validate = false;
+	string outPath;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-instances") && i + 1 < argc) instanceCount = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-triangles") && i + 1 < argc) triangles = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc) iterations = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threads = unsigned(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-validate")) validate = true;
+		else if (!strcmp(argv[i], "-out") && i + 1 < argc) outPath = argv[++i];
+	}
+
+	ThreadPool pool(threads);
+	const CpuRt::MeshData mesh = CpuRt::CreateSphereMesh(triangles);
+	const CpuRt::Bvh blas = CpuRt::BuildSahBvh(mesh, {}, pool);
+	const vector<CpuRt::InstanceDesc> instances = CreateScatteredInstances(instanceCount);
+
+	CpuRt::Tlas tlas;
+	tlas.Build(instances, { &blas }, pool);
+	double milliseconds = 0.0;
+	for (int i = 0; i < iterations; i++)
+	{
+		tlas.Build(instances, { &blas }, pool);
+		milliseconds += tlas.Stats().buildMilliseconds;
+	}
+
+	CpuRt::RenderSettings render;
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+	vector<CpuRt::Float4> output;
+	const CpuRt::RenderStats trace = CpuRt::Render(tlas, mesh, scene, render, output, pool);
+	printf("%u instances of %zu triangles, %u threads: top level build %.3f ms | trace %.2f MRays/s\n", instanceCount, mesh.TriangleCount(),
+		pool.ThreadCount(), milliseconds / iterations, trace.MRaysPerSecond());
+
+	if (validate)
+	{
+		// Against one SAH BVH over the instances' world space triangles. Not bit exact: the TLAS intersects in
+		// object space, so hits near triangle edges can go either way.
+		const CpuRt::MeshData world = FlattenInstances(mesh, instances);
+		const CpuRt::Bvh reference = CpuRt::BuildSahBvh(world, {}, pool);
+		vector<CpuRt::Float4> expected;
+		CpuRt::Render(reference, world, scene, render, expected, pool);
+		printf("validate: %zu of %zu pixels differ from the flattened scene by more than 1/255\n", CountMismatches(output, expected, 1.0f / 255.0f), output.size());
+	}
+
+	if (!outPath.empty() && !WriteTga(outPath, ToTexture(output, render.width, render.height)))
+	{
+		fprintf(stderr, "Failed to write %s\n", outPath.c_str());
+		return 1;
+	}
+	return 0;
+}
+
+template<int W>
+static CpuRt::RenderStats BenchmarkPackets(const CpuRt::Bvh& bvh, const CpuRt::MeshData& mesh, const CpuRt::SceneConstants& scene,
+	const CpuRt::RenderSettings& render, bool intervalCulling, int iterations, ThreadPool& pool, vector<CpuRt::Float4>& output)
+{
+	CpuRt::RenderStats total;
+	for (int i = 0; i < iterations; i++)
+	{
+		const CpuRt::RenderStats stats = CpuRt::RenderPackets<W>(bvh, mesh, scene, render, output, intervalCulling, pool);
+		total.milliseconds += stats.milliseconds;
+		total.rays += stats.rays;
+	}
+	return total;
+}
+
+// packet [-obj file | -triangles N] [-lanes 8,16] [-width N] [-height N] [-iterations N] [-threads N] [-validate]
+// : camera rays one at a time vs W wide packets through the same SAH BVH, without and with interval culling
+static int RunPacketBenchmark(int argc, char** argv)
+{
+	CpuRt::RenderSettings render;
+	string objPath;
+	uint32_t triangles = 100000;
+	vector<int> widths = { 8, 16 };
+	int iterations = 3;
+	unsigned threads = 0;
+	bool validate = false;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-obj") && i + 1 < argc) objPath = argv[++i];
+		else if (!strcmp(argv[i], "-triangles") && i + 1 < argc) triangles = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-lanes") && i + 1 < argc)
+		{
+			widths.clear();
+			for (const string& item : SplitList(argv[++i])) widths.push_back(atoi(item.c_str()));
+		}
+		else if (!strcmp(argv[i], "-width") && i + 1 < argc) render.width = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-height") && i + 1 < argc) render.height = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc) iterations = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threads = unsigned(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-validate")) validate = true;
+	}
+
+	ThreadPool pool(threads);
+	const CpuRt::MeshData mesh = LoadBenchmarkMesh(objPath, triangles);
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+	const CpuRt::Bvh bvh = CpuRt::BuildSahBvh(mesh, {}, pool);
+	printf("%zu triangles, %ux%u, %u threads, native SIMD width %d\n", mesh.TriangleCount(), render.width, render.height, pool.ThreadCount(), CpuRt::gNativeSimdWidth);
+
+	vector<CpuRt::Float4> reference, output;
+	CpuRt::RenderStats scalar;
+	for (int i = 0; i < iterations; i++)
+	{
+		const CpuRt::RenderStats stats = CpuRt::Render(bvh, mesh, scene, render, reference, pool);
+		scalar.milliseconds += stats.milliseconds;
+		scalar.rays += stats.rays;
+	}
+	printf("  scalar:   %.2f MRays/s\n", scalar.MRaysPerSecond());
+
+	for (int width : widths)
+	{
+		printf("  %2d lanes%s:\n", width, width > CpuRt::gNativeSimdWidth ? " (wider than the build target, plain loops)" : "");
+		for (bool intervalCulling : { false, true })
+		{
+			CpuRt::RenderStats stats;
+			if (width == 4) stats = BenchmarkPackets<4>(bvh, mesh, scene, render, intervalCulling, iterations, pool, output);
+			else if (width == 8) stats = BenchmarkPackets<8>(bvh, mesh, scene, render, intervalCulling, iterations, pool, output);
+			else if (width == 16) stats = BenchmarkPackets<16>(bvh, mesh, scene, render, intervalCulling, iterations, pool, output);
+			else throw runtime_error("Error: packets are 4, 8 or 16 rays wide");
+
+			printf("    %-18s %.2f MRays/s, %.2fx scalar", intervalCulling ? "interval culling:" : "lane masks only:",
+				stats.MRaysPerSecond(), stats.MRaysPerSecond() / scalar.MRaysPerSecond());
+			// Same hits, but the compiler may fuse multiply-adds in the scalar code (FMA targets), so not bit exact
+			if (validate) printf(" | validate: %zu of %zu pixels differ from scalar by more than 1/255", CountMismatches(output, reference, 1.0f / 255.0f), output.size());
+			printf("\n");
+		}
+	}
+	return 0;
+}
+
+template<int N>
+static void BenchmarkWideBvh(const CpuRt::Bvh& bvh, const CpuRt::MeshData& mesh, const CpuRt::SceneConstants& scene, const CpuRt::RenderSettings& render,
+	const CpuRt::RenderStats& binary, const vector<CpuRt::Float4>& reference, uint32_t wideLeafSize, int iterations, bool validate, ThreadPool& pool)
+{
+	CpuRt::WideBvh<N> wide;
+	wide.Build(bvh, wideLeafSize);
+	const CpuRt::WideBvhStats& stats = wide.Stats();
+
+	vector<CpuRt::Float4> output;
+	CpuRt::RenderStats trace;
+	for (int i = 0; i < iterations; i++)
+	{
+		const CpuRt::RenderStats frame = CpuRt::Render(wide, mesh, scene, render, output, pool);
+		trace.milliseconds += frame.milliseconds;
+		trace.rays += frame.rays;
+	}
+	printf("  bvh%d:   collapse %.1f ms, %zu nodes, %.2f children/node, %.1f node bytes/triangle | trace %.2f MRays/s, %.2fx binary",
+		N, stats.collapseMilliseconds, stats.nodes, stats.averageChildren, double(stats.nodeBytes) / mesh.TriangleCount(),
+		trace.MRaysPerSecond(), trace.MRaysPerSecond() / binary.MRaysPerSecond());
+	if (validate) printf(" | validate: %zu of %zu pixels differ by more than 1/255", CountMismatches(output, reference, 1.0f / 255.0f), output.size());
+	printf("\n");
+}
+
+// wide [-triangles N] [-instances N] [-lanes 4,8] [-leaf N] [-wideleaf N] [-iterations N] [-threads N] [-validate]
+// : binary vs quantized BVH4 / BVH8 memory and trace speed, on one big sphere and on a scattered instance scene of
+// about the same triangle count flattened into one mesh
+static int RunWideBvhBenchmark(int argc, char** argv)
+{
+	CpuRt::BvhSettings settings;
+	settings.maxLeafSize = 4;
+	CpuRt::RenderSettings render;
+	uint32_t triangles = 1000000, instanceCount = 2000, wideLeafSize = 4;
+	vector<int> widths = { 4, 8 };
+	int iterations = 3;
+	unsigned threads = 0;
+	bool validate = false;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-triangles") && i + 1 < argc) triangles = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-instances") && i + 1 < argc) instanceCount = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-lanes") && i + 1 < argc)
+		{
+			widths.clear();
+			for (const string& item : SplitList(argv[++i])) widths.push_back(atoi(item.c_str()));
+		}
+		else if (!strcmp(argv[i], "-leaf") && i + 1 < argc) settings.maxLeafSize = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-wideleaf") && i + 1 < argc) wideLeafSize = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc) iterations = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threads = unsigned(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-validate")) validate = true;
+	}
+
+	ThreadPool pool(threads);
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+	const pair<const char*, CpuRt::MeshData> meshes[] = {
+		{ "sphere", CpuRt::CreateSphereMesh(triangles) },
+		{ "scattered instances", FlattenInstances(CpuRt::CreateSphereMesh(max(1u, triangles / instanceCount)), CreateScatteredInstances(instanceCount)) },
+	};
+
+	for (const auto& [name, mesh] : meshes)
+	{
+		const CpuRt::Bvh bvh = CpuRt::BuildSahBvh(mesh, settings, pool);
+		vector<CpuRt::Float4> reference;
+		CpuRt::RenderStats binary;
+		for (int i = 0; i < iterations; i++)
+		{
+			const CpuRt::RenderStats frame = CpuRt::Render(bvh, mesh, scene, render, reference, pool);
+			binary.milliseconds += frame.milliseconds;
+			binary.rays += frame.rays;
+		}
+		printf("%s, %zu triangles, %u threads\n", name, mesh.TriangleCount(), pool.ThreadCount());
+		printf("  binary: %zu nodes, %.1f node bytes/triangle | trace %.2f MRays/s\n",
+			bvh.Stats().nodes, double(bvh.Stats().nodes * sizeof(CpuRt::BvhNode)) / mesh.TriangleCount(), binary.MRaysPerSecond());
+
+		for (int width : widths)
+		{
+			if (width == 4) BenchmarkWideBvh<4>(bvh, mesh, scene, render, binary, reference, wideLeafSize, iterations, validate, pool);
+			else if (width == 8) BenchmarkWideBvh<8>(bvh, mesh, scene, render, binary, reference, wideLeafSize, iterations, validate, pool);
+			else throw runtime_error("Error: wide BVH nodes have 4 or 8 children");
+		}
+	}
+	return 0;
+}
+
+// Closest hits of 'rays', returns the milliseconds it took
+template<typename Accel>
+static double TraceRaySet(const Accel& bvh, const vector<CpuRt::Ray>& rays, uint32_t rayFlags, vector<CpuRt::RayHit>& hits, ThreadPool& pool)
+{
+	hits.resize(rays.size());
+	const auto start = chrono::high_resolution_clock::now();
+	pool.ParallelFor(rays.size(), 4096, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; i++) bvh.Intersect(rays[i], rayFlags, hits[i]);
+	});
+	return ElapsedMs(start);
+}
+
+static vector<CpuRt::Ray> CreateCameraRays(const CpuRt::MeshData& mesh, const CpuRt::SceneConstants& scene, uint32_t width, uint32_t height, uint32_t stride)
+{
+	const CpuRt::ShaderContext context = { &mesh, &scene, width, height, nullptr };
+	vector<CpuRt::Ray> rays;
+	for (uint32_t y = 0; y < height; y += stride)
+	{
+		for (uint32_t x = 0; x < width; x += stride)
+		{
+			CpuRt::Ray ray;
+			CpuRt::GenerateCameraRay(context, x, y, ray.origin, ray.direction);
+			ray.tMin = 0.001f;
+			ray.tMax = 10000.0f;
+			rays.push_back(ray);
+		}
+	}
+	return rays;
+}
+
+// Incoherent rays: origins anywhere in the middle half of 'bounds', directions uniform over the sphere
+static vector<CpuRt::Ray> CreateRandomRays(const CpuRt::Aabb& bounds, size_t count, uint32_t seed)
+{
+	mt19937 rng(seed);
+	uniform_real_distribution<float> unit(0.0f, 1.0f);
+	const CpuRt::Float3 center = bounds.Centroid(), extent = bounds.Extent() * 0.5f;
+	vector<CpuRt::Ray> rays(count);
+	for (CpuRt::Ray& ray : rays)
+	{
+		ray.origin = { center.x + (unit(rng) - 0.5f) * extent.x, center.y + (unit(rng) - 0.5f) * extent.y, center.z + (unit(rng) - 0.5f) * extent.z };
+		const float z = unit(rng) * 2.0f - 1.0f, phi = unit(rng) * 6.2831853f, r = sqrt(max(0.0f, 1.0f - z * z));
+		ray.direction = { r * cos(phi), r * sin(phi), z };
+		ray.tMin = 0.0f;
+		ray.tMax = 10000.0f;
+	}
+	return rays;
+}
+
+// layout [-triangles N] [-leaf N] [-rays N] [-layouts dfs,veb,hot] [-iterations N] [-threads N] [-validate]
+// : node layouts and far child prefetch on a sphere whose nodes and triangles outgrow the last level cache, with
+// camera rays and incoherent random rays. Cache misses are simulated (SimulateBvhNodeCache), trace speed is measured.
+static int RunLayoutBenchmark(int argc, char** argv)
+{
+	CpuRt::BvhSettings settings;
+	settings.maxLeafSize = 4;
+	CpuRt::RenderSettings render;
+	uint32_t triangles = 4000000;
+	size_t randomRays = 1000000;
+	vector<CpuRt::BvhLayout> layouts = { CpuRt::BvhLayout::DepthFirst, CpuRt::BvhLayout::VanEmdeBoas, CpuRt::BvhLayout::HotFirst };
+	int iterations = 3;
+	unsigned threads = 0;
+	bool validate = false;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-triangles") && i + 1 < argc) triangles = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-leaf") && i + 1 < argc) settings.maxLeafSize = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-rays") && i + 1 < argc) randomRays = size_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-layouts") && i + 1 < argc)
+		{
+			layouts.clear();
+			for (const string& item : SplitList(argv[++i])) layouts.push_back(CpuRt::ParseBvhLayout(item.c_str()));
+		}
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc) iterations = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threads = unsigned(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-validate")) validate = true;
+	}
+
+	ThreadPool pool(threads);
+	const CpuRt::MeshData mesh = CpuRt::CreateSphereMesh(triangles);
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+	CpuRt::Bvh bvh = CpuRt::BuildSahBvh(mesh, settings, pool);
+	const size_t nodeBytes = bvh.Nodes().size() * sizeof(CpuRt::BvhNode), triangleBytes = bvh.TriangleCount() * (3 * sizeof(CpuRt::Float3) + sizeof(uint32_t));
+	printf("%zu triangles, %zu nodes, %.1f MB nodes + %.1f MB triangles, %u threads\n", mesh.TriangleCount(), bvh.Nodes().size(),
+		nodeBytes / 1048576.0, triangleBytes / 1048576.0, pool.ThreadCount());
+
+	struct RaySet
+	{
+		const char* name;
+		uint32_t rayFlags;
+		vector<CpuRt::Ray> rays;
+		vector<CpuRt::Ray> profile;		// a different sample of the same kind of rays, what HotFirst learns from
+		vector<CpuRt::RayHit> reference;
+	};
+	RaySet sets[] = {
+		{ "camera", CpuRt::RayFlagCullBackFacingTriangles, CreateCameraRays(mesh, scene, render.width, render.height, 1), CreateCameraRays(mesh, scene, render.width / 3, render.height / 3, 1), {} },
+		{ "random", CpuRt::RayFlagNone, CreateRandomRays(bvh.NodeBounds(0), randomRays, 1234), CreateRandomRays(bvh.NodeBounds(0), randomRays / 8, 5678), {} },
+	};
+	for (RaySet& set : sets) TraceRaySet(bvh, set.rays, set.rayFlags, set.reference, pool);
+
+	// Replaying every ray through the cache model takes longer than tracing them, a prefix is enough
+	const size_t simulatedRays = 262144;
+	for (CpuRt::BvhLayout layout : layouts)
+	{
+		auto start = chrono::high_resolution_clock::now();
+		vector<uint32_t> visits;
+		if (layout == CpuRt::BvhLayout::HotFirst)
+		{
+			// Camera and random rays run on different flags, profile each with its own
+			visits.assign(bvh.Nodes().size(), 0);
+			for (const RaySet& set : sets)
+			{
+				const vector<uint32_t> counts = CpuRt::ProfileBvhVisits(bvh, set.profile, set.rayFlags);
+				for (size_t i = 0; i < visits.size(); i++) visits[i] = uint32_t(min<uint64_t>(UINT32_MAX, uint64_t(visits[i]) + counts[i]));
+			}
+		}
+		const double profileMs = ElapsedMs(start);
+		start = chrono::high_resolution_clock::now();
+		CpuRt::RelayoutBvh(bvh, layout, visits);
+		printf("  %s: relayout %.1f ms", CpuRt::BvhLayoutName(layout), ElapsedMs(start));
+		if (layout == CpuRt::BvhLayout::HotFirst) printf(" (profile %.1f ms)", profileMs);
+		printf("\n");
+
+		for (RaySet& set : sets)
+		{
+			const vector<CpuRt::Ray> prefix(set.rays.begin(), set.rays.begin() + min(simulatedRays, set.rays.size()));
+			const CpuRt::BvhCacheStats cache = CpuRt::SimulateBvhNodeCache(bvh, prefix, set.rayFlags);
+			printf("    %-6s  %.1f nodes/ray, simulated node misses/ray: 32 KB %.2f, 1 MB %.2f, TLB %.2f | trace", set.name, cache.nodesPerRay,
+				cache.l1MissesPerRay, cache.l2MissesPerRay, cache.tlbMissesPerRay);
+
+			vector<CpuRt::RayHit> hits;
+			for (bool prefetch : { false, true })
+			{
+				bvh.SetPrefetchFarChild(prefetch);
+				double milliseconds = 0.0;
+				for (int i = 0; i < iterations; i++) milliseconds += TraceRaySet(bvh, set.rays, set.rayFlags, hits, pool);
+				printf(" %s %.2f MRays/s", prefetch ? "prefetch" : "plain", double(set.rays.size()) * iterations / (milliseconds * 1000.0));
+			}
+			bvh.SetPrefetchFarChild(false);
+
+			if (validate)
+			{
+				// Same traversal order whatever the layout, so the same hits bit for bit
+				size_t mismatches = 0;
+				for (size_t i = 0; i < hits.size(); i++) mismatches += hits[i].primitive != set.reference[i].primitive || hits[i].t != set.reference[i].t;
+				printf(" | validate: %zu of %zu hits differ", mismatches, hits.size());
+			}
+			printf("\n");
+		}
+	}
+	return 0;
+}
+
+// Box 'lo'..'hi' rotated by 'rotate', 12 triangles, front faces clockwise seen from outside
+static void AddBox(CpuRt::MeshData& mesh, const CpuRt::Float3& lo, const CpuRt::Float3& hi, const CpuRt::Float4x4& rotate)
+{
+	const uint32_t base = uint32_t(mesh.vertices.size());
+	const CpuRt::Float3 center = CpuRt::TransformPoint((lo + hi) * 0.5f, rotate);
+	for (int corner = 0; corner < 8; corner++)
+	{
+		const CpuRt::Float3 p = { corner & 1 ? hi.x : lo.x, corner & 2 ? hi.y : lo.y, corner & 4 ? hi.z : lo.z };
+		const CpuRt::Float3 position = CpuRt::TransformPoint(p, rotate);
+		mesh.vertices.push_back({ position, CpuRt::Normalize(position - center) });
+	}
+
+	static const uint32_t faces[6][4] = { { 0, 2, 3, 1 }, { 4, 5, 7, 6 }, { 0, 1, 5, 4 }, { 2, 6, 7, 3 }, { 0, 4, 6, 2 }, { 1, 3, 7, 5 } };
+	for (const auto& face : faces)
+	{
+		for (int half = 0; half < 2; half++)
+		{
+			uint32_t a = base + face[0], b = base + face[1 + half], c = base + face[2 + half];
+			const CpuRt::Float3& p0 = mesh.vertices[a].position;
+			const CpuRt::Float3 n = CpuRt::Cross(mesh.vertices[b].position - p0, mesh.vertices[c].position - p0);
+			if (CpuRt::Dot(n, p0 - center) < 0.0f) swap(b, c);
+			mesh.indices.insert(mesh.indices.end(), { a, b, c });
+		}
+	}
+}
+
+// Stand in for an architectural model: 'floors' stories of rooms x rooms rooms, each a few long wall slabs with a
+// door gap plus some furniture, on floor slabs that span the whole building. Turned 30 degrees about Y so the walls
+// run diagonally, which is what gives object split BVHs their overlapping boxes.
+static CpuRt::MeshData CreateBuildingMesh(uint32_t rooms, uint32_t floors)
+{
+	CpuRt::MeshData mesh;
+	const CpuRt::Float4x4 rotate = CpuRt::MatrixRotationY(CpuRt::ConvertToRadians(30.0f));
+	const float size = 3.6f, room = size / rooms, story = 0.4f, wall = 0.01f, door = room * 0.25f;
+	const float x0 = -size * 0.5f, z0 = -size * 0.5f, y0 = -1.0f;
+	mt19937 rng(2468);
+	uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+	for (uint32_t f = 0; f < floors; f++)
+	{
+		const float y = y0 + f * story;
+		AddBox(mesh, { x0, y - wall, z0 }, { x0 + size, y, z0 + size }, rotate);
+		for (uint32_t i = 0; i <= rooms; i++)
+		{
+			for (uint32_t j = 0; j < rooms; j++)
+			{
+				// Wall along x and along z at grid line i, cell j, split around a door in inner walls
+				const float line = i * room, a = j * room, b = a + room, gap = (a + b) * 0.5f;
+				const bool inner = i > 0 && i < rooms;
+				for (int part = 0; part < (inner ? 2 : 1); part++)
+				{
+					const float lo = inner && part == 1 ? gap + door * 0.5f : a, hi = inner && part == 0 ? gap - door * 0.5f : b;
+					AddBox(mesh, { x0 + lo, y, z0 + line - wall }, { x0 + hi, y + story * 0.8f, z0 + line + wall }, rotate);
+					AddBox(mesh, { x0 + line - wall, y, z0 + lo }, { x0 + line + wall, y + story * 0.8f, z0 + hi }, rotate);
+				}
+			}
+		}
+
+		for (uint32_t roomX = 0; roomX < rooms; roomX++)
+		{
+			for (uint32_t roomZ = 0; roomZ < rooms; roomZ++)
+			{
+				for (int item = 0; item < 3; item++)
+				{
+					const float w = room * (0.1f + 0.2f * unit(rng)), d = room * (0.1f + 0.2f * unit(rng)), h = story * (0.1f + 0.4f * unit(rng));
+					const float px = x0 + roomX * room + (room - w) * unit(rng), pz = z0 + roomZ * room + (room - d) * unit(rng);
+					AddBox(mesh, { px, y, pz }, { px + w, y + h, pz + d }, rotate);
+				}
+			}
+		}
+	}
+	return mesh;
+}
+
+// sbvh [-obj file | -rooms N] [-floors N] [-budget X] [-alpha X] [-leaf N] [-rays N] [-iterations N] [-threads N] [-validate]
+// : binned SAH vs SBVH on an architectural stand in: references, SAH cost, sibling overlap, build time and trace speed
+// of camera rays and of incoherent rays inside the building
+static int RunSbvhBenchmark(int argc, char** argv)
+{
+	CpuRt::BvhSettings settings;
+	settings.maxLeafSize = 4;
+	CpuRt::RenderSettings render;
+	string objPath;
+	uint32_t rooms = 24, floors = 4;
+	size_t randomRays = 1000000;
+	int iterations = 3;
+	unsigned threads = 0;
+	bool validate = false;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-obj") && i + 1 < argc) objPath = argv[++i];
+		else if (!strcmp(argv[i], "-rooms") && i + 1 < argc) rooms = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-floors") && i + 1 < argc) floors = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-budget") && i + 1 < argc) settings.splitBudget = float(atof(argv[++i]));
+		else if (!strcmp(argv[i], "-alpha") && i + 1 < argc) settings.spatialSplitAlpha = float(atof(argv[++i]));
+		else if (!strcmp(argv[i], "-leaf") && i + 1 < argc) settings.maxLeafSize = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-rays") && i + 1 < argc) randomRays = size_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc) iterations = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threads = unsigned(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-validate")) validate = true;
+	}
+
+	ThreadPool pool(threads);
+	const CpuRt::MeshData mesh = objPath.empty() ? CreateBuildingMesh(rooms, floors) : CpuRt::LoadObjMesh(objPath);
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+	printf("%zu triangles, %u threads, split budget %.2f, alpha %g\n", mesh.TriangleCount(), pool.ThreadCount(), settings.splitBudget, settings.spatialSplitAlpha);
+
+	vector<CpuRt::Ray> rays;
+	vector<CpuRt::Float4> reference;
+	vector<CpuRt::RayHit> referenceHits;
+	double sahCamera = 0.0, sahRandom = 0.0;
+	for (CpuRt::BvhBuildMode builder : { CpuRt::BvhBuildMode::Sah, CpuRt::BvhBuildMode::Sbvh })
+	{
+		const CpuRt::Bvh bvh = CpuRt::BuildBvh(mesh, builder, settings, pool);
+		const CpuRt::BvhStats& stats = bvh.Stats();
+		if (rays.empty()) rays = CreateRandomRays(bvh.NodeBounds(0), randomRays, 1234);
+
+		vector<CpuRt::Float4> output;
+		vector<CpuRt::RayHit> hits;
+		CpuRt::RenderStats camera;
+		double randomMs = 0.0;
+		for (int i = 0; i < iterations; i++)
+		{
+			const CpuRt::RenderStats frame = CpuRt::Render(bvh, mesh, scene, render, output, pool);
+			camera.milliseconds += frame.milliseconds;
+			camera.rays += frame.rays;
+			randomMs += TraceRaySet(bvh, rays, CpuRt::RayFlagNone, hits, pool);
+		}
+		const double random = double(rays.size()) * iterations / (randomMs * 1000.0);
+		if (builder == CpuRt::BvhBuildMode::Sah)
+		{
+			sahCamera = camera.MRaysPerSecond();
+			sahRandom = random;
+			reference = output;
+			referenceHits = hits;
+		}
+
+		printf("  %s: build %.1f ms, %zu references (+%.1f%%), %zu nodes, depth %u | SAH cost %.2f, sibling overlap %.2f | camera %.2f MRays/s (%.2fx), random %.2f MRays/s (%.2fx)",
+			CpuRt::BvhBuildModeName(builder), stats.buildMilliseconds, bvh.TriangleCount(), 100.0 * (double(bvh.TriangleCount()) / mesh.TriangleCount() - 1.0),
+			stats.nodes, stats.maxDepth, stats.sahCost, bvh.ComputeChildOverlap(), camera.MRaysPerSecond(), camera.MRaysPerSecond() / sahCamera, random, random / sahRandom);
+		if (validate && builder != CpuRt::BvhBuildMode::Sah)
+		{
+			// Same nearest hits up to ties between coplanar triangles, whose distances can differ in the last bits
+			size_t mismatches = 0;
+			for (size_t i = 0; i < hits.size(); i++) mismatches += fabs(hits[i].t - referenceHits[i].t) > 1e-5f * referenceHits[i].t;
+			printf(" | validate: %zu of %zu pixels, %zu of %zu random hits differ from sah", CountMismatches(output, reference, 1.0f / 255.0f), output.size(), mismatches, hits.size());
+		}
+		printf("\n");
+	}
+	return 0;
+}
+
+// W wide blocks of 'positions' (3 per triangle) tested against every ray, returns the milliseconds it took
+template<int W, CpuRt::TriangleKernel Kernel>
+static double BenchmarkTriangleKernel(const vector<CpuRt::Float3>& positions, const vector<CpuRt::Ray>& rays, size_t& hits)
+{
+	const uint32_t triangles = uint32_t(positions.size() / 3);
+	vector<CpuRt::TriangleBlock<W>> blocks((triangles + W - 1) / W);
+	vector<uint32_t> primitives(W);
+	for (uint32_t first = 0; first < triangles; first += W)
+	{
+		const uint32_t count = min<uint32_t>(W, triangles - first);
+		for (uint32_t lane = 0; lane < count; lane++) primitives[lane] = first + lane;
+		CpuRt::PackTriangleBlock(Kernel, &positions[size_t(first) * 3], primitives.data(), count, blocks[first / W]);
+	}
+
+	hits = 0;
+	const auto start = chrono::high_resolution_clock::now();
+	for (const CpuRt::Ray& ray : rays)
+	{
+		const CpuRt::TriangleBlockRay<W> blockRay(ray);
+		CpuRt::RayHit hit;
+		hit.t = ray.tMax;
+		for (size_t b = 0; b < blocks.size(); b++)
+		{
+			const uint32_t count = min<uint32_t>(W, triangles - uint32_t(b) * W);
+			CpuRt::IntersectTriangleBlock<Kernel>(blockRay, blocks[b], (1u << count) - 1, CpuRt::RayFlagNone, ray.tMin, hit);
+		}
+		hits += hit.Hit();
+	}
+	return ElapsedMs(start);
+}
+
+template<int W>
+static double BenchmarkTriangleKernel(CpuRt::TriangleKernel kernel, const vector<CpuRt::Float3>& positions, const vector<CpuRt::Ray>& rays, size_t& hits)
+{
+	switch (kernel)
+	{
+	case CpuRt::TriangleKernel::MollerTrumbore: return BenchmarkTriangleKernel<W, CpuRt::TriangleKernel::MollerTrumbore>(positions, rays, hits);
+	case CpuRt::TriangleKernel::Plucker: return BenchmarkTriangleKernel<W, CpuRt::TriangleKernel::Plucker>(positions, rays, hits);
+	case CpuRt::TriangleKernel::Watertight: return BenchmarkTriangleKernel<W, CpuRt::TriangleKernel::Watertight>(positions, rays, hits);
+	}
+	return 0.0;
+}
+
+// Indexed height field of grid x grid quads, two triangles each, every inner edge and vertex shared. Tilted so
+// no coordinate is round.
+static CpuRt::MeshData CreateHeightFieldMesh(uint32_t grid)
+{
+	CpuRt::MeshData mesh;
+	const CpuRt::Float4x4 rotate = CpuRt::MatrixRotationY(CpuRt::ConvertToRadians(23.0f));
+	for (uint32_t y = 0; y <= grid; y++)
+	{
+		for (uint32_t x = 0; x <= grid; x++)
+		{
+			const float u = float(x) / grid * 4.0f - 2.0f, v = float(y) / grid * 4.0f - 2.0f;
+			const CpuRt::Float3 p = { u, 0.3f * sin(3.1f * u) * cos(2.3f * v) + 0.1f * u, v };
+			mesh.vertices.push_back({ CpuRt::TransformPoint(p, rotate), { 0.0f, 1.0f, 0.0f } });
+		}
+	}
+	for (uint32_t y = 0; y < grid; y++)
+	{
+		for (uint32_t x = 0; x < grid; x++)
+		{
+			const uint32_t a = y * (grid + 1) + x, b = a + 1, c = a + grid + 1, d = c + 1;
+			mesh.indices.insert(mesh.indices.end(), { a, c, b, b, c, d });
+		}
+	}
+	return mesh;
+}
+
+// Rays from above at the inner vertices and the midpoints of the inner edges of a CreateHeightFieldMesh
+static vector<CpuRt::Ray> CreateEdgeRays(const CpuRt::MeshData& mesh, uint32_t grid, uint32_t seed)
+{
+	mt19937 rng(seed);
+	uniform_real_distribution<float> offset(-3.0f, 3.0f);
+	vector<CpuRt::Ray> rays;
+	const auto aim = [&](const CpuRt::Float3& target)
+	{
+		CpuRt::Ray ray;
+		ray.origin = { offset(rng), 5.0f, offset(rng) };
+		ray.direction = target - ray.origin;
+		ray.tMin = 0.0f;
+		ray.tMax = 2.0f;
+		rays.push_back(ray);
+	};
+	const auto position = [&](uint32_t x, uint32_t y) { return mesh.vertices[y * (grid + 1) + x].position; };
+	for (uint32_t y = 1; y < grid; y++)
+	{
+		for (uint32_t x = 1; x < grid; x++)
+		{
+			aim(position(x, y));
+			aim((position(x, y) + position(x + 1, y)) * 0.5f);
+			aim((position(x, y) + position(x, y + 1)) * 0.5f);
+			aim((position(x + 1, y) + position(x, y + 1)) * 0.5f);
+		}
+	}
+	return rays;
+}
+
+template<typename Accel>
+static size_t CountMisses(const Accel& accel, const vector<CpuRt::Ray>& rays)
+{
+	size_t misses = 0;
+	for (const CpuRt::Ray& ray : rays)
+	{
+		CpuRt::RayHit hit;
+		misses += !accel.Intersect(ray, CpuRt::RayFlagNone, hit);
+	}
+	return misses;
+}
+
+// Trace speed of one block BVH against the binary Bvh it was packed from, and the rays it lets through the height field
+template<int W, CpuRt::TriangleKernel Kernel>
+static void BenchmarkBlockBvh(const CpuRt::Bvh& bvh, const CpuRt::MeshData& mesh, const CpuRt::SceneConstants& scene, const CpuRt::RenderSettings& render,
+	const vector<CpuRt::Ray>& rays, const CpuRt::RenderStats& binary, double binaryRandom, const vector<CpuRt::Float4>& reference, const vector<CpuRt::RayHit>& referenceHits,
+	const CpuRt::Bvh& field, const vector<CpuRt::Ray>& edgeRays, int iterations, bool validate, ThreadPool& pool)
+{
+	CpuRt::BlockBvh<W, Kernel> blocks;
+	blocks.Build(bvh);
+	const CpuRt::BlockBvhStats& stats = blocks.Stats();
+
+	vector<CpuRt::Float4> output;
+	vector<CpuRt::RayHit> hits;
+	CpuRt::RenderStats camera;
+	double randomMs = 0.0;
+	for (int i = 0; i < iterations; i++)
+	{
+		const CpuRt::RenderStats frame = CpuRt::Render(blocks, mesh, scene, render, output, pool);
+		camera.milliseconds += frame.milliseconds;
+		camera.rays += frame.rays;
+		randomMs += TraceRaySet(blocks, rays, CpuRt::RayFlagNone, hits, pool);
+	}
+	const double random = double(rays.size()) * iterations / (randomMs * 1000.0);
+
+	CpuRt::BlockBvh<W, Kernel> fieldBlocks;
+	fieldBlocks.Build(field);
+	printf("  %-10s x%-2d: pack %.1f ms, %zu blocks, %.0f%% full, %.1f bytes/triangle | camera %.2f MRays/s (%.2fx), random %.2f MRays/s (%.2fx) | %zu leaks",
+		CpuRt::TriangleKernelName(Kernel), W, stats.packMilliseconds, stats.blocks, 100.0 * stats.fill, double(stats.blockBytes) / bvh.TriangleCount(),
+		camera.MRaysPerSecond(), camera.MRaysPerSecond() / binary.MRaysPerSecond(), random, random / binaryRandom, CountMisses(fieldBlocks, edgeRays));
+	if (validate)
+	{
+		size_t mismatches = 0;
+		for (size_t i = 0; i < hits.size(); i++)
+		{
+			mismatches += hits[i].Hit() != referenceHits[i].Hit() || fabs(hits[i].t - referenceHits[i].t) > 1e-5f * referenceHits[i].t;
+		}
+		printf(" | validate: %zu of %zu pixels, %zu of %zu random hits differ from binary", CountMismatches(output, reference, 1.0f / 255.0f), output.size(), mismatches, hits.size());
+	}
+	printf("\n");
+}
+
+template<int W>
+static void BenchmarkBlockBvh(CpuRt::TriangleKernel kernel, const CpuRt::Bvh& bvh, const CpuRt::MeshData& mesh, const CpuRt::SceneConstants& scene, const CpuRt::RenderSettings& render,
+	const vector<CpuRt::Ray>& rays, const CpuRt::RenderStats& binary, double binaryRandom, const vector<CpuRt::Float4>& reference, const vector<CpuRt::RayHit>& referenceHits,
+	const CpuRt::Bvh& field, const vector<CpuRt::Ray>& edgeRays, int iterations, bool validate, ThreadPool& pool)
+{
+	switch (kernel)
+	{
+	case CpuRt::TriangleKernel::MollerTrumbore:
+		BenchmarkBlockBvh<W, CpuRt::TriangleKernel::MollerTrumbore>(bvh, mesh, scene, render, rays, binary, binaryRandom, reference, referenceHits, field, edgeRays, iterations, validate, pool);
+		break;
+	case CpuRt::TriangleKernel::Plucker:
+		BenchmarkBlockBvh<W, CpuRt::TriangleKernel::Plucker>(bvh, mesh, scene, render, rays, binary, binaryRandom, reference, referenceHits, field, edgeRays, iterations, validate, pool);
+		break;
+	case CpuRt::TriangleKernel::Watertight:
+		BenchmarkBlockBvh<W, CpuRt::TriangleKernel::Watertight>(bvh, mesh, scene, render, rays, binary, binaryRandom, reference, referenceHits, field, edgeRays, iterations, validate, pool);
+		break;
+	}
+}
+
+// triangles [-obj file | -triangles N] [-lanes 1,4,8] [-kernels mt,plucker,watertight] [-leaf N] [-rays N] [-iterations N] [-threads N] [-validate]
+// : Möller-Trumbore, Plücker and watertight ray/triangle kernels over SoA triangle blocks. Raw kernel throughput on
+// one thread, then trace speed in BVH leaves, and how many rays aimed exactly at shared edges and vertices of a
+// height field slip through (leaks).
+static int RunTriangleBenchmark(int argc, char** argv)
+{
+	CpuRt::BvhSettings settings;
+	settings.maxLeafSize = 8;
+	CpuRt::RenderSettings render;
+	string objPath;
+	uint32_t triangles = 1000000;
+	size_t randomRays = 1000000;
+	vector<int> widths = { 1, 4, 8 };
+	vector<CpuRt::TriangleKernel> kernels = { CpuRt::TriangleKernel::MollerTrumbore, CpuRt::TriangleKernel::Plucker, CpuRt::TriangleKernel::Watertight };
+	int iterations = 3;
+	unsigned threads = 0;
+	bool validate = false;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-obj") && i + 1 < argc) objPath = argv[++i];
+		else if (!strcmp(argv[i], "-triangles") && i + 1 < argc) triangles = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-lanes") && i + 1 < argc)
+		{
+			widths.clear();
+			for (const string& item : SplitList(argv[++i])) widths.push_back(atoi(item.c_str()));
+		}
+		else if (!strcmp(argv[i], "-kernels") && i + 1 < argc)
+		{
+			kernels.clear();
+			for (const string& item : SplitList(argv[++i])) kernels.push_back(CpuRt::ParseTriangleKernel(item.c_str()));
+		}
+		else if (!strcmp(argv[i], "-leaf") && i + 1 < argc) settings.maxLeafSize = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-rays") && i + 1 < argc) randomRays = size_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc) iterations = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threads = unsigned(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-validate")) validate = true;
+	}
+	for (int width : widths)
+	{
+		if (width != 1 && width != 4 && width != 8 && width != 16) throw runtime_error("Error: triangle blocks are 1, 4, 8 or 16 lanes");
+	}
+
+	ThreadPool pool(threads);
+	const CpuRt::MeshData mesh = LoadBenchmarkMesh(objPath, triangles);
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+	const CpuRt::Bvh bvh = CpuRt::BuildSahBvh(mesh, settings, pool);
+	printf("%zu triangles, %u threads, leaf size %u, native SIMD width %d\n", mesh.TriangleCount(), pool.ThreadCount(), settings.maxLeafSize, CpuRt::gNativeSimdWidth);
+
+	// Kernels alone: 1024 neighbouring triangles of the Bvh's leaf order against rays at random triangles of them
+	{
+		const uint32_t kernelTriangles = uint32_t(min<size_t>(1024, bvh.TriangleCount()));
+		vector<CpuRt::Float3> positions;
+		CpuRt::Aabb bounds;
+		for (uint32_t i = 0; i < kernelTriangles; i++)
+		{
+			for (int v = 0; v < 3; v++)
+			{
+				positions.push_back(bvh.TrianglePositions(i)[v]);
+				bounds.Grow(positions.back());
+			}
+		}
+		mt19937 rng(99);
+		uniform_int_distribution<uint32_t> pick(0, kernelTriangles - 1);
+		vector<CpuRt::Ray> kernelRays = CreateRandomRays(bounds, 4096, 98);
+		for (CpuRt::Ray& ray : kernelRays)
+		{
+			const CpuRt::Float3* triangle = &positions[size_t(pick(rng)) * 3];
+			ray.direction = (triangle[0] + triangle[1] + triangle[2]) * (1.0f / 3.0f) - ray.origin;
+		}
+
+		const double tests = double(kernelRays.size()) * kernelTriangles;
+		size_t hits = 0;
+		const auto start = chrono::high_resolution_clock::now();
+		for (const CpuRt::Ray& ray : kernelRays)
+		{
+			CpuRt::RayHit hit;
+			hit.t = ray.tMax;
+			for (uint32_t i = 0; i < kernelTriangles; i++)
+			{
+				CpuRt::IntersectTriangle(ray, CpuRt::RayFlagNone, positions[i * 3], positions[i * 3 + 1], positions[i * 3 + 2], ray.tMin, hit, i);
+			}
+			hits += hit.Hit();
+		}
+		const double scalarMs = ElapsedMs(start);
+		printf("kernels, %u triangles x %zu rays, 1 thread\n", kernelTriangles, kernelRays.size());
+		printf("  IntersectTriangle: %.1f Mtests/s, %zu hits\n", tests / (scalarMs * 1000.0), hits);
+		for (CpuRt::TriangleKernel kernel : kernels)
+		{
+			for (int width : widths)
+			{
+				double ms = 0.0;
+				if (width == 1) ms = BenchmarkTriangleKernel<1>(kernel, positions, kernelRays, hits);
+				else if (width == 4) ms = BenchmarkTriangleKernel<4>(kernel, positions, kernelRays, hits);
+				else if (width == 8) ms = BenchmarkTriangleKernel<8>(kernel, positions, kernelRays, hits);
+				else ms = BenchmarkTriangleKernel<16>(kernel, positions, kernelRays, hits);
+				printf("  %-10s x%-2d: %.1f Mtests/s (%.2fx), %zu hits\n", CpuRt::TriangleKernelName(kernel), width, tests / (ms * 1000.0), scalarMs / ms, hits);
+			}
+		}
+	}
+
+	// In BVH leaves, against the binary Bvh's scalar Möller-Trumbore loop
+	const uint32_t grid = 256;
+	const CpuRt::MeshData fieldMesh = CreateHeightFieldMesh(grid);
+	const CpuRt::Bvh field = CpuRt::BuildSahBvh(fieldMesh, settings, pool);
+	const vector<CpuRt::Ray> edgeRays = CreateEdgeRays(fieldMesh, grid, 7);
+	const vector<CpuRt::Ray> rays = CreateRandomRays(bvh.NodeBounds(0), randomRays, 1234);
+	vector<CpuRt::Float4> reference;
+	vector<CpuRt::RayHit> referenceHits;
+	CpuRt::RenderStats binary;
+	double randomMs = 0.0;
+	for (int i = 0; i < iterations; i++)
+	{
+		const CpuRt::RenderStats frame = CpuRt::Render(bvh, mesh, scene, render, reference, pool);
+		binary.milliseconds += frame.milliseconds;
+		binary.rays += frame.rays;
+		randomMs += TraceRaySet(bvh, rays, CpuRt::RayFlagNone, referenceHits, pool);
+	}
+	const double binaryRandom = double(rays.size()) * iterations / (randomMs * 1000.0);
+	printf("bvh leaves, %zu rays at shared edges and vertices of a %u x %u height field\n", edgeRays.size(), grid, grid);
+	printf("  binary      : camera %.2f MRays/s, random %.2f MRays/s | %zu leaks\n", binary.MRaysPerSecond(), binaryRandom, CountMisses(field, edgeRays));
+	for (CpuRt::TriangleKernel kernel : kernels)
+	{
+		for (int width : widths)
+		{
+			if (width == 1) BenchmarkBlockBvh<1>(kernel, bvh, mesh, scene, render, rays, binary, binaryRandom, reference, referenceHits, field, edgeRays, iterations, validate, pool);
+			else if (width == 4) BenchmarkBlockBvh<4>(kernel, bvh, mesh, scene, render, rays, binary, binaryRandom, reference, referenceHits, field, edgeRays, iterations, validate, pool);
+			else if (width == 8) BenchmarkBlockBvh<8>(kernel, bvh, mesh, scene, render, rays, binary, binaryRandom, reference, referenceHits, field, edgeRays, iterations, validate, pool);
+			else BenchmarkBlockBvh<16>(kernel, bvh, mesh, scene, render, rays, binary, binaryRandom, reference, referenceHits, field, edgeRays, iterations, validate, pool);
+		}
+	}
+	return 0;
+}
+
+template<typename Accel>
+static CpuRt::RenderStats TraceCameraAndRandom(const Accel& accel, const CpuRt::MeshData& mesh, const CpuRt::SceneConstants& scene, const CpuRt::RenderSettings& render,
+	const vector<CpuRt::Ray>& rays, int iterations, vector<CpuRt::Float4>& output, vector<CpuRt::RayHit>& hits, double& randomMRaysPerSecond, ThreadPool& pool)
+{
+	CpuRt::RenderStats camera;
+	double randomMs = 0.0;
+	for (int i = 0; i < iterations; i++)
+	{
+		const CpuRt::RenderStats frame = CpuRt::Render(accel, mesh, scene, render, output, pool);
+		camera.milliseconds += frame.milliseconds;
+		camera.rays += frame.rays;
+		randomMs += TraceRaySet(accel, rays, CpuRt::RayFlagNone, hits, pool);
+	}
+	randomMRaysPerSecond = double(rays.size()) * iterations / (randomMs * 1000.0);
+	return camera;
+}
+
+// Triangle blocks vs pair blocks of W lanes over one mesh
+template<int W>
+static void BenchmarkTrianglePairs(const CpuRt::MeshData& mesh, const vector<CpuRt::TrianglePair>& pairs, const CpuRt::BvhSettings& settings,
+	const CpuRt::SceneConstants& scene, const CpuRt::RenderSettings& render, const vector<CpuRt::Ray>& rays, int iterations, bool validate, ThreadPool& pool)
+{
+	const CpuRt::Bvh bvh = CpuRt::BuildSahBvh(mesh, settings, pool);
+	CpuRt::BlockBvh<W> triangles;
+	triangles.Build(bvh);
+	CpuRt::PairBvh<W> paired;
+	paired.Build(mesh, pairs, settings, pool);
+
+	vector<CpuRt::Float4> reference, output;
+	vector<CpuRt::RayHit> referenceHits, hits;
+	double triangleRandom = 0.0, pairRandom = 0.0;
+	const CpuRt::RenderStats triangleCamera = TraceCameraAndRandom(triangles, mesh, scene, render, rays, iterations, reference, referenceHits, triangleRandom, pool);
+	const CpuRt::RenderStats pairCamera = TraceCameraAndRandom(paired, mesh, scene, render, rays, iterations, output, hits, pairRandom, pool);
+
+	const CpuRt::PairBvhStats& stats = paired.Stats();
+	printf("  x%-2d triangles: %zu sah nodes, %zu nodes, %zu blocks | camera %.2f MRays/s, random %.2f MRays/s\n",
+		W, bvh.Nodes().size(), triangles.Nodes().size(), triangles.Stats().blocks, triangleCamera.MRaysPerSecond(), triangleRandom);
+	printf("  x%-2d pairs:     %zu sah nodes, %zu nodes (%.0f%% fewer), %zu blocks, %.0f%% full | camera %.2f MRays/s (%.2fx), random %.2f MRays/s (%.2fx)",
+		W, stats.builtNodes, stats.nodes, 100.0 * (1.0 - double(stats.nodes) / triangles.Nodes().size()), stats.blocks, 100.0 * stats.fill,
+		pairCamera.MRaysPerSecond(), pairCamera.MRaysPerSecond() / triangleCamera.MRaysPerSecond(), pairRandom, pairRandom / triangleRandom);
+	if (validate)
+	{
+		// Same triangle and barycentrics, or a tie between coplanar triangles at the same distance. The kernel sums
+		// a pair's vertices in another order than a single triangle's, pixels where coplanar faces z-fight can differ.
+		size_t mismatches = 0;
+		for (size_t i = 0; i < hits.size(); i++)
+		{
+			const CpuRt::RayHit& a = hits[i];
+			const CpuRt::RayHit& b = referenceHits[i];
+			if (a.Hit() != b.Hit()) mismatches++;
+			else if (a.primitive == b.primitive) mismatches += fabs(a.barycentrics.x - b.barycentrics.x) > 1e-4f || fabs(a.barycentrics.y - b.barycentrics.y) > 1e-4f;
+			else mismatches += fabs(a.t - b.t) > 1e-5f * max(b.t, 1.0f);
+		}
+		printf(" | validate: %zu of %zu pixels, %zu of %zu random hits differ from triangle blocks", CountMismatches(output, reference, 1.0f / 255.0f), output.size(), mismatches, hits.size());
+	}
+	printf("\n");
+}
+
+// pairs [-obj file | -triangles N] [-rooms N] [-lanes 4,8] [-leaf N] [-rays N] [-iterations N] [-threads N] [-validate]
+// : triangles paired back into quads (TrianglePairs.h) vs single triangles, in blocks of W of either, on a sphere
+// and the generated building (both made of quads) or an OBJ
+static int RunTrianglePairBenchmark(int argc, char** argv)
+{
+	CpuRt::BvhSettings settings;
+	settings.maxLeafSize = 8;
+	CpuRt::RenderSettings render;
+	string objPath;
+	uint32_t triangles = 1000000, rooms = 24;
+	size_t randomRays = 1000000;
+	vector<int> widths = { 4, 8 };
+	int iterations = 3;
+	unsigned threads = 0;
+	bool validate = false;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-obj") && i + 1 < argc) objPath = argv[++i];
+		else if (!strcmp(argv[i], "-triangles") && i + 1 < argc) triangles = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-rooms") && i + 1 < argc) rooms = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-lanes") && i + 1 < argc)
+		{
+			widths.clear();
+			for (const string& item : SplitList(argv[++i])) widths.push_back(atoi(item.c_str()));
+		}
+		else if (!strcmp(argv[i], "-leaf") && i + 1 < argc) settings.maxLeafSize = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-rays") && i + 1 < argc) randomRays = size_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc) iterations = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threads = unsigned(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-validate")) validate = true;
+	}
+
+	ThreadPool pool(threads);
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+	vector<pair<string, CpuRt::MeshData>> meshes;
+	if (!objPath.empty()) meshes.emplace_back(objPath, CpuRt::LoadObjMesh(objPath));
+	else
+	{
+		meshes.emplace_back("sphere", CpuRt::CreateSphereMesh(triangles));
+		meshes.emplace_back("building", CreateBuildingMesh(rooms, 4));
+	}
+
+	for (const auto& [name, mesh] : meshes)
+	{
+		CpuRt::TrianglePairStats pairing;
+		const vector<CpuRt::TrianglePair> pairs = CpuRt::PairTriangles(mesh, &pairing);
+		CpuRt::Aabb bounds;
+		for (const CpuRt::Vertex& vertex : mesh.vertices) bounds.Grow(vertex.position);
+		const vector<CpuRt::Ray> rays = CreateRandomRays(bounds, randomRays, 1234);
+		printf("%s, %zu triangles, %u threads | pairing %.1f ms: %zu pairs, %zu single, %.1f%% of triangles paired\n", name.c_str(), mesh.TriangleCount(),
+			pool.ThreadCount(), pairing.milliseconds, pairing.pairs, pairing.singles, 100.0 * 2.0 * pairing.pairs / max<size_t>(1, pairing.triangles));
+		for (int width : widths)
+		{
+			if (width == 4) BenchmarkTrianglePairs<4>(mesh, pairs, settings, scene, render, rays, iterations, validate, pool);
+			else if (width == 8) BenchmarkTrianglePairs<8>(mesh, pairs, settings, scene, render, rays, iterations, validate, pool);
+			else if (width == 16) BenchmarkTrianglePairs<16>(mesh, pairs, settings, scene, render, rays, iterations, validate, pool);
+			else throw runtime_error("Error: triangle pair blocks are 4, 8 or 16 lanes");
+		}
+	}
+	return 0;
+}
+
+// Diffuse bounces off what a camera sees: pixels in scanline order, every hit spawns rays cosine distributed about
+// the geometric normal until there are 'count', the secondary rays of a path tracer before any reordering
+static vector<CpuRt::Ray> CreateBounceRays(const CpuRt::Bvh& bvh, const CpuRt::MeshData& mesh, const CpuRt::SceneConstants& scene,
+	const CpuRt::RenderSettings& render, size_t count, ThreadPool& pool)
+{
+	const vector<CpuRt::Ray> cameraRays = CreateCameraRays(mesh, scene, render.width, render.height, 1);
+	vector<CpuRt::RayHit> cameraHits;
+	TraceRaySet(bvh, cameraRays, CpuRt::RayFlagNone, cameraHits, pool);
+	size_t hitCount = 0;
+	for (const CpuRt::RayHit& hit : cameraHits) hitCount += hit.Hit();
+	if (hitCount == 0) throw runtime_error("Error: the camera sees nothing to bounce off");
+
+	mt19937 rng(2468);
+	uniform_real_distribution<float> unit(0.0f, 1.0f);
+	const size_t perHit = (count + hitCount - 1) / hitCount;
+	vector<CpuRt::Ray> rays;
+	rays.reserve(count);
+	for (size_t p = 0; p < cameraRays.size() && rays.size() < count; p++)
+	{
+		const CpuRt::RayHit& hit = cameraHits[p];
+		if (!hit.Hit()) continue;
+		const uint32_t* index = &mesh.indices[size_t(hit.primitive) * 3];
+		const CpuRt::Float3 p0 = mesh.vertices[index[0]].position;
+		CpuRt::Float3 normal = CpuRt::Normalize(CpuRt::Cross(mesh.vertices[index[1]].position - p0, mesh.vertices[index[2]].position - p0));
+		if (CpuRt::Dot(normal, cameraRays[p].direction) > 0.0f) normal = normal * -1.0f;
+		const CpuRt::Float3 tangent = CpuRt::Normalize(fabs(normal.x) > 0.5f ? CpuRt::Cross(normal, { 0.0f, 1.0f, 0.0f }) : CpuRt::Cross(normal, { 1.0f, 0.0f, 0.0f }));
+		const CpuRt::Float3 bitangent = CpuRt::Cross(normal, tangent);
+		const CpuRt::Float3 position = cameraRays[p].origin + cameraRays[p].direction * hit.t;
+		for (size_t k = 0; k < perHit && rays.size() < count; k++)
+		{
+			const float r = sqrt(unit(rng)), phi = unit(rng) * 6.2831853f, z = sqrt(max(0.0f, 1.0f - r * r));
+			CpuRt::Ray ray;
+			ray.origin = position + normal * 1e-4f;
+			ray.direction = tangent * (r * cos(phi)) + bitangent * (r * sin(phi)) + normal * z;
+			ray.tMin = 0.0f;
+			ray.tMax = 10000.0f;
+			rays.push_back(ray);
+		}
+	}
+	return rays;
+}
+
+// raysort [-triangles 100000,1000000] [-rays 65536,262144,1048576] [-originbits N] [-directionbits N] [-iterations N] [-threads N] [-validate]
+// : diffuse bounce rays traced as generated vs reordered by origin cell and direction (RaySort.h), per scene size and
+// ray count, to show where the key, sort and gather cost is paid back by faster traversal
+static int RunRaySortBenchmark(int argc, char** argv)
+{
+	CpuRt::BvhSettings settings;
+	CpuRt::RenderSettings render;
+	CpuRt::RaySortSettings sortSettings;
+	vector<uint32_t> sceneSizes = { 100000, 1000000 };
+	vector<size_t> rayCounts = { 65536, 262144, 1048576 };
+	const uint32_t instanceCount = 256;
+	int iterations = 3;
+	unsigned threads = 0;
+	bool validate = false;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-triangles") && i + 1 < argc)
+		{
+			sceneSizes.clear();
+			for (const string& item : SplitList(argv[++i])) sceneSizes.push_back(uint32_t(max(1, atoi(item.c_str()))));
+		}
+		else if (!strcmp(argv[i], "-rays") && i + 1 < argc)
+		{
+			rayCounts.clear();
+			for (const string& item : SplitList(argv[++i])) rayCounts.push_back(size_t(max(1, atoi(item.c_str()))));
+		}
+		else if (!strcmp(argv[i], "-originbits") && i + 1 < argc) sortSettings.originBits = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-directionbits") && i + 1 < argc) sortSettings.directionBits = uint32_t(max(0, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc) iterations = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threads = unsigned(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-validate")) validate = true;
+	}
+
+	ThreadPool pool(threads);
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+	printf("%u threads, keys %u bits (%u origin + %u direction per axis)\n", pool.ThreadCount(), CpuRt::RaySortKeyBits(sortSettings),
+		sortSettings.originBits, sortSettings.directionBits);
+	for (uint32_t sceneSize : sceneSizes)
+	{
+		const CpuRt::MeshData mesh = FlattenInstances(CpuRt::CreateSphereMesh(max(1u, sceneSize / instanceCount)), CreateScatteredInstances(instanceCount));
+		const CpuRt::Bvh bvh = CpuRt::BuildSahBvh(mesh, settings, pool);
+		const CpuRt::Aabb bounds = bvh.NodeBounds(0);
+		printf("scattered instances, %zu triangles, %.1f MB nodes\n", mesh.TriangleCount(), bvh.Nodes().size() * sizeof(CpuRt::BvhNode) / 1048576.0);
+		printf("  %9s | %10s | %8s %8s %8s %10s | %7s %7s\n", "rays", "unsorted", "key", "sort", "gather", "trace", "trace", "total");
+		for (size_t rayCount : rayCounts)
+		{
+			const vector<CpuRt::Ray> rays = CreateBounceRays(bvh, mesh, scene, render, rayCount, pool);
+			vector<CpuRt::RayHit> reference, hits;
+			double unsortedMs = 0.0;
+			CpuRt::RaySortStats sorted;
+			for (int i = 0; i < iterations; i++)
+			{
+				unsortedMs += TraceRaySet(bvh, rays, CpuRt::RayFlagNone, reference, pool);
+				const CpuRt::RaySortStats stats = CpuRt::TraceRaysSorted(bvh, rays, CpuRt::RayFlagNone, bounds, sortSettings, hits, pool);
+				sorted.keyMilliseconds += stats.keyMilliseconds;
+				sorted.sortMilliseconds += stats.sortMilliseconds;
+				sorted.gatherMilliseconds += stats.gatherMilliseconds;
+				sorted.traceMilliseconds += stats.traceMilliseconds;
+			}
+			printf("  %9zu | %7.2f ms | %5.2f ms %5.2f ms %5.2f ms %7.2f ms | %6.2fx %6.2fx", rays.size(), unsortedMs / iterations,
+				sorted.keyMilliseconds / iterations, sorted.sortMilliseconds / iterations, sorted.gatherMilliseconds / iterations,
+				sorted.traceMilliseconds / iterations, unsortedMs / sorted.traceMilliseconds, unsortedMs / sorted.TotalMilliseconds());
+			if (validate)
+			{
+				// Same rays, same traversal, only the order changes: the hits must be identical
+				size_t mismatches = 0;
+				for (size_t r = 0; r < rays.size(); r++)
+				{
+					mismatches += reference[r].primitive != hits[r].primitive || reference[r].t != hits[r].t ||
+						reference[r].barycentrics.x != hits[r].barycentrics.x || reference[r].barycentrics.y != hits[r].barycentrics.y;
+				}
+				printf(" | %zu mismatches", mismatches);
+			}
+			printf("\n");
+		}
+	}
+	return 0;
+}
+
+// pathtrace [-obj file | -triangles N] [-spp N] [-bounces N] [-roulette N] [-wave N] [-width N] [-height N] [-iterations N] [-threads N] [-validate] [-out file.tga]
+// : multi-bounce diffuse path tracing (PathTracer.h), the per-pixel megakernel loop vs the wavefront stages over SoA
+// ray queues, on scattered instances or an OBJ
+static int RunPathTraceBenchmark(int argc, char** argv)
+{
+	CpuRt::RenderSettings render;
+	CpuRt::PathTraceSettings settings;
+	string objPath, outPath;
+	uint32_t triangles = 1000000;
+	const uint32_t instanceCount = 256;
+	int iterations = 2;
+	unsigned threads = 0;
+	bool validate = false;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-obj") && i + 1 < argc) objPath = argv[++i];
+		else if (!strcmp(argv[i], "-triangles") && i + 1 < argc) triangles = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-spp") && i + 1 < argc) settings.samplesPerPixel = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-bounces") && i + 1 < argc) settings.maxBounces = uint32_t(max(0, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-roulette") && i + 1 < argc) settings.rouletteBounce = uint32_t(max(0, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-wave") && i + 1 < argc) settings.waveSize = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-width") && i + 1 < argc) render.width = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-height") && i + 1 < argc) render.height = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc) iterations = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threads = unsigned(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-validate")) validate = true;
+		else if (!strcmp(argv[i], "-out") && i + 1 < argc) outPath = argv[++i];
+	}
+
+	ThreadPool pool(threads);
+	const CpuRt::MeshData mesh = objPath.empty() ?
+		FlattenInstances(CpuRt::CreateSphereMesh(max(1u, triangles / instanceCount)), CreateScatteredInstances(instanceCount)) : CpuRt::LoadObjMesh(objPath);
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+	const CpuRt::Bvh bvh = CpuRt::BuildSahBvh(mesh, {}, pool);
+	printf("%s, %zu triangles, %ux%u, %u spp, %u bounces (roulette from %u), %u threads\n", objPath.empty() ? "scattered instances" : objPath.c_str(),
+		mesh.TriangleCount(), render.width, render.height, settings.samplesPerPixel, settings.maxBounces, settings.rouletteBounce, pool.ThreadCount());
+
+	vector<CpuRt::Float4> megakernelImage, wavefrontImage;
+	CpuRt::PathTraceStats megakernel, wavefront;
+	for (int i = 0; i < iterations; i++)
+	{
+		const CpuRt::PathTraceStats m = CpuRt::PathTraceMegakernel(bvh, mesh, scene, render, settings, megakernelImage, pool);
+		const CpuRt::PathTraceStats w = CpuRt::PathTraceWavefront(bvh, mesh, scene, render, settings, wavefrontImage, pool);
+		megakernel.milliseconds += m.milliseconds;
+		wavefront.milliseconds += w.milliseconds;
+		wavefront.generateMilliseconds += w.generateMilliseconds;
+		wavefront.extendMilliseconds += w.extendMilliseconds;
+		wavefront.shadeMilliseconds += w.shadeMilliseconds;
+		wavefront.compactMilliseconds += w.compactMilliseconds;
+		wavefront.shadowMilliseconds += w.shadowMilliseconds;
+		wavefront.accumulateMilliseconds += w.accumulateMilliseconds;
+		megakernel.rays = m.rays;
+		megakernel.shadowRays = m.shadowRays;
+		wavefront.rays = w.rays;
+		wavefront.shadowRays = w.shadowRays;
+	}
+	megakernel.milliseconds /= iterations;
+	wavefront.milliseconds /= iterations;
+
+	printf("  %.2f rays per path, %.2f shadow rays per path\n", double(megakernel.rays) / (size_t(render.width) * render.height * settings.samplesPerPixel),
+		double(megakernel.shadowRays) / (size_t(render.width) * render.height * settings.samplesPerPixel));
+	printf("  megakernel %8.1f ms %7.2f MRays/s\n", megakernel.milliseconds, megakernel.MRaysPerSecond());
+	printf("  wavefront  %8.1f ms %7.2f MRays/s %6.2fx | generate %.1f, extend %.1f, shade %.1f, compact %.1f, shadow %.1f, accumulate %.1f ms\n",
+		wavefront.milliseconds, wavefront.MRaysPerSecond(), megakernel.milliseconds / wavefront.milliseconds, wavefront.generateMilliseconds / iterations,
+		wavefront.extendMilliseconds / iterations, wavefront.shadeMilliseconds / iterations, wavefront.compactMilliseconds / iterations,
+		wavefront.shadowMilliseconds / iterations, wavefront.accumulateMilliseconds / iterations);
+	if (validate)
+	{
+		// Same random numbers, same paths: only the order rays are traced in differs
+		printf("  %zu rays / %zu shadow rays differ, %zu pixels differ\n", size_t(max(megakernel.rays, wavefront.rays) - min(megakernel.rays, wavefront.rays)),
+			size_t(max(megakernel.shadowRays, wavefront.shadowRays) - min(megakernel.shadowRays, wavefront.shadowRays)),
+			CountMismatches(megakernelImage, wavefrontImage, 1e-5f));
+	}
+
+	if (!outPath.empty() && !WriteTga(outPath, ToTexture(wavefrontImage, render.width, render.height)))
+	{
+		fprintf(stderr, "Failed to write %s\n", outPath.c_str());
+		return 1;
+	}
+	return 0;
+}
+
+// Shadow rays as ClosestHit casts them, from every camera hit towards the light
+static vector<CpuRt::Ray> CreateShadowRays(const CpuRt::Bvh& bvh, const CpuRt::MeshData& mesh, const CpuRt::SceneConstants& scene,
+	const CpuRt::RenderSettings& render, ThreadPool& pool)
+{
+	const vector<CpuRt::Ray> cameraRays = CreateCameraRays(mesh, scene, render.width, render.height, 1);
+	vector<CpuRt::RayHit> cameraHits;
+	TraceRaySet(bvh, cameraRays, CpuRt::RayFlagCullBackFacingTriangles, cameraHits, pool);
+	vector<CpuRt::Ray> shadowRays;
+	for (size_t i = 0; i < cameraRays.size(); i++)
+	{
+		if (!cameraHits[i].Hit()) continue;
+		const CpuRt::Float3 position = cameraRays[i].origin + cameraHits[i].t * cameraRays[i].direction;
+		const CpuRt::Float3 toLight = scene.lightPosition.xyz() - position;
+		shadowRays.push_back({ position, 0.001f, CpuRt::Normalize(toLight), CpuRt::Length(toLight) });
+	}
+	return shadowRays;
+}
+
+// occlusion [-obj file | -triangles N] [-rays N] [-iterations N] [-threads N] [-validate]
+// : occlusion queries (Occluded, TraceOcclusionRays) against closest hit traversal for shadow rays from what the camera
+// sees to the light and for random segments through the scene
+static int RunOcclusionBenchmark(int argc, char** argv)
+{
+	CpuRt::RenderSettings render;
+	string objPath;
+	uint32_t triangles = 1000000;
+	const uint32_t instanceCount = 256;
+	size_t randomRays = 1000000;
+	int iterations = 3;
+	unsigned threads = 0;
+	bool validate = false;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-obj") && i + 1 < argc) objPath = argv[++i];
+		else if (!strcmp(argv[i], "-triangles") && i + 1 < argc) triangles = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-rays") && i + 1 < argc) randomRays = size_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc) iterations = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threads = unsigned(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-validate")) validate = true;
+	}
+
+	ThreadPool pool(threads);
+	const CpuRt::MeshData mesh = objPath.empty() ?
+		FlattenInstances(CpuRt::CreateSphereMesh(max(1u, triangles / instanceCount)), CreateScatteredInstances(instanceCount)) : CpuRt::LoadObjMesh(objPath);
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+	const CpuRt::Bvh bvh = CpuRt::BuildSahBvh(mesh, {}, pool);
+	printf("%s, %zu triangles, %u threads\n", objPath.empty() ? "scattered instances" : objPath.c_str(), mesh.TriangleCount(), pool.ThreadCount());
+
+	const vector<CpuRt::Ray> shadowRays = CreateShadowRays(bvh, mesh, scene, render, pool);
+
+	// Segments between two random points of the middle half of the scene
+	vector<CpuRt::Ray> segments = CreateRandomRays(bvh.NodeBounds(0), randomRays, 1234);
+	mt19937 rng(99);
+	uniform_real_distribution<float> length(0.0f, CpuRt::Length(bvh.NodeBounds(0).Extent()) * 0.5f);
+	for (CpuRt::Ray& ray : segments) ray.tMax = length(rng);
+
+	struct RaySet
+	{
+		const char* name;
+		const vector<CpuRt::Ray>& rays;
+	};
+	const RaySet sets[] = { { "shadow", shadowRays }, { "segment", segments } };
+	for (const RaySet& set : sets)
+	{
+		vector<CpuRt::RayHit> hits;
+		vector<uint8_t> firstHit(set.rays.size()), occluded;
+		double closestMs = 0.0, firstHitMs = 0.0, occludedMs = 0.0;
+		for (int i = 0; i < iterations; i++)
+		{
+			closestMs += TraceRaySet(bvh, set.rays, CpuRt::RayFlagNone, hits, pool);
+
+			// The generic query, Intersect with the flags, against the Bvh's own any hit traversal
+			auto start = chrono::high_resolution_clock::now();
+			pool.ParallelFor(set.rays.size(), 4096, [&](size_t begin, size_t end)
+			{
+				for (size_t r = begin; r < end; r++) firstHit[r] = CpuRt::Occluded<CpuRt::Bvh>(bvh, set.rays[r], CpuRt::RayFlagNone);
+			});
+			firstHitMs += ElapsedMs(start);
+
+			start = chrono::high_resolution_clock::now();
+			CpuRt::TraceOcclusionRays(bvh, set.rays, CpuRt::RayFlagNone, occluded, pool);
+			occludedMs += ElapsedMs(start);
+		}
+
+		size_t blocked = 0;
+		for (uint8_t o : occluded) blocked += o;
+		const double mrays = set.rays.size() * iterations / 1000.0;
+		printf("  %-8s %8zu rays, %5.1f%% occluded | closest hit %7.2f MRays/s | first hit %7.2f MRays/s %5.2fx | occluded %7.2f MRays/s %5.2fx",
+			set.name, set.rays.size(), 100.0 * blocked / max<size_t>(1, set.rays.size()), mrays / closestMs, mrays / firstHitMs, closestMs / firstHitMs,
+			mrays / occludedMs, closestMs / occludedMs);
+		if (validate)
+		{
+			size_t mismatches = 0;
+			for (size_t r = 0; r < set.rays.size(); r++) mismatches += (hits[r].Hit() != (occluded[r] != 0)) + (firstHit[r] != occluded[r]);
+			printf(" | %zu mismatches", mismatches);
+		}
+		printf("\n");
+	}
+	return 0;
+}
+
+// Milliseconds 'trace(ray, hit)' takes over every ray
+template<typename Trace>
+static double TraceEach(const vector<CpuRt::Ray>& rays, vector<CpuRt::RayHit>& hits, ThreadPool& pool, const Trace& trace)
+{
+	hits.assign(rays.size(), CpuRt::RayHit{});
+	const auto start = chrono::high_resolution_clock::now();
+	pool.ParallelFor(rays.size(), 4096, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; i++) trace(rays[i], hits[i]);
+	});
+	return ElapsedMs(start);
+}
+
+// rayflags [-obj file | -triangles N] [-rays N] [-iterations N] [-threads N] [-validate]
+// : traversal with the ray flags tested at runtime (RuntimeRayFlags) vs instantiated per combination (StaticRayFlags
+// through DispatchRayFlags), binary BVH and BVH8, with the flags RayGen, ClosestHit's shadow rays and bounces use
+static int RunRayFlagBenchmark(int argc, char** argv)
+{
+	CpuRt::RenderSettings render;
+	string objPath;
+	uint32_t triangles = 1000000;
+	const uint32_t instanceCount = 256;
+	size_t randomRays = 1000000;
+	int iterations = 3;
+	unsigned threads = 0;
+	bool validate = false;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-obj") && i + 1 < argc) objPath = argv[++i];
+		else if (!strcmp(argv[i], "-triangles") && i + 1 < argc) triangles = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-rays") && i + 1 < argc) randomRays = size_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc) iterations = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threads = unsigned(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-validate")) validate = true;
+	}
+
+	ThreadPool pool(threads);
+	const CpuRt::MeshData mesh = objPath.empty() ?
+		FlattenInstances(CpuRt::CreateSphereMesh(max(1u, triangles / instanceCount)), CreateScatteredInstances(instanceCount)) : CpuRt::LoadObjMesh(objPath);
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+	const CpuRt::Bvh bvh = CpuRt::BuildSahBvh(mesh, {}, pool);
+	CpuRt::WideBvh<8> wide;
+	wide.Build(bvh);
+	printf("%s, %zu triangles, %u threads\n", objPath.empty() ? "scattered instances" : objPath.c_str(), mesh.TriangleCount(), pool.ThreadCount());
+
+	struct RaySet
+	{
+		const char* name;
+		uint32_t rayFlags;
+		vector<CpuRt::Ray> rays;
+	};
+	const RaySet sets[] = {
+		{ "camera, cull back", CpuRt::RayFlagCullBackFacingTriangles, CreateCameraRays(mesh, scene, render.width, render.height, 1) },
+		{ "shadow, first hit", CpuRt::RayFlagAcceptFirstHitAndEndSearch | CpuRt::RayFlagSkipClosestHitShader | CpuRt::RayFlagForceOpaque,
+			CreateShadowRays(bvh, mesh, scene, render, pool) },
+		{ "random, none", CpuRt::RayFlagNone, CreateRandomRays(bvh.NodeBounds(0), randomRays, 1234) },
+	};
+	for (const RaySet& set : sets)
+	{
+		const CpuRt::RuntimeRayFlags runtimeFlags = { set.rayFlags };
+		vector<CpuRt::RayHit> genericHits, staticHits, wideGenericHits, wideStaticHits;
+		double genericMs = 0.0, staticMs = 0.0, wideGenericMs = 0.0, wideStaticMs = 0.0;
+		for (int i = 0; i < iterations; i++)
+		{
+			genericMs += TraceEach(set.rays, genericHits, pool, [&](const CpuRt::Ray& ray, CpuRt::RayHit& hit)
+			{
+				hit.t = ray.tMax;
+				bvh.Traverse(0, ray, runtimeFlags, hit, [](uint32_t) {});
+			});
+			staticMs += TraceEach(set.rays, staticHits, pool, [&](const CpuRt::Ray& ray, CpuRt::RayHit& hit) { bvh.Intersect(ray, set.rayFlags, hit); });
+			wideGenericMs += TraceEach(set.rays, wideGenericHits, pool, [&](const CpuRt::Ray& ray, CpuRt::RayHit& hit) { wide.Traverse(ray, runtimeFlags, hit); });
+			wideStaticMs += TraceEach(set.rays, wideStaticHits, pool, [&](const CpuRt::Ray& ray, CpuRt::RayHit& hit) { wide.Intersect(ray, set.rayFlags, hit); });
+		}
+
+		const double mrays = set.rays.size() * iterations / 1000.0;
+		printf("  %-18s %8zu rays | binary runtime %6.2f, static %6.2f MRays/s %5.2fx | BVH8 runtime %6.2f, static %6.2f MRays/s %5.2fx", set.name,
+			set.rays.size(), mrays / genericMs, mrays / staticMs, genericMs / staticMs, mrays / wideGenericMs, mrays / wideStaticMs, wideGenericMs / wideStaticMs);
+		if (validate)
+		{
+			// The same kernel either way, the hits must be identical
+			size_t mismatches = 0;
+			for (size_t r = 0; r < set.rays.size(); r++)
+			{
+				mismatches += genericHits[r].primitive != staticHits[r].primitive || genericHits[r].t != staticHits[r].t;
+				mismatches += wideGenericHits[r].primitive != wideStaticHits[r].primitive || wideGenericHits[r].t != wideStaticHits[r].t;
+			}
+			printf(" | %zu mismatches", mismatches);
+		}
+		printf("\n");
+	}
+	return 0;
+}
+
+template<int W>
+static CpuRt::RenderStats BenchmarkBatchedShading(const CpuRt::Bvh& bvh, const CpuRt::MeshData& mesh, const CpuRt::SceneConstants& scene,
+	const CpuRt::RenderSettings& render, int iterations, ThreadPool& pool, vector<CpuRt::Float4>& output)
+{
+	CpuRt::RenderStats total;
+	for (int i = 0; i < iterations; i++)
+	{
+		const CpuRt::RenderStats stats = CpuRt::RenderBatched<W>(bvh, mesh, scene, render, output, pool);
+		total.milliseconds += stats.milliseconds;
+		total.rays += stats.rays;
+	}
+	return total;
+}
+
+// shading [-obj file | -triangles N] [-lanes 1,4,8,16] [-width N] [-height N] [-iterations N] [-threads N] [-validate]
+// : the shared shading functions (shaders/Shading.h) run for one hit per call (Render) vs W hits per call
+// (RenderBatched), traversal is the same scalar BVH walk in both
+static int RunShadingBenchmark(int argc, char** argv)
+{
+	CpuRt::RenderSettings render;
+	string objPath;
+	uint32_t triangles = 10000;
+	vector<int> widths = { 4, 8, 16 };
+	int iterations = 3;
+	unsigned threads = 0;
+	bool validate = false;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-obj") && i + 1 < argc) objPath = argv[++i];
+		else if (!strcmp(argv[i], "-triangles") && i + 1 < argc) triangles = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-lanes") && i + 1 < argc)
+		{
+			widths.clear();
+			for (const string& item : SplitList(argv[++i])) widths.push_back(atoi(item.c_str()));
+		}
+		else if (!strcmp(argv[i], "-width") && i + 1 < argc) render.width = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-height") && i + 1 < argc) render.height = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc) iterations = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threads = unsigned(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-validate")) validate = true;
+	}
+
+	ThreadPool pool(threads);
+	const CpuRt::MeshData mesh = LoadBenchmarkMesh(objPath, triangles);
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+	const CpuRt::Bvh bvh = CpuRt::BuildSahBvh(mesh, {}, pool);
+	printf("%zu triangles, %ux%u, %u threads, native SIMD width %d\n", mesh.TriangleCount(), render.width, render.height, pool.ThreadCount(), CpuRt::gNativeSimdWidth);
+
+	vector<CpuRt::Float4> reference, output;
+	CpuRt::RenderStats scalar;
+	for (int i = 0; i < iterations; i++)
+	{
+		const CpuRt::RenderStats stats = CpuRt::Render(bvh, mesh, scene, render, reference, pool);
+		scalar.milliseconds += stats.milliseconds;
+		scalar.rays += stats.rays;
+	}
+	printf("  1 hit per call:   %.2f ms/frame, %.2f MRays/s\n", scalar.milliseconds / iterations, scalar.MRaysPerSecond());
+
+	for (int width : widths)
+	{
+		CpuRt::RenderStats stats;
+		if (width == 1) stats = BenchmarkBatchedShading<1>(bvh, mesh, scene, render, iterations, pool, output);
+		else if (width == 4) stats = BenchmarkBatchedShading<4>(bvh, mesh, scene, render, iterations, pool, output);
+		else if (width == 8) stats = BenchmarkBatchedShading<8>(bvh, mesh, scene, render, iterations, pool, output);
+		else if (width == 16) stats = BenchmarkBatchedShading<16>(bvh, mesh, scene, render, iterations, pool, output);
+		else throw runtime_error("Error: shading batches are 1, 4, 8 or 16 hits wide");
+
+		printf("  %2d hits per call: %.2f ms/frame, %.2f MRays/s, %.2fx%s", width, stats.milliseconds / iterations, stats.MRaysPerSecond(),
+			stats.MRaysPerSecond() / scalar.MRaysPerSecond(), width > CpuRt::gNativeSimdWidth ? " (wider than the build target, plain loops)" : "");
+		// Same functions lane for lane, exact unless the compiler fuses multiply-adds differently on one side (FMA targets)
+		if (validate)
+		{
+			printf(" | validate: %zu pixels differ, %zu by more than 1/255", CountMismatches(output, reference, 0.0f),
+				CountMismatches(output, reference, 1.0f / 255.0f));
+		}
+		printf("\n");
+	}
+	return 0;
+}
+
+// Every 4th material the normal view, the rest diffuse with their own albedo
+static CpuRt::HitGroupTable<CpuRt::Tlas> CreateMaterialTable(uint32_t materials)
+{
+	CpuRt::HitGroupTable<CpuRt::Tlas> table;
+	for (uint32_t m = 0; m < materials; m++)
+	{
+		if (m % 4 == 3) table.Add<CpuRt::NormalHitGroup>();
+		else table.Add<CpuRt::DiffuseHitGroup>({ { 0.4f + 0.6f * float(m % 3) / 2.0f, 0.4f + 0.6f * float(m % 5) / 4.0f, 0.4f + 0.6f * float(m % 7) / 6.0f, 1.0f } });
+	}
+	return table;
+}
+
+// hitgroups [-instances N] [-triangles N] [-materials N] [-iterations N] [-threads N] [-validate]
+// : scattered instances with N materials, hit group records picked per instance through InstanceContributionToHitGroupIndex,
+// shaded one closest hit call per pixel vs one batch call per record and tile
+static int RunHitGroupBenchmark(int argc, char** argv)
+{
+	CpuRt::RenderSettings render;
+	uint32_t instanceCount = 256;
+	uint32_t triangles = 1000;
+	uint32_t materials = 16;
+	int iterations = 3;
+	unsigned threads = 0;
+	bool validate = false;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-instances") && i + 1 < argc) instanceCount = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-triangles") && i + 1 < argc) triangles = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-materials") && i + 1 < argc) materials = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc) iterations = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threads = unsigned(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-validate")) validate = true;
+	}
+
+	ThreadPool pool(threads);
+	const CpuRt::MeshData mesh = CpuRt::CreateSphereMesh(triangles);
+	const CpuRt::Bvh blas = CpuRt::BuildSahBvh(mesh, {}, pool);
+	vector<CpuRt::InstanceDesc> instances = CreateScatteredInstances(instanceCount);
+	for (uint32_t i = 0; i < instanceCount; i++) instances[i].instanceContributionToHitGroupIndex = i % materials;
+	CpuRt::Tlas tlas;
+	tlas.Build(instances, { &blas }, pool);
+
+	const CpuRt::HitGroupTable<CpuRt::Tlas> table = CreateMaterialTable(materials);
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+	printf("%u instances of %zu triangles, %u materials, %u threads, native SIMD width %d\n", instanceCount, mesh.TriangleCount(), materials,
+		pool.ThreadCount(), CpuRt::gNativeSimdWidth);
+
+	vector<CpuRt::Float4> reference, perHit, batched;
+	CpuRt::RenderStats single, perHitStats, batchedStats;
+	for (int i = 0; i < iterations; i++)
+	{
+		const CpuRt::RenderStats a = CpuRt::Render(tlas, mesh, scene, render, reference, pool);
+		const CpuRt::RenderStats b = CpuRt::RenderHitGroups(tlas, table, mesh, scene, render, perHit, pool);
+		const CpuRt::RenderStats c = CpuRt::RenderHitGroupsBatched(tlas, table, mesh, scene, render, batched, pool);
+		single.milliseconds += a.milliseconds;
+		single.rays += a.rays;
+		perHitStats.milliseconds += b.milliseconds;
+		perHitStats.rays += b.rays;
+		batchedStats.milliseconds += c.milliseconds;
+		batchedStats.rays += c.rays;
+	}
+	printf("  one hardcoded closest hit:   %.2f MRays/s\n", single.MRaysPerSecond());
+	printf("  hit group per pixel:         %.2f MRays/s\n", perHitStats.MRaysPerSecond());
+	printf("  hit groups batched by record: %.2f MRays/s, %.2fx per pixel", batchedStats.MRaysPerSecond(), batchedStats.MRaysPerSecond() / perHitStats.MRaysPerSecond());
+	// The diffuse batches run the SIMD instantiation of the shared shading, exact unless one side fuses multiply-adds
+	if (validate) printf(" | validate: %zu pixels differ, %zu by more than 1/255", CountMismatches(batched, perHit, 0.0f), CountMismatches(batched, perHit, 1.0f / 255.0f));
+	printf("\n");
+	return 0;
+}
+
+// visbuffer [-instances N] [-triangles N] [-materials N] [-width N] [-height N] [-iterations N] [-threads N] [-validate] [-out file.tga]
+// : frame time with the hit shading inline (per pixel and batched per tile) vs deferred through a visibility buffer
+static int RunVisibilityBufferBenchmark(int argc, char** argv)
+{
+	CpuRt::RenderSettings render;
+	uint32_t instanceCount = 256;
+	uint32_t triangles = 1000;
+	uint32_t materials = 16;
+	int iterations = 3;
+	unsigned threads = 0;
+	bool validate = false;
+	string outPath;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-instances") && i + 1 < argc) instanceCount = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-triangles") && i + 1 < argc) triangles = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-materials") && i + 1 < argc) materials = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-width") && i + 1 < argc) render.width = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-height") && i + 1 < argc) render.height = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc) iterations = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threads = unsigned(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-validate")) validate = true;
+		else if (!strcmp(argv[i], "-out") && i + 1 < argc) outPath = argv[++i];
+	}
+
+	ThreadPool pool(threads);
+	const CpuRt::MeshData mesh = CpuRt::CreateSphereMesh(triangles);
+	const CpuRt::Bvh blas = CpuRt::BuildSahBvh(mesh, {}, pool);
+	vector<CpuRt::InstanceDesc> instances = CreateScatteredInstances(instanceCount);
+	for (uint32_t i = 0; i < instanceCount; i++) instances[i].instanceContributionToHitGroupIndex = i % materials;
+	CpuRt::Tlas tlas;
+	tlas.Build(instances, { &blas }, pool);
+	const CpuRt::HitGroupTable<CpuRt::Tlas> table = CreateMaterialTable(materials);
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+	printf("%u instances of %zu triangles, %u materials, %ux%u, %u threads\n", instanceCount, mesh.TriangleCount(), materials, render.width, render.height,
+		pool.ThreadCount());
+
+	vector<CpuRt::Float4> inlined, tiles, deferred;
+	vector<CpuRt::VisibilitySample> visibility;
+	double inlineMs = 0.0, tileMs = 0.0;
+	CpuRt::VisibilityStats stats;
+	for (int i = 0; i < iterations; i++)
+	{
+		inlineMs += CpuRt::RenderHitGroups(tlas, table, mesh, scene, render, inlined, pool).milliseconds;
+		tileMs += CpuRt::RenderHitGroupsBatched(tlas, table, mesh, scene, render, tiles, pool).milliseconds;
+		const CpuRt::VisibilityStats frame = CpuRt::RenderVisibility(tlas, table, mesh, scene, render, visibility, deferred, pool);
+		stats.traceMilliseconds += frame.traceMilliseconds;
+		stats.binMilliseconds += frame.binMilliseconds;
+		stats.shadeMilliseconds += frame.shadeMilliseconds;
+	}
+	printf("  inline, per pixel:       %8.2f ms/frame\n", inlineMs / iterations);
+	printf("  inline, batched per tile: %7.2f ms/frame\n", tileMs / iterations);
+	printf("  visibility buffer:       %8.2f ms/frame (trace %.2f, bin %.2f, shade %.2f), %.2fx inline per pixel", stats.TotalMilliseconds() / iterations,
+		stats.traceMilliseconds / iterations, stats.binMilliseconds / iterations, stats.shadeMilliseconds / iterations, inlineMs / stats.TotalMilliseconds());
+	// Same shaders on the same hits, batched SIMD shading is exact unless one side fuses multiply-adds
+	if (validate) printf(" | validate: %zu pixels differ, %zu by more than 1/255", CountMismatches(deferred, inlined, 0.0f), CountMismatches(deferred, inlined, 1.0f / 255.0f));
+	printf("\n");
+
+	if (!outPath.empty() && !WriteTga(outPath, ToTexture(deferred, render.width, render.height)))
+	{
+		fprintf(stderr, "Failed to write %s\n", outPath.c_str());
+		return 1;
+	}
+	return 0;
+}
+
+// bvhcache [-obj file | -triangles N] [-builder sah|lbvh|sbvh] [-dir path] [-instances N] [-threads N] [-validate]
+// : what a mesh costs before its first ray, built vs mapped from the disk cache (BvhDiskCache.h), and the first frame
+// traced through each. With -instances the file carries the instance table and the frame goes through a TLAS.
+static int RunBvhCacheBenchmark(int argc, char** argv)
+{
+	CpuRt::BvhSettings settings;
+	CpuRt::RenderSettings render;
+	string objPath;
+	string directory = ".";
+	uint32_t triangles = 1000000;
+	uint32_t instanceCount = 0;
+	CpuRt::BvhBuildMode builder = CpuRt::BvhBuildMode::Sah;
+	unsigned threads = 0;
+	bool validate = false;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-obj") && i + 1 < argc) objPath = argv[++i];
+		else if (!strcmp(argv[i], "-triangles") && i + 1 < argc) triangles = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-builder") && i + 1 < argc) builder = CpuRt::ParseBvhBuildMode(argv[++i]);
+		else if (!strcmp(argv[i], "-dir") && i + 1 < argc) directory = argv[++i];
+		else if (!strcmp(argv[i], "-instances") && i + 1 < argc) instanceCount = uint32_t(max(0, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threads = unsigned(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-validate")) validate = true;
+	}
+
+	ThreadPool pool(threads);
+	const CpuRt::MeshData mesh = LoadBenchmarkMesh(objPath, triangles);
+	const vector<CpuRt::InstanceDesc> instances = CreateScatteredInstances(instanceCount);
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+
+	// Cold: key, build, write
+	auto start = chrono::high_resolution_clock::now();
+	const CpuRt::BvhDiskCacheKey key = CpuRt::MakeBvhDiskCacheKey(mesh, builder, settings, instances);
+	const double keyMs = ElapsedMs(start);
+	const string path = CpuRt::BvhDiskCachePath(directory, key);
+	start = chrono::high_resolution_clock::now();
+	const CpuRt::Bvh built = CpuRt::BuildBvh(mesh, builder, settings, pool);
+	const double buildMs = ElapsedMs(start);
+	start = chrono::high_resolution_clock::now();
+	const uint64_t fileBytes = CpuRt::WriteBvhDiskCache(path, key, built, instances);
+	const double writeMs = ElapsedMs(start);
+
+	// Warm: key, map
+	CpuRt::Bvh mapped;
+	CpuRt::BvhSpan<const CpuRt::InstanceDesc> mappedInstances;
+	start = chrono::high_resolution_clock::now();
+	if (!CpuRt::LoadBvhDiskCache(path, CpuRt::MakeBvhDiskCacheKey(mesh, builder, settings, instances), mapped, &mappedInstances))
+	{
+		fprintf(stderr, "Failed to load %s\n", path.c_str());
+		return 1;
+	}
+	const double loadMs = ElapsedMs(start);
+
+	printf("%zu triangles, %s, %u instances, %u threads, %s\n", mesh.TriangleCount(), CpuRt::BvhBuildModeName(builder), instanceCount, pool.ThreadCount(), path.c_str());
+	printf("  built:  %9.2f ms (hash %.2f, build %.2f), write %.2f ms, %.1f MB\n", keyMs + buildMs, keyMs, buildMs, writeMs, fileBytes / 1048576.0);
+	printf("  mapped: %9.2f ms (hash included), %.0fx faster to the first ray\n", loadMs, (keyMs + buildMs) / loadMs);
+
+	// First frame on each, the mapped one faults its pages in as it goes
+	vector<CpuRt::Float4> builtOutput, mappedOutput;
+	double builtTraceMs, mappedTraceMs;
+	if (instanceCount > 0)
+	{
+		CpuRt::Tlas builtTlas, mappedTlas;
+		builtTlas.Build(instances, { &built }, pool);
+		mappedTlas.Build(mappedInstances, { &mapped }, pool);
+		builtTraceMs = CpuRt::Render(builtTlas, mesh, scene, render, builtOutput, pool).milliseconds;
+		mappedTraceMs = CpuRt::Render(mappedTlas, mesh, scene, render, mappedOutput, pool).milliseconds;
+	}
+	else
+	{
+		builtTraceMs = CpuRt::Render(built, mesh, scene, render, builtOutput, pool).milliseconds;
+		mappedTraceMs = CpuRt::Render(mapped, mesh, scene, render, mappedOutput, pool).milliseconds;
+	}
+	printf("  first frame: built %.2f ms, mapped %.2f ms", builtTraceMs, mappedTraceMs);
+	if (validate) printf(" | validate: %zu pixels differ", CountMismatches(mappedOutput, builtOutput, 0.0f));
+	printf("\n");
+
+	// The one call path a loader takes, the file written above is a hit now
+	CpuRt::BvhDiskCacheStats cacheStats;
+	CpuRt::BuildBvhCached(directory, mesh, builder, settings, instances, &cacheStats, pool);
+	printf("  BuildBvhCached: %s, %.2f ms\n", cacheStats.hit ? "hit" : "miss", cacheStats.keyMilliseconds + cacheStats.loadMilliseconds + cacheStats.buildMilliseconds);
+	return 0;
+}
+
+// paging [-obj file | -triangles N] [-treelet KB] [-budgets 100,50,25,10] [-batch N] [-rays N] [-file path] [-threads N] [-validate]
+// : out of core tracing (BvhPaging.h) with the treelets under a memory budget, given in percent of all treelet
+// bytes, for camera rays and incoherent random rays, against the fully resident Bvh. Each set runs in at least
+// gPagingMinBatches batches, a batch loads every treelet it needs so eviction only shows between batches. Without
+// -file the paged file goes to the temp directory and is removed at the end.
+constexpr size_t gPagingMinBatches = 8;
+
+static int RunPagingBenchmark(int argc, char** argv)
+{
+	CpuRt::RenderSettings render;
+	string objPath;
+	string path;
+	uint32_t triangles = 1000000;
+	uint32_t treeletKb = CpuRt::gPagedBvhTreeletBytes / 1024;
+	vector<unsigned> budgets = { 100, 50, 25, 10 };
+	size_t batchSize = 65536;
+	size_t randomRays = 262144;
+	unsigned threads = 0;
+	bool validate = false;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-obj") && i + 1 < argc) objPath = argv[++i];
+		else if (!strcmp(argv[i], "-triangles") && i + 1 < argc) triangles = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-treelet") && i + 1 < argc) treeletKb = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-budgets") && i + 1 < argc)
+		{
+			budgets.clear();
+			for (const string& item : SplitList(argv[++i])) budgets.push_back(unsigned(atoi(item.c_str())));
+		}
+		else if (!strcmp(argv[i], "-batch") && i + 1 < argc) batchSize = size_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-rays") && i + 1 < argc) randomRays = size_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-file") && i + 1 < argc) path = argv[++i];
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threads = unsigned(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-validate")) validate = true;
+	}
+
+	const bool temporaryFile = path.empty();
+	if (temporaryFile) path = (filesystem::temp_directory_path() / "kepler-paged.kbpg").string();
+
+	ThreadPool pool(threads);
+	const CpuRt::MeshData mesh = LoadBenchmarkMesh(objPath, triangles);
+	const CpuRt::Bvh bvh = CpuRt::BuildSahBvh(mesh, {}, pool);
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+
+	auto start = chrono::high_resolution_clock::now();
+	const uint64_t fileBytes = CpuRt::WritePagedBvh(path, bvh, treeletKb * 1024);
+	const double writeMs = ElapsedMs(start);
+	CpuRt::PagedBvh paged;
+	paged.Open(path);
+	printf("%zu triangles, %u threads, %s: %.1f MB, %u treelets of up to %u KB, %zu top nodes (%.1f KB), written in %.1f ms\n", mesh.TriangleCount(),
+		pool.ThreadCount(), path.c_str(), fileBytes / 1048576.0, paged.TreeletCount(), treeletKb, paged.TopNodes().size(),
+		paged.TopNodes().size() * sizeof(CpuRt::BvhNode) / 1024.0, writeMs);
+
+	struct RaySet
+	{
+		const char* name;
+		uint32_t rayFlags;
+		vector<CpuRt::Ray> rays;
+	};
+	const RaySet sets[] = {
+		{ "camera", CpuRt::RayFlagCullBackFacingTriangles, CreateCameraRays(mesh, scene, render.width, render.height, 1) },
+		{ "random", CpuRt::RayFlagNone, CreateRandomRays(bvh.NodeBounds(0), randomRays, 1234) },
+	};
+
+	for (const RaySet& set : sets)
+	{
+		vector<CpuRt::RayHit> reference;
+		const double residentMs = TraceRaySet(bvh, set.rays, set.rayFlags, reference, pool);
+		const size_t setBatchSize = max<size_t>(1, min(batchSize, (set.rays.size() + gPagingMinBatches - 1) / gPagingMinBatches));
+		printf("%s, %zu rays in batches of %zu: resident %.2f MRays/s\n", set.name, set.rays.size(), setBatchSize, set.rays.size() / (residentMs * 1000.0));
+
+		for (unsigned budget : budgets)
+		{
+			CpuRt::TreeletCache cache(paged, paged.TreeletBytes() * budget / 100);
+			vector<CpuRt::Ray> batch;
+			vector<CpuRt::RayHit> batchHits, hits;
+			CpuRt::OutOfCoreStats total;
+			for (size_t first = 0; first < set.rays.size(); first += setBatchSize)
+			{
+				batch.assign(set.rays.begin() + first, set.rays.begin() + min(set.rays.size(), first + setBatchSize));
+				const CpuRt::OutOfCoreStats stats = CpuRt::TraceOutOfCore(paged, cache, batch, set.rayFlags, batchHits, pool);
+				total.rays += stats.rays;
+				total.deferred += stats.deferred;
+				total.milliseconds += stats.milliseconds;
+				hits.insert(hits.end(), batchHits.begin(), batchHits.end());
+			}
+
+			const CpuRt::TreeletCacheStats& cacheStats = cache.Stats();
+			printf("  %3u%% resident (%6.1f MB): hit rate %5.1f%% (%5.1f%% of bytes), %6llu visits, %6llu loads, %6llu evictions, %7.1f MB read (%.0f ms), %.2f deferred/ray | %.2f MRays/s, %.2fx resident",
+				budget, cache.BudgetBytes() / 1048576.0, 100.0 * cacheStats.HitRate(), 100.0 * cacheStats.ByteHitRate(), (unsigned long long)cacheStats.visits,
+				(unsigned long long)cacheStats.loads, (unsigned long long)cacheStats.evictions,
+				cacheStats.bytesRead / 1048576.0, cacheStats.loadMilliseconds, double(total.deferred) / total.rays, total.MRaysPerSecond(), residentMs / total.milliseconds);
+			if (validate)
+			{
+				// The same closest hits, unless two triangles are hit at the same t and the visiting order picks another
+				size_t mismatches = 0;
+				for (size_t i = 0; i < hits.size(); i++) mismatches += hits[i].primitive != reference[i].primitive || hits[i].t != reference[i].t;
+				printf(" | validate: %zu of %zu hits differ", mismatches, hits.size());
+			}
+			printf("\n");
+		}
+	}
+
+	paged.Close();
+	if (temporaryFile) remove(path.c_str());
+	return 0;
+}
+
+// numa [-obj file | -triangles N] [-split N] [-threads N] [-replica N] [-width N] [-height N] [-iterations N] [-validate]
+// : NumaRenderer (NumaRender.h) on 1 to all memory nodes, against Render on one pool of as many threads; -split cuts
+// the machine's CPUs into N nodes to try the node queues and stealing on one socket
+static int RunNumaBenchmark(int argc, char** argv)
+{
+	CpuRt::RenderSettings render;
+	string objPath;
+	uint32_t triangles = 1000000;
+	uint32_t split = 0;
+	unsigned threadsPerNode = 0;
+	uint32_t replicaNodes = CpuRt::gNumaReplicaNodes;
+	int iterations = 5;
+	bool validate = false;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-obj") && i + 1 < argc) objPath = argv[++i];
+		else if (!strcmp(argv[i], "-triangles") && i + 1 < argc) triangles = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-split") && i + 1 < argc) split = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threadsPerNode = unsigned(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-replica") && i + 1 < argc) replicaNodes = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-width") && i + 1 < argc) render.width = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-height") && i + 1 < argc) render.height = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-iterations") && i + 1 < argc) iterations = max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-validate")) validate = true;
+	}
+
+	vector<CpuRt::NumaNode> nodes = CpuRt::DetectNumaNodes();
+	printf("%zu memory node(s):", nodes.size());
+	for (const CpuRt::NumaNode& node : nodes) printf(" node%u %zu CPUs", node.id, node.cpus.size());
+	printf("\n");
+	if (split) nodes = CpuRt::SplitNumaNodes(nodes, split);
+
+	const CpuRt::MeshData mesh = LoadBenchmarkMesh(objPath, triangles);
+	const CpuRt::Bvh bvh = CpuRt::BuildSahBvh(mesh);
+	const CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+	printf("%zu triangles, %ux%u, %zu BVH nodes, top %u replicated per node\n", mesh.TriangleCount(), render.width, render.height, bvh.Nodes().size(), replicaNodes);
+
+	double firstMRays = 0.0;
+	for (size_t count = 1; count <= nodes.size(); count++)
+	{
+		CpuRt::NumaRenderer renderer(vector<CpuRt::NumaNode>(nodes.begin(), nodes.begin() + count), threadsPerNode);
+		renderer.SetBvh(bvh, replicaNodes);
+
+		vector<CpuRt::Float4> output;
+		CpuRt::NumaRenderStats best;
+		for (int iteration = 0; iteration < iterations; iteration++)
+		{
+			const CpuRt::NumaRenderStats stats = renderer.Render(mesh, scene, render, output);
+			if (iteration == 0 || stats.milliseconds < best.milliseconds) best = stats;
+		}
+
+		// The same threads unpinned, sharing one tree, one tile queue and the output
+		ThreadPool pool(renderer.ThreadCount());
+		vector<CpuRt::Float4> reference;
+		double sharedMs = 0.0;
+		for (int iteration = 0; iteration < iterations; iteration++)
+		{
+			const double ms = CpuRt::Render(bvh, mesh, scene, render, reference, pool).milliseconds;
+			if (iteration == 0 || ms < sharedMs) sharedMs = ms;
+		}
+
+		if (count == 1) firstMRays = best.MRaysPerSecond();
+		printf("  %zu node(s), %u threads: %.2f MRays/s (%.2fx 1 node), %u tiles stolen, copy %.2f ms | shared Render %.2f MRays/s, numa %.2fx",
+			count, renderer.ThreadCount(), best.MRaysPerSecond(), best.MRaysPerSecond() / firstMRays, best.stolenTiles, best.copyMilliseconds,
+			best.rays / (sharedMs * 1000.0), sharedMs / best.milliseconds);
+		if (validate) printf(" | validate: %zu of %zu pixels differ by more than 1/255", CountMismatches(output, reference, 1.0f / 255.0f), output.size());
+		printf("\n");
+	}
+	return 0;
+}
+
+// RMSE over the color channels
+static double ImageRmse(const vector<CpuRt::Float4>& a, const vector<CpuRt::Float4>& b)
+{
+	double sum = 0.0;
+	for (size_t i = 0; i < a.size(); i++)
+	{
+		const double r = a[i].x - b[i].x, g = a[i].y - b[i].y, bl = a[i].z - b[i].z;
+		sum += r * r + g * g + bl * bl;
+	}
+	return sqrt(sum / (3.0 * max<size_t>(1, a.size())));
+}
+
+// Averages of block x block pixels, what is left of the error at low frequencies
+static vector<CpuRt::Float4> AverageBlocks(const vector<CpuRt::Float4>& image, uint32_t width, uint32_t height, uint32_t block)
+{
+	const uint32_t blocksX = width / block, blocksY = height / block;
+	vector<CpuRt::Float4> averages(size_t(blocksX) * blocksY, { 0.0f, 0.0f, 0.0f, 0.0f });
+	for (uint32_t y = 0; y < blocksY * block; y++)
+	{
+		for (uint32_t x = 0; x < blocksX * block; x++)
+		{
+			CpuRt::Float4& average = averages[size_t(y / block) * blocksX + x / block];
+			average = average + image[size_t(y) * width + x] * (1.0f / float(block * block));
+		}
+	}
+	return averages;
+}
+
+// sampling [-obj file | -instances N] [-triangles N] [-samplers random,sobol,lattice,bluenoise] [-spp 1,2,4,...] [-reference N] [-light X] [-width N] [-height N] [-threads N] [-validate] [-out prefix]
+// : error against a reference render per sampler (Sampling.h) and samples per pixel, for pixel jitter and the soft
+// shadows of a square light of half size X. The second table averages 4x4 pixel blocks first, blue noise moves its
+// error to frequencies that averaging removes. -validate checks the stratification the samplers promise.
+static int RunSamplingBenchmark(int argc, char** argv)
+{
+	CpuRt::RenderSettings render;
+	render.width = 320;
+	render.height = 180;
+	string objPath, outPrefix;
+	uint32_t instanceCount = 64;
+	uint32_t triangles = 65536;
+	uint32_t referenceSamples = 1024;
+	float lightSize = 0.5f;
+	vector<string> samplers = { "random", "sobol", "lattice", "bluenoise" };
+	vector<unsigned> sampleCounts = { 1, 2, 4, 8, 16, 32, 64 };
+	unsigned threads = 0;
+	bool validate = false;
+	for (int i = 0; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-obj") && i + 1 < argc) objPath = argv[++i];
+		else if (!strcmp(argv[i], "-instances") && i + 1 < argc) instanceCount = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-triangles") && i + 1 < argc) triangles = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-samplers") && i + 1 < argc) samplers = SplitList(argv[++i]);
+		else if (!strcmp(argv[i], "-spp") && i + 1 < argc)
+		{
+			sampleCounts.clear();
+			for (const string& item : SplitList(argv[++i])) sampleCounts.push_back(unsigned(max(1, atoi(item.c_str()))));
+		}
+		else if (!strcmp(argv[i], "-reference") && i + 1 < argc) referenceSamples = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-light") && i + 1 < argc) lightSize = float(atof(argv[++i]));
+		else if (!strcmp(argv[i], "-width") && i + 1 < argc) render.width = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-height") && i + 1 < argc) render.height = uint32_t(max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threads = unsigned(atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-validate")) validate = true;
+		else if (!strcmp(argv[i], "-out") && i + 1 < argc) outPrefix = argv[++i];
+	}
+
+	ThreadPool pool(threads);
+	const CpuRt::MeshData mesh = objPath.empty() ? FlattenInstances(CpuRt::CreateSphereMesh(max(1u, triangles / instanceCount)), CreateScatteredInstances(instanceCount)) :
+		CpuRt::LoadObjMesh(objPath);
+	const CpuRt::Bvh bvh = CpuRt::BuildSahBvh(mesh, {}, pool);
+	CpuRt::SceneConstants scene = CpuRt::DefaultSceneConstants(render.width, render.height);
+	scene.lightSize = lightSize;
+
+	auto start = chrono::high_resolution_clock::now();
+	const vector<CpuRt::UINT>& blueNoise = CpuRt::BlueNoiseTile();
+	const double blueNoiseMs = ElapsedMs(start);
+
+	// Sobol with a seed none of the measured renders use, far more converged than any of them
+	vector<CpuRt::Float4> reference;
+	scene.sampler = CpuRt::gSamplerSobol;
+	scene.samplesPerPixel = referenceSamples;
+	scene.samplerSeed = 0x9e3779b9u;
+	const double referenceMs = CpuRt::Render(bvh, mesh, scene, render, reference, pool).milliseconds;
+	printf("%zu triangles, %ux%u, %u threads, light half size %.2f, blue noise tile %ux%u in %.1f ms, reference %u spp in %.0f ms\n",
+		mesh.TriangleCount(), render.width, render.height, pool.ThreadCount(), lightSize, CpuRt::gBlueNoiseTileSize, CpuRt::gBlueNoiseTileSize,
+		blueNoiseMs, referenceSamples, referenceMs);
+	if (!outPrefix.empty()) WriteTga(outPrefix + "_reference.tga", ToTexture(reference, render.width, render.height));
+
+	const uint32_t block = 4;
+	const vector<CpuRt::Float4> referenceBlocks = AverageBlocks(reference, render.width, render.height, block);
+	vector<vector<double>> errors(samplers.size()), blockErrors(samplers.size());
+	for (size_t s = 0; s < samplers.size(); s++)
+	{
+		scene.sampler = CpuRt::ParseSampler(samplers[s].c_str());
+		scene.samplerSeed = 1;
+		for (unsigned samples : sampleCounts)
+		{
+			vector<CpuRt::Float4> output;
+			scene.samplesPerPixel = samples;
+			CpuRt::Render(bvh, mesh, scene, render, output, pool);
+			errors[s].push_back(ImageRmse(output, reference));
+			blockErrors[s].push_back(ImageRmse(AverageBlocks(output, render.width, render.height, block), referenceBlocks));
+			if (!outPrefix.empty()) WriteTga(outPrefix + "_" + samplers[s] + "_" + to_string(samples) + ".tga", ToTexture(output, render.width, render.height));
+		}
+	}
+
+	// Slope of log error over log samples between the first and the last count, -0.5 is Monte Carlo
+	const auto printTable = [&](const char* title, const vector<vector<double>>& table)
+	{
+		printf("%s\n  %-10s", title, "spp");
+		for (unsigned samples : sampleCounts) printf(" %9u", samples);
+		printf(" | slope\n");
+		for (size_t s = 0; s < samplers.size(); s++)
+		{
+			printf("  %-10s", samplers[s].c_str());
+			for (double error : table[s]) printf(" %9.5f", error);
+			const double slope = sampleCounts.size() > 1 && table[s].front() > 0.0 && table[s].back() > 0.0 ?
+				log(table[s].back() / table[s].front()) / log(double(sampleCounts.back()) / sampleCounts.front()) : 0.0;
+			printf(" | %5.2f\n", slope);
+		}
+	};
+	printTable("RMSE against the reference", errors);
+	printTable("RMSE of 4x4 pixel block averages", blockErrors);
+
+	if (validate)
+	{
+		// Owen scrambling keeps Sobol dimensions 0 and 1 a (0,2)-sequence: the first 2^k samples of any pixel put one
+		// point in every elementary interval of area 2^-k. Lattice dimensions each take every 2^-k stratum once.
+		size_t netFailures = 0, latticeFailures = 0;
+		for (uint32_t pixel = 0; pixel < 16; pixel++)
+		{
+			const uint32_t pixelSeed = CpuRt::PixelSeed(1, pixel, 0);
+			for (uint32_t k = 0; k <= 10; k++)
+			{
+				const uint32_t count = 1u << k;
+				for (uint32_t a = 0; a <= k; a++)
+				{
+					vector<uint32_t> cells(count, 0);
+					for (uint32_t i = 0; i < count; i++)
+					{
+						const float x = CpuRt::PixelSampleDimension(CpuRt::gSamplerSobol, pixelSeed, i, 0, 0);
+						const float y = CpuRt::PixelSampleDimension(CpuRt::gSamplerSobol, pixelSeed, i, 1, 0);
+						cells[uint32_t(y * float(1u << (k - a))) << a | uint32_t(x * float(1u << a))]++;
+					}
+					for (uint32_t cell : cells) netFailures += cell != 1;
+				}
+				for (uint32_t dimension = 0; dimension < CpuRt::gSamplingDimensions; dimension++)
+				{
+					vector<uint32_t> strata(count, 0);
+					for (uint32_t i = 0; i < count; i++) strata[uint32_t(CpuRt::PixelSampleDimension(CpuRt::gSamplerLattice, pixelSeed, i, dimension, 0) * float(count))]++;
+					for (uint32_t stratum : strata) latticeFailures += stratum != 1;
+				}
+			}
+		}
+		vector<uint32_t> ranks(blueNoise.size(), 0);
+		for (CpuRt::UINT rotation : blueNoise) ranks[rotation >> 20]++;
+		const size_t rankFailures = size_t(count_if(ranks.begin(), ranks.end(), [](uint32_t n) { return n != 1; }));
+		printf("validate: %zu Sobol elementary intervals without exactly one point, %zu lattice strata without exactly one point, %zu blue noise ranks not used once\n",
+			netFailures, latticeFailures, rankFailures);
+	}
+	return 0;
+}
+
+static void PrintUsage()
+{
+	printf("usage: kepler-headless <command> [args]\n");
+	printf("  atlas [-page N] [-padding N] [-mips N] [-out prefix] [-synthetic N] textures...   pack small textures into atlases/arrays\n");
+	printf("  jpeg [-iterations N] files...   benchmark reduced resolution JPEG decode\n");
+	printf("  pack [-out file] [-root dir] [-page N] materials.mtl...   build a texture pack from the materials' textures\n");
+	printf("  trace [-width N] [-height N] [-tile N] [-iterations N] [-obj file] [-out file.tga]   CPU reference render\n");
+	printf("  bvh [-obj file | -triangles N] [-builder sah,lbvh,sbvh] [-threads 1,2,...] [-iterations N] [-bins N] [-leaf N] [-morton 30|63] [-treelets N] [-validate]   BVH build benchmark\n");
+	printf("  refit [-obj file | -triangles N] [-frames N] [-twist radians] [-builder sah|lbvh|sbvh] [-threshold X] [-threads N]   BVH refit vs rebuild on a deforming mesh\n");
+	printf("  tlas [-instances N] [-triangles N] [-iterations N] [-threads N] [-validate] [-out file.tga]   two-level acceleration structure build and trace\n");
+	printf("  packet [-obj file | -triangles N] [-lanes 8,16] [-width N] [-height N] [-iterations N] [-threads N] [-validate]   scalar vs packet camera ray traversal\n");
+	printf("  wide [-triangles N] [-instances N] [-lanes 4,8] [-leaf N] [-wideleaf N] [-iterations N] [-threads N] [-validate]   binary vs quantized BVH4 / BVH8\n");
+	printf("  layout [-triangles N] [-leaf N] [-rays N] [-layouts dfs,veb,hot] [-iterations N] [-threads N] [-validate]   BVH node layouts and prefetch, cache misses and trace speed\n");
+	printf("  sbvh [-obj file | -rooms N] [-floors N] [-budget X] [-alpha X] [-leaf N] [-rays N] [-iterations N] [-threads N] [-validate]   binned SAH vs spatial split BVH\n");
+	printf("  triangles [-obj file | -triangles N] [-lanes 1,4,8] [-kernels mt,plucker,watertight] [-leaf N] [-rays N] [-iterations N] [-threads N] [-validate]   ray/triangle kernels over SoA triangle blocks\n");
+	printf("  pairs [-obj file | -triangles N] [-rooms N] [-lanes 4,8] [-leaf N] [-rays N] [-iterations N] [-threads N] [-validate]   triangle pairs vs single triangles in BVH leaves\n");
+	printf("  raysort [-triangles N,...] [-rays N,...] [-originbits N] [-directionbits N] [-iterations N] [-threads N] [-validate]   secondary rays traced as generated vs sorted by origin and direction\n");
+	printf("  pathtrace [-obj file | -triangles N] [-spp N] [-bounces N] [-roulette N] [-wave N] [-width N] [-height N] [-iterations N] [-threads N] [-validate] [-out file.tga]   megakernel vs wavefront path tracing\n");
+	printf("  occlusion [-obj file | -triangles N] [-rays N] [-iterations N] [-threads N] [-validate]   occlusion queries vs closest hit traversal\n");
+	printf("  rayflags [-obj file | -triangles N] [-rays N] [-iterations N] [-threads N] [-validate]   runtime vs compile time specialized ray flags in traversal\n");
+	printf("  shading [-obj file | -triangles N] [-lanes 1,4,8,16] [-width N] [-height N] [-iterations N] [-threads N] [-validate]   shared HLSL/C++ shading, one hit vs W hits per call\n");
+	printf("  hitgroups [-instances N] [-triangles N] [-materials N] [-iterations N] [-threads N] [-validate]   CPU hit group table, closest hit per pixel vs batched by record\n");
+	printf("  visbuffer [-instances N] [-triangles N] [-materials N] [-width N] [-height N] [-iterations N] [-threads N] [-validate] [-out file.tga]   inline vs visibility buffer deferred hit shading\n");
+	printf("  bvhcache [-obj file | -triangles N] [-builder sah|lbvh|sbvh] [-dir path] [-instances N] [-threads N] [-validate]   BVH build vs memory mapped load from the disk cache\n");
+	printf("  paging [-obj file | -triangles N] [-treelet KB] [-budgets 100,50,25,10] [-batch N] [-rays N] [-file path] [-threads N] [-validate]   out of core BVH treelets under a memory budget\n");
+	printf("  numa [-obj file | -triangles N] [-split N] [-threads N] [-replica N] [-width N] [-height N] [-iterations N] [-validate]   NUMA aware rendering on 1 to all memory nodes\n");
+	printf("  sampling [-obj file | -instances N] [-triangles N] [-samplers random,sobol,lattice,bluenoise] [-spp 1,2,4,...] [-reference N] [-light X] [-width N] [-height N] [-threads N] [-validate] [-out prefix]   pixel jitter and light sample generators, error vs samples per pixel\n");
+	printf("  ttff [-first N] [-root dir] [-iterations N] [-warm] pack materials.mtl...   time to first frame, loose files vs texture pack\n");
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	try
+	{
+		const string command = argv[1];
+		if (command == "atlas") return RunAtlas(argc - 2, argv + 2);
+		if (command == "jpeg") return RunJpegBenchmark(argc - 2, argv + 2);
+		if (command == "pack") return RunPack(argc - 2, argv + 2);
+		if (command == "ttff") return RunTimeToFirstFrame(argc - 2, argv + 2);
+		if (command == "trace") return RunTrace(argc - 2, argv + 2);
+		if (command == "bvh") return RunBvhBenchmark(argc - 2, argv + 2);
+		if (command == "refit") return RunRefitBenchmark(argc - 2, argv + 2);
+		if (command == "tlas") return RunTlasBenchmark(argc - 2, argv + 2);
+		if (command == "packet") return RunPacketBenchmark(argc - 2, argv + 2);
+		if (command == "wide") return RunWideBvhBenchmark(argc - 2, argv + 2);
+		if (command == "layout") return RunLayoutBenchmark(argc - 2, argv + 2);
+		if (command == "sbvh") return RunSbvhBenchmark(argc - 2, argv + 2);
+		if (command == "triangles") return RunTriangleBenchmark(argc - 2, argv + 2);
+		if (command == "pairs") return RunTrianglePairBenchmark(argc - 2, argv + 2);
+		if (command == "raysort") return RunRaySortBenchmark(argc - 2, argv + 2);
+		if (command == "pathtrace") return RunPathTraceBenchmark(argc - 2, argv + 2);
+		if (command == "occlusion") return RunOcclusionBenchmark(argc - 2, argv + 2);
+		if (command == "rayflags") return RunRayFlagBenchmark(argc - 2, argv + 2);
+		if (command == "shading") return RunShadingBenchmark(argc - 2, argv + 2);
+		if (command == "hitgroups") return RunHitGroupBenchmark(argc - 2, argv + 2);
+		if (command == "visbuffer") return RunVisibilityBufferBenchmark(argc - 2, argv + 2);
+		if (command == "bvhcache") return RunBvhCacheBenchmark(argc - 2, argv + 2);
+		if (command == "paging") return RunPagingBenchmark(argc - 2, argv + 2);
+		if (command == "numa") return RunNumaBenchmark(argc - 2, argv + 2);
+		if (command == "sampling") return RunSamplingBenchmark(argc - 2, argv + 2);
+	}
+	catch (const exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	PrintUsage();
+	return 1;
+}
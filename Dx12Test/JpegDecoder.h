@@ -0,0 +1,893 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "ThreadPool.h"
+
+/*
+ ------------------------------Reduced Resolution JPEG Decode------------------------------------
+ Decodes baseline and progressive huffman JPEGs directly at 1/2, 1/4 or 1/8 of their size.
+ Only the top-left KxK (K = 8 / scale) DCT coefficients of every block are kept and fed to a KxK IDCT whose
+ basis carries the box filter of the skipped samples, so the result is close to a box downsample of the full
+ decode (minus the aliasing of the dropped frequencies) while coefficient memory, IDCT and color conversion
+ shrink by scale^2.
+ Entropy decoding skips the value bits of dropped coefficients together with their code, and progressive AC
+ scans that only carry dropped coefficients (and are not refined by a kept scan) are not decoded at all.
+ Restart intervals are decoded in parallel, IDCT and color conversion run in parallel over block rows.
+ Anything else (arithmetic coding, 12 bit, CMYK, ...) returns false so the caller can fall back to stb_image.
+*/
+
+namespace Jpeg
+{
+	static const uint8_t gDezigzag[64] =
+	{
+		0,  1,  8, 16,  9,  2,  3, 10,
+		17, 24, 32, 25, 18, 11,  4,  5,
+		12, 19, 26, 33, 40, 48, 41, 34,
+		27, 20, 13,  6,  7, 14, 21, 28,
+		35, 42, 49, 56, 57, 50, 43, 36,
+		29, 22, 15, 23, 30, 37, 44, 51,
+		58, 59, 52, 45, 38, 31, 39, 46,
+		53, 60, 61, 54, 47, 55, 62, 63
+	};
+
+	constexpr int gFastBits = 9;
+
+	inline int PopCount64(uint64_t x)
+	{
+#ifdef _MSC_VER
+		return static_cast<int>(__popcnt64(x));
+#else
+		return __builtin_popcountll(x);
+#endif
+	}
+
+	// x != 0
+	inline int CountTrailingZeros64(uint64_t x)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward64(&index, x);
+		return static_cast<int>(index);
+#else
+		return __builtin_ctzll(x);
+#endif
+	}
+
+	struct HuffmanTable
+	{
+		uint16_t fast[1 << gFastBits];	// (length << 8) | symbol, 0 when the code is longer than gFastBits
+		uint16_t fastSkip[1 << gFastBits];	// AC only: ((length + value bits) << 8) | symbol
+		uint8_t values[256];
+		int32_t maxCode[18];			// largest code of each length, left aligned to 16 bits
+		int32_t delta[17];				// value index = code + delta[length]
+		bool defined = false;
+	};
+
+	struct Component
+	{
+		int id = 0;
+		int h = 1, v = 1;
+		int quantTable = 0;
+		int dcTable = 0, acTable = 0;
+		int blocksW = 0, blocksH = 0;		// blocks covering the image, non interleaved scans walk these
+		int paddedBlocksW = 0;				// blocks covering the MCU padded image, the storage stride
+		int paddedBlocksH = 0;
+		std::vector<int16_t> coefs;			// K*K natural order coefficients per block
+		std::vector<uint64_t> nonzero;		// progressive only: zigzag bitmask of non-zero coefficients
+		std::vector<uint8_t> samples;		// decoded plane at 1/scale, paddedBlocksW*K wide
+	};
+
+	struct BitReader
+	{
+		const uint8_t* data = nullptr;
+		size_t pos = 0;
+		size_t end = 0;
+		uint64_t buffer = 0;
+		int bits = 0;
+		bool hitMarker = false;
+
+		void Reset(const uint8_t* d, size_t begin, size_t e)
+		{
+			data = d; pos = begin; end = e;
+			buffer = 0; bits = 0; hitMarker = false;
+		}
+
+		// Past a marker (or the end of the scan) the stream is padded with zeros
+		void Fill()
+		{
+			while (bits <= 56)
+			{
+				uint32_t byte = 0;
+				if (!hitMarker && pos < end)
+				{
+					byte = data[pos];
+					if (byte == 0xFF)
+					{
+						const uint8_t next = (pos + 1 < end) ? data[pos + 1] : 0xD9;
+						if (next == 0x00) pos += 2;
+						else { hitMarker = true; byte = 0; }
+					}
+					else pos++;
+				}
+				buffer |= uint64_t(byte) << (56 - bits);
+				bits += 8;
+			}
+		}
+
+		uint32_t Peek(int n) { if (bits < n) Fill(); return uint32_t(buffer >> (64 - n)); }
+		void Skip(int n) { buffer <<= n; bits -= n; }
+		uint32_t GetBits(int n) { if (n == 0) return 0; uint32_t v = Peek(n); Skip(n); return v; }
+		uint32_t GetBit() { return GetBits(1); }
+		void SkipBits(int n) { for (; n > 32; n -= 32) GetBits(32); GetBits(n); }
+
+		int Receive(int n)
+		{
+			if (n == 0) return 0;
+			int v = static_cast<int>(GetBits(n));
+			return v < (1 << (n - 1)) ? v - (1 << n) + 1 : v;
+		}
+
+		// AC symbol with its value bits consumed but not read, for coefficients nobody keeps
+		int SkipCoefficient(const HuffmanTable& table)
+		{
+			if (bits < 32) Fill();
+			const uint32_t fast = table.fastSkip[buffer >> (64 - gFastBits)];
+			if (fast)
+			{
+				Skip(fast >> 8);
+				return fast & 0xFF;
+			}
+
+			const int rs = Decode(table);
+			GetBits(rs & 15);
+			return rs;
+		}
+
+		int Decode(const HuffmanTable& table)
+		{
+			if (bits < 16) Fill();
+			const uint32_t fast = table.fast[buffer >> (64 - gFastBits)];
+			if (fast)
+			{
+				Skip(fast >> 8);
+				return fast & 0xFF;
+			}
+
+			const int32_t code16 = static_cast<int32_t>(buffer >> 48);
+			for (int length = gFastBits + 1; length <= 16; length++)
+			{
+				if (code16 <= table.maxCode[length])
+				{
+					const int32_t code = code16 >> (16 - length);
+					Skip(length);
+					return table.values[(code + table.delta[length]) & 0xFF];
+				}
+			}
+			Skip(16);	// corrupt code, keep going with garbage rather than loop forever
+			return 0;
+		}
+	};
+
+	static void BuildHuffmanTable(HuffmanTable& table, const uint8_t counts[16], const uint8_t* values, int valueCount)
+	{
+		memset(table.fast, 0, sizeof(table.fast));
+		memset(table.fastSkip, 0, sizeof(table.fastSkip));
+		memcpy(table.values, values, valueCount);
+
+		int32_t code = 0;
+		int index = 0;
+		for (int length = 1; length <= 16; length++)
+		{
+			table.delta[length] = index - code;
+			for (int i = 0; i < counts[length - 1]; i++, index++, code++)
+			{
+				if (length <= gFastBits)
+				{
+					const int first = code << (gFastBits - length);
+					const int fill = 1 << (gFastBits - length);
+					for (int j = 0; j < fill; j++)
+					{
+						table.fast[first + j] = static_cast<uint16_t>((length << 8) | values[index]);
+						table.fastSkip[first + j] = static_cast<uint16_t>(((length + (values[index] & 15)) << 8) | values[index]);
+					}
+				}
+			}
+			table.maxCode[length] = counts[length - 1] ? ((code - 1) << (16 - length)) | ((1 << (16 - length)) - 1) : -1;
+			code <<= 1;
+		}
+		table.maxCode[17] = INT32_MAX;
+		table.defined = true;
+	}
+
+	struct ScanInfo
+	{
+		int componentCount = 0;
+		int components[4] = {};
+		int ss = 0, se = 63, ah = 0, al = 0;
+	};
+
+	struct Decoder
+	{
+		const uint8_t* data = nullptr;
+		size_t size = 0;
+		int width = 0, height = 0;
+		int scale = 1, K = 8;
+		bool progressive = false;
+		bool adobeRGB = false;
+		int hMax = 1, vMax = 1;
+		int mcusX = 0, mcusY = 0;
+		int restartInterval = 0;
+		std::vector<Component> components;
+		uint16_t quant[4][64] = {};			// zigzag order
+		HuffmanTable dcTables[4];
+		HuffmanTable acTables[4];
+		int8_t keepIndex[64];				// zigzag index -> coefficient slot in the KxK block, -1 if dropped
+		int lastKept = 63;					// zigzag index of the last kept coefficient
+		std::vector<uint8_t> skipScan;		// progressive only: per scan, 1 if none of its coefficients are needed
+		size_t scanIndex = 0;
+
+		static uint16_t ReadU16(const uint8_t* p) { return uint16_t((p[0] << 8) | p[1]); }
+
+		bool ParseFrame(const uint8_t* p, size_t length, bool isProgressive)
+		{
+			if (length < 6 || p[0] != 8) return false;		// 8 bit samples only
+			progressive = isProgressive;
+			height = ReadU16(p + 1);
+			width = ReadU16(p + 3);
+			const int count = p[5];
+			if (width == 0 || height == 0 || (count != 1 && count != 3) || length < size_t(6 + count * 3)) return false;
+
+			components.resize(count);
+			for (int i = 0; i < count; i++)
+			{
+				Component& c = components[i];
+				c.id = p[6 + i * 3];
+				c.h = p[7 + i * 3] >> 4;
+				c.v = p[7 + i * 3] & 15;
+				c.quantTable = p[8 + i * 3] & 3;
+				if (c.h < 1 || c.h > 4 || c.v < 1 || c.v > 4) return false;
+				hMax = std::max(hMax, c.h);
+				vMax = std::max(vMax, c.v);
+			}
+
+			mcusX = (width + hMax * 8 - 1) / (hMax * 8);
+			mcusY = (height + vMax * 8 - 1) / (vMax * 8);
+			for (Component& c : components)
+			{
+				c.blocksW = ((width * c.h + hMax - 1) / hMax + 7) / 8;
+				c.blocksH = ((height * c.v + vMax - 1) / vMax + 7) / 8;
+				c.paddedBlocksW = mcusX * c.h;
+				c.paddedBlocksH = mcusY * c.v;
+			}
+			return true;
+		}
+
+		void AllocateCoefficients()
+		{
+			K = 8 / scale;
+			for (int zz = 0; zz < 64; zz++)
+			{
+				const int natural = gDezigzag[zz];
+				const int row = natural / 8, col = natural % 8;
+				keepIndex[zz] = (row < K && col < K) ? int8_t(row * K + col) : int8_t(-1);
+				if (keepIndex[zz] >= 0) lastKept = zz;
+			}
+
+			for (Component& c : components)
+			{
+				const size_t blocks = size_t(c.paddedBlocksW) * c.paddedBlocksH;
+				c.coefs.assign(blocks * K * K, 0);
+				if (progressive) c.nonzero.assign(blocks, 0);
+			}
+		}
+
+		// Zigzag positions [ss, se]
+		static uint64_t BandMask(int ss, int se) { return (se == 63 ? ~uint64_t(0) : (uint64_t(1) << (se + 1)) - 1) & ~((uint64_t(1) << ss) - 1); }
+
+		int16_t* BlockCoefs(Component& c, int bx, int by) { return c.coefs.data() + (size_t(by) * c.paddedBlocksW + bx) * K * K; }
+
+		/*
+		 Block decoders, one per scan type. Dropped coefficients are decoded but not stored, past lastKept only
+		 their code is decoded; progressive refinement only needs to know whether they are non-zero.
+		*/
+
+		void DecodeBaselineBlock(BitReader& reader, Component& c, int bx, int by, int& dcPred)
+		{
+			int16_t* coefs = BlockCoefs(c, bx, by);
+			const int t = reader.Decode(dcTables[c.dcTable]);
+			dcPred += reader.Receive(t);
+			coefs[0] = static_cast<int16_t>(dcPred);
+
+			const HuffmanTable& ac = acTables[c.acTable];
+			for (int k = 1; k < 64;)
+			{
+				const bool dropping = k > lastKept;
+				const int rs = dropping ? reader.SkipCoefficient(ac) : reader.Decode(ac);
+				const int r = rs >> 4, s = rs & 15;
+				if (s == 0)
+				{
+					if (r != 15) break;
+					k += 16;
+					continue;
+				}
+
+				k += r + dropping;
+				if (dropping || k > 63) continue;
+				const int slot = keepIndex[k];
+				if (slot >= 0) coefs[slot] = static_cast<int16_t>(reader.Receive(s));
+				else reader.GetBits(s);
+				k++;
+			}
+		}
+
+		void DecodeDcFirst(BitReader& reader, Component& c, int bx, int by, int al, int& dcPred)
+		{
+			int16_t* coefs = BlockCoefs(c, bx, by);
+			const int t = reader.Decode(dcTables[c.dcTable]);
+			dcPred += reader.Receive(t);
+			coefs[0] = static_cast<int16_t>(dcPred * (1 << al));
+		}
+
+		void DecodeDcRefine(BitReader& reader, Component& c, int bx, int by, int al)
+		{
+			if (reader.GetBit()) BlockCoefs(c, bx, by)[0] |= static_cast<int16_t>(1 << al);
+		}
+
+		void DecodeAcFirst(BitReader& reader, Component& c, int bx, int by, const ScanInfo& scan, int& eobRun)
+		{
+			if (eobRun > 0) { eobRun--; return; }
+
+			int16_t* coefs = BlockCoefs(c, bx, by);
+			uint64_t& nonzero = c.nonzero[size_t(by) * c.paddedBlocksW + bx];
+			const HuffmanTable& ac = acTables[c.acTable];
+
+			for (int k = scan.ss; k <= scan.se;)
+			{
+				const bool dropping = k > lastKept;
+				const int rs = dropping ? reader.SkipCoefficient(ac) : reader.Decode(ac);
+				const int r = rs >> 4, s = rs & 15;
+				if (s == 0)
+				{
+					if (r < 15)
+					{
+						eobRun = (1 << r) - 1;
+						if (r) eobRun += reader.GetBits(r);
+						break;
+					}
+					k += 16;
+					continue;
+				}
+
+				k += r;
+				if (k > 63) break;
+				if (dropping)
+				{
+					nonzero |= uint64_t(1) << k++;
+					continue;
+				}
+				const int value = reader.Receive(s) * (1 << scan.al);
+				const int slot = keepIndex[k];
+				if (slot >= 0) coefs[slot] = static_cast<int16_t>(value);
+				nonzero |= uint64_t(1) << k;
+				k++;
+			}
+		}
+
+		void RefineCoefficient(BitReader& reader, int16_t* coefs, int k, int bit)
+		{
+			if (!reader.GetBit()) return;
+			const int slot = keepIndex[k];
+			if (slot >= 0 && (coefs[slot] & bit) == 0)
+			{
+				coefs[slot] = static_cast<int16_t>(coefs[slot] > 0 ? coefs[slot] + bit : coefs[slot] - bit);
+			}
+		}
+
+		void DecodeAcRefine(BitReader& reader, Component& c, int bx, int by, const ScanInfo& scan, int& eobRun)
+		{
+			int16_t* coefs = BlockCoefs(c, bx, by);
+			uint64_t& nonzero = c.nonzero[size_t(by) * c.paddedBlocksW + bx];
+			const int bit = 1 << scan.al;
+
+			if (eobRun > 0)
+			{
+				eobRun--;
+				const int lastRefined = std::min(scan.se, lastKept);
+				for (int k = scan.ss; k <= lastRefined; k++)
+				{
+					if (nonzero & (uint64_t(1) << k)) RefineCoefficient(reader, coefs, k, bit);
+				}
+				if (lastRefined < scan.se) reader.SkipBits(PopCount64(nonzero & BandMask(std::max(scan.ss, lastRefined + 1), scan.se)));
+				return;
+			}
+
+			const HuffmanTable& ac = acTables[c.acTable];
+			int k = scan.ss;
+			while (k <= scan.se)
+			{
+				const int rs = reader.Decode(ac);
+				int r = rs >> 4;
+				int s = rs & 15;
+				if (s == 0)
+				{
+					if (r < 15)
+					{
+						eobRun = (1 << r) - 1;
+						if (r) eobRun += reader.GetBits(r);
+						r = 64;		// refine the rest of the band, no new coefficient
+					}
+				}
+				else
+				{
+					s = reader.GetBit() ? bit : -bit;
+				}
+
+				// Nothing past lastKept is stored: find the zero the run ends on and skip the correction bits passed on the way
+				if (k > lastKept)
+				{
+					uint64_t zeros = ~nonzero & BandMask(k, scan.se);
+					for (int i = 0; i < r && zeros; i++) zeros &= zeros - 1;
+					const int end = zeros ? CountTrailingZeros64(zeros) : scan.se + 1;
+					if (end > k) reader.SkipBits(PopCount64(nonzero & BandMask(k, end - 1)));
+					if (zeros && s != 0) nonzero |= uint64_t(1) << end;
+					k = end + 1;
+					continue;
+				}
+
+				// Skip r zero coefficients, refining the non-zero ones passed on the way, then place s
+				while (k <= scan.se)
+				{
+					const int zz = k++;
+					if (nonzero & (uint64_t(1) << zz))
+					{
+						RefineCoefficient(reader, coefs, zz, bit);
+					}
+					else
+					{
+						if (r == 0)
+						{
+							if (s != 0)
+							{
+								const int slot = keepIndex[zz];
+								if (slot >= 0) coefs[slot] = static_cast<int16_t>(s);
+								nonzero |= uint64_t(1) << zz;
+							}
+							break;
+						}
+						r--;
+					}
+				}
+			}
+		}
+
+		// Decodes MCUs [firstMcu, lastMcu) of a scan from one restart interval worth of entropy data
+		void DecodeInterval(const ScanInfo& scan, size_t begin, size_t end, int firstMcu, int lastMcu)
+		{
+			BitReader reader;
+			reader.Reset(data, begin, end);
+			int eobRun = 0;
+			int dcPred[4] = {};
+
+			const bool interleaved = scan.componentCount > 1;
+			const int mcusPerRow = interleaved ? mcusX : components[scan.components[0]].blocksW;
+
+			for (int mcu = firstMcu; mcu < lastMcu; mcu++)
+			{
+				const int mx = mcu % mcusPerRow;
+				const int my = mcu / mcusPerRow;
+
+				for (int i = 0; i < scan.componentCount; i++)
+				{
+					Component& c = components[scan.components[i]];
+					const int bw = interleaved ? c.h : 1;
+					const int bh = interleaved ? c.v : 1;
+					for (int y = 0; y < bh; y++)
+					{
+						for (int x = 0; x < bw; x++)
+						{
+							const int bx = mx * bw + x;
+							const int by = my * bh + y;
+							if (!progressive) DecodeBaselineBlock(reader, c, bx, by, dcPred[i]);
+							else if (scan.ss == 0 && scan.ah == 0) DecodeDcFirst(reader, c, bx, by, scan.al, dcPred[i]);
+							else if (scan.ss == 0) DecodeDcRefine(reader, c, bx, by, scan.al);
+							else if (scan.ah == 0) DecodeAcFirst(reader, c, bx, by, scan, eobRun);
+							else DecodeAcRefine(reader, c, bx, by, scan, eobRun);
+						}
+					}
+				}
+			}
+		}
+
+		// Entropy data runs up to the first marker that is not RSTn, restart markers split it into independent intervals
+		size_t FindScanEnd(size_t begin, std::vector<size_t>* intervalStarts) const
+		{
+			size_t pos = begin;
+			for (; pos + 1 < size; pos++)
+			{
+				if (data[pos] != 0xFF) continue;
+				const uint8_t marker = data[pos + 1];
+				if (marker == 0x00 || marker == 0xFF) continue;
+				if (marker >= 0xD0 && marker <= 0xD7)
+				{
+					if (intervalStarts) intervalStarts->push_back(pos + 2);
+					pos++;
+					continue;
+				}
+				break;
+			}
+			return pos;
+		}
+
+		size_t DecodeScan(const ScanInfo& scan, size_t begin, ThreadPool& pool)
+		{
+			std::vector<size_t> intervalStarts = { begin };
+			const size_t scanEnd = FindScanEnd(begin, &intervalStarts);
+
+			const bool interleaved = scan.componentCount > 1;
+			const Component& first = components[scan.components[0]];
+			const int totalMcus = interleaved ? mcusX * mcusY : first.blocksW * first.blocksH;
+			const int mcusPerInterval = restartInterval > 0 ? restartInterval : totalMcus;
+
+			// Each interval is a separate task, it owns its bit reader, DC predictors and EOB run
+			pool.ParallelFor(intervalStarts.size(), 1, [&](size_t i0, size_t i1)
+			{
+				for (size_t i = i0; i < i1; i++)
+				{
+					const size_t intervalEnd = (i + 1 < intervalStarts.size()) ? intervalStarts[i + 1] - 2 : scanEnd;
+					const int firstMcu = static_cast<int>(std::min<size_t>(i * mcusPerInterval, totalMcus));
+					const int lastMcu = std::min(firstMcu + mcusPerInterval, totalMcus);
+					DecodeInterval(scan, intervalStarts[i], intervalEnd, firstMcu, lastMcu);
+				}
+			});
+
+			return scanEnd;
+		}
+
+		/*
+		 Walks the remaining scan headers of a progressive frame and marks the AC scans the scaled IDCT doesn't need:
+		 all of their coefficients are past lastKept and no decoded refinement scan later needs their non-zero history.
+		 Back to front, so each scan knows the bands the refinements after it still decode.
+		*/
+		void PlanScans(size_t pos)
+		{
+			struct Band { int component, ss, se, ah; };
+			std::vector<Band> bands;
+			while (pos + 4 <= size)
+			{
+				if (data[pos] != 0xFF) { pos++; continue; }
+				const uint8_t marker = data[pos + 1];
+				if (marker == 0xFF) { pos++; continue; }
+				if (marker == 0xD9) break;
+				if (marker >= 0xD0 && marker <= 0xD7) { pos += 2; continue; }
+
+				const size_t length = ReadU16(data + pos + 2);
+				if (length < 2 || pos + 2 + length > size) break;
+				if (marker != 0xDA)
+				{
+					pos += 2 + length;
+					continue;
+				}
+
+				const uint8_t* p = data + pos + 4;
+				const int count = p[0];
+				Band band = { -1, 0, 63, 0 };
+				if (length >= size_t(6 + count * 2))
+				{
+					const uint8_t* spectral = p + 1 + count * 2;
+					band = { count == 1 ? -2 : -1, spectral[0], std::min<int>(spectral[1], 63), spectral[2] >> 4 };
+					for (size_t c = 0; c < components.size() && count == 1; c++) if (components[c].id == p[1]) band.component = int(c);
+				}
+				bands.push_back(band);
+				pos = FindScanEnd(pos + 2 + length, nullptr);
+			}
+
+			skipScan.assign(bands.size(), 0);
+			uint64_t refined[4] = {};
+			for (size_t i = bands.size(); i-- > 0;)
+			{
+				const Band& band = bands[i];
+				if (band.component < 0 || band.ss == 0) continue;		// DC and anything unexpected is always decoded
+				const uint64_t mask = BandMask(band.ss, band.se);
+				if (band.ss > lastKept && (refined[band.component] & mask) == 0) skipScan[i] = 1;
+				else if (band.ah > 0) refined[band.component] |= mask;
+			}
+		}
+
+		bool Parse(ThreadPool& pool, bool headerOnly)
+		{
+			if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) return false;
+
+			size_t pos = 2;
+			bool frameSeen = false;
+			while (pos + 4 <= size)
+			{
+				if (data[pos] != 0xFF) { pos++; continue; }
+				const uint8_t marker = data[pos + 1];
+				if (marker == 0xFF) { pos++; continue; }
+				if (marker == 0xD9) break;
+				if (marker == 0xD8 || (marker >= 0xD0 && marker <= 0xD7)) { pos += 2; continue; }
+
+				const size_t length = ReadU16(data + pos + 2);
+				const uint8_t* p = data + pos + 4;
+				if (length < 2 || pos + 2 + length > size) return false;
+				const size_t payload = length - 2;
+
+				switch (marker)
+				{
+				case 0xC0:
+				case 0xC1:
+				case 0xC2:
+					if (frameSeen || !ParseFrame(p, payload, marker == 0xC2)) return false;
+					frameSeen = true;
+					if (headerOnly) return true;
+					AllocateCoefficients();
+					if (progressive && lastKept < 63) PlanScans(pos + 2 + length);
+					break;
+
+				case 0xC3: case 0xC5: case 0xC6: case 0xC7: case 0xC9: case 0xCA: case 0xCB: case 0xCD: case 0xCE: case 0xCF:
+					return false;		// lossless, hierarchical and arithmetic coded frames
+
+				case 0xC4:
+					for (size_t i = 0; i + 17 <= payload;)
+					{
+						const int tableClass = p[i] >> 4, id = p[i] & 15;
+						if (tableClass > 1 || id > 3) return false;
+						int count = 0;
+						for (int j = 0; j < 16; j++) count += p[i + 1 + j];
+						if (count > 256 || i + 17 + count > payload) return false;
+						BuildHuffmanTable(tableClass ? acTables[id] : dcTables[id], p + i + 1, p + i + 17, count);
+						i += 17 + count;
+					}
+					break;
+
+				case 0xDB:
+					for (size_t i = 0; i < payload;)
+					{
+						const int precision = p[i] >> 4, id = p[i] & 3;
+						const size_t tableSize = precision ? 129 : 65;
+						if (i + tableSize > payload) return false;
+						for (int j = 0; j < 64; j++)
+						{
+							quant[id][j] = precision ? ReadU16(p + i + 1 + j * 2) : p[i + 1 + j];
+						}
+						i += tableSize;
+					}
+					break;
+
+				case 0xDD:
+					if (payload < 2) return false;
+					restartInterval = ReadU16(p);
+					break;
+
+				case 0xEE:
+					// Adobe APP14, transform 0 means the 3 channels are plain RGB
+					if (payload >= 12 && !memcmp(p, "Adobe", 5)) adobeRGB = (p[11] == 0);
+					break;
+
+				case 0xDA:
+				{
+					if (!frameSeen || payload < 1) return false;
+					ScanInfo scan;
+					scan.componentCount = p[0];
+					if (scan.componentCount < 1 || scan.componentCount > int(components.size()) || payload < size_t(4 + scan.componentCount * 2)) return false;
+
+					for (int i = 0; i < scan.componentCount; i++)
+					{
+						const int id = p[1 + i * 2];
+						const int tables = p[2 + i * 2];
+						int index = -1;
+						for (size_t c = 0; c < components.size(); c++) if (components[c].id == id) index = int(c);
+						if (index < 0) return false;
+
+						components[index].dcTable = tables >> 4 & 3;
+						components[index].acTable = tables & 3;
+						scan.components[i] = index;
+					}
+
+					const uint8_t* spectral = p + 1 + scan.componentCount * 2;
+					scan.ss = spectral[0];
+					scan.se = spectral[1];
+					scan.ah = spectral[2] >> 4;
+					scan.al = spectral[2] & 15;
+					if (scan.ss > 63 || scan.se > 63 || scan.ss > scan.se) return false;
+					if (!progressive) { scan.ss = 0; scan.se = 63; scan.ah = scan.al = 0; }
+					if (progressive && scan.ss > 0 && scan.componentCount != 1) return false;
+
+					for (int i = 0; i < scan.componentCount; i++)
+					{
+						const Component& c = components[scan.components[i]];
+						const bool needsDc = !progressive || (scan.ss == 0 && scan.ah == 0);
+						const bool needsAc = !progressive || scan.ss > 0;
+						if ((needsDc && !dcTables[c.dcTable].defined) || (needsAc && !acTables[c.acTable].defined)) return false;
+					}
+
+					const bool skip = scanIndex < skipScan.size() && skipScan[scanIndex];
+					scanIndex++;
+					pos = skip ? FindScanEnd(pos + 2 + length, nullptr) : DecodeScan(scan, pos + 2 + length, pool);
+					continue;
+				}
+
+				default:
+					break;
+				}
+
+				pos += 2 + length;
+			}
+			return frameSeen && !headerOnly;
+		}
+
+		/*
+		 Reduced size IDCT: out(x) = sum_u C(u) F(u) cos((2x+1) u pi / 2K) * box(u) / 2
+		 box(u) = prod cos(u pi 2^i / 16) over the halvings folds the average of the dropped samples in.
+		*/
+		void BuildIdctTable(float table[8][8]) const
+		{
+			const float pi = 3.14159265358979f;
+			for (int x = 0; x < K; x++)
+			{
+				for (int u = 0; u < K; u++)
+				{
+					float box = 1.0f;
+					for (int step = 1; step < scale; step *= 2) box *= cosf(u * pi * step / 16.0f);
+					const float cu = (u == 0) ? 0.70710678f : 1.0f;
+					table[x][u] = 0.5f * cu * cosf((2 * x + 1) * u * pi / (2.0f * K)) * box;
+				}
+			}
+		}
+
+		void InverseTransform(ThreadPool& pool)
+		{
+			float table[8][8];
+			BuildIdctTable(table);
+
+			for (Component& c : components)
+			{
+				// Dequantization factors for the kept coefficients, natural order
+				float dequant[64];
+				for (int zz = 0; zz < 64; zz++)
+				{
+					if (keepIndex[zz] >= 0) dequant[keepIndex[zz]] = float(quant[c.quantTable][zz]);
+				}
+
+				const size_t stride = size_t(c.paddedBlocksW) * K;
+				c.samples.assign(stride * c.paddedBlocksH * K, 0);
+
+				pool.ParallelFor(c.paddedBlocksH, 4, [&](size_t row0, size_t row1)
+				{
+					float block[64], temp[64];
+					for (size_t by = row0; by < row1; by++)
+					{
+						for (int bx = 0; bx < c.paddedBlocksW; bx++)
+						{
+							const int16_t* coefs = BlockCoefs(c, bx, int(by));
+							for (int i = 0; i < K * K; i++) block[i] = coefs[i] * dequant[i];
+
+							// rows: temp[v][x] = sum_u table[x][u] * F[v][u]
+							for (int v = 0; v < K; v++)
+							{
+								for (int x = 0; x < K; x++)
+								{
+									float sum = 0.0f;
+									for (int u = 0; u < K; u++) sum += table[x][u] * block[v * K + u];
+									temp[v * K + x] = sum;
+								}
+							}
+
+							// columns
+							uint8_t* out = c.samples.data() + by * K * stride + size_t(bx) * K;
+							for (int y = 0; y < K; y++)
+							{
+								for (int x = 0; x < K; x++)
+								{
+									float sum = 128.0f;
+									for (int v = 0; v < K; v++) sum += table[y][v] * temp[v * K + x];
+									out[y * stride + x] = static_cast<uint8_t>(std::min(std::max(sum + 0.5f, 0.0f), 255.0f));
+								}
+							}
+						}
+					}
+				});
+
+				c.coefs.clear();
+				c.coefs.shrink_to_fit();
+				c.nonzero.clear();
+				c.nonzero.shrink_to_fit();
+			}
+		}
+
+		// Nearest upsampling of subsampled planes, YCbCr -> RGB, output RGBA8
+		void ConvertToRGBA(std::vector<uint8_t>& pixels, int& outWidth, int& outHeight, ThreadPool& pool)
+		{
+			outWidth = (width + scale - 1) / scale;
+			outHeight = (height + scale - 1) / scale;
+			pixels.resize(size_t(outWidth) * outHeight * 4);
+
+			pool.ParallelFor(outHeight, 16, [&](size_t y0, size_t y1)
+			{
+				for (size_t y = y0; y < y1; y++)
+				{
+					const uint8_t* rows[3] = {};
+					for (size_t i = 0; i < components.size(); i++)
+					{
+						const Component& c = components[i];
+						rows[i] = c.samples.data() + (y * c.v / vMax) * size_t(c.paddedBlocksW) * K;
+					}
+
+					uint8_t* dst = pixels.data() + y * outWidth * 4;
+					for (int x = 0; x < outWidth; x++, dst += 4)
+					{
+						if (components.size() == 1)
+						{
+							dst[0] = dst[1] = dst[2] = rows[0][x];
+						}
+						else
+						{
+							const float Y = rows[0][x * components[0].h / hMax];
+							const float cb = rows[1][x * components[1].h / hMax];
+							const float cr = rows[2][x * components[2].h / hMax];
+							if (adobeRGB)
+							{
+								dst[0] = uint8_t(Y); dst[1] = uint8_t(cb); dst[2] = uint8_t(cr);
+							}
+							else
+							{
+								const float r = Y + 1.402f * (cr - 128.0f);
+								const float g = Y - 0.344136f * (cb - 128.0f) - 0.714136f * (cr - 128.0f);
+								const float b = Y + 1.772f * (cb - 128.0f);
+								dst[0] = static_cast<uint8_t>(std::min(std::max(r + 0.5f, 0.0f), 255.0f));
+								dst[1] = static_cast<uint8_t>(std::min(std::max(g + 0.5f, 0.0f), 255.0f));
+								dst[2] = static_cast<uint8_t>(std::min(std::max(b + 0.5f, 0.0f), 255.0f));
+							}
+						}
+						dst[3] = 0xFF;
+					}
+				}
+			});
+		}
+	};
+
+	// Width/height from the frame header without decoding anything
+	static bool ReadSize(const uint8_t* data, size_t size, int& width, int& height)
+	{
+		Decoder decoder;
+		decoder.data = data;
+		decoder.size = size;
+		if (!decoder.Parse(ThreadPool::Default(), true)) return false;
+		width = decoder.width;
+		height = decoder.height;
+		return true;
+	}
+
+	// Largest DCT scale (1, 2, 4, 8) that keeps the longer side at or above the requested resolution
+	static int SelectScale(int width, int height, int resolution)
+	{
+		int scale = 1;
+		while (scale < 8 && resolution > 0 && std::max(width, height) / (scale * 2) >= resolution) scale *= 2;
+		return scale;
+	}
+
+	// Decodes straight to (width/scale) x (height/scale) RGBA8 pixels, false if the stream is not supported
+	static bool DecodeScaled(const uint8_t* data, size_t size, int scale, std::vector<uint8_t>& pixels, int& width, int& height, ThreadPool& pool = ThreadPool::Default())
+	{
+		if (scale != 1 && scale != 2 && scale != 4 && scale != 8) return false;
+
+		Decoder decoder;
+		decoder.data = data;
+		decoder.size = size;
+		decoder.scale = scale;
+		if (!decoder.Parse(pool, false)) return false;
+
+		decoder.InverseTransform(pool);
+		decoder.ConvertToRGBA(pixels, width, height, pool);
+		return true;
+	}
+}
@@ -0,0 +1,433 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "Bvh.h"
+#include "CpuRayTracer.h"
+#include "TriangleBlocks.h"
+
+/*
+ ------------------------------NUMA Rendering------------------------------------
+ Render for machines with more than one memory node (sockets), where a thread reading memory of another node pays
+ the interconnect on every miss. NumaRenderer keeps each node's work on its own memory:
+	- workers per node, pinned to the node's CPUs, so the first touch of anything they allocate places it there
+	- the hot top of the BVH replicated per node (BvhTopReplica): every ray starts there, the shared rest is read
+	  far less often and by then mostly from cache
+	- the image cut into one band of tile rows per node, each band's framebuffer allocated and first touched by
+	  its node, copied into the output at the end of the frame
+	- a tile queue per band; a node steals tiles of other bands only once its own queue is empty
+ Nodes come from sysfs on Linux and GetNumaNodeProcessorMask (processor group 0) on Windows. SplitNumaNodes cuts
+ them into more, smaller nodes to try the scheduling on a single socket machine.
+*/
+
+namespace CpuRt
+{
+	constexpr uint32_t gNumaReplicaNodes = 8191;		// 12 full levels, 256 KB per memory node
+
+	struct NumaNode
+	{
+		uint32_t id = 0;
+		std::vector<uint32_t> cpus;		// empty: not pinned
+	};
+
+	// "0-3,8-11" as in /sys/devices/system/node/node0/cpulist or /sys/devices/system/node/online
+	inline std::vector<uint32_t> ParseCpuList(const std::string& list)
+	{
+		std::vector<uint32_t> cpus;
+		size_t position = 0;
+		while (position < list.size())
+		{
+			size_t end = list.find(',', position);
+			if (end == std::string::npos) end = list.size();
+			const std::string range = list.substr(position, end - position);
+			const size_t dash = range.find('-');
+			if (!range.empty() && range[0] >= '0' && range[0] <= '9')
+			{
+				const uint32_t first = uint32_t(strtoul(range.c_str(), nullptr, 10));
+				const uint32_t last = dash == std::string::npos ? first : uint32_t(strtoul(range.c_str() + dash + 1, nullptr, 10));
+				for (uint32_t cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+			}
+			position = end + 1;
+		}
+		return cpus;
+	}
+
+	// Memory nodes with CPUs, one unpinned node when the system does not tell
+	inline std::vector<NumaNode> DetectNumaNodes()
+	{
+		std::vector<NumaNode> nodes;
+#ifdef _WIN32
+		ULONG highest = 0;
+		if (GetNumaHighestNodeNumber(&highest))
+		{
+			for (ULONG id = 0; id <= highest; id++)
+			{
+				ULONGLONG mask = 0;
+				if (!GetNumaNodeProcessorMask(static_cast<UCHAR>(id), &mask) || mask == 0) continue;
+				NumaNode node;
+				node.id = id;
+				for (uint32_t cpu = 0; cpu < 64; cpu++)
+				{
+					if (mask & (1ull << cpu)) node.cpus.push_back(cpu);
+				}
+				nodes.push_back(node);
+			}
+		}
+#else
+		// Node ids can have gaps, the online list names them all
+		const auto readLine = [](const char* path)
+		{
+			std::string result;
+			FILE* file = fopen(path, "r");
+			if (!file) return result;
+			char line[4096] = {};
+			if (fgets(line, sizeof(line), file)) result = line;
+			fclose(file);
+			return result;
+		};
+		for (uint32_t id : ParseCpuList(readLine("/sys/devices/system/node/online")))
+		{
+			char path[64];
+			snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", id);
+			NumaNode node;
+			node.id = id;
+			node.cpus = ParseCpuList(readLine(path));
+			if (!node.cpus.empty()) nodes.push_back(node);
+		}
+#endif
+		if (nodes.empty()) nodes.push_back(NumaNode());
+		return nodes;
+	}
+
+	// The CPUs of 'nodes' dealt round robin into 'count' nodes, CPUs repeat when there are fewer than 'count'
+	inline std::vector<NumaNode> SplitNumaNodes(const std::vector<NumaNode>& nodes, uint32_t count)
+	{
+		std::vector<uint32_t> cpus;
+		for (const NumaNode& node : nodes) cpus.insert(cpus.end(), node.cpus.begin(), node.cpus.end());
+		std::vector<NumaNode> split(std::max(1u, count));
+		for (uint32_t i = 0; i < split.size(); i++) split[i].id = i;
+		for (size_t i = 0; i < std::max(cpus.size(), split.size()) && !cpus.empty(); i++) split[i % split.size()].cpus.push_back(cpus[i % cpus.size()]);
+		for (NumaNode& node : split)
+		{
+			std::sort(node.cpus.begin(), node.cpus.end());
+			node.cpus.erase(std::unique(node.cpus.begin(), node.cpus.end()), node.cpus.end());
+		}
+		return split;
+	}
+
+	// Restricts the calling thread to 'cpus', false when the system refused (the thread runs anywhere then)
+	inline bool PinThreadToCpus(const std::vector<uint32_t>& cpus)
+	{
+		if (cpus.empty()) return false;
+#ifdef _WIN32
+		DWORD_PTR mask = 0;
+		for (uint32_t cpu : cpus)
+		{
+			if (cpu < sizeof(DWORD_PTR) * 8) mask |= DWORD_PTR(1) << cpu;
+		}
+		return mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (uint32_t cpu : cpus)
+		{
+			if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+		}
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+	}
+
+	/*
+	 The top 'maxNodes' nodes of a Bvh, breadth first, copied into memory of the thread that builds it. Its leaves
+	 are the shared tree's subtrees below ('count' 1, 'offset' the subtree root in the Bvh), traversal continues
+	 there with the hit found so far. Hits are the Bvh's, up to ties between equally near triangles.
+	*/
+	class BvhTopReplica
+	{
+	public:
+		void Build(const Bvh& source, uint32_t maxNodes = gNumaReplicaNodes)
+		{
+			bvh = &source;
+			nodes.clear();
+			const BvhNodeSpan shared = source.Nodes();
+			if (shared.empty()) return;
+
+			// Pairs are added whole, so a budget of 2^k - 1 gets exactly k full levels where the tree has them
+			struct Pending { uint32_t source; uint32_t node; };
+			std::vector<Pending> queue = { { 0u, 0u } };
+			nodes.push_back(shared[0]);
+			for (size_t q = 0; q < queue.size(); q++)
+			{
+				const uint32_t index = queue[q].source, node = queue[q].node;
+				if (shared[index].IsLeaf() || nodes.size() + 2 > maxNodes)
+				{
+					nodes[node].offset = index;
+					nodes[node].count = 1;
+					continue;
+				}
+				const uint32_t left = static_cast<uint32_t>(nodes.size());
+				nodes[node].offset = left;
+				nodes.push_back(shared[shared[index].offset]);
+				nodes.push_back(shared[shared[index].offset + 1]);
+				queue.push_back({ shared[index].offset, left });
+				queue.push_back({ shared[index].offset + 1, left + 1 });
+			}
+		}
+
+		bool Intersect(const Ray& ray, uint32_t rayFlags, RayHit& hit) const
+		{
+			return Detail::IntersectCollapsedBvh(nodes, ray, rayFlags, hit, [&](const BvhNode& node)
+			{
+				return bvh->IntersectSubtree(node.offset, ray, rayFlags, hit);
+			});
+		}
+
+		size_t NodeCount() const { return nodes.size(); }
+
+	private:
+		const Bvh* bvh = nullptr;
+		BvhNodeArray nodes;
+	};
+
+	struct NumaRenderStats
+	{
+		double milliseconds = 0.0;			// tiles and the copy into the output
+		double copyMilliseconds = 0.0;
+		uint64_t rays = 0;
+		uint32_t stolenTiles = 0;			// rendered by a node other than the one owning their band
+
+		double MRaysPerSecond() const { return milliseconds > 0.0 ? rays / (milliseconds * 1000.0) : 0.0; }
+	};
+
+	class NumaRenderer
+	{
+	public:
+		// 'threadsPerNode' 0 runs one worker per CPU of each node
+		explicit NumaRenderer(const std::vector<NumaNode>& numaNodes, unsigned threadsPerNode = 0)
+			: nodes(numaNodes), memory(numaNodes.size())
+		{
+			for (uint32_t n = 0; n < nodes.size(); n++)
+			{
+				const unsigned count = threadsPerNode ? threadsPerNode : std::max<unsigned>(1, unsigned(nodes[n].cpus.size()));
+				for (unsigned i = 0; i < count; i++)
+				{
+					workers.emplace_back([this, n, i] { WorkerLoop(n, i); });
+				}
+			}
+		}
+
+		~NumaRenderer()
+		{
+			{
+				std::lock_guard<std::mutex> lock(jobLock);
+				quit = true;
+			}
+			jobSignal.notify_all();
+			for (std::thread& worker : workers) worker.join();
+		}
+
+		NumaRenderer(const NumaRenderer&) = delete;
+		NumaRenderer& operator=(const NumaRenderer&) = delete;
+
+		uint32_t NodeCount() const { return static_cast<uint32_t>(nodes.size()); }
+		unsigned ThreadCount() const { return static_cast<unsigned>(workers.size()); }
+
+		// Replicates the top of 'bvh' on every node, the first worker of each node builds its copy
+		void SetBvh(const Bvh& bvh, uint32_t replicaNodes = gNumaReplicaNodes)
+		{
+			RunOnWorkers([&](uint32_t node, uint32_t worker)
+			{
+				if (worker == 0) memory[node].replica.Build(bvh, replicaNodes);
+			});
+		}
+
+		const BvhTopReplica& Replica(uint32_t node) const { return memory[node].replica; }
+
+		NumaRenderStats Render(const MeshData& mesh, const SceneConstants& scene, const RenderSettings& settings, std::vector<Float4>& output)
+		{
+			const uint32_t tileSize = std::max(1u, settings.tileSize);
+			const uint32_t tilesX = (settings.width + tileSize - 1) / tileSize;
+			const uint32_t tilesY = (settings.height + tileSize - 1) / tileSize;
+			const uint32_t nodeCount = NodeCount();
+
+			// Band n is tile rows [firstRow[n], firstRow[n + 1]), reallocated by its own node when the size changes
+			std::vector<uint32_t> firstRow(nodeCount + 1);
+			for (uint32_t n = 0; n <= nodeCount; n++) firstRow[n] = uint32_t(uint64_t(tilesY) * n / nodeCount);
+			std::vector<unsigned> nodeWorkers(nodeCount, 0);
+			for (const WorkerInfo& info : workerInfo) nodeWorkers[info.node]++;
+			std::vector<uint8_t> reallocated(nodeCount, 0);
+			RunOnWorkers([&](uint32_t node, uint32_t worker)
+			{
+				NodeMemory& local = memory[node];
+				const size_t pixels = size_t(std::min(firstRow[node + 1] * tileSize, settings.height) - std::min(firstRow[node] * tileSize, settings.height)) * settings.width;
+				if (worker == 0 && local.framebufferPixels != pixels)
+				{
+					local.framebuffer.reset(new Float4[pixels]);		// not value initialized, touched below on this node
+					local.framebufferPixels = pixels;
+					reallocated[node] = 1;
+				}
+				local.nextTile = firstRow[node] * tilesX;
+			});
+
+			// First touch of a new band by its own node's workers, so a stolen tile can't place its pages on the thief's node
+			RunOnWorkers([&](uint32_t node, uint32_t worker)
+			{
+				if (!reallocated[node]) return;
+				NodeMemory& local = memory[node];
+				const size_t begin = local.framebufferPixels * worker / nodeWorkers[node], end = local.framebufferPixels * (worker + 1) / nodeWorkers[node];
+				std::fill(local.framebuffer.get() + begin, local.framebuffer.get() + end, Float4{});
+			});
+
+			output.resize(size_t(settings.width) * settings.height);
+			std::atomic<uint32_t> stolen{ 0 };
+			const auto start = std::chrono::high_resolution_clock::now();
+			RunOnWorkers([&](uint32_t node, uint32_t)
+			{
+				const ShaderContext context = { &mesh, &scene, settings.width, settings.height, nullptr };
+				const BvhTopReplica& replica = memory[node].replica;
+				uint32_t localStolen = 0;
+
+				// Own band first, then the other bands in node order after this one
+				for (uint32_t step = 0; step < nodeCount; step++)
+				{
+					const uint32_t band = (node + step) % nodeCount;
+					const uint32_t lastTile = firstRow[band + 1] * tilesX;
+					NodeMemory& owner = memory[band];
+					for (uint32_t tile = owner.nextTile++; tile < lastTile; tile = owner.nextTile++)
+					{
+						const uint32_t x0 = (tile % tilesX) * tileSize, y0 = (tile / tilesX) * tileSize;
+						const uint32_t x1 = std::min(x0 + tileSize, settings.width), y1 = std::min(y0 + tileSize, settings.height);
+						const uint32_t bandY = firstRow[band] * tileSize;
+						for (uint32_t y = y0; y < y1; y++)
+						{
+							for (uint32_t x = x0; x < x1; x++)
+							{
+								owner.framebuffer[size_t(y - bandY) * settings.width + x] = RayGen(context, replica, x, y);
+							}
+						}
+						localStolen += step != 0;
+					}
+				}
+				stolen += localStolen;
+			});
+
+			// Every band is a run of whole rows, one copy each, split over the node's workers
+			const auto copyStart = std::chrono::high_resolution_clock::now();
+			RunOnWorkers([&](uint32_t node, uint32_t worker)
+			{
+				const NodeMemory& local = memory[node];
+				const size_t begin = local.framebufferPixels * worker / nodeWorkers[node], end = local.framebufferPixels * (worker + 1) / nodeWorkers[node];
+				const size_t offset = size_t(std::min(firstRow[node] * tileSize, settings.height)) * settings.width;
+				std::copy(local.framebuffer.get() + begin, local.framebuffer.get() + end, output.data() + offset + begin);
+			});
+
+			NumaRenderStats stats;
+			const auto now = std::chrono::high_resolution_clock::now();
+			stats.milliseconds = std::chrono::duration<double, std::milli>(now - start).count();
+			stats.copyMilliseconds = std::chrono::duration<double, std::milli>(now - copyStart).count();
+			stats.rays = uint64_t(settings.width) * settings.height;
+			stats.stolenTiles = stolen;
+			return stats;
+		}
+
+	private:
+		// What each node allocates itself, aligned so two nodes never write the same cache line
+		struct alignas(64) NodeMemory
+		{
+			BvhTopReplica replica;
+			std::unique_ptr<Float4[]> framebuffer;
+			size_t framebufferPixels = 0;
+			std::atomic<uint32_t> nextTile{ 0 };		// the band's tile queue
+		};
+
+		struct WorkerInfo
+		{
+			uint32_t node;
+			uint32_t index;
+		};
+
+		// job(node, worker index within the node) on every worker once, returns when all are done, rethrows the
+		// first exception
+		void RunOnWorkers(const std::function<void(uint32_t, uint32_t)>& job)
+		{
+			std::unique_lock<std::mutex> lock(jobLock);
+			doneSignal.wait(lock, [this] { return started == workers.size(); });
+			currentJob = &job;
+			running = static_cast<uint32_t>(workers.size());
+			jobError = nullptr;
+			generation++;
+			jobSignal.notify_all();
+			doneSignal.wait(lock, [this] { return running == 0; });
+			currentJob = nullptr;
+			if (jobError) std::rethrow_exception(jobError);
+		}
+
+		void WorkerLoop(uint32_t node, uint32_t index)
+		{
+			PinThreadToCpus(nodes[node].cpus);
+			uint64_t seen = 0;
+			std::unique_lock<std::mutex> lock(jobLock);
+			workerInfo.push_back({ node, index });
+			started++;
+			doneSignal.notify_all();
+			for (;;)
+			{
+				jobSignal.wait(lock, [&] { return quit || generation != seen; });
+				if (quit) return;
+				seen = generation;
+				const std::function<void(uint32_t, uint32_t)>* job = currentJob;
+				lock.unlock();
+				try
+				{
+					(*job)(node, index);
+				}
+				catch (...)
+				{
+					std::lock_guard<std::mutex> errorLock(jobErrorLock);
+					if (!jobError) jobError = std::current_exception();
+				}
+				lock.lock();
+				if (--running == 0) doneSignal.notify_all();
+			}
+		}
+
+		std::vector<NumaNode> nodes;
+		std::vector<NodeMemory> memory;
+		std::vector<std::thread> workers;
+		std::vector<WorkerInfo> workerInfo;
+
+		std::mutex jobLock;
+		std::condition_variable jobSignal;
+		std::condition_variable doneSignal;
+		const std::function<void(uint32_t, uint32_t)>* currentJob = nullptr;
+		uint64_t generation = 0;
+		uint32_t running = 0;
+		size_t started = 0;
+		bool quit = false;
+		std::mutex jobErrorLock;
+		std::exception_ptr jobError;
+	};
+}
@@ -0,0 +1,452 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "CpuRayTracer.h"
+
+/*
+ ------------------------------Path tracer------------------------------------
+ Multi-bounce diffuse lighting on top of the CPU ray tracer, two ways over the same per-vertex code:
+	PathTraceMegakernel: every pixel runs its paths to the end, the RayGen loop with bounces (the shape a DXR
+	                     RayGen shader would take). Threads diverge as soon as paths do.
+	PathTraceWavefront:  Laine, Karras & Aila 2013, "Megakernels Considered Harmful". Paths in flight are SoA queues,
+	                     every stage runs over a whole queue across all cores before the next:
+		generate   camera rays for a wave of paths
+		extend     closest hit of every queued ray
+		shade      misses pick up the sky, hits emit a shadow ray towards the light and a bounce ray
+		compact    stable stream compaction of the surviving bounce rays and of the shadow rays
+		shadow     occlusion of every shadow ray, the unoccluded add their light
+		accumulate samples into pixels
+ Surfaces are Lambertian with one albedo, lit by the scene's point light like ClosestHit (no falloff) and by the sky
+ color of Miss. Paths end after maxBounces or by Russian roulette. Random numbers are a hash of (path, bounce,
+ dimension), so both renderers trace exactly the same paths and produce the same image.
+*/
+
+namespace CpuRt
+{
+	struct PathTraceSettings
+	{
+		uint32_t samplesPerPixel = 4;
+		uint32_t maxBounces = 4;			// rays after the camera ray
+		uint32_t rouletteBounce = 2;		// Russian roulette from this bounce on
+		Float3 albedo = { 0.7f, 0.7f, 0.7f };
+		uint32_t waveSize = 1u << 20;		// paths in flight in the wavefront renderer, rounded to whole pixels
+	};
+
+	struct PathTraceStats
+	{
+		double milliseconds = 0.0;
+		uint64_t paths = 0;
+		uint64_t rays = 0;					// camera and bounce rays
+		uint64_t shadowRays = 0;
+
+		// Stages of the wavefront renderer
+		double generateMilliseconds = 0.0;
+		double extendMilliseconds = 0.0;
+		double shadeMilliseconds = 0.0;
+		double compactMilliseconds = 0.0;
+		double shadowMilliseconds = 0.0;
+		double accumulateMilliseconds = 0.0;
+
+		double MRaysPerSecond() const { return milliseconds > 0.0 ? (rays + shadowRays) / (milliseconds * 1000.0) : 0.0; }
+	};
+
+	namespace PathTraceDetail
+	{
+		// Jarzynski & Olano 2020, "Hash Functions for GPU Rendering": PCG as a hash
+		inline uint32_t PcgHash(uint32_t v)
+		{
+			const uint32_t state = v * 747796405u + 2891336453u;
+			const uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+			return (word >> 22u) ^ word;
+		}
+
+		// [0, 1)
+		inline float PathRandom(uint32_t path, uint32_t bounce, uint32_t dimension)
+		{
+			return (PcgHash(path + PcgHash(bounce * 8u + dimension)) >> 8) * (1.0f / 16777216.0f);
+		}
+
+		// GenerateCameraRay with the sample anywhere in the pixel, 'jitter' in [0, 1)^2
+		inline Ray CameraRay(const ShaderContext& context, uint32_t x, uint32_t y, const Float2& jitter)
+		{
+			Float2 screenPos = { (x + jitter.x) / context.width * 2.0f - 1.0f, (y + jitter.y) / context.height * 2.0f - 1.0f };
+			screenPos.y = -screenPos.y;
+			const Float4 world = Transform({ screenPos.x, screenPos.y, 0.0f, 1.0f }, context.scene->projectionToWorld);
+
+			Ray ray;
+			ray.origin = context.scene->cameraPosition.xyz();
+			ray.direction = Normalize(world.xyz() / world.w - ray.origin);
+			ray.tMin = 0.001f;
+			ray.tMax = 10000.0f;
+			return ray;
+		}
+
+		inline Ray PathCameraRay(const ShaderContext& context, uint32_t path, uint32_t samplesPerPixel)
+		{
+			const uint32_t pixel = path / samplesPerPixel;
+			return CameraRay(context, pixel % context.width, pixel / context.width, { PathRandom(path, 0, 3), PathRandom(path, 0, 4) });
+		}
+
+		// Miss
+		inline Float3 SkyRadiance(const Float3& throughput)
+		{
+			return throughput * Float3{ 0.0f, 0.2f, 0.4f };
+		}
+
+		// What shading one hit leaves behind
+		struct PathVertex
+		{
+			bool shadow = false;			// light to add if 'shadowRay' is unoccluded
+			Ray shadowRay;
+			Float3 shadowRadiance;
+			bool bounce = false;			// the path goes on with 'bounceRay'
+			Ray bounceRay;
+			Float3 throughput;
+		};
+
+		inline PathVertex ShadePathVertex(const ShaderContext& context, const PathTraceSettings& settings, const Ray& ray, const RayHit& hit,
+			const Float3& throughput, uint32_t path, uint32_t bounce)
+		{
+			const uint32_t* indices = &context.mesh->indices[size_t(hit.primitive) * 3];
+			const Float3 p0 = context.mesh->vertices[indices[0]].position;
+			Float3 vertexNormals[3] = {
+				context.mesh->vertices[indices[0]].normal,
+				context.mesh->vertices[indices[1]].normal,
+				context.mesh->vertices[indices[2]].normal
+			};
+			Float3 geometricNormal = Cross(context.mesh->vertices[indices[1]].position - p0, context.mesh->vertices[indices[2]].position - p0);
+			Float3 normal = HitAttribute<float>(vertexNormals, hit.barycentrics);
+			if (context.instances && hit.instance != gInvalidPrimitive)
+			{
+				geometricNormal = TransformNormal(context.instances[hit.instance].transform, geometricNormal);
+				normal = TransformNormal(context.instances[hit.instance].transform, normal);
+			}
+
+			// Two sided surfaces: both normals face the incoming ray
+			geometricNormal = Normalize(geometricNormal);
+			if (Dot(geometricNormal, ray.direction) > 0.0f) geometricNormal = -geometricNormal;
+			normal = Normalize(normal);
+			if (Dot(normal, geometricNormal) < 0.0f) normal = -normal;
+
+			PathVertex vertex;
+			const Float3 weight = throughput * settings.albedo;
+			const Float3 position = ray.origin + hit.t * ray.direction + geometricNormal * 1e-4f;
+
+			// CalculateDiffuseLighting, if the light is visible
+			const Float3 toLight = context.scene->lightPosition.xyz() - position;
+			const float lightDistance = Length(toLight);
+			const float nDotL = lightDistance > 0.0f ? Dot(normal, toLight) / lightDistance : 0.0f;
+			if (nDotL > 0.0f && Dot(geometricNormal, toLight) > 0.0f)
+			{
+				vertex.shadow = true;
+				vertex.shadowRay = { position, 0.0f, toLight / lightDistance, lightDistance };
+				vertex.shadowRadiance = weight * context.scene->lightDiffuseColor.xyz() * nDotL;
+			}
+
+			if (bounce + 1 > settings.maxBounces) return vertex;
+			vertex.throughput = weight;
+			if (bounce + 1 >= settings.rouletteBounce)
+			{
+				const float survival = std::min(0.95f, std::max(std::max(weight.x, weight.y), weight.z));
+				if (PathRandom(path, bounce + 1, 2) >= survival) return vertex;
+				vertex.throughput = weight / survival;
+			}
+
+			// Cosine distributed about the geometric normal, the albedo is all that is left of BRDF * cos / pdf
+			const Float3 tangent = Normalize(std::fabs(geometricNormal.x) > 0.5f ? Cross(geometricNormal, { 0.0f, 1.0f, 0.0f }) : Cross(geometricNormal, { 1.0f, 0.0f, 0.0f }));
+			const Float3 bitangent = Cross(geometricNormal, tangent);
+			const float r = std::sqrt(PathRandom(path, bounce + 1, 0)), phi = PathRandom(path, bounce + 1, 1) * 6.2831853f;
+			const float z = std::sqrt(std::max(0.0f, 1.0f - r * r));
+			vertex.bounce = true;
+			vertex.bounceRay = { position, 0.0f, tangent * (r * std::cos(phi)) + bitangent * (r * std::sin(phi)) + geometricNormal * z, 10000.0f };
+			return vertex;
+		}
+
+		// Rays with a color and the path they belong to, SoA
+		struct RayQueue
+		{
+			std::vector<float> originX, originY, originZ;
+			std::vector<float> directionX, directionY, directionZ;
+			std::vector<float> tMin, tMax;
+			std::vector<float> weightX, weightY, weightZ;		// throughput of bounce rays, light carried by shadow rays
+			std::vector<uint32_t> path;							// slot in the wave
+			size_t count = 0;
+
+			void Resize(size_t size)
+			{
+				count = size;
+				for (std::vector<float>* v : { &originX, &originY, &originZ, &directionX, &directionY, &directionZ, &tMin, &tMax, &weightX, &weightY, &weightZ })
+				{
+					if (v->size() < size) v->resize(size);
+				}
+				if (path.size() < size) path.resize(size);
+			}
+
+			Ray GetRay(size_t i) const
+			{
+				return { { originX[i], originY[i], originZ[i] }, tMin[i], { directionX[i], directionY[i], directionZ[i] }, tMax[i] };
+			}
+
+			Float3 Weight(size_t i) const { return { weightX[i], weightY[i], weightZ[i] }; }
+
+			void Set(size_t i, const Ray& ray, const Float3& weight, uint32_t pathSlot)
+			{
+				originX[i] = ray.origin.x; originY[i] = ray.origin.y; originZ[i] = ray.origin.z;
+				directionX[i] = ray.direction.x; directionY[i] = ray.direction.y; directionZ[i] = ray.direction.z;
+				tMin[i] = ray.tMin; tMax[i] = ray.tMax;
+				weightX[i] = weight.x; weightY[i] = weight.y; weightZ[i] = weight.z;
+				path[i] = pathSlot;
+			}
+
+			void Copy(const RayQueue& source, size_t from, size_t to)
+			{
+				Set(to, source.GetRay(from), source.Weight(from), source.path[from]);
+			}
+		};
+
+		// Stable stream compaction: the first 'source.count' entries with keep[i] set, in order, into 'target'
+		inline void CompactRayQueue(const RayQueue& source, const std::vector<uint8_t>& keep, RayQueue& target, ThreadPool& pool)
+		{
+			constexpr size_t chunkSize = 16384;
+			const size_t chunks = (source.count + chunkSize - 1) / chunkSize;
+			std::vector<size_t> offsets(chunks + 1, 0);
+			pool.ParallelFor(chunks, 1, [&](size_t begin, size_t end)
+			{
+				for (size_t chunk = begin; chunk < end; chunk++)
+				{
+					size_t kept = 0;
+					for (size_t i = chunk * chunkSize; i < std::min(source.count, (chunk + 1) * chunkSize); i++) kept += keep[i];
+					offsets[chunk + 1] = kept;
+				}
+			});
+			for (size_t chunk = 0; chunk < chunks; chunk++) offsets[chunk + 1] += offsets[chunk];
+
+			target.Resize(offsets[chunks]);
+			pool.ParallelFor(chunks, 1, [&](size_t begin, size_t end)
+			{
+				for (size_t chunk = begin; chunk < end; chunk++)
+				{
+					size_t to = offsets[chunk];
+					for (size_t i = chunk * chunkSize; i < std::min(source.count, (chunk + 1) * chunkSize); i++)
+					{
+						if (keep[i]) target.Copy(source, i, to++);
+					}
+				}
+			});
+		}
+
+		inline double MillisecondsSince(std::chrono::high_resolution_clock::time_point start)
+		{
+			return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		}
+
+		inline void CheckSettings(const PathTraceSettings& settings)
+		{
+			if (settings.samplesPerPixel == 0) throw std::runtime_error("Error: path tracing needs at least one sample per pixel");
+		}
+	}
+
+	// Every pixel's paths start to end in one loop, tiles on the pool as in Render. Output is the average radiance.
+	template<typename Accel>
+	inline PathTraceStats PathTraceMegakernel(const Accel& accel, const MeshData& mesh, const SceneConstants& scene, const RenderSettings& render,
+		const PathTraceSettings& settings, std::vector<Float4>& output, ThreadPool& pool = ThreadPool::Default())
+	{
+		using namespace PathTraceDetail;
+		CheckSettings(settings);
+		const ShaderContext context = { &mesh, &scene, render.width, render.height, AccelInstances(accel) };
+		output.resize(size_t(render.width) * render.height);
+
+		std::atomic<uint64_t> rays{ 0 }, shadowRays{ 0 };
+		const auto start = std::chrono::high_resolution_clock::now();
+		ForEachTile(render, pool, [&](uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1)
+		{
+			uint64_t tileRays = 0, tileShadowRays = 0;
+			for (uint32_t y = y0; y < y1; y++)
+			{
+				for (uint32_t x = x0; x < x1; x++)
+				{
+					Float3 radiance = { 0.0f, 0.0f, 0.0f };
+					for (uint32_t sample = 0; sample < settings.samplesPerPixel; sample++)
+					{
+						// Summed per path first, the order the wavefront renderer adds things up in
+						const uint32_t path = (y * render.width + x) * settings.samplesPerPixel + sample;
+						Ray ray = PathCameraRay(context, path, settings.samplesPerPixel);
+						Float3 throughput = { 1.0f, 1.0f, 1.0f }, pathRadiance = { 0.0f, 0.0f, 0.0f };
+						for (uint32_t bounce = 0; ; bounce++)
+						{
+							RayHit hit;
+							tileRays++;
+							if (!accel.Intersect(ray, RayFlagNone, hit))
+							{
+								pathRadiance += SkyRadiance(throughput);
+								break;
+							}
+
+							const PathVertex vertex = ShadePathVertex(context, settings, ray, hit, throughput, path, bounce);
+							if (vertex.shadow)
+							{
+								tileShadowRays++;
+								if (!Occluded(accel, vertex.shadowRay, RayFlagNone)) pathRadiance += vertex.shadowRadiance;
+							}
+							if (!vertex.bounce) break;
+							ray = vertex.bounceRay;
+							throughput = vertex.throughput;
+						}
+						radiance += pathRadiance;
+					}
+					const Float3 color = radiance / float(settings.samplesPerPixel);
+					output[size_t(y) * render.width + x] = { color.x, color.y, color.z, 1.0f };
+				}
+			}
+			rays += tileRays;
+			shadowRays += tileShadowRays;
+		});
+
+		PathTraceStats stats;
+		stats.milliseconds = MillisecondsSince(start);
+		stats.paths = uint64_t(render.width) * render.height * settings.samplesPerPixel;
+		stats.rays = rays;
+		stats.shadowRays = shadowRays;
+		return stats;
+	}
+
+	// The same image a stage at a time over queues of up to settings.waveSize paths
+	template<typename Accel>
+	inline PathTraceStats PathTraceWavefront(const Accel& accel, const MeshData& mesh, const SceneConstants& scene, const RenderSettings& render,
+		const PathTraceSettings& settings, std::vector<Float4>& output, ThreadPool& pool = ThreadPool::Default())
+	{
+		using namespace PathTraceDetail;
+		CheckSettings(settings);
+		const ShaderContext context = { &mesh, &scene, render.width, render.height, AccelInstances(accel) };
+		const size_t pixelCount = size_t(render.width) * render.height;
+		const size_t wavePixels = std::max<size_t>(1, settings.waveSize / settings.samplesPerPixel);
+		output.resize(pixelCount);
+
+		PathTraceStats stats;
+		RayQueue queue, staged, shadows, stagedShadows;
+		std::vector<RayHit> hits;
+		std::vector<uint8_t> keep, keepShadow;
+		std::vector<float> radianceX, radianceY, radianceZ;		// per path slot
+
+		const auto start = std::chrono::high_resolution_clock::now();
+		for (size_t firstPixel = 0; firstPixel < pixelCount; firstPixel += wavePixels)
+		{
+			const size_t pixels = std::min(wavePixels, pixelCount - firstPixel);
+			const size_t paths = pixels * settings.samplesPerPixel;
+			const uint32_t firstPath = static_cast<uint32_t>(firstPixel * settings.samplesPerPixel);
+
+			// Generate
+			auto stageStart = std::chrono::high_resolution_clock::now();
+			queue.Resize(paths);
+			radianceX.assign(paths, 0.0f);
+			radianceY.assign(paths, 0.0f);
+			radianceZ.assign(paths, 0.0f);
+			pool.ParallelFor(paths, 16384, [&](size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					queue.Set(i, PathCameraRay(context, firstPath + uint32_t(i), settings.samplesPerPixel), { 1.0f, 1.0f, 1.0f }, uint32_t(i));
+				}
+			});
+			stats.generateMilliseconds += MillisecondsSince(stageStart);
+
+			for (uint32_t bounce = 0; queue.count > 0; bounce++)
+			{
+				// Extend
+				stageStart = std::chrono::high_resolution_clock::now();
+				hits.assign(queue.count, RayHit{});
+				pool.ParallelFor(queue.count, 4096, [&](size_t begin, size_t end)
+				{
+					for (size_t i = begin; i < end; i++) accel.Intersect(queue.GetRay(i), RayFlagNone, hits[i]);
+				});
+				stats.rays += queue.count;
+				stats.extendMilliseconds += MillisecondsSince(stageStart);
+
+				// Shade, into slots parallel to the queue
+				stageStart = std::chrono::high_resolution_clock::now();
+				staged.Resize(queue.count);
+				stagedShadows.Resize(queue.count);
+				keep.assign(queue.count, 0);
+				keepShadow.assign(queue.count, 0);
+				pool.ParallelFor(queue.count, 4096, [&](size_t begin, size_t end)
+				{
+					for (size_t i = begin; i < end; i++)
+					{
+						const uint32_t slot = queue.path[i];
+						if (!hits[i].Hit())
+						{
+							const Float3 sky = SkyRadiance(queue.Weight(i));
+							radianceX[slot] += sky.x;
+							radianceY[slot] += sky.y;
+							radianceZ[slot] += sky.z;
+							continue;
+						}
+
+						const PathVertex vertex = ShadePathVertex(context, settings, queue.GetRay(i), hits[i], queue.Weight(i), firstPath + slot, bounce);
+						if (vertex.shadow)
+						{
+							stagedShadows.Set(i, vertex.shadowRay, vertex.shadowRadiance, slot);
+							keepShadow[i] = 1;
+						}
+						if (vertex.bounce)
+						{
+							staged.Set(i, vertex.bounceRay, vertex.throughput, slot);
+							keep[i] = 1;
+						}
+					}
+				});
+				stats.shadeMilliseconds += MillisecondsSince(stageStart);
+
+				// Compact
+				stageStart = std::chrono::high_resolution_clock::now();
+				CompactRayQueue(staged, keep, queue, pool);
+				CompactRayQueue(stagedShadows, keepShadow, shadows, pool);
+				stats.compactMilliseconds += MillisecondsSince(stageStart);
+
+				// Shadow, a path has at most one shadow ray per bounce so slots are never shared
+				stageStart = std::chrono::high_resolution_clock::now();
+				pool.ParallelFor(shadows.count, 4096, [&](size_t begin, size_t end)
+				{
+					for (size_t i = begin; i < end; i++)
+					{
+						if (Occluded(accel, shadows.GetRay(i), RayFlagNone)) continue;
+						const uint32_t slot = shadows.path[i];
+						radianceX[slot] += shadows.weightX[i];
+						radianceY[slot] += shadows.weightY[i];
+						radianceZ[slot] += shadows.weightZ[i];
+					}
+				});
+				stats.shadowRays += shadows.count;
+				stats.shadowMilliseconds += MillisecondsSince(stageStart);
+			}
+
+			// Accumulate, a pixel's samples are consecutive slots
+			stageStart = std::chrono::high_resolution_clock::now();
+			pool.ParallelFor(pixels, 16384, [&](size_t begin, size_t end)
+			{
+				for (size_t p = begin; p < end; p++)
+				{
+					Float3 radiance = { 0.0f, 0.0f, 0.0f };
+					for (size_t slot = p * settings.samplesPerPixel; slot < (p + 1) * settings.samplesPerPixel; slot++)
+					{
+						radiance += Float3{ radianceX[slot], radianceY[slot], radianceZ[slot] };
+					}
+					const Float3 color = radiance / float(settings.samplesPerPixel);
+					output[firstPixel + p] = { color.x, color.y, color.z, 1.0f };
+				}
+			});
+			stats.accumulateMilliseconds += MillisecondsSince(stageStart);
+		}
+
+		stats.milliseconds = MillisecondsSince(start);
+		stats.paths = uint64_t(pixelCount) * settings.samplesPerPixel;
+		return stats;
+	}
+}
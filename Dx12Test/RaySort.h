@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "Bvh.h"
+#include "BvhLbvhBuilder.h"
+#include "ThreadPool.h"
+
+/*
+ ------------------------------Ray sorting------------------------------------
+ Secondary rays (shadows, bounces) leave neighbouring pixels in all directions, traced in pixel order every ray
+ walks its own path through the tree and traversal waits on memory. Reordering them first (Garanzha & Loop 2010,
+ "Fast Ray Sorting and Breadth-First Packet Traversal for GPU Ray Tracing"; Pharr et al. 1997):
+	1. a key per ray: direction octant, then the Morton code of the origin's cell in the scene bounds, then the
+	   Morton code of the quantized direction, so neighbours in the sorted order start close together and head
+	   the same way
+	2. parallel LSD radix sort of (key, ray index), RadixSortPairs from the LBVH builder
+	3. rays gathered in sorted order and traced in contiguous chunks, hits scattered back to the caller's order
+ Hits are exactly those of tracing in the original order, only the order of the work changes.
+*/
+
+namespace CpuRt
+{
+	struct RaySortSettings
+	{
+		uint32_t originBits = 8;		// per axis, the origin cells are the scene bounds split 2^originBits times
+		uint32_t directionBits = 4;		// per axis, on top of the octant
+	};
+
+	struct RaySortStats
+	{
+		double keyMilliseconds = 0.0;
+		double sortMilliseconds = 0.0;
+		double gatherMilliseconds = 0.0;		// rays into sorted order and hits back
+		double traceMilliseconds = 0.0;
+
+		double OverheadMilliseconds() const { return keyMilliseconds + sortMilliseconds + gatherMilliseconds; }
+		double TotalMilliseconds() const { return OverheadMilliseconds() + traceMilliseconds; }
+	};
+
+	inline uint32_t RaySortKeyBits(const RaySortSettings& settings)
+	{
+		return 3 + 3 * settings.originBits + 3 * settings.directionBits;
+	}
+
+	// Octant, origin cell, direction cell from the most significant bit down
+	inline uint64_t RaySortKey(const Ray& ray, const Float3& boundsMin, const Float3& invExtent, const RaySortSettings& settings)
+	{
+		const uint64_t octant = uint64_t(ray.direction.x < 0.0f) << 2 | uint64_t(ray.direction.y < 0.0f) << 1 | uint64_t(ray.direction.z < 0.0f);
+		const float length = Length(ray.direction);
+		const Float3 direction = length > 0.0f ? ray.direction * (0.5f / length) + Float3{ 0.5f, 0.5f, 0.5f } : Float3{ 0.5f, 0.5f, 0.5f };
+		const uint64_t origin = MortonCode((ray.origin - boundsMin) * invExtent, settings.originBits);
+		return (octant << (3 * (settings.originBits + settings.directionBits))) | (origin << (3 * settings.directionBits)) |
+			MortonCode(direction, settings.directionBits);
+	}
+
+	/*
+	 Permutation that sorts 'rays' by RaySortKey: order[i] is the index of the i-th ray to trace. 'bounds' should
+	 hold the ray origins (the scene bounds), origins outside are clamped to its border cells.
+	*/
+	inline RaySortStats SortRays(const std::vector<Ray>& rays, const Aabb& bounds, const RaySortSettings& settings,
+		std::vector<uint32_t>& order, ThreadPool& pool = ThreadPool::Default())
+	{
+		if (settings.originBits == 0 || settings.originBits > 21 || settings.directionBits > 21 || RaySortKeyBits(settings) > 64)
+		{
+			throw std::runtime_error("Error: ray sort keys need 1 to 21 origin bits and at most 64 bits in total");
+		}
+
+		RaySortStats stats;
+		auto start = std::chrono::high_resolution_clock::now();
+		const Float3 extent = bounds.max - bounds.min;
+		const Float3 invExtent = { extent.x > 0.0f ? 1.0f / extent.x : 0.0f, extent.y > 0.0f ? 1.0f / extent.y : 0.0f, extent.z > 0.0f ? 1.0f / extent.z : 0.0f };
+		std::vector<uint64_t> keys(rays.size());
+		order.resize(rays.size());
+		pool.ParallelFor(rays.size(), 16384, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				keys[i] = RaySortKey(rays[i], bounds.min, invExtent, settings);
+				order[i] = static_cast<uint32_t>(i);
+			}
+		});
+		stats.keyMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+		start = std::chrono::high_resolution_clock::now();
+		RadixSortPairs(keys, order, RaySortKeyBits(settings), pool);
+		stats.sortMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		return stats;
+	}
+
+	/*
+	 Closest hits of 'rays' into 'hits' (same order as 'rays'), traced in RaySortKey order. Any structure with
+	 Intersect(ray, flags, hit) works. 'bounds' as for SortRays.
+	*/
+	template<typename Accel>
+	inline RaySortStats TraceRaysSorted(const Accel& accel, const std::vector<Ray>& rays, uint32_t rayFlags, const Aabb& bounds, const RaySortSettings& settings,
+		std::vector<RayHit>& hits, ThreadPool& pool = ThreadPool::Default())
+	{
+		std::vector<uint32_t> order;
+		RaySortStats stats = SortRays(rays, bounds, settings, order, pool);
+
+		auto start = std::chrono::high_resolution_clock::now();
+		std::vector<Ray> sorted(rays.size());
+		pool.ParallelFor(rays.size(), 16384, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++) sorted[i] = rays[order[i]];
+		});
+		stats.gatherMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+		// Contiguous chunks, every thread gets runs of neighbouring rays
+		start = std::chrono::high_resolution_clock::now();
+		std::vector<RayHit> sortedHits(rays.size());
+		pool.ParallelFor(rays.size(), 4096, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++) accel.Intersect(sorted[i], rayFlags, sortedHits[i]);
+		});
+		stats.traceMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+		start = std::chrono::high_resolution_clock::now();
+		hits.resize(rays.size());
+		pool.ParallelFor(rays.size(), 16384, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++) hits[order[i]] = sortedHits[i];
+		});
+		stats.gatherMilliseconds += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		return stats;
+	}
+}
@@ -0,0 +1,338 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "CpuRayTracer.h"
+#include "CpuSimd.h"
+#include "ShadingBatch.h"
+#include "ThreadPool.h"
+
+/*
+ ------------------------------CPU Shader Table------------------------------------
+ The hit group records of CreateShaderTable for the CPU tracer. A record holds what the GPU record holds: the shader
+ (function pointers instead of a shader identifier) followed by its local root arguments. TraceRay picks the record
+ the way DXR does,
+	RayContributionToHitGroupIndex + MultiplierForGeometryContributionToHitGroupIndex * GeometryIndex()
+		+ InstanceContributionToHitGroupIndex
+ so materials are records chosen per instance and per ray type, and shading calls whatever the record points to
+ instead of branching on a material type. GeometryIndex() is 0, every BLAS here holds one geometry.
+
+ Hit groups are types with static ClosestHit / ClosestHitBatch templates and a LocalRootArguments struct,
+ MakeHitGroupRecord turns one into a record at compile time. RenderHitGroupsBatched groups the hits of a tile by
+ record and hands every group to its record's batch function in one call, the batches SIMD shading wants.
+*/
+
+namespace CpuRt
+{
+	// Local root arguments per record: a 64 byte record less the 32 byte shader identifier
+	constexpr size_t gLocalRootArgumentsSize = 32;
+
+	template<typename Accel>
+	struct HitGroupRecord
+	{
+		// ClosestHit of one hit
+		using ClosestHitShader = void (*)(const ShaderContext& context, const Accel& accel, const HitGroupRecord& record, const Ray& ray,
+			const RayHit& hit, HitInfo& payload);
+		// ClosestHit of 'count' hits that all picked this record, colors[i] is the ShadedColorAndHitT of hit i
+		using ClosestHitBatchShader = void (*)(const ShaderContext& context, const Accel& accel, const HitGroupRecord& record, const Ray* rays,
+			const RayHit* hits, size_t count, Float4* colors);
+
+		ClosestHitShader closestHit = nullptr;
+		ClosestHitBatchShader closestHitBatch = nullptr;		// optional, closestHit per hit without
+		alignas(16) uint8_t localRootArguments[gLocalRootArgumentsSize] = {};
+
+		template<typename Arguments>
+		void SetLocalRootArguments(const Arguments& arguments)
+		{
+			static_assert(sizeof(Arguments) <= gLocalRootArgumentsSize && std::is_trivially_copyable_v<Arguments>, "Local root arguments do not fit a record");
+			memcpy(localRootArguments, &arguments, sizeof(Arguments));
+		}
+
+		template<typename Arguments>
+		Arguments LocalRootArguments() const
+		{
+			static_assert(sizeof(Arguments) <= gLocalRootArgumentsSize && std::is_trivially_copyable_v<Arguments>, "Local root arguments do not fit a record");
+			Arguments arguments;
+			memcpy(&arguments, localRootArguments, sizeof(Arguments));
+			return arguments;
+		}
+	};
+
+	// Record for HitGroup, its shaders get the arguments back as HitGroup::LocalRootArguments
+	template<typename Accel, typename HitGroup>
+	inline HitGroupRecord<Accel> MakeHitGroupRecord(const typename HitGroup::LocalRootArguments& arguments = {})
+	{
+		using Arguments = typename HitGroup::LocalRootArguments;
+		HitGroupRecord<Accel> record;
+		record.closestHit = [](const ShaderContext& context, const Accel& accel, const HitGroupRecord<Accel>& self, const Ray& ray, const RayHit& hit, HitInfo& payload)
+		{
+			HitGroup::ClosestHit(context, accel, self.template LocalRootArguments<Arguments>(), ray, hit, payload);
+		};
+		record.closestHitBatch = [](const ShaderContext& context, const Accel& accel, const HitGroupRecord<Accel>& self, const Ray* rays, const RayHit* hits,
+			size_t count, Float4* colors)
+		{
+			HitGroup::ClosestHitBatch(context, accel, self.template LocalRootArguments<Arguments>(), rays, hits, count, colors);
+		};
+		record.SetLocalRootArguments(arguments);
+		return record;
+	}
+
+	template<typename Accel>
+	class HitGroupTable
+	{
+	public:
+		// Index of the new record
+		uint32_t Add(const HitGroupRecord<Accel>& record)
+		{
+			records.push_back(record);
+			return static_cast<uint32_t>(records.size() - 1);
+		}
+
+		template<typename HitGroup>
+		uint32_t Add(const typename HitGroup::LocalRootArguments& arguments = {})
+		{
+			return Add(MakeHitGroupRecord<Accel, HitGroup>(arguments));
+		}
+
+		size_t Size() const { return records.size(); }
+
+		const HitGroupRecord<Accel>& Record(uint32_t index) const
+		{
+			if (index >= records.size())
+			{
+				throw std::runtime_error("Error: hit group record " + std::to_string(index) + " is outside the table of " + std::to_string(records.size()));
+			}
+			return records[index];
+		}
+
+	private:
+		std::vector<HitGroupRecord<Accel>> records;
+	};
+
+	inline uint32_t HitGroupRecordIndex(const ShaderContext& context, const RayHit& hit, uint32_t rayContribution, uint32_t geometryMultiplier)
+	{
+		const uint32_t geometryIndex = 0;
+		const uint32_t instanceContribution = context.instances && hit.instance != gInvalidPrimitive ?
+			context.instances[hit.instance].instanceContributionToHitGroupIndex : 0;
+		return rayContribution + geometryMultiplier * geometryIndex + instanceContribution;
+	}
+
+	// TraceRay with the closest hit shader taken from 'table'
+	template<typename Accel>
+	inline void TraceRay(const ShaderContext& context, const Accel& accel, const HitGroupTable<Accel>& table, uint32_t rayFlags,
+		uint32_t rayContribution, uint32_t geometryMultiplier, const Ray& ray, HitInfo& payload)
+	{
+		RayHit hit;
+		if (!accel.Intersect(ray, rayFlags, hit))
+		{
+			Miss(payload);
+			return;
+		}
+		const HitGroupRecord<Accel>& record = table.Record(HitGroupRecordIndex(context, hit, rayContribution, geometryMultiplier));
+		record.closestHit(context, accel, record, ray, hit, payload);
+	}
+
+	/*
+	 ------------------------------Hit groups------------------------------------
+	*/
+
+	// ClosestHit.hlsl times a per record albedo (CubeConstantBuffer), white is the shader as is
+	struct DiffuseHitGroup
+	{
+		using LocalRootArguments = CubeConstantBuffer;
+
+		template<typename Accel>
+		static void ClosestHit(const ShaderContext& context, const Accel& accel, const LocalRootArguments& arguments, const Ray& ray, const RayHit& hit,
+			HitInfo& payload)
+		{
+			CpuRt::ClosestHit(context, accel, ray, hit, payload);
+			payload.ShadedColorAndHitT = payload.ShadedColorAndHitT * arguments.albedo;
+		}
+
+		template<typename Accel>
+		static void ClosestHitBatch(const ShaderContext& context, const Accel& accel, const LocalRootArguments& arguments, const Ray* rays, const RayHit* hits,
+			size_t count, Float4* colors)
+		{
+			for (size_t first = 0; first < count; first += gNativeSimdWidth)
+			{
+				const uint32_t lanes = static_cast<uint32_t>(std::min(count - first, size_t(gNativeSimdWidth)));
+				ShadeHits<gNativeSimdWidth>(context, accel, rays + first, hits + first, lanes, colors + first);
+			}
+			for (size_t i = 0; i < count; i++) colors[i] = colors[i] * arguments.albedo;
+		}
+	};
+
+	// Debug view: the interpolated world space normal mapped to [0, 1], no lighting
+	struct NormalHitGroup
+	{
+		struct LocalRootArguments {};
+
+		template<typename Accel>
+		static void ClosestHit(const ShaderContext& context, const Accel&, const LocalRootArguments&, const Ray&, const RayHit& hit, HitInfo& payload)
+		{
+			const uint32_t* indices = &context.mesh->indices[size_t(hit.primitive) * 3];
+			Float3 vertexNormals[3] = {
+				context.mesh->vertices[indices[0]].normal,
+				context.mesh->vertices[indices[1]].normal,
+				context.mesh->vertices[indices[2]].normal
+			};
+
+			Float3 normal = HitAttribute<float>(vertexNormals, hit.barycentrics);
+			if (context.instances && hit.instance != gInvalidPrimitive)
+			{
+				normal = TransformNormal(context.instances[hit.instance].transform, normal);
+			}
+			normal = Normalize(normal) * 0.5f + Float3{ 0.5f, 0.5f, 0.5f };
+			payload.ShadedColorAndHitT = { normal.x, normal.y, normal.z, 1.0f };
+		}
+
+		template<typename Accel>
+		static void ClosestHitBatch(const ShaderContext& context, const Accel& accel, const LocalRootArguments& arguments, const Ray* rays, const RayHit* hits,
+			size_t count, Float4* colors)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				HitInfo payload;
+				ClosestHit(context, accel, arguments, rays[i], hits[i], payload);
+				colors[i] = payload.ShadedColorAndHitT;
+			}
+		}
+	};
+
+	/*
+	 ------------------------------Renderers------------------------------------
+	 Render with the hit shading from 'table', the camera rays use RayContributionToHitGroupIndex 0 and a geometry
+	 multiplier of 1 as RayGen.hlsl does.
+	*/
+
+	// One TraceRay and closest hit call per pixel, the record changes from pixel to pixel
+	template<typename Accel>
+	inline RenderStats RenderHitGroups(const Accel& accel, const HitGroupTable<Accel>& table, const MeshData& mesh, const SceneConstants& scene,
+		const RenderSettings& settings, std::vector<Float4>& output, ThreadPool& pool = ThreadPool::Default())
+	{
+		const ShaderContext context = { &mesh, &scene, settings.width, settings.height, AccelInstances(accel) };
+		output.resize(size_t(settings.width) * settings.height);
+
+		const auto start = std::chrono::high_resolution_clock::now();
+		ForEachTile(settings, pool, [&](uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1)
+		{
+			for (uint32_t y = y0; y < y1; y++)
+			{
+				for (uint32_t x = x0; x < x1; x++)
+				{
+					Ray ray;
+					GenerateCameraRay(context, x, y, ray.origin, ray.direction);
+					ray.tMin = 0.001f;
+					ray.tMax = 10000.0f;
+
+					HitInfo payload;
+					payload.ShadedColorAndHitT = { 0.0f, 0.0f, 0.0f, 0.0f };
+					TraceRay(context, accel, table, RayFlagCullBackFacingTriangles, 0, 1, ray, payload);
+					output[size_t(y) * settings.width + x] = payload.ShadedColorAndHitT;
+				}
+			}
+		});
+
+		RenderStats stats;
+		stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		stats.rays = uint64_t(settings.width) * settings.height;
+		return stats;
+	}
+
+	/*
+	 A tile's camera rays traced first, the hits sorted by record (stable, pixel order within a record), then one
+	 closestHitBatch call per record present in the tile. Records without a batch function get a closestHit call
+	 per hit in the same order, the image is RenderHitGroups' either way.
+	*/
+	template<typename Accel>
+	inline RenderStats RenderHitGroupsBatched(const Accel& accel, const HitGroupTable<Accel>& table, const MeshData& mesh, const SceneConstants& scene,
+		const RenderSettings& settings, std::vector<Float4>& output, ThreadPool& pool = ThreadPool::Default())
+	{
+		const ShaderContext context = { &mesh, &scene, settings.width, settings.height, AccelInstances(accel) };
+		output.resize(size_t(settings.width) * settings.height);
+
+		const auto start = std::chrono::high_resolution_clock::now();
+		ForEachTile(settings, pool, [&](uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1)
+		{
+			// (record << 32 | hit) sorts by record and keeps pixel order inside one
+			std::vector<uint64_t> keys;
+			std::vector<Ray> rays, sortedRays;
+			std::vector<RayHit> hits, sortedHits;
+			std::vector<size_t> pixels;
+			std::vector<Float4> colors;
+			for (uint32_t y = y0; y < y1; y++)
+			{
+				for (uint32_t x = x0; x < x1; x++)
+				{
+					Ray ray;
+					GenerateCameraRay(context, x, y, ray.origin, ray.direction);
+					ray.tMin = 0.001f;
+					ray.tMax = 10000.0f;
+
+					RayHit hit;
+					const size_t pixel = size_t(y) * settings.width + x;
+					if (accel.Intersect(ray, RayFlagCullBackFacingTriangles, hit))
+					{
+						keys.push_back(uint64_t(HitGroupRecordIndex(context, hit, 0, 1)) << 32 | hits.size());
+						rays.push_back(ray);
+						hits.push_back(hit);
+						pixels.push_back(pixel);
+					}
+					else
+					{
+						HitInfo payload;
+						Miss(payload);
+						output[pixel] = payload.ShadedColorAndHitT;
+					}
+				}
+			}
+
+			std::sort(keys.begin(), keys.end());
+			sortedRays.resize(keys.size());
+			sortedHits.resize(keys.size());
+			colors.resize(keys.size());
+			for (size_t i = 0; i < keys.size(); i++)
+			{
+				sortedRays[i] = rays[uint32_t(keys[i])];
+				sortedHits[i] = hits[uint32_t(keys[i])];
+			}
+
+			for (size_t first = 0; first < keys.size();)
+			{
+				const uint32_t index = uint32_t(keys[first] >> 32);
+				size_t last = first + 1;
+				while (last < keys.size() && uint32_t(keys[last] >> 32) == index) last++;
+
+				const HitGroupRecord<Accel>& record = table.Record(index);
+				if (record.closestHitBatch)
+				{
+					record.closestHitBatch(context, accel, record, &sortedRays[first], &sortedHits[first], last - first, &colors[first]);
+				}
+				else
+				{
+					for (size_t i = first; i < last; i++)
+					{
+						HitInfo payload;
+						record.closestHit(context, accel, record, sortedRays[i], sortedHits[i], payload);
+						colors[i] = payload.ShadedColorAndHitT;
+					}
+				}
+				first = last;
+			}
+
+			for (size_t i = 0; i < keys.size(); i++) output[pixels[uint32_t(keys[i])]] = colors[i];
+		});
+
+		RenderStats stats;
+		stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		stats.rays = uint64_t(settings.width) * settings.height;
+		return stats;
+	}
+}
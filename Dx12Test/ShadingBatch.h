@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "CpuRayTracer.h"
+#include "CpuShading.h"
+#include "CpuSimd.h"
+#include "ThreadPool.h"
+
+/*
+ ------------------------------Batched Shading------------------------------------
+ Render with the shading of shaders/Shading.h run W pixels at a time instead of one: one
+ CameraRayDirection<SimdFloat<W>> call makes W camera rays, each is traced alone (traversal stays scalar), and the
+ hits of a tile, compacted so no lane shades a miss, go through HitAttribute, CalculateDiffuseLighting and
+ CombineLighting W at a time with every vector component in a SIMD register. What does not batch stays per hit:
+ instance transforms of the normal, shadow rays, misses.
+ Same functions as the scalar tracer and the shaders, so the image is Render's.
+*/
+
+namespace CpuRt
+{
+	// ClosestHit or Miss for rays[i] / hits[i], i < count <= W, colors[i] is the payload's ShadedColorAndHitT
+	template<int W, typename Accel>
+	inline void ShadeHits(const ShaderContext& context, const Accel& accel, const Ray* rays, const RayHit* hits, uint32_t count, Float4* colors)
+	{
+		using real = SimdFloat<W>;
+
+		// Hits to SoA, lanes without a hit shade a zero vertex and are dropped at the end
+		float position[3][W], vertexNormal[3][3][W], barycentric[2][W];
+		for (uint32_t i = 0; i < uint32_t(W); i++)
+		{
+			Float3 p = { 0.0f, 0.0f, 0.0f };
+			Float3 normals[3] = { p, p, p };
+			Float2 b = { 0.0f, 0.0f };
+			if (i < count && hits[i].Hit())
+			{
+				// HitWorldPosition
+				p = rays[i].origin + hits[i].t * rays[i].direction;
+				const uint32_t* indices = &context.mesh->indices[size_t(hits[i].primitive) * 3];
+				for (int v = 0; v < 3; v++) normals[v] = context.mesh->vertices[indices[v]].normal;
+				b = hits[i].barycentrics;
+			}
+			for (int c = 0; c < 3; c++)
+			{
+				position[c][i] = p[c];
+				for (int v = 0; v < 3; v++) vertexNormal[v][c][i] = normals[v][c];
+			}
+			barycentric[0][i] = b.x;
+			barycentric[1][i] = b.y;
+		}
+
+		const auto load = [](const float (&soa)[3][W]) { return ShadingFloat3<real>{ real::Load(soa[0]), real::Load(soa[1]), real::Load(soa[2]) }; };
+		const auto store = [](const ShadingFloat3<real>& v, float (&soa)[3][W]) { v.x.Store(soa[0]); v.y.Store(soa[1]); v.z.Store(soa[2]); };
+
+		ShadingFloat3<real> vertexNormals[3] = { load(vertexNormal[0]), load(vertexNormal[1]), load(vertexNormal[2]) };
+		ShadingFloat3<real> triangleNormal = HitAttribute<real>(vertexNormals, { real::Load(barycentric[0]), real::Load(barycentric[1]) });
+		if (context.instances)
+		{
+			float normal[3][W];
+			store(triangleNormal, normal);
+			for (uint32_t i = 0; i < count; i++)
+			{
+				if (!hits[i].Hit() || hits[i].instance == gInvalidPrimitive) continue;
+				const Float3 n = TransformNormal(context.instances[hits[i].instance].transform, { normal[0][i], normal[1][i], normal[2][i] });
+				for (int c = 0; c < 3; c++) normal[c][i] = n[c];
+			}
+			triangleNormal = load(normal);
+		}
+		triangleNormal = normalize(triangleNormal);
+
+		const ShadingFloat4<real> diffuseColor = CalculateDiffuseLighting<real>(*context.scene, load(position), triangleNormal);
+
+		// Only surfaces facing the light need to know whether it is blocked
+		float diffuse[3][W], lightVisibility[W];
+		store({ diffuseColor.x, diffuseColor.y, diffuseColor.z }, diffuse);
+		for (uint32_t i = 0; i < uint32_t(W); i++)
+		{
+			lightVisibility[i] = 1.0f;
+			if (i < count && hits[i].Hit() && (diffuse[0][i] > 0.0f || diffuse[1][i] > 0.0f || diffuse[2][i] > 0.0f) &&
+				TraceShadowRay(accel, { position[0][i], position[1][i], position[2][i] }, context.scene->lightPosition.xyz()))
+			{
+				lightVisibility[i] = 0.0f;
+			}
+		}
+
+		const ShadingFloat4<real> color = CombineLighting<real>(*context.scene, diffuseColor, real::Load(lightVisibility));
+		float rgba[4][W];
+		color.x.Store(rgba[0]);
+		color.y.Store(rgba[1]);
+		color.z.Store(rgba[2]);
+		color.w.Store(rgba[3]);
+		for (uint32_t i = 0; i < count; i++)
+		{
+			HitInfo payload;
+			if (hits[i].Hit()) payload.ShadedColorAndHitT = { rgba[0][i], rgba[1][i], rgba[2][i], rgba[3][i] };
+			else Miss(payload);
+			colors[i] = payload.ShadedColorAndHitT;
+		}
+	}
+
+	/*
+	 Render, with RayGen W pixels of a row at a time and the hits of a tile compacted into full batches of W
+	 before shading, misses take the Miss color right away
+	*/
+	template<int W, typename Accel>
+	inline RenderStats RenderBatched(const Accel& accel, const MeshData& mesh, const SceneConstants& scene, const RenderSettings& settings,
+		std::vector<Float4>& output, ThreadPool& pool = ThreadPool::Default())
+	{
+		using real = SimdFloat<W>;
+		const ShaderContext context = { &mesh, &scene, settings.width, settings.height, AccelInstances(accel) };
+		output.resize(size_t(settings.width) * settings.height);
+
+		const auto start = std::chrono::high_resolution_clock::now();
+		ForEachTile(settings, pool, [&](uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1)
+		{
+			std::vector<Ray> rays;
+			std::vector<RayHit> hits;
+			std::vector<size_t> pixels;
+			float laneX[W], direction[3][W];
+			for (uint32_t y = y0; y < y1; y++)
+			{
+				for (uint32_t x = x0; x < x1; x += W)
+				{
+					for (int i = 0; i < W; i++) laneX[i] = float(x + i);
+
+					// RayGen
+					const ShadingFloat3<real> rayDir = CameraRayDirection<real>(scene, real::Load(laneX), real::Broadcast(float(y)),
+						float(settings.width), float(settings.height));
+					rayDir.x.Store(direction[0]);
+					rayDir.y.Store(direction[1]);
+					rayDir.z.Store(direction[2]);
+					for (uint32_t i = 0; i < std::min(uint32_t(W), x1 - x); i++)
+					{
+						Ray ray;
+						ray.origin = scene.cameraPosition.xyz();
+						ray.direction = { direction[0][i], direction[1][i], direction[2][i] };
+						ray.tMin = 0.001f;
+						ray.tMax = 10000.0f;
+
+						RayHit hit;
+						const size_t pixel = size_t(y) * settings.width + x + i;
+						if (accel.Intersect(ray, RayFlagCullBackFacingTriangles, hit))
+						{
+							rays.push_back(ray);
+							hits.push_back(hit);
+							pixels.push_back(pixel);
+						}
+						else
+						{
+							HitInfo payload;
+							Miss(payload);
+							output[pixel] = payload.ShadedColorAndHitT;
+						}
+					}
+				}
+			}
+
+			Float4 colors[W];
+			for (size_t first = 0; first < hits.size(); first += W)
+			{
+				const uint32_t count = uint32_t(std::min(hits.size() - first, size_t(W)));
+				ShadeHits<W>(context, accel, &rays[first], &hits[first], count, colors);
+				for (uint32_t i = 0; i < count; i++) output[pixels[first + i]] = colors[i];
+			}
+		});
+
+		RenderStats stats;
+		stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		stats.rays = uint64_t(settings.width) * settings.height;
+		return stats;
+	}
+}
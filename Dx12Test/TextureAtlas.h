@@ -0,0 +1,461 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "TextureLoader.h"
+
+/*
+ ------------------------------Texture Atlas Packing------------------------------------
+ Material libraries reference thousands of small textures. Giving each one a committed resource wastes
+ most of a 64KB placement and one descriptor per texture, so small textures are packed into groups,
+ every group being a single Texture2DArray on the GPU:
+	Array : textures sharing format and size, one slice each, uv unchanged
+	Atlas : everything else of the same format, skyline packed into equally sized pages (one slice per page)
+ Large textures keep their own resource (Standalone).
+ Shaders remap with uv' = frac(uv) * uvScale + uvOffset and sample slice 'slice' of group 'group'.
+ Array slices keep their full mip chain. Atlas pages get atlasMipLevels mips, their entries are aligned to and padded
+ by 1 << (atlasMipLevels - 1) texels so the 2x2 box filter never mixes two entries and the coarsest mip still has a
+ texel of gutter. Page width is the power of two that packs into the fewest texels, pages are trimmed to the rows used.
+*/
+
+enum class AtlasPlacement : uint32_t
+{
+	Standalone = 0,
+	Array,
+	Atlas
+};
+
+struct AtlasSettings
+{
+	int pageSize = 2048;		// max atlas page width/height, pages shrink when there is little to pack
+	int padding = 2;			// gutter texels replicated around every atlas entry so bilinear filtering does not bleed
+	int atlasMipLevels = 3;		// mips of atlas pages, the gutter grows to 1 << (atlasMipLevels - 1) texels when that is wider
+	int maxPackedSize = 256;	// textures with a larger side stay standalone
+	int minArrayCount = 8;		// identical format/size textures needed before they go to an array instead of the atlas
+	int maxArraySlices = 2048;	// D3D12_REQ_TEXTURE2D_ARRAY_AXIS_DIMENSION
+};
+
+struct AtlasRemap
+{
+	AtlasPlacement placement = AtlasPlacement::Standalone;
+	int group = -1;				// index into TextureAtlas::groups, -1 for standalone textures
+	int slice = 0;
+	float uvScale[2] = { 1.0f, 1.0f };
+	float uvOffset[2] = { 0.0f, 0.0f };
+};
+
+struct AtlasGroup
+{
+	AtlasPlacement placement = AtlasPlacement::Array;
+	uint32_t format = gTextureFormatRGBA8;
+	int width = 0;
+	int height = 0;
+	int mipLevels = 1;
+	std::vector<TextureInfo> slices;					// mip 0 of every slice
+	std::vector<std::vector<TextureInfo>> mips;			// per slice, mips 1 to mipLevels - 1
+};
+
+struct AtlasStats
+{
+	size_t inputTextures = 0;
+	size_t arrayTextures = 0;
+	size_t atlasTextures = 0;
+	size_t standaloneTextures = 0;
+	size_t groups = 0;
+	size_t atlasPages = 0;
+	uint64_t usedTexels = 0;			// texels of packed textures, gutters excluded
+	uint64_t allocatedTexels = 0;		// texels of all group slices
+	uint64_t bytesBefore = 0;			// one committed resource per texture, full mip chains
+	uint64_t bytesAfter = 0;			// one committed resource per group with its mips + standalone textures
+	size_t descriptorsBefore = 0;
+	size_t descriptorsAfter = 0;
+
+	double Efficiency() const { return allocatedTexels ? double(usedTexels) / double(allocatedTexels) : 1.0; }
+};
+
+struct TextureAtlas
+{
+	std::vector<AtlasGroup> groups;
+	std::vector<AtlasRemap> remap;		// one entry per input texture, same order as the input
+	AtlasStats stats;
+};
+
+namespace Utility
+{
+	// Committed textures are placed at D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT
+	static uint64_t CommittedTextureSize(uint64_t bytes)
+	{
+		const uint64_t placementAlignment = 65536;
+		return ((bytes + placementAlignment - 1) / placementAlignment) * placementAlignment;
+	}
+
+	static int FullMipCount(int width, int height)
+	{
+		int levels = 1;
+		while ((width >> levels) > 0 || (height >> levels) > 0) levels++;
+		return levels;
+	}
+
+	// Bytes of the first 'levels' mips of a width x height texture, D3D12 mip sizes
+	static uint64_t MipChainBytes(int width, int height, int bpp, int levels)
+	{
+		uint64_t bytes = 0;
+		for (int level = 0; level < levels; level++)
+		{
+			bytes += uint64_t(std::max(1, width >> level)) * std::max(1, height >> level) * bpp;
+		}
+		return bytes;
+	}
+
+	// Skyline bottom-left bin packer, one per atlas page
+	struct SkylinePacker
+	{
+		struct Segment { int x, y, width; };
+
+		int width = 0;
+		int height = 0;
+		std::vector<Segment> skyline;
+
+		SkylinePacker(int w, int h) : width(w), height(h) { skyline.push_back({ 0, 0, w }); }
+
+		// Returns y of the rect if placed at segment i, or -1 when it does not fit there
+		int Fit(size_t i, int w, int h) const
+		{
+			if (skyline[i].x + w > width) return -1;
+
+			int y = 0;
+			int remaining = w;
+			for (size_t j = i; remaining > 0; j++)
+			{
+				if (j >= skyline.size()) return -1;
+				y = std::max(y, skyline[j].y);
+				if (y + h > height) return -1;
+				remaining -= skyline[j].width;
+			}
+			return y;
+		}
+
+		bool Insert(int w, int h, int& outX, int& outY)
+		{
+			int bestY = INT32_MAX, bestWidth = INT32_MAX;
+			size_t bestIndex = SIZE_MAX;
+
+			for (size_t i = 0; i < skyline.size(); i++)
+			{
+				int y = Fit(i, w, h);
+				if (y >= 0 && (y + h < bestY || (y + h == bestY && skyline[i].width < bestWidth)))
+				{
+					bestY = y + h;
+					bestWidth = skyline[i].width;
+					bestIndex = i;
+				}
+			}
+
+			if (bestIndex == SIZE_MAX) return false;
+
+			outX = skyline[bestIndex].x;
+			outY = bestY - h;
+
+			// Raise the skyline under the new rect and trim the segments it covers
+			Segment seg = { outX, bestY, w };
+			skyline.insert(skyline.begin() + bestIndex, seg);
+			for (size_t i = bestIndex + 1; i < skyline.size();)
+			{
+				const int prevEnd = skyline[i - 1].x + skyline[i - 1].width;
+				if (skyline[i].x >= prevEnd) break;
+
+				const int shrink = prevEnd - skyline[i].x;
+				skyline[i].x += shrink;
+				skyline[i].width -= shrink;
+				if (skyline[i].width > 0) break;
+				skyline.erase(skyline.begin() + i);
+			}
+
+			// Merge neighbours at the same height
+			for (size_t i = 0; i + 1 < skyline.size();)
+			{
+				if (skyline[i].y == skyline[i + 1].y)
+				{
+					skyline[i].width += skyline[i + 1].width;
+					skyline.erase(skyline.begin() + i + 1);
+				}
+				else i++;
+			}
+			return true;
+		}
+	};
+
+	// Copies src into dst at (x + padding, y + padding) and replicates its border texels out to the whole
+	// width x height rect at (x, y) (clamp addressing)
+	static void BlitWithGutter(TextureInfo& dst, const TextureInfo& src, int x, int y, int width, int height, int padding)
+	{
+		const int bpp = src.stride;
+		for (int row = 0; row < height; row++)
+		{
+			const int srcRow = std::min(std::max(row - padding, 0), src.height - 1);
+			uint8_t* dstRow = dst.pixels.data() + (size_t(y + row) * dst.width + x) * bpp;
+			const uint8_t* srcPixels = src.pixels.data() + size_t(srcRow) * src.width * bpp;
+
+			for (int i = 0; i < padding; i++)
+			{
+				memcpy(dstRow + i * bpp, srcPixels, bpp);
+			}
+			memcpy(dstRow + padding * bpp, srcPixels, size_t(src.width) * bpp);
+			for (int i = padding + src.width; i < width; i++)
+			{
+				memcpy(dstRow + i * bpp, srcPixels + (src.width - 1) * bpp, bpp);
+			}
+		}
+	}
+
+	// Atlas entry rect: the texture plus its gutter, rounded up to 'alignment' so entries start on mip blocks
+	static int PaddedAtlasSide(int side, int padding, int alignment)
+	{
+		return (side + 2 * padding + alignment - 1) / alignment * alignment;
+	}
+
+	struct AtlasPlacementRect { int page, x, y; };
+
+	// Skyline packs the textures in order onto pageSize pages, returns the page count and in 'usedHeight' the
+	// highest row any page reached, the pages can be trimmed to it
+	static size_t PackAtlasPages(const std::vector<TextureInfo>& textures, const std::vector<size_t>& indices, int pageSize,
+		int padding, int alignment, std::vector<AtlasPlacementRect>& placements, int& usedHeight)
+	{
+		usedHeight = 0;
+		std::vector<SkylinePacker> pages;
+		placements.resize(indices.size());
+		for (size_t i = 0; i < indices.size(); i++)
+		{
+			const TextureInfo& tex = textures[indices[i]];
+			const int w = PaddedAtlasSide(tex.width, padding, alignment);
+			const int h = PaddedAtlasSide(tex.height, padding, alignment);
+
+			AtlasPlacementRect& placement = placements[i];
+			placement.page = 0;
+			for (; placement.page < int(pages.size()); placement.page++)
+			{
+				if (pages[placement.page].Insert(w, h, placement.x, placement.y)) break;
+			}
+
+			if (placement.page == int(pages.size()))
+			{
+				pages.emplace_back(pageSize, pageSize);
+				if (!pages.back().Insert(w, h, placement.x, placement.y))
+				{
+					throw std::runtime_error("Error: " + std::to_string(w) + "x" + std::to_string(h) + " texture does not fit an empty " + std::to_string(pageSize) + " atlas page");
+				}
+			}
+			usedHeight = std::max(usedHeight, placement.y + h);
+		}
+		return pages.size();
+	}
+
+	static TextureInfo CreateSlice(int width, int height, int bpp, uint32_t format)
+	{
+		TextureInfo slice = {};
+		slice.width = width;
+		slice.height = height;
+		slice.stride = bpp;
+		slice.format = format;
+		slice.pixels.assign(size_t(width) * height * bpp, 0);
+		return slice;
+	}
+
+	// Packs small textures into arrays and atlas pages, returns the groups to upload and a uv remap per input texture.
+	// Standalone textures are left in 'textures', packed ones are moved into the groups.
+	static TextureAtlas PackTextures(std::vector<TextureInfo>& textures, const AtlasSettings& settings = {})
+	{
+		TextureAtlas atlas;
+		atlas.remap.resize(textures.size());
+
+		AtlasStats& stats = atlas.stats;
+		stats.inputTextures = textures.size();
+		stats.descriptorsBefore = textures.size();
+
+		// Bucket by format and size, larger textures stay standalone
+		std::map<std::tuple<uint32_t, int, int>, std::vector<size_t>> buckets;
+		for (size_t i = 0; i < textures.size(); i++)
+		{
+			const TextureInfo& tex = textures[i];
+			const uint64_t standaloneBytes = CommittedTextureSize(MipChainBytes(tex.width, tex.height, tex.stride, FullMipCount(tex.width, tex.height)));
+			stats.bytesBefore += standaloneBytes;
+
+			if (tex.width > settings.maxPackedSize || tex.height > settings.maxPackedSize)
+			{
+				stats.standaloneTextures++;
+				stats.bytesAfter += standaloneBytes;
+				continue;
+			}
+			buckets[{ tex.format, tex.width, tex.height }].push_back(i);
+		}
+
+		// Large buckets become Texture2DArrays, the rest is left for the atlas
+		const int atlasMipLevels = std::max(settings.atlasMipLevels, 1);
+		const int alignment = 1 << (atlasMipLevels - 1);
+		const int padding = std::max(settings.padding, alignment > 1 ? alignment : 0);
+		std::map<uint32_t, std::vector<size_t>> atlasCandidates;
+		for (auto& bucket : buckets)
+		{
+			const std::vector<size_t>& indices = bucket.second;
+			if (indices.size() < size_t(settings.minArrayCount))
+			{
+				// With its gutter the texture has to fit a page, otherwise it stays standalone
+				const int paddedSide = PaddedAtlasSide(std::max(std::get<1>(bucket.first), std::get<2>(bucket.first)), padding, alignment);
+				if (paddedSide > settings.pageSize)
+				{
+					for (size_t index : indices)
+					{
+						const TextureInfo& tex = textures[index];
+						stats.standaloneTextures++;
+						stats.bytesAfter += CommittedTextureSize(MipChainBytes(tex.width, tex.height, tex.stride, FullMipCount(tex.width, tex.height)));
+					}
+					continue;
+				}
+
+				auto& candidates = atlasCandidates[std::get<0>(bucket.first)];
+				candidates.insert(candidates.end(), indices.begin(), indices.end());
+				continue;
+			}
+
+			for (size_t first = 0; first < indices.size(); first += settings.maxArraySlices)
+			{
+				AtlasGroup group;
+				group.placement = AtlasPlacement::Array;
+				group.format = std::get<0>(bucket.first);
+				group.width = std::get<1>(bucket.first);
+				group.height = std::get<2>(bucket.first);
+				group.mipLevels = FullMipCount(group.width, group.height);
+
+				const size_t last = std::min(indices.size(), first + settings.maxArraySlices);
+				for (size_t i = first; i < last; i++)
+				{
+					AtlasRemap& remap = atlas.remap[indices[i]];
+					remap.placement = AtlasPlacement::Array;
+					remap.group = static_cast<int>(atlas.groups.size());
+					remap.slice = static_cast<int>(group.slices.size());
+					group.slices.push_back(std::move(textures[indices[i]]));
+				}
+
+				stats.arrayTextures += group.slices.size();
+				atlas.groups.push_back(std::move(group));
+			}
+		}
+
+		// Skyline pack the leftovers, tallest first
+		for (auto& candidates : atlasCandidates)
+		{
+			std::vector<size_t>& indices = candidates.second;
+			std::sort(indices.begin(), indices.end(), [&](size_t a, size_t b)
+			{
+				if (textures[a].height != textures[b].height) return textures[a].height > textures[b].height;
+				return textures[a].width > textures[b].width;
+			});
+
+			// Every power of two page width from the largest entry up to settings.pageSize is packed, the pages are
+			// trimmed to the rows they use and the width needing the fewest texels is kept (a single half empty large
+			// page costs more than a few small ones)
+			int maxSide = 64;
+			for (size_t index : indices)
+			{
+				maxSide = std::max(maxSide, PaddedAtlasSide(std::max(textures[index].width, textures[index].height), padding, alignment));
+			}
+
+			int pageWidth = settings.pageSize, pageHeight = settings.pageSize;
+			std::vector<AtlasPlacementRect> placements, trial;
+			uint64_t bestTexels = UINT64_MAX;
+			for (int size = settings.pageSize; size >= maxSide; size /= 2)
+			{
+				int usedHeight = 0;
+				const uint64_t texels = uint64_t(PackAtlasPages(textures, indices, size, padding, alignment, trial, usedHeight)) * size * usedHeight;
+				if (texels < bestTexels)
+				{
+					bestTexels = texels;
+					pageWidth = size;
+					pageHeight = usedHeight;
+					placements.swap(trial);
+				}
+			}
+
+			AtlasGroup group;
+			group.placement = AtlasPlacement::Atlas;
+			group.format = candidates.first;
+			group.width = pageWidth;
+			group.height = pageHeight;
+			group.mipLevels = std::min(atlasMipLevels, FullMipCount(pageWidth, pageHeight));
+			const int groupIndex = static_cast<int>(atlas.groups.size());
+
+			for (size_t i = 0; i < indices.size(); i++)
+			{
+				const TextureInfo& tex = textures[indices[i]];
+				const AtlasPlacementRect& placement = placements[i];
+				while (group.slices.size() <= size_t(placement.page))
+				{
+					group.slices.push_back(CreateSlice(pageWidth, pageHeight, tex.stride, tex.format));
+				}
+
+				BlitWithGutter(group.slices[placement.page], tex, placement.x, placement.y,
+					PaddedAtlasSide(tex.width, padding, alignment), PaddedAtlasSide(tex.height, padding, alignment), padding);
+
+				AtlasRemap& remap = atlas.remap[indices[i]];
+				remap.placement = AtlasPlacement::Atlas;
+				remap.group = groupIndex;
+				remap.slice = placement.page;
+				remap.uvScale[0] = float(tex.width) / float(pageWidth);
+				remap.uvScale[1] = float(tex.height) / float(pageHeight);
+				remap.uvOffset[0] = float(placement.x + padding) / float(pageWidth);
+				remap.uvOffset[1] = float(placement.y + padding) / float(pageHeight);
+
+				stats.usedTexels += uint64_t(tex.width) * tex.height;
+				textures[indices[i]] = TextureInfo();
+			}
+
+			stats.atlasTextures += indices.size();
+			stats.atlasPages += group.slices.size();
+			atlas.groups.push_back(std::move(group));
+		}
+
+		for (AtlasGroup& group : atlas.groups)
+		{
+			const uint64_t sliceTexels = uint64_t(group.width) * group.height;
+			stats.allocatedTexels += sliceTexels * group.slices.size();
+			if (group.placement == AtlasPlacement::Array)
+			{
+				stats.usedTexels += sliceTexels * group.slices.size();
+			}
+
+			group.mips.resize(group.slices.size());
+			for (size_t slice = 0; slice < group.slices.size(); slice++)
+			{
+				std::vector<TextureInfo> chain = GenerateMipChain(group.slices[slice], group.mipLevels);
+				group.mips[slice].assign(std::make_move_iterator(chain.begin() + 1), std::make_move_iterator(chain.end()));
+			}
+
+			const int bpp = group.slices.empty() ? 4 : group.slices[0].stride;
+			stats.bytesAfter += CommittedTextureSize(MipChainBytes(group.width, group.height, bpp, group.mipLevels) * group.slices.size());
+		}
+
+		stats.groups = atlas.groups.size();
+		stats.descriptorsAfter = atlas.groups.size() + stats.standaloneTextures;
+		return atlas;
+	}
+
+	static void PrintAtlasStats(const AtlasStats& stats)
+	{
+		printf("Texture atlas: %zu textures -> %zu groups (%zu array, %zu atlas on %zu pages, %zu standalone)\n",
+			stats.inputTextures, stats.groups, stats.arrayTextures, stats.atlasTextures, stats.atlasPages, stats.standaloneTextures);
+		printf("  packing efficiency %.1f%% (%llu used / %llu allocated texels)\n",
+			stats.Efficiency() * 100.0, (unsigned long long)stats.usedTexels, (unsigned long long)stats.allocatedTexels);
+		printf("  memory with mips %.2f MB -> %.2f MB, descriptors %zu -> %zu\n",
+			stats.bytesBefore / (1024.0 * 1024.0), stats.bytesAfter / (1024.0 * 1024.0), stats.descriptorsBefore, stats.descriptorsAfter);
+	}
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+// stb_image.h has no guard around its implementation, only include it when the app has not already
+#ifndef STBI_INCLUDE_STB_IMAGE_H
+#include "stb_image.h"
+#endif
+#include "JpegDecoder.h"
+
+/*
+ ------------------------------Texture Types------------------------------------
+ Kept free of Windows headers so the offline tools (Headless.cpp) share the same loader as the app.
+*/
+
+constexpr uint32_t gTextureFormatRGBA8 = 28;	// DXGI_FORMAT_R8G8B8A8_UNORM
+
+struct TextureInfo
+{
+	std::vector<uint8_t> pixels;
+	int width = 0;
+	int height = 0;
+	int stride = 0;
+	int offset = 0;
+	uint32_t format = gTextureFormatRGBA8;		// DXGI_FORMAT value of pixels
+};
+
+namespace Utility
+{
+	static void FormatTexture(TextureInfo& info, uint8_t* pixels)
+	{
+		const uint32_t numPixels = (info.width * info.height);
+		const uint32_t oldStride = info.stride;
+
+		const uint32_t newStride = 4;				// uploading textures to GPU as DXGI_FORMAT_R8G8B8A8_UNORM
+		const uint32_t newSize = (numPixels * newStride);
+		info.pixels.resize(newSize);
+
+		for (uint32_t i = 0; i < numPixels; i++)
+		{
+			// grey scale images only have one channel, replicate it
+			const uint32_t g = (oldStride < 3) ? 0 : 1;
+			const uint32_t b = (oldStride < 3) ? 0 : 2;
+			info.pixels[i * newStride] = pixels[i * oldStride];				// R
+			info.pixels[i * newStride + 1] = pixels[i * oldStride + g];		// G
+			info.pixels[i * newStride + 2] = pixels[i * oldStride + b];		// B
+			info.pixels[i * newStride + 3] = 0xFF;							// A (always 1)
+		}
+
+		info.stride = newStride;
+		info.format = gTextureFormatRGBA8;
+	}
+
+	static std::vector<uint8_t> ReadBinaryFile(const std::string& filepath)
+	{
+		std::vector<uint8_t> bytes;
+		FILE* file = fopen(filepath.c_str(), "rb");
+		if (!file)
+		{
+			throw std::runtime_error("Error: failed to open " + filepath);
+		}
+
+		fseek(file, 0, SEEK_END);
+		bytes.resize(static_cast<size_t>(ftell(file)));
+		fseek(file, 0, SEEK_SET);
+		const size_t read = fread(bytes.data(), 1, bytes.size(), file);
+		fclose(file);
+
+		if (read != bytes.size())
+		{
+			throw std::runtime_error("Error: failed to read " + filepath);
+		}
+		return bytes;
+	}
+
+	// Box filter for when a downscale is wanted but the JPEG path does not apply
+	static void DownsampleTexture(TextureInfo& texture, int scale)
+	{
+		if (scale <= 1) return;
+
+		const int width = (texture.width + scale - 1) / scale;
+		const int height = (texture.height + scale - 1) / scale;
+		std::vector<uint8_t> pixels(size_t(width) * height * texture.stride);
+
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				for (int ch = 0; ch < texture.stride; ch++)
+				{
+					int sum = 0, count = 0;
+					for (int sy = y * scale; sy < std::min((y + 1) * scale, texture.height); sy++)
+					{
+						for (int sx = x * scale; sx < std::min((x + 1) * scale, texture.width); sx++, count++)
+						{
+							sum += texture.pixels[(size_t(sy) * texture.width + sx) * texture.stride + ch];
+						}
+					}
+					pixels[(size_t(y) * width + x) * texture.stride + ch] = static_cast<uint8_t>((sum + count / 2) / count);
+				}
+			}
+		}
+
+		texture.pixels.swap(pixels);
+		texture.width = width;
+		texture.height = height;
+	}
+
+	// Full chain down to 1x1 with D3D12 mip sizes (max(1, size >> level)), 2x2 box filter. 'levels' > 0 stops
+	// after that many mips, mip 0 included.
+	static std::vector<TextureInfo> GenerateMipChain(const TextureInfo& texture, int levels = 0)
+	{
+		std::vector<TextureInfo> chain(1, texture);
+		while ((chain.back().width > 1 || chain.back().height > 1) && (levels <= 0 || int(chain.size()) < levels))
+		{
+			const TextureInfo& src = chain.back();
+			TextureInfo mip;
+			mip.width = std::max(1, src.width >> 1);
+			mip.height = std::max(1, src.height >> 1);
+			mip.stride = src.stride;
+			mip.format = src.format;
+			mip.pixels.resize(size_t(mip.width) * mip.height * mip.stride);
+
+			for (int y = 0; y < mip.height; y++)
+			{
+				const int y0 = std::min(y * 2, src.height - 1), y1 = std::min(y * 2 + 1, src.height - 1);
+				for (int x = 0; x < mip.width; x++)
+				{
+					const int x0 = std::min(x * 2, src.width - 1), x1 = std::min(x * 2 + 1, src.width - 1);
+					for (int ch = 0; ch < mip.stride; ch++)
+					{
+						const int sum = src.pixels[(size_t(y0) * src.width + x0) * src.stride + ch] + src.pixels[(size_t(y0) * src.width + x1) * src.stride + ch]
+							+ src.pixels[(size_t(y1) * src.width + x0) * src.stride + ch] + src.pixels[(size_t(y1) * src.width + x1) * src.stride + ch];
+						mip.pixels[(size_t(y) * mip.width + x) * mip.stride + ch] = static_cast<uint8_t>((sum + 2) / 4);
+					}
+				}
+			}
+			chain.push_back(std::move(mip));
+		}
+		return chain;
+	}
+
+	// resolution is the material's -texres: JPEGs larger than that are decoded at 1/2, 1/4 or 1/8 scale
+	// without ever producing the full size image. 0 loads at full size.
+	static TextureInfo LoadTexture(std::string filepath, int resolution = 0)
+	{
+		TextureInfo result = {};
+		const std::vector<uint8_t> file = ReadBinaryFile(filepath);
+
+		int scale = 1;
+		int width = 0, height = 0;
+		if (resolution > 0 && Jpeg::ReadSize(file.data(), file.size(), width, height))
+		{
+			scale = Jpeg::SelectScale(width, height, resolution);
+			if (scale > 1 && Jpeg::DecodeScaled(file.data(), file.size(), scale, result.pixels, result.width, result.height))
+			{
+				result.stride = 4;
+				result.format = gTextureFormatRGBA8;
+				return result;
+			}
+		}
+
+		// Load image pixels with stb_image
+		uint8_t* pixels = stbi_load_from_memory(file.data(), static_cast<int>(file.size()), &result.width, &result.height, &result.stride, STBI_default);
+		if (!pixels)
+		{
+			throw std::runtime_error("Error: failed to load image!");
+		}
+
+		FormatTexture(result, pixels);
+		stbi_image_free(pixels);
+		DownsampleTexture(result, scale);
+		return result;
+	}
+}
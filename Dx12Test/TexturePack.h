@@ -0,0 +1,507 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "TextureLoader.h"
+#include "ThreadPool.h"
+
+/*
+ ------------------------------Texture Pack------------------------------------
+ One file holding every texture of a material library with its mip chain already in the layout CopyTextureRegion
+ wants: rows padded to D3D12_TEXTURE_DATA_PITCH_ALIGNMENT, payloads placement aligned. The runtime maps the file
+ and copies mips straight from the mapping into an upload buffer, no open/decode per texture.
+
+ Layout: header | texture entries | mip entries | name table | payloads
+ Payloads are ordered coarse to fine over all textures, so the small mips the first frame needs sit together at the
+ front of the file and fault in with a few sequential reads. Mips of a page or more start on a page, smaller ones
+ are packed (placement aligned) without ever straddling a page, so every mip costs the minimum number of faults.
+*/
+
+constexpr uint32_t gTexturePackMagic = 0x4B50544B;			// "KTPK"
+constexpr uint32_t gTexturePackVersion = 1;
+constexpr uint32_t gTexturePackPageSize = 4096;
+constexpr uint32_t gTexturePitchAlignment = 256;			// D3D12_TEXTURE_DATA_PITCH_ALIGNMENT
+constexpr uint32_t gTexturePlacementAlignment = 512;		// D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT
+
+struct TexturePackHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t pageSize;
+	uint32_t textureCount;
+	uint32_t mipCount;
+	uint32_t nameBytes;
+	uint64_t fileSize;
+};
+
+struct TexturePackTexture
+{
+	uint32_t nameOffset;		// into the name table, zero terminated, see Utility::NormalizeTexturePath
+	uint32_t format;			// DXGI_FORMAT of every mip
+	uint32_t width;
+	uint32_t height;
+	uint32_t mipCount;
+	uint32_t firstMip;			// index of mip 0 in the mip entries, the chain follows
+};
+
+struct TexturePackMip
+{
+	uint64_t offset;			// from the start of the file
+	uint32_t width;
+	uint32_t height;
+	uint32_t rowPitch;
+	uint32_t size;				// rowPitch * height
+};
+
+static_assert(sizeof(TexturePackHeader) == 32, "texture pack header layout changed");
+static_assert(sizeof(TexturePackTexture) == 24, "texture pack texture layout changed");
+static_assert(sizeof(TexturePackMip) == 24, "texture pack mip layout changed");
+
+struct TexturePackStats
+{
+	size_t textures = 0;
+	size_t mips = 0;
+	uint64_t payloadBytes = 0;		// texels incl. row padding
+	uint64_t fileBytes = 0;
+};
+
+// A mip of a texture in the pack, for TextureStreamer::Schedule it names the top (finest wanted) mip
+struct MipStreamRequest
+{
+	uint32_t texture = 0;
+	uint32_t mip = 0;
+};
+
+namespace Utility
+{
+	template<typename T>
+	static T AlignUp(T value, T alignment)
+	{
+		return (value + alignment - 1) / alignment * alignment;
+	}
+
+	// Pack names are the .mtl texture paths with forward slashes and lower case, .mtl files are written on Windows
+	static std::string NormalizeTexturePath(std::string path)
+	{
+		for (char& c : path)
+		{
+			c = (c == '\\') ? '/' : static_cast<char>(tolower(static_cast<unsigned char>(c)));
+		}
+		return path;
+	}
+
+	static void WritePadding(FILE* file, uint64_t& position, uint64_t target)
+	{
+		static const uint8_t zeros[gTexturePackPageSize] = {};
+		while (position < target)
+		{
+			const size_t count = static_cast<size_t>(std::min<uint64_t>(target - position, sizeof(zeros)));
+			fwrite(zeros, 1, count, file);
+			position += count;
+		}
+	}
+
+	// names[i] is what the runtime looks textures[i] up by, textures are RGBA8 top mips
+	static TexturePackStats WriteTexturePack(const std::string& filepath, const std::vector<std::string>& names, const std::vector<TextureInfo>& textures,
+		uint32_t pageSize = gTexturePackPageSize, ThreadPool& pool = ThreadPool::Default())
+	{
+		if (names.size() != textures.size())
+		{
+			throw std::runtime_error("Error: texture pack needs one name per texture");
+		}
+		pageSize = AlignUp(std::max(pageSize, gTexturePlacementAlignment), gTexturePlacementAlignment);
+
+		std::vector<std::vector<TextureInfo>> chains(textures.size());
+		pool.ParallelFor(textures.size(), 1, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++) chains[i] = GenerateMipChain(textures[i]);
+		});
+
+		TexturePackHeader header = {};
+		header.magic = gTexturePackMagic;
+		header.version = gTexturePackVersion;
+		header.pageSize = pageSize;
+		header.textureCount = static_cast<uint32_t>(textures.size());
+
+		std::vector<TexturePackTexture> entries(textures.size());
+		std::vector<TexturePackMip> mips;
+		std::string nameTable;
+		for (size_t i = 0; i < textures.size(); i++)
+		{
+			TexturePackTexture& entry = entries[i];
+			entry.nameOffset = static_cast<uint32_t>(nameTable.size());
+			entry.format = textures[i].format;
+			entry.width = textures[i].width;
+			entry.height = textures[i].height;
+			entry.mipCount = static_cast<uint32_t>(chains[i].size());
+			entry.firstMip = static_cast<uint32_t>(mips.size());
+			nameTable += NormalizeTexturePath(names[i]);
+			nameTable += '\0';
+
+			for (const TextureInfo& level : chains[i])
+			{
+				TexturePackMip mip = {};
+				mip.width = level.width;
+				mip.height = level.height;
+				mip.rowPitch = AlignUp<uint32_t>(level.width * level.stride, gTexturePitchAlignment);
+				mip.size = mip.rowPitch * level.height;
+				mips.push_back(mip);
+			}
+		}
+		header.mipCount = static_cast<uint32_t>(mips.size());
+		header.nameBytes = static_cast<uint32_t>(nameTable.size());
+
+		// Payload order: coarse to fine over every texture, ties keep texture order
+		std::vector<uint32_t> order(mips.size());
+		for (uint32_t i = 0; i < order.size(); i++) order[i] = i;
+		std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+		{
+			return std::max(mips[a].width, mips[a].height) < std::max(mips[b].width, mips[b].height);
+		});
+
+		uint64_t offset = sizeof(TexturePackHeader) + entries.size() * sizeof(TexturePackTexture) + mips.size() * sizeof(TexturePackMip) + nameTable.size();
+		offset = AlignUp<uint64_t>(offset, pageSize);
+		TexturePackStats stats;
+		for (uint32_t index : order)
+		{
+			TexturePackMip& mip = mips[index];
+			offset = AlignUp<uint64_t>(offset, gTexturePlacementAlignment);
+			if (mip.size >= pageSize || offset / pageSize != (offset + mip.size - 1) / pageSize)
+			{
+				offset = AlignUp<uint64_t>(offset, pageSize);
+			}
+			mip.offset = offset;
+			offset += mip.size;
+			stats.payloadBytes += mip.size;
+		}
+		header.fileSize = AlignUp<uint64_t>(offset, pageSize);
+
+		FILE* file = fopen(filepath.c_str(), "wb");
+		if (!file)
+		{
+			throw std::runtime_error("Error: failed to create " + filepath);
+		}
+
+		fwrite(&header, sizeof(header), 1, file);
+		fwrite(entries.data(), sizeof(TexturePackTexture), entries.size(), file);
+		fwrite(mips.data(), sizeof(TexturePackMip), mips.size(), file);
+		fwrite(nameTable.data(), 1, nameTable.size(), file);
+		uint64_t position = sizeof(TexturePackHeader) + entries.size() * sizeof(TexturePackTexture) + mips.size() * sizeof(TexturePackMip) + nameTable.size();
+
+		// Texture and level of every mip entry, to find the texels of the payload order
+		std::vector<std::pair<uint32_t, uint32_t>> source(mips.size());
+		for (uint32_t t = 0; t < entries.size(); t++)
+		{
+			for (uint32_t level = 0; level < entries[t].mipCount; level++) source[entries[t].firstMip + level] = { t, level };
+		}
+
+		for (uint32_t index : order)
+		{
+			const TexturePackMip& mip = mips[index];
+			const TextureInfo& level = chains[source[index].first][source[index].second];
+			WritePadding(file, position, mip.offset);
+
+			const uint32_t rowBytes = level.width * level.stride;
+			for (int row = 0; row < level.height; row++)
+			{
+				fwrite(level.pixels.data() + size_t(row) * rowBytes, 1, rowBytes, file);
+				position += rowBytes;
+				WritePadding(file, position, mip.offset + uint64_t(row + 1) * mip.rowPitch);
+			}
+		}
+		WritePadding(file, position, header.fileSize);
+
+		const bool failed = ferror(file) != 0;
+		fclose(file);
+		if (failed)
+		{
+			throw std::runtime_error("Error: failed to write " + filepath);
+		}
+
+		stats.textures = entries.size();
+		stats.mips = mips.size();
+		stats.fileBytes = header.fileSize;
+		return stats;
+	}
+
+	// Finest mip with no side above 'resolution', 0 keeps mip 0
+	static uint32_t FirstMipForResolution(const TexturePackTexture& texture, int resolution)
+	{
+		uint32_t mip = 0;
+		while (resolution > 0 && mip + 1 < texture.mipCount && std::max(texture.width >> mip, texture.height >> mip) > uint32_t(resolution))
+		{
+			mip++;
+		}
+		return mip;
+	}
+}
+
+/*
+ Read only mapping of a texture pack. Nothing is read at Open beyond the index, texel pages fault in when a mip is
+ first touched, Prefetch starts that read early and Release hands the pages back once a mip has been uploaded.
+*/
+class TexturePack
+{
+public:
+	TexturePack() = default;
+	~TexturePack() { Close(); }
+
+	TexturePack(const TexturePack&) = delete;
+	TexturePack& operator=(const TexturePack&) = delete;
+
+	void Open(const std::string& filepath)
+	{
+		Close();
+
+#ifdef _WIN32
+		fileHandle = CreateFileA(filepath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		LARGE_INTEGER fileSize = {};
+		if (fileHandle == INVALID_HANDLE_VALUE || !GetFileSizeEx(fileHandle, &fileSize))
+		{
+			Close();
+			throw std::runtime_error("Error: failed to open " + filepath);
+		}
+		size = static_cast<uint64_t>(fileSize.QuadPart);
+
+		mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		data = mappingHandle ? static_cast<const uint8_t*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+
+		SYSTEM_INFO systemInfo;
+		GetSystemInfo(&systemInfo);
+		systemPageSize = systemInfo.dwPageSize;
+#else
+		fileHandle = open(filepath.c_str(), O_RDONLY);
+		struct stat fileStat = {};
+		if (fileHandle < 0 || fstat(fileHandle, &fileStat) != 0)
+		{
+			Close();
+			throw std::runtime_error("Error: failed to open " + filepath);
+		}
+		size = static_cast<uint64_t>(fileStat.st_size);
+
+		void* mapping = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fileHandle, 0) : MAP_FAILED;
+		data = (mapping == MAP_FAILED) ? nullptr : static_cast<const uint8_t*>(mapping);
+		systemPageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+#endif
+
+		if (!data)
+		{
+			Close();
+			throw std::runtime_error("Error: failed to map " + filepath);
+		}
+
+		if (!Validate())
+		{
+			Close();
+			throw std::runtime_error("Error: " + filepath + " is not a valid texture pack");
+		}
+
+		for (uint32_t i = 0; i < header->textureCount; i++)
+		{
+			lookup[Name(textures[i])] = i;
+		}
+	}
+
+	void Close()
+	{
+#ifdef _WIN32
+		if (data) UnmapViewOfFile(data);
+		if (mappingHandle) CloseHandle(mappingHandle);
+		if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+		mappingHandle = nullptr;
+		fileHandle = INVALID_HANDLE_VALUE;
+#else
+		if (data) munmap(const_cast<uint8_t*>(data), size);
+		if (fileHandle >= 0) close(fileHandle);
+		fileHandle = -1;
+#endif
+		data = nullptr;
+		size = 0;
+		header = nullptr;
+		textures = nullptr;
+		mips = nullptr;
+		names = nullptr;
+		lookup.clear();
+	}
+
+	bool IsOpen() const { return data != nullptr; }
+	uint64_t FileSize() const { return size; }
+	uint32_t TextureCount() const { return header->textureCount; }
+
+	const TexturePackTexture& Texture(uint32_t index) const { return textures[index]; }
+	const TexturePackMip& Mip(const TexturePackTexture& texture, uint32_t level) const { return mips[texture.firstMip + level]; }
+	const char* Name(const TexturePackTexture& texture) const { return names + texture.nameOffset; }
+
+	// Index of the texture for an .mtl path, -1 when it is not in the pack
+	int Find(const std::string& path) const
+	{
+		auto it = lookup.find(Utility::NormalizeTexturePath(path));
+		return (it == lookup.end()) ? -1 : static_cast<int>(it->second);
+	}
+
+	// Rows are TexturePackMip::rowPitch apart
+	const uint8_t* Data(const TexturePackMip& mip) const { return data + mip.offset; }
+
+	// Asynchronous read ahead of the pages of a mip
+	void Prefetch(const TexturePackMip& mip) const
+	{
+		const uint64_t begin = mip.offset / systemPageSize * systemPageSize;
+		const uint64_t end = std::min(size, Utility::AlignUp<uint64_t>(mip.offset + mip.size, systemPageSize));
+#ifdef _WIN32
+		WIN32_MEMORY_RANGE_ENTRY range = { const_cast<uint8_t*>(data) + begin, static_cast<SIZE_T>(end - begin) };
+		PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+		madvise(const_cast<uint8_t*>(data) + begin, end - begin, MADV_WILLNEED);
+#endif
+	}
+
+	// Drops the pages of an uploaded mip from the working set, only pages holding nothing but this mip
+	void Release(const TexturePackMip& mip) const
+	{
+		const uint64_t begin = Utility::AlignUp<uint64_t>(mip.offset, systemPageSize);
+		const uint64_t end = (mip.offset + mip.size) / systemPageSize * systemPageSize;
+		if (end <= begin) return;
+#ifdef _WIN32
+		VirtualUnlock(const_cast<uint8_t*>(data) + begin, static_cast<SIZE_T>(end - begin));
+#else
+		madvise(const_cast<uint8_t*>(data) + begin, end - begin, MADV_DONTNEED);
+#endif
+	}
+
+private:
+	bool Validate()
+	{
+		if (size < sizeof(TexturePackHeader)) return false;
+		header = reinterpret_cast<const TexturePackHeader*>(data);
+		if (header->magic != gTexturePackMagic || header->version != gTexturePackVersion || header->fileSize > size) return false;
+
+		const uint64_t tableBytes = sizeof(TexturePackHeader) + uint64_t(header->textureCount) * sizeof(TexturePackTexture)
+			+ uint64_t(header->mipCount) * sizeof(TexturePackMip) + header->nameBytes;
+		if (tableBytes > size || (header->nameBytes > 0 && data[tableBytes - 1] != '\0')) return false;
+
+		textures = reinterpret_cast<const TexturePackTexture*>(data + sizeof(TexturePackHeader));
+		mips = reinterpret_cast<const TexturePackMip*>(textures + header->textureCount);
+		names = reinterpret_cast<const char*>(mips + header->mipCount);
+
+		for (uint32_t i = 0; i < header->textureCount; i++)
+		{
+			const TexturePackTexture& texture = textures[i];
+			if (texture.nameOffset >= header->nameBytes || texture.mipCount == 0 || uint64_t(texture.firstMip) + texture.mipCount > header->mipCount) return false;
+		}
+		for (uint32_t i = 0; i < header->mipCount; i++)
+		{
+			if (mips[i].offset + mips[i].size > size || uint64_t(mips[i].rowPitch) * mips[i].height != mips[i].size) return false;
+		}
+		return true;
+	}
+
+#ifdef _WIN32
+	HANDLE fileHandle = INVALID_HANDLE_VALUE;
+	HANDLE mappingHandle = nullptr;
+#else
+	int fileHandle = -1;
+#endif
+	const uint8_t* data = nullptr;
+	uint64_t size = 0;
+	uint64_t systemPageSize = gTexturePackPageSize;
+
+	const TexturePackHeader* header = nullptr;
+	const TexturePackTexture* textures = nullptr;
+	const TexturePackMip* mips = nullptr;
+	const char* names = nullptr;
+	std::unordered_map<std::string, uint32_t> lookup;
+};
+
+/*
+ Upload order for texture pack mips. Schedule splits the wanted chains into what the first frame is drawn with
+ (the coarse mips up to firstFrameSize, always at least the 1x1) and the rest, which Next hands out coarse to fine
+ over all textures so every texture sharpens at the same pace and each one stays a contiguous run of resident mips.
+*/
+class TextureStreamer
+{
+public:
+	void Schedule(const TexturePack& pack, const std::vector<MipStreamRequest>& topMips, uint32_t firstFrameSize)
+	{
+		this->pack = &pack;
+		firstFrame.clear();
+		streamed.clear();
+
+		std::vector<std::pair<uint32_t, MipStreamRequest>> requests;
+		for (const MipStreamRequest& top : topMips)
+		{
+			const TexturePackTexture& texture = pack.Texture(top.texture);
+			for (uint32_t mip = top.mip; mip < texture.mipCount; mip++)
+			{
+				const TexturePackMip& level = pack.Mip(texture, mip);
+				requests.push_back({ std::max(level.width, level.height), { top.texture, mip } });
+			}
+		}
+
+		std::stable_sort(requests.begin(), requests.end(), [](const std::pair<uint32_t, MipStreamRequest>& a, const std::pair<uint32_t, MipStreamRequest>& b)
+		{
+			return a.first < b.first;
+		});
+
+		for (const auto& request : requests)
+		{
+			const TexturePackTexture& texture = pack.Texture(request.second.texture);
+			const bool coarsest = request.second.mip + 1 == texture.mipCount;
+			if (coarsest || request.first <= firstFrameSize)
+			{
+				firstFrame.push_back(request.second);
+				pack.Prefetch(pack.Mip(texture, request.second.mip));
+			}
+			else
+			{
+				streamed.push_back(request.second);
+			}
+		}
+
+		if (!streamed.empty()) PrefetchFront();
+	}
+
+	const std::vector<MipStreamRequest>& FirstFrame() const { return firstFrame; }
+	size_t Pending() const { return streamed.size(); }
+
+	// Next mip to upload after the first frame, prefetches the one after it
+	bool Next(MipStreamRequest& request)
+	{
+		if (streamed.empty()) return false;
+		request = streamed.front();
+		streamed.pop_front();
+		if (!streamed.empty()) PrefetchFront();
+		return true;
+	}
+
+private:
+	void PrefetchFront()
+	{
+		const MipStreamRequest& next = streamed.front();
+		pack->Prefetch(pack->Mip(pack->Texture(next.texture), next.mip));
+	}
+
+	const TexturePack* pack = nullptr;
+	std::vector<MipStreamRequest> firstFrame;
+	std::deque<MipStreamRequest> streamed;
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ ------------------------------Thread Pool------------------------------------
+ Fork-join pool for the CPU side work (texture decode, BVH builds, CPU tracing).
+ Tasks are grouped in a TaskGroup; Wait() runs queued tasks on the waiting thread instead of blocking,
+ so tasks may spawn and wait on nested groups without starving the pool.
+*/
+
+struct TaskGroup
+{
+	std::atomic<size_t> pending{ 0 };
+	std::exception_ptr error;
+	std::mutex errorLock;
+};
+
+class ThreadPool
+{
+public:
+	// threadCount counts the calling thread too, 0 uses every hardware thread
+	explicit ThreadPool(unsigned threadCount = 0)
+	{
+		if (threadCount == 0) threadCount = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned i = 1; i < threadCount; i++)
+		{
+			workers.emplace_back([this] { WorkerLoop(); });
+		}
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(queueLock);
+			quit = true;
+		}
+		queueSignal.notify_all();
+		for (std::thread& worker : workers) worker.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	unsigned ThreadCount() const { return static_cast<unsigned>(workers.size()) + 1; }
+
+	void Run(TaskGroup& group, std::function<void()> task)
+	{
+		group.pending++;
+		{
+			std::lock_guard<std::mutex> lock(queueLock);
+			queue.push_back({ std::move(task), &group });
+		}
+		queueSignal.notify_one();
+	}
+
+	// Helps with queued work until every task of the group finished, rethrows the first task exception
+	void Wait(TaskGroup& group)
+	{
+		while (group.pending.load(std::memory_order_acquire) > 0)
+		{
+			if (!RunOne()) std::this_thread::yield();
+		}
+
+		if (group.error)
+		{
+			std::exception_ptr error = group.error;
+			group.error = nullptr;
+			std::rethrow_exception(error);
+		}
+	}
+
+	// Calls body(begin, end) over [0, count) in chunks of 'grain', the calling thread takes part
+	template<typename Body>
+	void ParallelFor(size_t count, size_t grain, const Body& body)
+	{
+		if (count == 0) return;
+		grain = std::max<size_t>(grain, 1);
+
+		const size_t chunks = (count + grain - 1) / grain;
+		if (chunks == 1 || workers.empty())
+		{
+			body(size_t(0), count);
+			return;
+		}
+
+		std::atomic<size_t> nextChunk{ 0 };
+		auto worker = [&]()
+		{
+			for (size_t chunk = nextChunk++; chunk < chunks; chunk = nextChunk++)
+			{
+				const size_t begin = chunk * grain;
+				body(begin, std::min(count, begin + grain));
+			}
+		};
+
+		TaskGroup group;
+		const size_t helpers = std::min<size_t>(chunks, ThreadCount()) - 1;
+		for (size_t i = 0; i < helpers; i++) Run(group, worker);
+
+		// Keep going with the caller, but still wait for helpers before 'nextChunk' leaves scope
+		try
+		{
+			worker();
+		}
+		catch (...)
+		{
+			nextChunk = chunks;
+			Wait(group);
+			throw;
+		}
+		Wait(group);
+	}
+
+	// Process wide pool used when callers do not bring their own
+	static ThreadPool& Default()
+	{
+		static ThreadPool pool;
+		return pool;
+	}
+
+private:
+	struct Task
+	{
+		std::function<void()> function;
+		TaskGroup* group = nullptr;
+	};
+
+	bool RunOne()
+	{
+		Task task;
+		{
+			std::lock_guard<std::mutex> lock(queueLock);
+			if (queue.empty()) return false;
+			task = std::move(queue.back());		// newest first keeps recursive work depth first
+			queue.pop_back();
+		}
+		Execute(task);
+		return true;
+	}
+
+	static void Execute(Task& task)
+	{
+		try
+		{
+			task.function();
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(task.group->errorLock);
+			if (!task.group->error) task.group->error = std::current_exception();
+		}
+		task.group->pending.fetch_sub(1, std::memory_order_release);
+	}
+
+	void WorkerLoop()
+	{
+		for (;;)
+		{
+			Task task;
+			{
+				std::unique_lock<std::mutex> lock(queueLock);
+				queueSignal.wait(lock, [this] { return quit || !queue.empty(); });
+				if (quit && queue.empty()) return;
+				task = std::move(queue.front());	// oldest first, those are the biggest pieces of recursive work
+				queue.pop_front();
+			}
+			Execute(task);
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::deque<Task> queue;
+	std::mutex queueLock;
+	std::condition_variable queueSignal;
+	bool quit = false;
+};
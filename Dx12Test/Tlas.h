@@ -0,0 +1,408 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "Bvh.h"
+#include "BvhLbvhBuilder.h"
+#include "CpuSimd.h"
+
+/*
+ ------------------------------Top Level Acceleration Structure------------------------------------
+ The two-level model of CreateTlas on the CPU: a BVH over InstanceDescs, each pointing at a BLAS (a Bvh).
+ Rays are moved into the instance's object space with the inverse of its Transform and traced through the BLAS
+ there, hits report InstanceIndex() in RayHit::instance. InstanceMask, TRIANGLE_CULL_DISABLE and
+ TRIANGLE_FRONT_COUNTERCLOCKWISE behave as in DXR, winding is decided in object space.
+
+ Built to be rebuilt every frame: instance bounds are the BLAS root bounds transformed with SSE, then an LBVH
+ over them (30 bit Morton codes, radix sort, Karras splits top down with bounds on the way back). Nodes keep both
+ children's bounds, one cache line each, so traversal tests the two children together and visits the nearer first.
+*/
+
+namespace CpuRt
+{
+	constexpr uint32_t gTlasLeaf = 0x80000000u;		// child refers to an instance, not a node
+
+	struct TlasNode
+	{
+		Float3 childMin[2];
+		Float3 childMax[2];
+		uint32_t child[2];		// internal node index or gTlasLeaf | instance index
+		uint32_t padding[2];
+	};
+
+	static_assert(sizeof(TlasNode) == 64, "TlasNode should stay one cache line");
+
+	struct TlasStats
+	{
+		double buildMilliseconds = 0.0;
+		size_t instances = 0;
+	};
+
+	// World space bounds of 'box' under an affine transform (Arvo): transformed center, extents through |M|
+	inline Aabb TransformBounds(const Float3x4& t, const Aabb& box)
+	{
+		const Float3 center = box.Centroid();
+		const Float3 extent = box.Extent() * 0.5f;
+		Aabb result;
+#ifdef CPURT_SSE2
+		const __m128 c = _mm_setr_ps(center.x, center.y, center.z, 1.0f);
+		const __m128 e = _mm_setr_ps(extent.x, extent.y, extent.z, 0.0f);
+		const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+
+		const __m128 r0 = _mm_loadu_ps(t.m[0]), r1 = _mm_loadu_ps(t.m[1]), r2 = _mm_loadu_ps(t.m[2]);
+		__m128 c0 = _mm_mul_ps(r0, c), c1 = _mm_mul_ps(r1, c), c2 = _mm_mul_ps(r2, c), c3 = _mm_setzero_ps();
+		__m128 e0 = _mm_mul_ps(_mm_and_ps(r0, absMask), e), e1 = _mm_mul_ps(_mm_and_ps(r1, absMask), e);
+		__m128 e2 = _mm_mul_ps(_mm_and_ps(r2, absMask), e), e3 = _mm_setzero_ps();
+
+		// Row dot products: transpose, then add the columns
+		_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+		_MM_TRANSPOSE4_PS(e0, e1, e2, e3);
+		const __m128 worldCenter = _mm_add_ps(_mm_add_ps(c0, c1), _mm_add_ps(c2, c3));
+		const __m128 worldExtent = _mm_add_ps(_mm_add_ps(e0, e1), _mm_add_ps(e2, e3));
+
+		alignas(16) float lo[4], hi[4];
+		_mm_store_ps(lo, _mm_sub_ps(worldCenter, worldExtent));
+		_mm_store_ps(hi, _mm_add_ps(worldCenter, worldExtent));
+		result.min = { lo[0], lo[1], lo[2] };
+		result.max = { hi[0], hi[1], hi[2] };
+#else
+		const Float3 worldCenter = TransformPoint(t, center);
+		Float3 worldExtent;
+		for (int i = 0; i < 3; i++)
+		{
+			worldExtent[i] = std::abs(t.m[i][0]) * extent.x + std::abs(t.m[i][1]) * extent.y + std::abs(t.m[i][2]) * extent.z;
+		}
+		result.min = worldCenter - worldExtent;
+		result.max = worldCenter + worldExtent;
+#endif
+		return result;
+	}
+
+	class Tlas
+	{
+	public:
+		// 'blases' are referenced, not copied, InstanceDesc::accelerationStructure indexes them. 'instanceDescs' are
+		// copied, a vector or the instance table of a mapped cache file (BvhDiskCache.h).
+		void Build(BvhSpan<const InstanceDesc> instanceDescs, const std::vector<const Bvh*>& blases, ThreadPool& pool = ThreadPool::Default())
+		{
+			const auto start = std::chrono::high_resolution_clock::now();
+			count = static_cast<uint32_t>(instanceDescs.size());
+			instances.resize(count);
+			instanceData.resize(count);
+			worldBounds.resize(count);
+			nodes.clear();
+			stats.instances = count;
+			if (count == 0) return;
+
+			// One streaming pass over the descs: copy, world bounds, inverse transform, centroid bounds.
+			// Everything per instance stays in desc order, only bounds are gathered into Morton order below.
+			std::mutex boundsLock;
+			Aabb centroidBounds;
+			bounds = Aabb();
+			pool.ParallelFor(count, 4096, [&](size_t begin, size_t end)
+			{
+				Aabb localBounds, localCentroids;
+				for (size_t i = begin; i < end; i++)
+				{
+					const InstanceDesc& desc = instances[i] = instanceDescs[i];
+					if (desc.accelerationStructure >= blases.size() || !blases[desc.accelerationStructure] || blases[desc.accelerationStructure]->Empty())
+					{
+						throw std::runtime_error("Error: TLAS instance references a missing or empty BLAS");
+					}
+					const Bvh* blas = blases[desc.accelerationStructure];
+					worldBounds[i] = TransformBounds(desc.transform, blas->NodeBounds(0));
+					instanceData[i] = { InverseAffine(desc.transform), blas, desc.instanceMask, desc.flags };
+					localBounds.Grow(worldBounds[i]);
+					localCentroids.Grow(worldBounds[i].Centroid());
+				}
+				std::lock_guard<std::mutex> lock(boundsLock);
+				bounds.Grow(localBounds);
+				centroidBounds.Grow(localCentroids);
+			});
+
+			// Morton order, 30 bit keys sorted in 3 passes of 10 bits
+			keys.resize(count);
+			values.resize(count);
+			const Float3 extent = centroidBounds.Extent();
+			const Float3 invExtent = {
+				extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+				extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+				extent.z > 0.0f ? 1.0f / extent.z : 0.0f };
+			pool.ParallelFor(count, 8192, [&](size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					keys[i] = static_cast<uint32_t>(MortonCode((worldBounds[i].Centroid() - centroidBounds.min) * invExtent, 10));
+					values[i] = static_cast<uint32_t>(i);
+				}
+			});
+			RadixSortPairs(keys, values, 30, pool, keysScratch, valuesScratch);
+
+			if (count == 1)
+			{
+				stats.buildMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+				return;
+			}
+
+			// Leaf bounds in Morton order, so the build below reads them front to back
+			sortedBounds.resize(count);
+			pool.ParallelFor(count, 8192, [&](size_t begin, size_t end)
+			{
+				for (size_t j = begin; j < end; j++) sortedBounds[j] = worldBounds[values[j]];
+			});
+
+			// Top down from the root, each node's range split where the Morton prefix changes and its bounds returned
+			// on the way back up. The first levels are split here, the subtrees below them are built in parallel, then
+			// the bounds of the first levels are filled in from the bottom.
+			nodes.resize(count - 1);
+			const uint32_t subtreeLeaves = std::max<uint32_t>(count / (pool.ThreadCount() * 8), 4096);
+			std::vector<PendingNode> top, subtrees;
+			SplitTop({ 0, 0, count - 1, 0, -1 }, subtreeLeaves, top, subtrees);
+			pool.ParallelFor(subtrees.size(), 1, [&](size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					const PendingNode& subtree = subtrees[i];
+					const Aabb subtreeBounds = BuildSubtree(subtree.node, subtree.first, subtree.last);
+					if (subtree.side >= 0) SetChildBounds(nodes[subtree.parent], subtree.side, subtreeBounds);
+				}
+			});
+			for (size_t i = top.size(); i-- > 0;)
+			{
+				const TlasNode& node = nodes[top[i].node];
+				if (top[i].side >= 0) SetChildBounds(nodes[top[i].parent], top[i].side, { Min(node.childMin[0], node.childMin[1]), Max(node.childMax[0], node.childMax[1]) });
+			}
+
+			stats.buildMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		}
+
+		// Closest hit over every instance whose InstanceMask shares a bit with 'instanceInclusionMask'
+		bool Intersect(const Ray& ray, uint32_t rayFlags, RayHit& hit, uint32_t instanceInclusionMask = 0xFF) const
+		{
+			hit.t = ray.tMax;
+			if (count == 0) return false;
+
+			const Float3 invDir = { 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z };
+			uint32_t stack[96];
+			uint32_t stackSize = 0;
+			uint32_t current = count == 1 ? gTlasLeaf : 0;
+			bool found = false;
+
+			for (;;)
+			{
+				if (current & gTlasLeaf)
+				{
+					if (IntersectInstance(current & ~gTlasLeaf, ray, rayFlags, instanceInclusionMask, hit))
+					{
+						found = true;
+						if (rayFlags & RayFlagAcceptFirstHitAndEndSearch) return true;
+					}
+				}
+				else
+				{
+					const TlasNode& node = nodes[current];
+					float tNear[2];
+					const bool hitChild[2] = {
+						IntersectBounds(node.childMin[0], node.childMax[0], ray, invDir, hit.t, tNear[0]),
+						IntersectBounds(node.childMin[1], node.childMax[1], ray, invDir, hit.t, tNear[1]) };
+					if (hitChild[0] && hitChild[1])
+					{
+						const int nearSide = tNear[0] <= tNear[1] ? 0 : 1;
+						stack[stackSize++] = node.child[nearSide ^ 1];
+						current = node.child[nearSide];
+						continue;
+					}
+					if (hitChild[0] || hitChild[1])
+					{
+						current = node.child[hitChild[0] ? 0 : 1];
+						continue;
+					}
+				}
+
+				if (stackSize == 0) break;
+				current = stack[--stackSize];
+			}
+			return found;
+		}
+
+		const InstanceDesc* Instances() const { return instances.data(); }
+		size_t InstanceCount() const { return instances.size(); }
+		const Aabb& Bounds() const { return bounds; }
+		const TlasStats& Stats() const { return stats; }
+
+	private:
+		// What traversal needs of an instance
+		struct InstanceData
+		{
+			Float3x4 worldToObject;
+			const Bvh* blas;
+			uint32_t mask;
+			uint32_t flags;
+		};
+
+		// Internal node over Morton ordered leaves [first, last], 'side' of 'parent' (-1 for the root)
+		struct PendingNode
+		{
+			uint32_t node;
+			uint32_t first, last;
+			uint32_t parent;
+			int side;
+		};
+
+		/*
+		 Nodes are laid out depth first: the node over [first, last] split after 'split' has its left child next to
+		 it and its right child after the split - first internal nodes of the left subtree. The split is where the
+		 highest bit the range's keys differ in turns to 1 (Karras), duplicate keys are split on their index bits.
+		*/
+		uint32_t FindSplit(uint32_t first, uint32_t last) const
+		{
+			const uint32_t firstKey = keys[first], lastKey = keys[last];
+			if (firstKey == lastKey)
+			{
+				const uint32_t bit = 63 - CountLeadingZeros64(first ^ last);
+				return (last >> bit << bit) - 1;
+			}
+
+			const uint32_t bit = 63 - CountLeadingZeros64(firstKey ^ lastKey);
+			uint32_t low = first + 1, high = last;
+			while (low < high)
+			{
+				const uint32_t middle = (low + high) >> 1;
+				if ((keys[middle] >> bit) & 1) high = middle;
+				else low = middle + 1;
+			}
+			return low - 1;
+		}
+
+		static void SetChildBounds(TlasNode& node, int side, const Aabb& childBounds)
+		{
+			node.childMin[side] = childBounds.min;
+			node.childMax[side] = childBounds.max;
+		}
+
+		// Links 'node' to its children, leaves get their bounds here, and the children of at most 'subtreeLeaves'
+		// leaves go to 'subtrees' instead of being split further
+		void SplitTop(const PendingNode& pending, uint32_t subtreeLeaves, std::vector<PendingNode>& top, std::vector<PendingNode>& subtrees)
+		{
+			if (pending.last - pending.first + 1 <= subtreeLeaves)
+			{
+				subtrees.push_back(pending);
+				return;
+			}
+
+			top.push_back(pending);
+			const uint32_t split = FindSplit(pending.first, pending.last);
+			const PendingNode children[2] = {
+				{ pending.node + 1, pending.first, split, pending.node, 0 },
+				{ pending.node + 1 + split - pending.first, split + 1, pending.last, pending.node, 1 } };
+			for (const PendingNode& child : children)
+			{
+				TlasNode& node = nodes[pending.node];
+				if (child.first == child.last)
+				{
+					node.child[child.side] = gTlasLeaf | values[child.first];
+					SetChildBounds(node, child.side, sortedBounds[child.first]);
+					continue;
+				}
+				node.child[child.side] = child.node;
+				SplitTop(child, subtreeLeaves, top, subtrees);
+			}
+		}
+
+		// Links and bounds of the subtree over [first, last] (first < last) rooted at 'nodeIndex', returns its bounds
+		Aabb BuildSubtree(uint32_t nodeIndex, uint32_t first, uint32_t last)
+		{
+			const uint32_t split = FindSplit(first, last);
+			TlasNode& node = nodes[nodeIndex];
+			Aabb childBounds[2];
+			if (split == first)
+			{
+				node.child[0] = gTlasLeaf | values[first];
+				childBounds[0] = sortedBounds[first];
+			}
+			else
+			{
+				node.child[0] = nodeIndex + 1;
+				childBounds[0] = BuildSubtree(nodeIndex + 1, first, split);
+			}
+			if (split + 1 == last)
+			{
+				node.child[1] = gTlasLeaf | values[last];
+				childBounds[1] = sortedBounds[last];
+			}
+			else
+			{
+				node.child[1] = nodeIndex + 1 + split - first;
+				childBounds[1] = BuildSubtree(node.child[1], split + 1, last);
+			}
+			SetChildBounds(node, 0, childBounds[0]);
+			SetChildBounds(node, 1, childBounds[1]);
+			return { Min(childBounds[0].min, childBounds[1].min), Max(childBounds[0].max, childBounds[1].max) };
+		}
+
+		static bool IntersectBounds(const Float3& boundsMin, const Float3& boundsMax, const Ray& ray, const Float3& invDir, float tMax, float& tNear)
+		{
+			const float tx0 = (boundsMin.x - ray.origin.x) * invDir.x, tx1 = (boundsMax.x - ray.origin.x) * invDir.x;
+			const float ty0 = (boundsMin.y - ray.origin.y) * invDir.y, ty1 = (boundsMax.y - ray.origin.y) * invDir.y;
+			const float tz0 = (boundsMin.z - ray.origin.z) * invDir.z, tz1 = (boundsMax.z - ray.origin.z) * invDir.z;
+			tNear = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), ray.tMin));
+			const float tFar = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), tMax));
+			return tNear <= tFar;
+		}
+
+		bool IntersectInstance(uint32_t index, const Ray& ray, uint32_t rayFlags, uint32_t instanceInclusionMask, RayHit& hit) const
+		{
+			const InstanceData& instance = instanceData[index];
+			if (!(instance.mask & instanceInclusionMask)) return false;
+
+			// Same t in both spaces: the direction is transformed but not renormalized
+			Ray objectRay;
+			objectRay.origin = TransformPoint(instance.worldToObject, ray.origin);
+			objectRay.direction = TransformVector(instance.worldToObject, ray.direction);
+			objectRay.tMin = ray.tMin;
+			objectRay.tMax = hit.t;
+
+			const uint32_t cullFlags = RayFlagCullBackFacingTriangles | RayFlagCullFrontFacingTriangles;
+			uint32_t flags = rayFlags;
+			if (instance.flags & InstanceFlagTriangleCullDisable)
+			{
+				flags &= ~cullFlags;
+			}
+			else if (instance.flags & InstanceFlagTriangleFrontCounterclockwise)
+			{
+				// Front and back trade places
+				const uint32_t cull = flags & cullFlags;
+				if (cull == RayFlagCullBackFacingTriangles || cull == RayFlagCullFrontFacingTriangles) flags ^= cullFlags;
+			}
+
+			RayHit local;
+			if (!instance.blas->Intersect(objectRay, flags, local)) return false;
+			hit = local;
+			hit.instance = index;
+			return true;
+		}
+
+		std::vector<InstanceDesc> instances;
+		std::vector<InstanceData> instanceData;
+		std::vector<TlasNode> nodes;			// root at 0, absent with a single instance
+		std::vector<Aabb> worldBounds;			// build only, kept to reuse the memory
+		std::vector<Aabb> sortedBounds;			// build only, worldBounds in Morton order
+		std::vector<uint32_t> keys;				// build only
+		std::vector<uint32_t> values;			// build only, instance of every Morton ordered leaf
+		std::vector<uint32_t> keysScratch;		// build only, radix sort buffers
+		std::vector<uint32_t> valuesScratch;
+		uint32_t count = 0;
+		Aabb bounds;
+		TlasStats stats;
+	};
+
+	inline const InstanceDesc* AccelInstances(const Tlas& tlas)
+	{
+		return tlas.Instances();
+	}
+}
@@ -0,0 +1,494 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Bvh.h"
+#include "CpuSimd.h"
+
+/*
+ ------------------------------Triangle blocks------------------------------------
+ Triangles of a Bvh leaf packed W at a time into SoA blocks, so one ray is tested against W triangles with one
+ set of vector instructions, and the kernels that test them:
+	- MollerTrumbore: IntersectTriangle vectorized, the block holds vertex 0 and the two edges from it
+	- Plucker:        signed volumes of the ray and each edge, every edge computed the same way from both triangles
+	  that share it (as in Embree), the block holds the three vertices
+	- Watertight:     Woop, Benthin & Wald 2013, "Watertight Ray/Triangle Intersection": vertices translated to the
+	  ray origin and sheared so the ray is the +z axis, then 2D edge functions. Edge functions that come out exactly
+	  0 are redone in double precision, so a ray through a shared edge or vertex hits one of the triangles around it.
+ All three take hits in (tMin, hit.t), cull like IntersectTriangle (det > 0 is front facing, clockwise seen from the
+ ray origin) and report barycentrics as the weights of vertex 1 and 2 (BuiltInTriangleIntersectionAttributes).
+ BlockBvh copies a Bvh's nodes and points its leaves at blocks instead of triangles.
+*/
+
+namespace CpuRt
+{
+	enum class TriangleKernel
+	{
+		MollerTrumbore,
+		Plucker,
+		Watertight,
+	};
+
+	inline const char* TriangleKernelName(TriangleKernel kernel)
+	{
+		switch (kernel)
+		{
+		case TriangleKernel::MollerTrumbore: return "mt";
+		case TriangleKernel::Plucker: return "plucker";
+		case TriangleKernel::Watertight: return "watertight";
+		}
+		return "unknown";
+	}
+
+	inline TriangleKernel ParseTriangleKernel(const char* name)
+	{
+		if (!strcmp(name, "mt")) return TriangleKernel::MollerTrumbore;
+		if (!strcmp(name, "plucker")) return TriangleKernel::Plucker;
+		if (!strcmp(name, "watertight")) return TriangleKernel::Watertight;
+		throw std::runtime_error(std::string("Error: unknown triangle kernel ") + name);
+	}
+
+	// W triangles, lanes past the leaf's triangle count are zero and masked off by the caller
+	template<int W>
+	struct alignas(64) TriangleBlock
+	{
+		float p[3][3][W];			// [vertex 0, edge 1 / vertex 1, edge 2 / vertex 2][axis][lane], edges for MollerTrumbore only
+		uint32_t primitive[W];		// mesh triangle
+	};
+
+	// Packs 'count' <= W triangles (3 positions each) into 'block' the way 'kernel' reads them
+	template<int W>
+	inline void PackTriangleBlock(TriangleKernel kernel, const Float3* positions, const uint32_t* primitives, uint32_t count, TriangleBlock<W>& block)
+	{
+		block = {};
+		for (uint32_t lane = 0; lane < W; lane++) block.primitive[lane] = gInvalidPrimitive;
+		for (uint32_t lane = 0; lane < count; lane++)
+		{
+			const Float3* triangle = positions + size_t(lane) * 3;
+			Float3 p[3] = { triangle[0], triangle[1], triangle[2] };
+			if (kernel == TriangleKernel::MollerTrumbore)
+			{
+				p[1] = triangle[1] - triangle[0];
+				p[2] = triangle[2] - triangle[0];
+			}
+			for (int v = 0; v < 3; v++)
+			{
+				for (int axis = 0; axis < 3; axis++) block.p[v][axis][lane] = p[v][axis];
+			}
+			block.primitive[lane] = primitives[lane];
+		}
+	}
+
+	// What every kernel wants of a ray, computed once per ray
+	template<int W>
+	struct TriangleBlockRay
+	{
+		using Vector = SimdFloat<W>;
+
+		explicit TriangleBlockRay(const Ray& ray)
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				origin[axis] = Vector::Broadcast(ray.origin[axis]);
+				direction[axis] = Vector::Broadcast(ray.direction[axis]);
+			}
+
+			// Watertight: z is the largest direction component, x and y swapped where that keeps the winding
+			const float ax = std::fabs(ray.direction.x), ay = std::fabs(ray.direction.y), az = std::fabs(ray.direction.z);
+			kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+			kx = (kz + 1) % 3;
+			ky = (kx + 1) % 3;
+			if (ray.direction[kz] < 0.0f) std::swap(kx, ky);
+			shear[0] = Vector::Broadcast(ray.direction[kx] / ray.direction[kz]);
+			shear[1] = Vector::Broadcast(ray.direction[ky] / ray.direction[kz]);
+			shear[2] = Vector::Broadcast(1.0f / ray.direction[kz]);
+		}
+
+		Vector origin[3];
+		Vector direction[3];
+		int kx, ky, kz;
+		Vector shear[3];			// Sx, Sy, Sz
+	};
+
+	namespace Detail
+	{
+		template<int W>
+		struct SimdFloat3
+		{
+			SimdFloat<W> x, y, z;
+		};
+
+		template<int W>
+		inline SimdFloat3<W> LoadBlockVertex(const TriangleBlock<W>& block, int v)
+		{
+			return { SimdFloat<W>::Load(block.p[v][0]), SimdFloat<W>::Load(block.p[v][1]), SimdFloat<W>::Load(block.p[v][2]) };
+		}
+
+		template<int W>
+		inline SimdFloat3<W> operator+(const SimdFloat3<W>& a, const SimdFloat3<W>& b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+		template<int W>
+		inline SimdFloat3<W> operator-(const SimdFloat3<W>& a, const SimdFloat3<W>& b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+		template<int W>
+		inline SimdFloat<W> Dot(const SimdFloat3<W>& a, const SimdFloat3<W>& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+		template<int W>
+		inline SimdFloat3<W> Cross(const SimdFloat3<W>& a, const SimdFloat3<W>& b) { return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x }; }
+
+		template<int W>
+		inline uint32_t GreaterMask(const SimdFloat<W>& a, const SimdFloat<W>& b) { return LessMask(b, a); }
+
+		// Lanes whose sign of 'det' the flags cull, det > 0 is front facing
+		template<int W>
+		inline uint32_t CullMask(const SimdFloat<W>& det, uint32_t rayFlags)
+		{
+			const SimdFloat<W> zero = SimdFloat<W>::Broadcast(0.0f);
+			uint32_t culled = 0;
+			if (rayFlags & RayFlagCullBackFacingTriangles) culled |= LessMask(det, zero);
+			if (rayFlags & RayFlagCullFrontFacingTriangles) culled |= GreaterMask(det, zero);
+			return culled;
+		}
+
+		// Nearest of the 'valid' lanes into 'hit', the lowest lane on ties like a scalar loop over the block
+		template<int W>
+		inline bool TakeNearestLane(uint32_t valid, const SimdFloat<W>& t, const SimdFloat<W>& u, const SimdFloat<W>& v, const TriangleBlock<W>& block, RayHit& hit)
+		{
+			if (valid == 0) return false;
+			const SimdFloat<W> candidates = Select(valid, t, SimdFloat<W>::Broadcast(std::numeric_limits<float>::infinity()));
+			const float nearest = ReduceMin(candidates);
+			const uint32_t lane = CountTrailingZeros(valid & ~NotEqualMask(candidates, SimdFloat<W>::Broadcast(nearest)));
+			float us[W], vs[W];
+			u.Store(us);
+			v.Store(vs);
+			hit.t = nearest;
+			hit.primitive = block.primitive[lane];
+			hit.barycentrics = { us[lane], vs[lane] };
+			return true;
+		}
+
+		/*
+		 xa yb - ya xb with the two vertices in a fixed order, negated when they were swapped. Compilers that fuse
+		 multiplies and adds (-ffp-contract=fast, /fp:fast) round xa yb - ya xb and xb ya - yb xa differently, the
+		 two triangles sharing an edge have to get exactly opposite values for it.
+		*/
+		template<int W>
+		inline SimdFloat<W> EdgeFunction(const SimdFloat<W>& xa, const SimdFloat<W>& ya, const SimdFloat<W>& xb, const SimdFloat<W>& yb)
+		{
+			const uint32_t swap = LessMask(xb, xa) | (~NotEqualMask(xa, xb) & LessMask(yb, ya));
+			const SimdFloat<W> x0 = Select(swap, xb, xa), y0 = Select(swap, yb, ya), x1 = Select(swap, xa, xb), y1 = Select(swap, ya, yb);
+			const SimdFloat<W> w = x0 * y1 - y0 * x1;
+			return Select(swap, SimdFloat<W>::Broadcast(0.0f) - w, w);
+		}
+
+		// Vertex relative to the ray origin in the sheared frame where the ray runs along +z
+		template<int W>
+		inline void ShearVertex(const TriangleBlockRay<W>& ray, const float (&p)[3][W], SimdFloat<W>& x, SimdFloat<W>& y, SimdFloat<W>& z)
+		{
+			const SimdFloat<W> dz = SimdFloat<W>::Load(p[ray.kz]) - ray.origin[ray.kz];
+			x = (SimdFloat<W>::Load(p[ray.kx]) - ray.origin[ray.kx]) - ray.shear[0] * dz;
+			y = (SimdFloat<W>::Load(p[ray.ky]) - ray.origin[ray.ky]) - ray.shear[1] * dz;
+			z = ray.shear[2] * dz;
+		}
+
+		// EdgeFunction of vertices 'a' and 'b' in one lane again in double precision: the products of floats are
+		// exact there, so the edge still flips sign exactly between the two triangles sharing it
+		template<int W>
+		inline float EdgeFunctionDouble(const SimdFloat<W>* x, const SimdFloat<W>* y, int a, int b, uint32_t lane)
+		{
+			float xa[W], ya[W], xb[W], yb[W];
+			x[a].Store(xa);
+			y[a].Store(ya);
+			x[b].Store(xb);
+			y[b].Store(yb);
+			return float(double(xa[lane]) * yb[lane] - double(ya[lane]) * xb[lane]);
+		}
+
+		// Lanes of 'valid' whose edge functions (weights of vertex 0, 1, 2) put the ray inside the triangle, with the
+		// distance and the weights of vertex 1 and 2. Vertex depths 'z' come from ShearVertex.
+		template<int W>
+		inline uint32_t WatertightHits(uint32_t valid, const SimdFloat<W>& w0, const SimdFloat<W>& w1, const SimdFloat<W>& w2, const SimdFloat<W>& z0,
+			const SimdFloat<W>& z1, const SimdFloat<W>& z2, uint32_t rayFlags, SimdFloat<W>& t, SimdFloat<W>& u, SimdFloat<W>& v)
+		{
+			const SimdFloat<W> zero = SimdFloat<W>::Broadcast(0.0f);
+			const SimdFloat<W> minimum = Min(Min(w0, w1), w2), maximum = Max(Max(w0, w1), w2);
+			valid &= LessEqualMask(zero, minimum) | LessEqualMask(maximum, zero);
+
+			// The sheared frame keeps the handedness, det has the sign of Möller-Trumbore's
+			const SimdFloat<W> det = w0 + w1 + w2;
+			valid &= NotEqualMask(det, zero) & ~CullMask(det, rayFlags);
+			const SimdFloat<W> invDet = SimdFloat<W>::Broadcast(1.0f) / det;
+			t = (w0 * z0 + w1 * z1 + w2 * z2) * invDet;
+			u = w1 * invDet;
+			v = w2 * invDet;
+			return valid;
+		}
+	}
+
+	/*
+	 Tests the 'active' lanes of 'block', takes the nearest hit in (tMin, hit.t). Vectors are W floats, so
+	 W = 1 is the scalar version of every kernel.
+	*/
+	template<TriangleKernel Kernel, int W>
+	inline bool IntersectTriangleBlock(const TriangleBlockRay<W>& ray, const TriangleBlock<W>& block, uint32_t active, uint32_t rayFlags, float tMin, RayHit& hit)
+	{
+		using Vector = SimdFloat<W>;
+		using Vector3 = Detail::SimdFloat3<W>;
+		const Vector zero = Vector::Broadcast(0.0f), one = Vector::Broadcast(1.0f);
+		const Vector3 origin = { ray.origin[0], ray.origin[1], ray.origin[2] };
+		const Vector3 direction = { ray.direction[0], ray.direction[1], ray.direction[2] };
+
+		uint32_t valid = active;
+		Vector t, u, v;
+		if constexpr (Kernel == TriangleKernel::MollerTrumbore)
+		{
+			const Vector3 p0 = Detail::LoadBlockVertex(block, 0), e1 = Detail::LoadBlockVertex(block, 1), e2 = Detail::LoadBlockVertex(block, 2);
+			const Vector3 p = Detail::Cross(direction, e2);
+			const Vector det = Detail::Dot(e1, p);
+			valid &= NotEqualMask(det, zero) & ~Detail::CullMask(det, rayFlags);
+
+			const Vector invDet = one / det;
+			const Vector3 s = origin - p0;
+			u = Detail::Dot(s, p) * invDet;
+			const Vector3 q = Detail::Cross(s, e1);
+			v = Detail::Dot(direction, q) * invDet;
+			t = Detail::Dot(e2, q) * invDet;
+			valid &= LessEqualMask(zero, u) & LessEqualMask(zero, v) & LessEqualMask(u + v, one);
+		}
+		else if constexpr (Kernel == TriangleKernel::Plucker)
+		{
+			const Vector3 p0 = Detail::LoadBlockVertex(block, 0) - origin;
+			const Vector3 p1 = Detail::LoadBlockVertex(block, 1) - origin;
+			const Vector3 p2 = Detail::LoadBlockVertex(block, 2) - origin;
+
+			// Twice the signed volume of the ray with each edge, the weight of the vertex opposite that edge
+			const Vector3 edge0 = p2 - p0, edge1 = p0 - p1, edge2 = p1 - p2;
+			const Vector w1 = Detail::Dot(Detail::Cross(edge0, p2 + p0), direction);
+			const Vector w2 = Detail::Dot(Detail::Cross(edge1, p0 + p1), direction);
+			const Vector w0 = Detail::Dot(Detail::Cross(edge2, p1 + p2), direction);
+			const Vector minimum = Min(Min(w0, w1), w2), maximum = Max(Max(w0, w1), w2);
+			valid &= LessEqualMask(zero, minimum) | LessEqualMask(maximum, zero);
+
+			// The sum is 2 Dot(direction, normal), the opposite sign of Möller-Trumbore's det. The distance comes from
+			// the plane, the edge sums are too far off for it.
+			const Vector sum = w0 + w1 + w2;
+			valid &= NotEqualMask(sum, zero) & ~Detail::CullMask(zero - sum, rayFlags);
+			const Vector invSum = one / sum;
+			const Vector3 normal = Detail::Cross(p1 - p0, p2 - p0);
+			t = Detail::Dot(p0, normal) / Detail::Dot(direction, normal);
+			u = w1 * invSum;
+			v = w2 * invSum;
+		}
+		else
+		{
+			Vector x[3], y[3], z[3];
+			for (int vertex = 0; vertex < 3; vertex++) Detail::ShearVertex(ray, block.p[vertex], x[vertex], y[vertex], z[vertex]);
+
+			// 2D edge functions, each the weight of the vertex opposite the edge
+			Vector w0 = Detail::EdgeFunction(x[2], y[2], x[1], y[1]);
+			Vector w1 = Detail::EdgeFunction(x[0], y[0], x[2], y[2]);
+			Vector w2 = Detail::EdgeFunction(x[1], y[1], x[0], y[0]);
+			const uint32_t edgeHits = valid & ~(NotEqualMask(w0, zero) & NotEqualMask(w1, zero) & NotEqualMask(w2, zero));
+			if (edgeHits != 0)
+			{
+				float e0[W], e1[W], e2[W];
+				w0.Store(e0);
+				w1.Store(e1);
+				w2.Store(e2);
+				for (uint32_t lanes = edgeHits; lanes != 0; lanes &= lanes - 1)
+				{
+					const uint32_t lane = CountTrailingZeros(lanes);
+					e0[lane] = Detail::EdgeFunctionDouble(x, y, 2, 1, lane);
+					e1[lane] = Detail::EdgeFunctionDouble(x, y, 0, 2, lane);
+					e2[lane] = Detail::EdgeFunctionDouble(x, y, 1, 0, lane);
+				}
+				w0 = Vector::Load(e0);
+				w1 = Vector::Load(e1);
+				w2 = Vector::Load(e2);
+			}
+			valid = Detail::WatertightHits(valid, w0, w1, w2, z[0], z[1], z[2], rayFlags, t, u, v);
+		}
+
+		valid &= Detail::GreaterMask(t, Vector::Broadcast(tMin)) & LessMask(t, Vector::Broadcast(hit.t));
+		return Detail::TakeNearestLane(valid, t, u, v, block, hit);
+	}
+
+	namespace Detail
+	{
+		// The Bvh's slab test with the exit distance pushed out by the rounding error it can have (1 + 2 gamma(3),
+		// Ize 2013, "Robust BVH Ray Traversal"): a ray through a triangle's vertex or edge on a box face stays in the
+		// box, a watertight kernel would be wasted behind a leaky box test
+		inline bool IntersectBoundsRobust(const BvhNode& node, const Float3& origin, const Float3& invDir, float tMin, float tMax)
+		{
+			const float tx0 = (node.boundsMin.x - origin.x) * invDir.x, tx1 = (node.boundsMax.x - origin.x) * invDir.x;
+			const float ty0 = (node.boundsMin.y - origin.y) * invDir.y, ty1 = (node.boundsMax.y - origin.y) * invDir.y;
+			const float tz0 = (node.boundsMin.z - origin.z) * invDir.z, tz1 = (node.boundsMax.z - origin.z) * invDir.z;
+			const float tNear = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), tMin));
+			const float tFar = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::max(tz0, tz1)) * 1.00000036f;
+			return tNear <= std::min(tFar, tMax);
+		}
+
+		/*
+		 Copies 'source' into 'nodes' breadth first (sibling pairs stay adjacent), subtrees of at most 'maxLeafSize'
+		 primitives become one leaf. Their primitives are contiguous in the source, packLeaf(first, count) stores
+		 them and returns what the leaf's 'offset' becomes.
+		*/
+		template<typename PackLeaf>
+		inline void CollapseBvhLeaves(BvhNodeSpan source, uint32_t maxLeafSize, BvhNodeArray& nodes, PackLeaf&& packLeaf)
+		{
+			nodes.clear();
+			if (source.empty()) return;
+
+			// Primitive range under every node, children come after their parent
+			std::vector<uint32_t> first(source.size()), count(source.size());
+			for (size_t i = source.size(); i-- > 0; )
+			{
+				const uint32_t left = source[i].offset;
+				first[i] = source[i].IsLeaf() ? left : first[left];
+				count[i] = source[i].IsLeaf() ? source[i].count : count[left] + count[left + 1];
+			}
+
+			struct Pending { uint32_t source; uint32_t node; };
+			std::vector<Pending> queue = { { 0u, 0u } };
+			nodes.push_back(source[0]);
+			for (size_t q = 0; q < queue.size(); q++)
+			{
+				const uint32_t index = queue[q].source, node = queue[q].node;
+				if (!source[index].IsLeaf() && count[index] > maxLeafSize)
+				{
+					const uint32_t left = static_cast<uint32_t>(nodes.size());
+					nodes[node].offset = left;
+					queue.push_back({ source[index].offset, left });
+					queue.push_back({ source[index].offset + 1, left + 1 });
+					const BvhNode children[2] = { source[source[index].offset], source[source[index].offset + 1] };
+					nodes.push_back(children[0]);
+					nodes.push_back(children[1]);
+					continue;
+				}
+				nodes[node].offset = packLeaf(first[index], count[index]);
+				nodes[node].count = static_cast<uint16_t>(count[index]);
+			}
+		}
+
+		// The Bvh's traversal over collapsed nodes, testLeaf(node) tests a leaf's primitives and returns whether it hit
+		template<typename LeafTest>
+		inline bool IntersectCollapsedBvh(BvhNodeSpan nodes, const Ray& ray, uint32_t rayFlags, RayHit& hit, LeafTest&& testLeaf)
+		{
+			hit.t = ray.tMax;
+			if (nodes.empty()) return false;
+
+			const Float3 invDir = { 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z };
+			const uint32_t dirNegative[3] = { invDir.x < 0.0f, invDir.y < 0.0f, invDir.z < 0.0f };
+
+			uint32_t stack[128];
+			uint32_t stackSize = 0;
+			uint32_t current = 0;
+			bool found = false;
+
+			for (;;)
+			{
+				const BvhNode& node = nodes[current];
+				if (IntersectBoundsRobust(node, ray.origin, invDir, ray.tMin, hit.t))
+				{
+					if (node.IsLeaf())
+					{
+						if (testLeaf(node))
+						{
+							found = true;
+							if (rayFlags & RayFlagAcceptFirstHitAndEndSearch) return true;
+						}
+					}
+					else
+					{
+						const bool rightFirst = dirNegative[node.axis] != 0;
+						stack[stackSize++] = rightFirst ? node.offset : node.offset + 1;
+						current = rightFirst ? node.offset + 1 : node.offset;
+						continue;
+					}
+				}
+
+				if (stackSize == 0) break;
+				current = stack[--stackSize];
+			}
+			return found;
+		}
+	}
+
+	struct BlockBvhStats
+	{
+		double packMilliseconds = 0.0;
+		size_t blocks = 0;
+		double fill = 0.0;				// triangles over block lanes
+		size_t blockBytes = 0;
+	};
+
+	/*
+	 A Bvh's nodes with leaves pointing at TriangleBlocks: 'offset' is the leaf's first block, 'count' still its
+	 triangle count. Traversal is the Bvh's with a conservative box test, leaves test a block at a time with 'Kernel'.
+	 Build again after the Bvh is rebuilt, refit or relaid out.
+	*/
+	template<int W, TriangleKernel Kernel = TriangleKernel::Watertight>
+	class BlockBvh
+	{
+	public:
+		static_assert(W == 1 || W == 4 || W == 8 || W == 16, "Triangle blocks are 1, 4, 8 or 16 lanes");
+		using Block = TriangleBlock<W>;
+
+		bool Empty() const { return nodes.empty(); }
+		const BvhNodeArray& Nodes() const { return nodes; }
+		const BlockBvhStats& Stats() const { return stats; }
+
+		// Subtrees of at most W triangles become one leaf, so leaves fill whole blocks where the builder stopped at
+		// fewer triangles
+		void Build(const Bvh& bvh)
+		{
+			const auto start = std::chrono::high_resolution_clock::now();
+			blocks.clear();
+			Detail::CollapseBvhLeaves(bvh.Nodes(), W, nodes, [&](uint32_t first, uint32_t count)
+			{
+				const uint32_t offset = static_cast<uint32_t>(blocks.size());
+				uint32_t primitives[W];
+				for (uint32_t i = 0; i < count; i += W)
+				{
+					const uint32_t lanes = std::min<uint32_t>(W, count - i);
+					for (uint32_t lane = 0; lane < lanes; lane++) primitives[lane] = bvh.PrimitiveId(first + i + lane);
+					blocks.emplace_back();
+					PackTriangleBlock(Kernel, bvh.TrianglePositions(first + i), primitives, lanes, blocks.back());
+				}
+				return offset;
+			});
+
+			stats.packMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+			stats.blocks = blocks.size();
+			stats.fill = blocks.empty() ? 0.0 : double(bvh.TriangleCount()) / (blocks.size() * W);
+			stats.blockBytes = blocks.size() * sizeof(Block);
+		}
+
+		// Closest hit, or the first one found with RayFlagAcceptFirstHitAndEndSearch
+		bool Intersect(const Ray& ray, uint32_t rayFlags, RayHit& hit) const
+		{
+			const TriangleBlockRay<W> blockRay(ray);
+			return Detail::IntersectCollapsedBvh(nodes, ray, rayFlags, hit, [&](const BvhNode& node)
+			{
+				bool found = false;
+				for (uint32_t i = 0; i < node.count; i += W)
+				{
+					const uint32_t active = (1u << std::min<uint32_t>(W, node.count - i)) - 1;
+					found |= IntersectTriangleBlock<Kernel>(blockRay, blocks[node.offset + i / W], active, rayFlags, ray.tMin, hit);
+					if (found && (rayFlags & RayFlagAcceptFirstHitAndEndSearch)) break;
+				}
+				return found;
+			});
+		}
+
+	private:
+		BvhNodeArray nodes;
+		std::vector<Block> blocks;
+		BlockBvhStats stats;
+	};
+}
@@ -0,0 +1,363 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+#include "Bvh.h"
+#include "BvhSahBuilder.h"
+#include "CpuSimd.h"
+#include "TriangleBlocks.h"
+
+/*
+ ------------------------------Triangle pairs------------------------------------
+ Most modelled meshes are quads split in two. PairTriangles matches triangles that share an edge back into pairs,
+ PairBvh builds its tree over pairs (half the leaf primitives, fewer nodes) and tests a block of W pairs with the
+ watertight kernel (TriangleBlocks.h): the four vertices are loaded and sheared once, the shared edge function is
+ computed once and negated for the second triangle. Hits still report the mesh triangle and the barycentrics of
+ that triangle's own vertex order, as PrimitiveIndex() and BuiltInTriangleIntersectionAttributes would.
+*/
+
+namespace CpuRt
+{
+	// First triangle q0 q1 q2, second q3 q2 q1 (shared edge q1 q2), both rotations of the mesh triangles' vertex order
+	struct TrianglePair
+	{
+		uint32_t vertices[4];		// mesh vertex indices of q0 .. q3
+		uint32_t triangles[2];		// mesh triangles, the second gInvalidPrimitive for a triangle left on its own
+		uint8_t rotation[2];		// mesh vertex k of a triangle is its pair vertex (k + rotation) % 3
+	};
+
+	struct TrianglePairStats
+	{
+		double milliseconds = 0.0;
+		size_t triangles = 0;
+		size_t pairs = 0;			// two triangles
+		size_t singles = 0;			// no neighbour worth pairing with
+	};
+
+	namespace Detail
+	{
+		inline uint32_t FindRotation(const uint32_t* mesh, const uint32_t* local)
+		{
+			for (uint8_t r = 0; r < 3; r++)
+			{
+				if (mesh[0] == local[r] && mesh[1] == local[(1 + r) % 3] && mesh[2] == local[(2 + r) % 3]) return r;
+			}
+			return 0;
+		}
+
+		inline Aabb TriangleBounds(const MeshData& mesh, uint32_t triangle)
+		{
+			Aabb bounds;
+			for (int v = 0; v < 3; v++) bounds.Grow(mesh.vertices[mesh.indices[size_t(triangle) * 3 + v]].position);
+			return bounds;
+		}
+	}
+
+	/*
+	 Greedy in triangle order: a triangle pairs with the unpaired neighbour across one of its edges whose pair has the
+	 smallest box, if that box's area is no more than the two triangle boxes' together (a thin sliver stays single
+	 rather than bloat a leaf). Neighbours are found by vertex position, so vertices split for normals or UVs still
+	 connect, and must wind the shared edge the other way (consistently oriented surface).
+	*/
+	inline std::vector<TrianglePair> PairTriangles(const MeshData& mesh, TrianglePairStats* stats = nullptr)
+	{
+		const auto start = std::chrono::high_resolution_clock::now();
+		const uint32_t triangleCount = static_cast<uint32_t>(mesh.TriangleCount());
+
+		// Vertex index to the first vertex at the same position
+		std::vector<uint32_t> position(mesh.vertices.size());
+		{
+			struct Key
+			{
+				uint32_t bits[3];
+				bool operator==(const Key& other) const { return !memcmp(bits, other.bits, sizeof(bits)); }
+			};
+			struct KeyHash
+			{
+				size_t operator()(const Key& key) const { return (size_t(key.bits[0]) * 73856093u) ^ (size_t(key.bits[1]) * 19349663u) ^ (size_t(key.bits[2]) * 83492791u); }
+			};
+			std::unordered_map<Key, uint32_t, KeyHash> unique;
+			for (uint32_t i = 0; i < mesh.vertices.size(); i++)
+			{
+				Key key;
+				memcpy(key.bits, &mesh.vertices[i].position, sizeof(key.bits));
+				position[i] = unique.emplace(key, i).first->second;
+			}
+		}
+
+		// Directed edge (a, b) to the triangle that has it
+		const auto edgeKey = [](uint32_t a, uint32_t b) { return (uint64_t(a) << 32) | b; };
+		std::unordered_map<uint64_t, uint32_t> edges;
+		edges.reserve(size_t(triangleCount) * 3);
+		const auto corner = [&](uint32_t triangle, uint32_t v) { return position[mesh.indices[size_t(triangle) * 3 + v % 3]]; };
+		for (uint32_t t = 0; t < triangleCount; t++)
+		{
+			for (uint32_t e = 0; e < 3; e++) edges.emplace(edgeKey(corner(t, e), corner(t, e + 1)), t);
+		}
+
+		std::vector<TrianglePair> pairs;
+		pairs.reserve(triangleCount / 2 + 1);
+		std::vector<bool> paired(triangleCount, false);
+		TrianglePairStats counts;
+		counts.triangles = triangleCount;
+		for (uint32_t t = 0; t < triangleCount; t++)
+		{
+			if (paired[t]) continue;
+			paired[t] = true;
+			const Aabb bounds = Detail::TriangleBounds(mesh, t);
+
+			uint32_t best = gInvalidPrimitive, bestEdge = 0;
+			float bestArea = std::numeric_limits<float>::max();
+			for (uint32_t e = 0; e < 3; e++)
+			{
+				const auto found = edges.find(edgeKey(corner(t, e + 1), corner(t, e)));
+				if (found == edges.end() || paired[found->second]) continue;
+				const Aabb other = Detail::TriangleBounds(mesh, found->second);
+				Aabb both = bounds;
+				both.Grow(other);
+				const float area = both.HalfArea();
+				if (area <= bounds.HalfArea() + other.HalfArea() && area < bestArea)
+				{
+					best = found->second;
+					bestEdge = e;
+					bestArea = area;
+				}
+			}
+
+			// Rotate the first triangle so the shared edge is q1 q2
+			const uint32_t* indices = &mesh.indices[size_t(t) * 3];
+			TrianglePair pair;
+			const uint32_t first[3] = { indices[(bestEdge + 2) % 3], indices[bestEdge], indices[(bestEdge + 1) % 3] };
+			std::copy(first, first + 3, pair.vertices);
+			pair.triangles[0] = t;
+			pair.rotation[0] = static_cast<uint8_t>(Detail::FindRotation(indices, first));
+			pair.triangles[1] = gInvalidPrimitive;
+			pair.rotation[1] = 0;
+			pair.vertices[3] = first[0];
+
+			if (best != gInvalidPrimitive)
+			{
+				// The second triangle's own indices, which may be other vertices at the same positions
+				const uint32_t* other = &mesh.indices[size_t(best) * 3];
+				uint32_t e = 0;
+				while (e < 3 && !(position[other[e]] == position[first[2]] && position[other[(e + 1) % 3]] == position[first[1]])) e++;
+				const uint32_t second[3] = { other[(e + 2) % 3], other[e], other[(e + 1) % 3] };
+				pair.vertices[3] = second[0];
+				pair.triangles[1] = best;
+				pair.rotation[1] = static_cast<uint8_t>(Detail::FindRotation(other, second));
+				paired[best] = true;
+				counts.pairs++;
+			}
+			else
+			{
+				counts.singles++;
+			}
+			pairs.push_back(pair);
+		}
+
+		counts.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		if (stats) *stats = counts;
+		return pairs;
+	}
+
+	// W pairs, lanes past the leaf's pair count are zero and masked off by the caller
+	template<int W>
+	struct alignas(64) TrianglePairBlock
+	{
+		float q[4][3][W];				// [pair vertex][axis][lane]
+		uint32_t primitive[2][W];		// mesh triangles
+		uint8_t rotation[2][W];
+		uint32_t paired;				// lanes holding two triangles
+	};
+
+	template<int W>
+	inline void PackTrianglePairBlock(const MeshData& mesh, const TrianglePair* pairs, uint32_t count, TrianglePairBlock<W>& block)
+	{
+		block = {};
+		for (uint32_t lane = 0; lane < W; lane++) block.primitive[0][lane] = block.primitive[1][lane] = gInvalidPrimitive;
+		for (uint32_t lane = 0; lane < count; lane++)
+		{
+			const TrianglePair& pair = pairs[lane];
+			for (int v = 0; v < 4; v++)
+			{
+				const Float3& p = mesh.vertices[pair.vertices[v]].position;
+				for (int axis = 0; axis < 3; axis++) block.q[v][axis][lane] = p[axis];
+			}
+			for (int t = 0; t < 2; t++)
+			{
+				block.primitive[t][lane] = pair.triangles[t];
+				block.rotation[t][lane] = pair.rotation[t];
+			}
+			if (pair.triangles[1] != gInvalidPrimitive) block.paired |= 1u << lane;
+		}
+	}
+
+	namespace Detail
+	{
+		// Nearest of the 'valid' lanes of one triangle of a pair block into 'hit', barycentrics back in the mesh
+		// triangle's vertex order
+		template<int W>
+		inline bool TakeNearestPairLane(uint32_t valid, const SimdFloat<W>& t, const SimdFloat<W>& u, const SimdFloat<W>& v,
+			const TrianglePairBlock<W>& block, int triangle, RayHit& hit)
+		{
+			if (valid == 0) return false;
+			const SimdFloat<W> candidates = Select(valid, t, SimdFloat<W>::Broadcast(std::numeric_limits<float>::infinity()));
+			const float nearest = ReduceMin(candidates);
+			const uint32_t lane = CountTrailingZeros(valid & ~NotEqualMask(candidates, SimdFloat<W>::Broadcast(nearest)));
+			float us[W], vs[W];
+			u.Store(us);
+			v.Store(vs);
+			const float weights[3] = { 1.0f - us[lane] - vs[lane], us[lane], vs[lane] };
+			const uint32_t rotation = block.rotation[triangle][lane];
+			hit.t = nearest;
+			hit.primitive = block.primitive[triangle][lane];
+			hit.barycentrics = { weights[(1 + rotation) % 3], weights[(2 + rotation) % 3] };
+			return true;
+		}
+	}
+
+	// Watertight test of the 'active' lanes of 'block', nearest hit in (tMin, hit.t), the first triangle of a pair
+	// wins ties
+	template<int W>
+	inline bool IntersectTrianglePairBlock(const TriangleBlockRay<W>& ray, const TrianglePairBlock<W>& block, uint32_t active, uint32_t rayFlags, float tMin, RayHit& hit)
+	{
+		using Vector = SimdFloat<W>;
+		const Vector zero = Vector::Broadcast(0.0f);
+		Vector x[4], y[4], z[4];
+		for (int vertex = 0; vertex < 4; vertex++) Detail::ShearVertex(ray, block.q[vertex], x[vertex], y[vertex], z[vertex]);
+
+		// Five edge functions: q1 q2 is the first triangle's weight of q0 and, negated, the second's weight of q3
+		Vector shared = Detail::EdgeFunction(x[2], y[2], x[1], y[1]);
+		Vector a1 = Detail::EdgeFunction(x[0], y[0], x[2], y[2]);
+		Vector a2 = Detail::EdgeFunction(x[1], y[1], x[0], y[0]);
+		Vector b1 = Detail::EdgeFunction(x[3], y[3], x[1], y[1]);
+		Vector b2 = Detail::EdgeFunction(x[2], y[2], x[3], y[3]);
+		const uint32_t edgeHits = active & ~(NotEqualMask(shared, zero) & NotEqualMask(a1, zero) & NotEqualMask(a2, zero) &
+			NotEqualMask(b1, zero) & NotEqualMask(b2, zero));
+		if (edgeHits != 0)
+		{
+			float e[5][W];
+			shared.Store(e[0]);
+			a1.Store(e[1]);
+			a2.Store(e[2]);
+			b1.Store(e[3]);
+			b2.Store(e[4]);
+			for (uint32_t lanes = edgeHits; lanes != 0; lanes &= lanes - 1)
+			{
+				const uint32_t lane = CountTrailingZeros(lanes);
+				e[0][lane] = Detail::EdgeFunctionDouble(x, y, 2, 1, lane);
+				e[1][lane] = Detail::EdgeFunctionDouble(x, y, 0, 2, lane);
+				e[2][lane] = Detail::EdgeFunctionDouble(x, y, 1, 0, lane);
+				e[3][lane] = Detail::EdgeFunctionDouble(x, y, 3, 1, lane);
+				e[4][lane] = Detail::EdgeFunctionDouble(x, y, 2, 3, lane);
+			}
+			shared = Vector::Load(e[0]);
+			a1 = Vector::Load(e[1]);
+			a2 = Vector::Load(e[2]);
+			b1 = Vector::Load(e[3]);
+			b2 = Vector::Load(e[4]);
+		}
+
+		const Vector minT = Vector::Broadcast(tMin);
+		Vector t, u, v;
+		uint32_t valid = Detail::WatertightHits(active, shared, a1, a2, z[0], z[1], z[2], rayFlags, t, u, v);
+		valid &= Detail::GreaterMask(t, minT) & LessMask(t, Vector::Broadcast(hit.t));
+		bool found = Detail::TakeNearestPairLane(valid, t, u, v, block, 0, hit);
+
+		valid = Detail::WatertightHits(active & block.paired, zero - shared, b1, b2, z[3], z[2], z[1], rayFlags, t, u, v);
+		valid &= Detail::GreaterMask(t, minT) & LessMask(t, Vector::Broadcast(hit.t));
+		found |= Detail::TakeNearestPairLane(valid, t, u, v, block, 1, hit);
+		return found;
+	}
+
+	struct PairBvhStats
+	{
+		double buildMilliseconds = 0.0;		// SAH build over pairs, collapse and packing
+		size_t builtNodes = 0;				// of the SAH tree over pairs
+		size_t nodes = 0;					// after collapsing into blocks
+		size_t blocks = 0;
+		double fill = 0.0;					// pairs over block lanes
+		size_t blockBytes = 0;
+	};
+
+	/*
+	 BlockBvh over triangle pairs: a binned SAH tree over the pairs' boxes, subtrees of at most W pairs collapsed
+	 into one leaf of TrianglePairBlocks. 'offset' is a leaf's first block, 'count' its pair count.
+	*/
+	template<int W>
+	class PairBvh
+	{
+	public:
+		static_assert(W == 1 || W == 4 || W == 8 || W == 16, "Triangle pair blocks are 1, 4, 8 or 16 lanes");
+		using Block = TrianglePairBlock<W>;
+
+		bool Empty() const { return nodes.empty(); }
+		const BvhNodeArray& Nodes() const { return nodes; }
+		const PairBvhStats& Stats() const { return stats; }
+
+		void Build(const MeshData& mesh, const std::vector<TrianglePair>& pairs, const BvhSettings& settings = {}, ThreadPool& pool = ThreadPool::Default())
+		{
+			const auto start = std::chrono::high_resolution_clock::now();
+			std::vector<Aabb> bounds(pairs.size());
+			pool.ParallelFor(pairs.size(), 16384, [&](size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					bounds[i] = Aabb();
+					for (uint32_t vertex : pairs[i].vertices) bounds[i].Grow(mesh.vertices[vertex].position);
+				}
+			});
+			const Bvh tree = BuildSahBvh(bounds, settings, pool);
+
+			blocks.clear();
+			std::vector<TrianglePair> leafPairs(W);
+			Detail::CollapseBvhLeaves(tree.Nodes(), W, nodes, [&](uint32_t first, uint32_t count)
+			{
+				const uint32_t offset = static_cast<uint32_t>(blocks.size());
+				for (uint32_t i = 0; i < count; i += W)
+				{
+					const uint32_t lanes = std::min<uint32_t>(W, count - i);
+					for (uint32_t lane = 0; lane < lanes; lane++) leafPairs[lane] = pairs[tree.PrimitiveId(first + i + lane)];
+					blocks.emplace_back();
+					PackTrianglePairBlock(mesh, leafPairs.data(), lanes, blocks.back());
+				}
+				return offset;
+			});
+
+			stats.buildMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+			stats.builtNodes = tree.Nodes().size();
+			stats.nodes = nodes.size();
+			stats.blocks = blocks.size();
+			stats.fill = blocks.empty() ? 0.0 : double(pairs.size()) / (blocks.size() * W);
+			stats.blockBytes = blocks.size() * sizeof(Block);
+		}
+
+		// Closest hit, or the first one found with RayFlagAcceptFirstHitAndEndSearch
+		bool Intersect(const Ray& ray, uint32_t rayFlags, RayHit& hit) const
+		{
+			const TriangleBlockRay<W> blockRay(ray);
+			return Detail::IntersectCollapsedBvh(nodes, ray, rayFlags, hit, [&](const BvhNode& node)
+			{
+				bool found = false;
+				for (uint32_t i = 0; i < node.count; i += W)
+				{
+					const uint32_t active = (1u << std::min<uint32_t>(W, node.count - i)) - 1;
+					found |= IntersectTrianglePairBlock(blockRay, blocks[node.offset + i / W], active, rayFlags, ray.tMin, hit);
+					if (found && (rayFlags & RayFlagAcceptFirstHitAndEndSearch)) break;
+				}
+				return found;
+			});
+		}
+
+	private:
+		BvhNodeArray nodes;
+		std::vector<Block> blocks;
+		PairBvhStats stats;
+	};
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "BvhLbvhBuilder.h"
+#include "CpuRayTracer.h"
+#include "ShaderTable.h"
+#include "ThreadPool.h"
+
+/*
+ ------------------------------Visibility Buffer------------------------------------
+ Deferred hit shading (Burns & Hunt 2013, "The Visibility Buffer"), for the CPU tracer: instead of shading at each
+ hit as TraceRay does, a frame runs in two passes
+	1. trace: camera rays only find their closest hit, the pixel keeps (instance, primitive, barycentrics, t)
+	2. shade: hit pixels sorted by (hit group record, primitive) with the LBVH builder's radix sort, then every run of
+	   one record goes to that record's closestHitBatch in one call. Neighbours in a run share the material and
+	   mostly the triangle, so vertex fetches are coherent and the batches are as long as the material's area
+	   allows, not as long as one tile.
+ Traversal and shading no longer alternate in the same loop, each pass keeps its own working set in cache.
+ The camera ray of a pixel is generated again in pass 2, the same GenerateCameraRay, so the image is
+ RenderHitGroups'.
+*/
+
+namespace CpuRt
+{
+	// What pass 1 leaves per pixel, primitive is gInvalidPrimitive where the camera ray missed
+	struct VisibilitySample
+	{
+		uint32_t instance;
+		uint32_t primitive;
+		Float2 barycentrics;
+		float t;
+	};
+
+	static_assert(sizeof(VisibilitySample) == 20, "VisibilitySample should stay compact");
+
+	struct VisibilityStats
+	{
+		double traceMilliseconds = 0.0;
+		double binMilliseconds = 0.0;		// keys and the sort by record
+		double shadeMilliseconds = 0.0;
+
+		double TotalMilliseconds() const { return traceMilliseconds + binMilliseconds + shadeMilliseconds; }
+	};
+
+	// Pass 1: the visibility buffer, row major width * height
+	template<typename Accel>
+	inline void TraceVisibility(const Accel& accel, const MeshData& mesh, const SceneConstants& scene, const RenderSettings& settings,
+		std::vector<VisibilitySample>& visibility, ThreadPool& pool = ThreadPool::Default())
+	{
+		const ShaderContext context = { &mesh, &scene, settings.width, settings.height, AccelInstances(accel) };
+		visibility.resize(size_t(settings.width) * settings.height);
+		ForEachTile(settings, pool, [&](uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1)
+		{
+			for (uint32_t y = y0; y < y1; y++)
+			{
+				for (uint32_t x = x0; x < x1; x++)
+				{
+					Ray ray;
+					GenerateCameraRay(context, x, y, ray.origin, ray.direction);
+					ray.tMin = 0.001f;
+					ray.tMax = 10000.0f;
+
+					RayHit hit;
+					if (!accel.Intersect(ray, RayFlagCullBackFacingTriangles, hit)) hit.primitive = gInvalidPrimitive;
+					visibility[size_t(y) * settings.width + x] = { hit.instance, hit.primitive, hit.barycentrics, hit.t };
+				}
+			}
+		});
+	}
+
+	/*
+	 Pass 2: output from the visibility buffer, closest hits through 'table' (RayContributionToHitGroupIndex 0, as
+	 RayGen.hlsl traces), misses through Miss
+	*/
+	template<typename Accel>
+	inline VisibilityStats ShadeVisibility(const Accel& accel, const HitGroupTable<Accel>& table, const MeshData& mesh, const SceneConstants& scene,
+		const RenderSettings& settings, const std::vector<VisibilitySample>& visibility, std::vector<Float4>& output, ThreadPool& pool = ThreadPool::Default())
+	{
+		VisibilityStats stats;
+		const ShaderContext context = { &mesh, &scene, settings.width, settings.height, AccelInstances(accel) };
+		output.resize(visibility.size());
+
+		// (record << 32 | primitive) per hit pixel, the sort is stable so pixels stay in scanline order within a triangle
+		auto start = std::chrono::high_resolution_clock::now();
+		std::vector<uint64_t> keys;
+		std::vector<uint32_t> pixels;
+		keys.reserve(visibility.size());
+		pixels.reserve(visibility.size());
+		uint32_t maxRecord = 0;
+		HitInfo missPayload;
+		Miss(missPayload);
+		for (size_t p = 0; p < visibility.size(); p++)
+		{
+			const VisibilitySample& sample = visibility[p];
+			if (sample.primitive == gInvalidPrimitive)
+			{
+				output[p] = missPayload.ShadedColorAndHitT;
+				continue;
+			}
+			RayHit hit;
+			hit.instance = sample.instance;
+			const uint32_t record = HitGroupRecordIndex(context, hit, 0, 1);
+			maxRecord = std::max(maxRecord, record);
+			keys.push_back(uint64_t(record) << 32 | sample.primitive);
+			pixels.push_back(static_cast<uint32_t>(p));
+		}
+		if (!keys.empty()) table.Record(maxRecord);		// throws when the instances point past the table
+
+		uint32_t recordBits = 0;
+		while (recordBits < 32 && (maxRecord >> recordBits) != 0) recordBits++;
+		RadixSortPairs(keys, pixels, 32 + recordBits, pool);
+		stats.binMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+		// Chunks of the sorted hits, split again where the record changes
+		start = std::chrono::high_resolution_clock::now();
+		pool.ParallelFor(keys.size(), 4096, [&](size_t begin, size_t end)
+		{
+			std::vector<Ray> rays;
+			std::vector<RayHit> hits;
+			std::vector<Float4> colors;
+			for (size_t first = begin; first < end;)
+			{
+				const uint32_t index = uint32_t(keys[first] >> 32);
+				size_t last = first + 1;
+				while (last < end && uint32_t(keys[last] >> 32) == index) last++;
+
+				rays.resize(last - first);
+				hits.resize(last - first);
+				colors.resize(last - first);
+				for (size_t i = first; i < last; i++)
+				{
+					const uint32_t pixel = pixels[i];
+					Ray& ray = rays[i - first];
+					GenerateCameraRay(context, pixel % settings.width, pixel / settings.width, ray.origin, ray.direction);
+					ray.tMin = 0.001f;
+					ray.tMax = 10000.0f;
+
+					const VisibilitySample& sample = visibility[pixel];
+					RayHit& hit = hits[i - first];
+					hit.t = sample.t;
+					hit.primitive = sample.primitive;
+					hit.barycentrics = sample.barycentrics;
+					hit.instance = sample.instance;
+				}
+
+				const HitGroupRecord<Accel>& record = table.Record(index);
+				if (record.closestHitBatch)
+				{
+					record.closestHitBatch(context, accel, record, rays.data(), hits.data(), last - first, colors.data());
+				}
+				else
+				{
+					for (size_t i = 0; i < last - first; i++)
+					{
+						HitInfo payload;
+						record.closestHit(context, accel, record, rays[i], hits[i], payload);
+						colors[i] = payload.ShadedColorAndHitT;
+					}
+				}
+				for (size_t i = first; i < last; i++) output[pixels[i]] = colors[i - first];
+				first = last;
+			}
+		});
+		stats.shadeMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		return stats;
+	}
+
+	// Both passes, a frame of RenderHitGroups
+	template<typename Accel>
+	inline VisibilityStats RenderVisibility(const Accel& accel, const HitGroupTable<Accel>& table, const MeshData& mesh, const SceneConstants& scene,
+		const RenderSettings& settings, std::vector<VisibilitySample>& visibility, std::vector<Float4>& output, ThreadPool& pool = ThreadPool::Default())
+	{
+		const auto start = std::chrono::high_resolution_clock::now();
+		TraceVisibility(accel, mesh, scene, settings, visibility, pool);
+		const double traceMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+		VisibilityStats stats = ShadeVisibility(accel, table, mesh, scene, settings, visibility, output, pool);
+		stats.traceMilliseconds = traceMilliseconds;
+		return stats;
+	}
+}
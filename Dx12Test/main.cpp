@@ -21,6 +21,9 @@
 #ifndef WIN32_LEAN_AND_MEAN
 #define WIN32_LEAN_AND_MEAN	
 #endif
+#ifndef NOMINMAX
+#define NOMINMAX			// the portable headers use std::min/std::max
+#endif
 #include <Windows.h>
 #include <DirectXMath.h>
 #include <DirectXPackedVector.h>
@@ -42,6 +45,11 @@
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
 #include "StepTimer.h"
+#include "TextureLoader.h"
+#include "TexturePack.h"
+#include "CpuScene.h"
+#include "CpuSampling.h"
+#include "BvhBuilder.h"
 #include "dxc/dxcapi.h"
 #include "dxc/dxcapi.use.h"
 
@@ -91,6 +99,11 @@ inline void ThrowIfFailed(HRESULT hr, const wchar_t* msg)
  ------------------------------Common Types------------------------------------
 */
 constexpr UINT gFrameCount = 2;
+static const char* gTexturePackPath = "textures.kpack";		// kepler-headless pack's default output, the loose texture is used without it
+constexpr UINT gFirstFrameMipSize = 128;					// texture pack mips up to this size are uploaded before the first frame
+constexpr UINT64 gTextureStreamBytesPerFrame = 4 << 20;		// finer mips streamed per frame after that
+constexpr UINT gTextureDescriptorIndex = 5;					// material texture SRV (t4) in each frame's DXR descriptor table, after the output UAV and t0-t3
+constexpr float gMeshTwist = 0.0f;							// peak twist of the mesh about Y in radians per unit height, 0 keeps it static (0.3 to exercise BLAS refits)
 
 static const D3D12_HEAP_PROPERTIES UploadHeapProperties =
 {
@@ -115,22 +128,12 @@ struct GlobalState
     UINT width = 1280;
     UINT height = 720;
     BOOL vsync = false;
+	bool samplingDemo = false;		// S key: jittered blue noise camera rays and soft shadows instead of 1 center sample
     
 }gAppState;
 
-struct CubeConstantBuffer
-{
-    XMFLOAT4 albedo;
-};
-
-struct SceneConstantBuffer
-{
-    XMMATRIX projectionToWorld;
-    XMVECTOR cameraPosition;
-    XMVECTOR lightPosition;
-    XMVECTOR lightAmbientColor;
-    XMVECTOR lightDiffuseColor;
-};
+// CubeConstantBuffer, SceneConstantBuffer and Vertex, the same header the shaders include
+#include "shaders/Shading.h"
 
 union AlignedSceneConstantBuffer
 {
@@ -138,15 +141,6 @@ union AlignedSceneConstantBuffer
     uint8_t alignmentPadding[D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT];
 };
 
-struct TextureInfo
-{
-	std::vector<UINT8> pixels;
-	int width = 0;
-	int height = 0;
-	int stride = 0;
-	int offset = 0;
-};
-
 struct D3D12ShaderInfo 
 {
 	LPCWSTR		filename = nullptr;
@@ -245,71 +239,24 @@ namespace Utility
         const DirectX::XMFLOAT2 vector2Epsilon = DirectX::XMFLOAT2(0.00001f, 0.00001f);
         return DirectX::XMVector3NearEqual(DirectX::XMLoadFloat2(&lhs), DirectX::XMLoadFloat2(&rhs), DirectX::XMLoadFloat2(&vector2Epsilon)) == TRUE;
     }
-
-	static void FormatTexture(TextureInfo& info, UINT8* pixels)
-	{
-		const UINT numPixels = (info.width * info.height);
-		const UINT oldStride = info.stride;
-		const UINT oldSize = (numPixels * info.stride);
-
-		const UINT newStride = 4;				// uploading textures to GPU as DXGI_FORMAT_R8G8B8A8_UNORM
-		const UINT newSize = (numPixels * newStride);
-		info.pixels.resize(newSize);
-
-		for (UINT i = 0; i < numPixels; i++)
-		{
-			info.pixels[i * newStride] = pixels[i * oldStride];		// R
-			info.pixels[i * newStride + 1] = pixels[i * oldStride + 1];	// G
-			info.pixels[i * newStride + 2] = pixels[i * oldStride + 2];	// B
-			info.pixels[i * newStride + 3] = 0xFF;							// A (always 1)
-		}
-
-		info.stride = newStride;
-	}
-
-	static TextureInfo LoadTexture(string filepath)
-	{
-		TextureInfo result = {};
-
-		// Load image pixels with stb_image
-		UINT8* pixels = stbi_load(filepath.c_str(), &result.width, &result.height, &result.stride, STBI_default);
-		if (!pixels)
-		{
-			throw runtime_error("Error: failed to load image!");
-		}
-
-		FormatTexture(result, pixels);
-		stbi_image_free(pixels);
-		return result;
-	}
-
 }
 
 
-struct Vertex
+// Vertices of a loaded model are unique by position
+bool operator==(const Vertex& lhs, const Vertex& rhs)
 {
-	DirectX::XMFLOAT3 position;
-	DirectX::XMFLOAT3 normal;
-	//DirectX::XMFLOAT2 uv;
-
-	bool operator==(const Vertex &v) const 
+	if (Utility::CompareVector3WithEpsilon(lhs.position, rhs.position))
 	{
-		if (Utility::CompareVector3WithEpsilon(position, v.position)) 
-		{
-			//if (Utility::CompareVector2WithEpsilon(uv, v.uv)) return true;
-			return true;
-		}
-		return false;
-	}
-
-	Vertex& operator=(const Vertex& v) 
-	{
-		position = v.position;
-		//uv = v.uv;
-		return *this;
+		//if (Utility::CompareVector2WithEpsilon(lhs.uv, rhs.uv)) return true;
+		return true;
 	}
+	return false;
+}
 
-};
+// The CPU reference tracer (CpuRayTracer.h) reads the same vertex, scene constant and instance data
+static_assert(sizeof(Vertex) == sizeof(CpuRt::Vertex), "Vertex and CpuRt::Vertex layouts differ");
+static_assert(sizeof(SceneConstantBuffer) == sizeof(CpuRt::SceneConstants), "SceneConstantBuffer and CpuRt::SceneConstants layouts differ");
+static_assert(sizeof(D3D12_RAYTRACING_INSTANCE_DESC) == sizeof(CpuRt::InstanceDesc), "D3D12_RAYTRACING_INSTANCE_DESC and CpuRt::InstanceDesc layouts differ");
 
 namespace std
 {
@@ -396,6 +343,8 @@ struct Mesh
 			{ XMFLOAT3(1.0f, 1.0f, 1.0f), XMFLOAT3(0.0f, 0.0f, 1.0f) },
 			{ XMFLOAT3(-1.0f, 1.0f, 1.0f), XMFLOAT3(0.0f, 0.0f, 1.0f) },
 		};
+
+		material.texturePath = "textures\\statue.jpg";
 	}
 
 	static void LoadModel(string filepath, Mesh& model)
@@ -421,6 +370,7 @@ struct Mesh
 		// Only support a single material right now
 		model.material.name = materials[0].name;
 		model.material.texturePath = materials[0].diffuse_texname;
+		model.material.textureResolution = static_cast<float>(max(materials[0].diffuse_texopt.texture_resolution, 0));	// -texres, 0 keeps the source size
 
 		// Parse the model and store the unique vertices
 		unordered_map<Vertex, uint32_t> uniqueVertices = {};
@@ -566,6 +516,9 @@ struct RayTracingResources
 	AccelerationStructureBuffer	TLAS;
 	AccelerationStructureBuffer	BLAS;
 	UINT64 tlasSize;
+	bool blasDirty = false;			// vertex buffer changed, BLAS and TLAS are updated before the next DispatchRays
+	CpuRt::MeshData blasProxyMesh;	// deforming meshes only: CPU copy of the BLAS geometry
+	CpuRt::Bvh blasProxy;			// refit along with the BLAS, its SAH drift stands in for the driver's tree
 	RtProgram rayGenProg;
 	RtProgram missProg;
 	HitProgram hitProg;
@@ -573,6 +526,7 @@ struct RayTracingResources
 	ID3D12StateObjectProperties* rtpsoInfo = nullptr;
 	ID3D12Resource* shaderTable = nullptr;
 	uint32_t shaderTableRecordSize = 0;
+	uint32_t shaderTableFrameSize = 0;		// one copy of the records per frame, each points at its frame's descriptor table
 };
 
 /*
@@ -585,11 +539,23 @@ struct AppResources
     UINT rtvDescSize = 0;
     ID3D12Resource* vertexBuffer = nullptr;
 	D3D12_VERTEX_BUFFER_VIEW vertexBufferView;
+	ID3D12Resource* vertexUpload[gFrameCount] = {};		// per frame staging for UpdateVertexBuffer, persistently mapped
+	UINT8* vertexUploadMappedPtr[gFrameCount] = {};
+	std::vector<Vertex> restVertices;						// mesh vertices before Update deforms them
     ID3D12Resource* indexBuffer = nullptr;
 	D3D12_INDEX_BUFFER_VIEW indexBufferView;
+	ID3D12Resource* blueNoiseBuffer = nullptr;				// CpuRt::BlueNoiseTile(), RayGen.hlsl's BlueNoise
     ID3D12Resource* texture = nullptr;
 	ID3D12Resource* textureUploadResource = nullptr;
-	ID3D12DescriptorHeap* descriptorHeap = nullptr;
+	TexturePack texturePack;
+	TextureStreamer textureStreamer;
+	UINT textureTopMip = 0;									// pack mip that is mip 0 of 'texture'
+	std::vector<UINT64> textureUploadOffsets;				// per texture mip, into textureUploadResource
+	UINT8* textureUploadMappedPtr = nullptr;
+	float textureMinLod = 0.0f;								// finest resident mip of 'texture', ResourceMinLODClamp for its SRV
+	float textureSRVMinLod[gFrameCount] = {};				// the clamp each frame's descriptor table was last written with
+	ID3D12DescriptorHeap* descriptorHeap = nullptr;			// gFrameCount copies of the DXR descriptor table
+	UINT descriptorTableSize = 0;
 	ID3D12RootSignature*	globalRootSignature = nullptr;
 
 	//camera params
@@ -929,27 +895,43 @@ static void CreateBuffer(
     ThrowIfFailed(dr.device->CreateCommittedResource(&heapDesc, D3D12_HEAP_FLAG_NONE, &resourceDesc, resourceState, nullptr, IID_PPV_ARGS(ppResource)),L"Failed to create buff resource");
 }
 
+// Default heap vertex buffer, written only by copies from the per frame upload buffers so frames in flight never see a CPU write
 static void CreateVertexBuffer(DeviceResources& dr, AppResources& ar, Application& app)
 {
     UINT64 buffSize = (UINT)app.mesh.vertices.size() * sizeof(Vertex);
-    const D3D12_HEAP_TYPE heapType = D3D12_HEAP_TYPE_UPLOAD;
-    const D3D12_RESOURCE_STATES resourceState = D3D12_RESOURCE_STATE_GENERIC_READ;
     const D3D12_RESOURCE_FLAGS resourceFlags = D3D12_RESOURCE_FLAG_NONE;
     UINT64 buffAlignment = 0;
 
-    CreateBuffer(dr, buffSize, heapType, resourceState, resourceFlags, buffAlignment, &ar.vertexBuffer);
+    CreateBuffer(dr, buffSize, D3D12_HEAP_TYPE_DEFAULT, D3D12_RESOURCE_STATE_COPY_DEST, resourceFlags, buffAlignment, &ar.vertexBuffer);
 
 #if NAME_D3D_RESOURCES
 	ar.vertexBuffer->SetName(L"Vertex Buffer");
 #endif
 
-    //copy data to mapped buffer 
-    UINT8* vtxMappedPtr;
-    D3D12_RANGE readRange = {};
-    ThrowIfFailed(ar.vertexBuffer->Map(0, &readRange, reinterpret_cast<void**>(&vtxMappedPtr)), L"Failed to map vtx buffer");
+	D3D12_RANGE readRange = {};
+	for (UINT i = 0; i < gFrameCount; i++)
+	{
+		CreateBuffer(dr, buffSize, D3D12_HEAP_TYPE_UPLOAD, D3D12_RESOURCE_STATE_GENERIC_READ, resourceFlags, buffAlignment, &ar.vertexUpload[i]);
+#if NAME_D3D_RESOURCES
+		ar.vertexUpload[i]->SetName(L"Vertex Upload Buffer");
+#endif
+		ThrowIfFailed(ar.vertexUpload[i]->Map(0, &readRange, reinterpret_cast<void**>(&ar.vertexUploadMappedPtr[i])), L"Failed to map vtx upload buffer");
+	}
+
+    //copy data to the vertex buffer through this frame's upload buffer
+    memcpy(ar.vertexUploadMappedPtr[dr.frameIndex], app.mesh.vertices.data(), buffSize);
+	dr.cmdList[0]->CopyBufferRegion(ar.vertexBuffer, 0, ar.vertexUpload[dr.frameIndex], 0, buffSize);
+
+	// Read by the BLAS builds and by the hit shaders
+	D3D12_RESOURCE_BARRIER barrier = {};
+	barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION;
+	barrier.Transition.pResource = ar.vertexBuffer;
+	barrier.Transition.StateBefore = D3D12_RESOURCE_STATE_COPY_DEST;
+	barrier.Transition.StateAfter = D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE;
+	barrier.Transition.Subresource = D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES;
+	dr.cmdList[0]->ResourceBarrier(1, &barrier);
 
-    memcpy(vtxMappedPtr, app.mesh.vertices.data(), buffSize);
-    ar.vertexBuffer->Unmap(0, nullptr);
+	ar.restVertices = app.mesh.vertices;
 
     //Init vertex buffer view 
     ar.vertexBufferView.BufferLocation = ar.vertexBuffer->GetGPUVirtualAddress();
@@ -985,6 +967,30 @@ static void CreateIndexBuffer(DeviceResources& dr, AppResources& ar, Application
 	ar.indexBufferView.Format = DXGI_FORMAT_R32_UINT;
 }
 
+// Blue noise rotations of the gSamplerBlueNoise sampler (shaders/Sampling.h), generated on the CPU once
+static void CreateBlueNoiseBuffer(DeviceResources& dr, AppResources& ar)
+{
+    const std::vector<UINT>& tile = CpuRt::BlueNoiseTile();
+    UINT64 buffSize = tile.size() * sizeof(UINT);
+    const D3D12_HEAP_TYPE heapType = D3D12_HEAP_TYPE_UPLOAD;
+    const D3D12_RESOURCE_STATES resourceState = D3D12_RESOURCE_STATE_GENERIC_READ;
+    const D3D12_RESOURCE_FLAGS resourceFlags = D3D12_RESOURCE_FLAG_NONE;
+    UINT64 buffAlignment = 0;
+
+    CreateBuffer(dr, buffSize, heapType, resourceState, resourceFlags, buffAlignment, &ar.blueNoiseBuffer);
+
+#if NAME_D3D_RESOURCES
+	ar.blueNoiseBuffer->SetName(L"Blue Noise Buffer");
+#endif
+
+    UINT8* mappedPtr;
+    D3D12_RANGE readRange = {};
+    ThrowIfFailed(ar.blueNoiseBuffer->Map(0, &readRange, reinterpret_cast<void**>(&mappedPtr)), L"Failed to map blue noise buffer");
+
+    memcpy(mappedPtr, tile.data(), buffSize);
+    ar.blueNoiseBuffer->Unmap(0, nullptr);
+}
+
 void UploadTexture(DeviceResources& dr, ID3D12Resource* destResource, ID3D12Resource* srcResource, const TextureInfo &texture)
 {
 	UINT8* pData;
@@ -1021,7 +1027,7 @@ void UploadTexture(DeviceResources& dr, ID3D12Resource* destResource, ID3D12Reso
 	barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION;
 	barrier.Transition.pResource = destResource;
 	barrier.Transition.StateBefore = D3D12_RESOURCE_STATE_COPY_DEST;
-	barrier.Transition.StateAfter = D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE;
+	barrier.Transition.StateAfter = D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE;
 	barrier.Transition.Subresource = D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES;
 
 	dr.cmdList[0]->ResourceBarrier(1, &barrier);
@@ -1029,7 +1035,7 @@ void UploadTexture(DeviceResources& dr, ID3D12Resource* destResource, ID3D12Reso
 
 static void CreateTexture(DeviceResources& dr, AppResources& ar, Application& app)
 {
-    TextureInfo texture = Utility::LoadTexture(app.mesh.material.texturePath);
+    TextureInfo texture = Utility::LoadTexture(app.mesh.material.texturePath, static_cast<int>(app.mesh.material.textureResolution));
 	app.mesh.material.textureResolution = static_cast<float>(texture.width);
 
 	D3D12_RESOURCE_DESC textureDesc = {};
@@ -1067,6 +1073,157 @@ static void CreateTexture(DeviceResources& dr, AppResources& ar, Application& ap
 	UploadTexture(dr, ar.texture, ar.textureUploadResource, texture);
 }
 
+// Copies one pack mip from the mapping into the upload buffer and records its copy, the pack already has the upload footprint
+static void UploadPackMip(DeviceResources& dr, AppResources& ar, const MipStreamRequest& request)
+{
+	const TexturePackTexture& entry = ar.texturePack.Texture(request.texture);
+	const TexturePackMip& mip = ar.texturePack.Mip(entry, request.mip);
+	const UINT subresource = request.mip - ar.textureTopMip;
+	memcpy(ar.textureUploadMappedPtr + ar.textureUploadOffsets[subresource], ar.texturePack.Data(mip), mip.size);
+	ar.texturePack.Release(mip);
+
+	D3D12_TEXTURE_COPY_LOCATION source = {};
+	source.pResource = ar.textureUploadResource;
+	source.Type = D3D12_TEXTURE_COPY_TYPE_PLACED_FOOTPRINT;
+	source.PlacedFootprint.Offset = ar.textureUploadOffsets[subresource];
+	source.PlacedFootprint.Footprint.Format = static_cast<DXGI_FORMAT>(entry.format);
+	source.PlacedFootprint.Footprint.Width = mip.width;
+	source.PlacedFootprint.Footprint.Height = mip.height;
+	source.PlacedFootprint.Footprint.Depth = 1;
+	source.PlacedFootprint.Footprint.RowPitch = mip.rowPitch;
+
+	D3D12_TEXTURE_COPY_LOCATION destination = {};
+	destination.pResource = ar.texture;
+	destination.SubresourceIndex = subresource;
+	destination.Type = D3D12_TEXTURE_COPY_TYPE_SUBRESOURCE_INDEX;
+
+	dr.cmdList[0]->CopyTextureRegion(&destination, 0, 0, 0, &source, nullptr);
+}
+
+// Material texture from a texture pack (see TexturePack.h): the coarse mips are uploaded now, the rest by StreamTextureMips
+static void CreateTextureFromPack(DeviceResources& dr, AppResources& ar, Application& app, const std::string& packPath)
+{
+	ar.texturePack.Open(packPath);
+	const int index = ar.texturePack.Find(app.mesh.material.texturePath);
+	if (index < 0)
+	{
+		throw std::runtime_error("Error: " + app.mesh.material.texturePath + " is not in " + packPath);
+	}
+
+	const TexturePackTexture& entry = ar.texturePack.Texture(index);
+	ar.textureTopMip = Utility::FirstMipForResolution(entry, static_cast<int>(app.mesh.material.textureResolution));
+	const TexturePackMip& top = ar.texturePack.Mip(entry, ar.textureTopMip);
+	app.mesh.material.textureResolution = static_cast<float>(top.width);
+
+	D3D12_RESOURCE_DESC textureDesc = {};
+	textureDesc.Width = top.width;
+	textureDesc.Height = top.height;
+	textureDesc.MipLevels = static_cast<UINT16>(entry.mipCount - ar.textureTopMip);
+	textureDesc.DepthOrArraySize = 1;
+	textureDesc.SampleDesc.Count = 1;
+	textureDesc.Format = static_cast<DXGI_FORMAT>(entry.format);
+	textureDesc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
+
+	ThrowIfFailed(dr.device->CreateCommittedResource(&DefaultHeapProperties, D3D12_HEAP_FLAG_NONE, &textureDesc, D3D12_RESOURCE_STATE_COPY_DEST, nullptr, IID_PPV_ARGS(&ar.texture)), L"Failed to create texture resource");
+#if NAME_D3D_RESOURCES
+	ar.texture->SetName(L"Texture");
+#endif
+
+	// One upload buffer for the whole chain, it stays mapped until every mip streamed in
+	UINT64 uploadSize = 0;
+	ar.textureUploadOffsets.clear();
+	for (UINT mip = ar.textureTopMip; mip < entry.mipCount; mip++)
+	{
+		uploadSize = ALIGN(D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT, uploadSize);
+		ar.textureUploadOffsets.push_back(uploadSize);
+		uploadSize += ar.texturePack.Mip(entry, mip).size;
+	}
+
+	CreateBuffer(dr, uploadSize, D3D12_HEAP_TYPE_UPLOAD, D3D12_RESOURCE_STATE_GENERIC_READ, D3D12_RESOURCE_FLAG_NONE, 0, &ar.textureUploadResource);
+#if NAME_D3D_RESOURCES
+	ar.textureUploadResource->SetName(L"Texture Upload Buffer");
+#endif
+	ThrowIfFailed(ar.textureUploadResource->Map(0, nullptr, reinterpret_cast<void**>(&ar.textureUploadMappedPtr)), L"Failed to map texture upload buffer");
+
+	ar.textureStreamer.Schedule(ar.texturePack, { { static_cast<uint32_t>(index), ar.textureTopMip } }, gFirstFrameMipSize);
+	for (const MipStreamRequest& request : ar.textureStreamer.FirstFrame())
+	{
+		UploadPackMip(dr, ar, request);
+	}
+	ar.textureMinLod = static_cast<float>(ar.textureStreamer.FirstFrame().back().mip - ar.textureTopMip);
+
+	D3D12_RESOURCE_BARRIER barrier = {};
+	barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION;
+	barrier.Transition.pResource = ar.texture;
+	barrier.Transition.StateBefore = D3D12_RESOURCE_STATE_COPY_DEST;
+	barrier.Transition.StateAfter = D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE;
+	barrier.Transition.Subresource = D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES;
+	dr.cmdList[0]->ResourceBarrier(1, &barrier);
+
+	if (ar.textureStreamer.Pending() == 0)
+	{
+		ar.textureUploadResource->Unmap(0, nullptr);
+		ar.textureUploadMappedPtr = nullptr;
+		ar.texturePack.Close();
+	}
+}
+
+// Uploads the next finer pack mips, up to gTextureStreamBytesPerFrame per frame (at least one mip)
+static void StreamTextureMips(DeviceResources& dr, AppResources& ar)
+{
+	if (ar.textureStreamer.Pending() == 0) return;
+
+	UINT64 bytes = 0;
+	MipStreamRequest request;
+	while (bytes < gTextureStreamBytesPerFrame && ar.textureStreamer.Next(request))
+	{
+		D3D12_RESOURCE_BARRIER barrier = {};
+		barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION;
+		barrier.Transition.pResource = ar.texture;
+		barrier.Transition.StateBefore = D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE;
+		barrier.Transition.StateAfter = D3D12_RESOURCE_STATE_COPY_DEST;
+		barrier.Transition.Subresource = request.mip - ar.textureTopMip;
+		dr.cmdList[0]->ResourceBarrier(1, &barrier);
+
+		UploadPackMip(dr, ar, request);
+
+		std::swap(barrier.Transition.StateBefore, barrier.Transition.StateAfter);
+		dr.cmdList[0]->ResourceBarrier(1, &barrier);
+
+		ar.textureMinLod = static_cast<float>(request.mip - ar.textureTopMip);
+		bytes += ar.texturePack.Mip(ar.texturePack.Texture(request.texture), request.mip).size;
+	}
+
+	// Every mip is in, the mapping and the upload buffer pages are no longer needed
+	if (ar.textureStreamer.Pending() == 0)
+	{
+		ar.textureUploadResource->Unmap(0, nullptr);
+		ar.textureUploadMappedPtr = nullptr;
+		ar.texturePack.Close();
+	}
+}
+
+/*
+ The material texture's SRV in 'frame's descriptor table, clamped to the finest mip streamed in so far. Render rewrites
+ it as StreamTextureMips moves that, in the table of the frame being recorded only: the GPU is done with it
+ (MoveToNextFrame waited for its fence) while the other frame may still be reading its own.
+*/
+static void CreateTextureSRV(DeviceResources& dr, AppResources& ar, UINT frame)
+{
+	D3D12_SHADER_RESOURCE_VIEW_DESC textureSRVDesc = {};
+	textureSRVDesc.Format = ar.texture->GetDesc().Format;
+	textureSRVDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+	textureSRVDesc.Texture2D.MipLevels = static_cast<UINT>(-1);
+	textureSRVDesc.Texture2D.MostDetailedMip = 0;
+	textureSRVDesc.Texture2D.ResourceMinLODClamp = ar.textureMinLod;
+	textureSRVDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+
+	D3D12_CPU_DESCRIPTOR_HANDLE handle = ar.descriptorHeap->GetCPUDescriptorHandleForHeapStart();
+	handle.ptr += (frame * ar.descriptorTableSize + gTextureDescriptorIndex) * dr.device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+	dr.device->CreateShaderResourceView(ar.texture, &textureSRVDesc, handle);
+	ar.textureSRVMinLod[frame] = ar.textureMinLod;
+}
+
 static void CreateConstBuffer(DeviceResources& dr, ID3D12Resource** buffer, UINT64 buffSize)
 {
     const D3D12_HEAP_TYPE heapType = D3D12_HEAP_TYPE_UPLOAD;
@@ -1102,7 +1259,7 @@ static void CreateCubeParamsConstBuffer(DeviceResources& dr, AppResources& ar, A
 /*
  ------------------------------Ray Tracing Related Function Definitions------------------------------------
 */
-static void CreateBlas(DeviceResources& dr, AppResources& ar, Application& app, RayTracingResources& rt)
+static D3D12_RAYTRACING_GEOMETRY_DESC GetBlasGeometryDesc(AppResources& ar, Application& app)
 {
 	D3D12_RAYTRACING_GEOMETRY_DESC geometryDesc;
 	geometryDesc.Type = D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES;
@@ -1115,8 +1272,16 @@ static void CreateBlas(DeviceResources& dr, AppResources& ar, Application& app,
 	geometryDesc.Triangles.IndexCount = static_cast<UINT>(app.mesh.indices.size());
 	geometryDesc.Triangles.Transform3x4 = 0;
 	geometryDesc.Flags = D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE;
-	
-	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE;
+	return geometryDesc;
+}
+
+static void CreateBlas(DeviceResources& dr, AppResources& ar, Application& app, RayTracingResources& rt)
+{
+	D3D12_RAYTRACING_GEOMETRY_DESC geometryDesc = GetBlasGeometryDesc(ar, app);
+
+	// ALLOW_UPDATE so deformed vertices can be refit in place (UpdateAccelerationStructures)
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE |
+		D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE;
 
 	// Get the size requirements for the BLAS buffers
 	D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS ASInputs = {};
@@ -1132,9 +1297,9 @@ static void CreateBlas(DeviceResources& dr, AppResources& ar, Application& app,
 	//ASPreBuildInfo.ScratchDataSizeInBytes = ALIGN(D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT, ASPreBuildInfo.ScratchDataSizeInBytes);
 	//ASPreBuildInfo.ResultDataMaxSizeInBytes = ALIGN(D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BYTE_ALIGNMENT, ASPreBuildInfo.ResultDataMaxSizeInBytes);
 
-	// Create the BLAS scratch buffer
+	// Create the BLAS scratch buffer, kept for updates so it covers both kinds of build
 	// ToDo create only one scratch buffer doing prebuild blas/tlas at same time and allocating max size
-	UINT64 buffSize = ASPreBuildInfo.ScratchDataSizeInBytes;
+	UINT64 buffSize = max(ASPreBuildInfo.ScratchDataSizeInBytes, ASPreBuildInfo.UpdateScratchDataSizeInBytes);
     D3D12_HEAP_TYPE heapType = D3D12_HEAP_TYPE_DEFAULT;
     D3D12_RESOURCE_STATES resourceState = D3D12_RESOURCE_STATE_UNORDERED_ACCESS;
     D3D12_RESOURCE_FLAGS resourceFlags = D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
@@ -1161,6 +1326,15 @@ static void CreateBlas(DeviceResources& dr, AppResources& ar, Application& app,
 
 	dr.cmdList[0]->BuildRaytracingAccelerationStructure(&buildDesc, 0, nullptr);
 
+	// Tree the refits are measured against, only needed when Update deforms the mesh
+	if (gMeshTwist != 0.0f)
+	{
+		rt.blasProxyMesh.vertices.resize(app.mesh.vertices.size());
+		memcpy(rt.blasProxyMesh.vertices.data(), app.mesh.vertices.data(), app.mesh.vertices.size() * sizeof(Vertex));
+		rt.blasProxyMesh.indices.assign(app.mesh.indices.begin(), app.mesh.indices.end());
+		rt.blasProxy = CpuRt::BuildBvh(rt.blasProxyMesh, CpuRt::BvhBuildMode::Sah);
+	}
+
 	// Wait for the BLAS build to complete
 	D3D12_RESOURCE_BARRIER uavBarrier;
 	uavBarrier.Type = D3D12_RESOURCE_BARRIER_TYPE_UAV;
@@ -1195,7 +1369,9 @@ static void CreateTlas(DeviceResources& dr, AppResources& ar, Application& app,
 	memcpy(pData, &instanceDesc, sizeof(instanceDesc));
 	rt.TLAS.pInstanceDesc->Unmap(0, nullptr);
 
-	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE;
+	// The TLAS bounds depend on the BLAS, it is updated along with it
+	D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS buildFlags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE |
+		D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE;
 
 	// Get the size requirements for the TLAS buffers
 	D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS ASInputs = {};
@@ -1215,7 +1391,7 @@ static void CreateTlas(DeviceResources& dr, AppResources& ar, Application& app,
 	rt.tlasSize = ASPreBuildInfo.ResultDataMaxSizeInBytes;
 
 	// Create TLAS scratch buffer
-	buffSize = ASPreBuildInfo.ScratchDataSizeInBytes;
+	buffSize = max(ASPreBuildInfo.ScratchDataSizeInBytes, ASPreBuildInfo.UpdateScratchDataSizeInBytes);
     heapType = D3D12_HEAP_TYPE_DEFAULT;
     resourceState = D3D12_RESOURCE_STATE_UNORDERED_ACCESS;
     resourceFlags = D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
@@ -1250,6 +1426,81 @@ static void CreateTlas(DeviceResources& dr, AppResources& ar, Application& app,
 	dr.cmdList[0]->ResourceBarrier(1, &uavBarrier);
 }
 
+/*
+ Writes the app's mesh vertices (same count as at creation) to this frame's upload buffer and records its copy to the
+ vertex buffer, the acceleration structures follow in the same command list. MoveToNextFrame waited for the frame
+ that used this upload buffer last, and the copy runs after the previous frame's DispatchRays on the queue.
+*/
+static void UpdateVertexBuffer(DeviceResources& dr, AppResources& ar, Application& app, RayTracingResources& rt)
+{
+	memcpy(ar.vertexUploadMappedPtr[dr.frameIndex], app.mesh.vertices.data(), ar.vertexBufferView.SizeInBytes);
+
+	D3D12_RESOURCE_BARRIER barrier = {};
+	barrier.Type = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION;
+	barrier.Transition.pResource = ar.vertexBuffer;
+	barrier.Transition.StateBefore = D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE;
+	barrier.Transition.StateAfter = D3D12_RESOURCE_STATE_COPY_DEST;
+	barrier.Transition.Subresource = D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES;
+	dr.cmdList[0]->ResourceBarrier(1, &barrier);
+
+	dr.cmdList[0]->CopyBufferRegion(ar.vertexBuffer, 0, ar.vertexUpload[dr.frameIndex], 0, ar.vertexBufferView.SizeInBytes);
+
+	std::swap(barrier.Transition.StateBefore, barrier.Transition.StateAfter);
+	dr.cmdList[0]->ResourceBarrier(1, &barrier);
+
+	rt.blasDirty = true;
+}
+
+/*
+ Refit of the BLAS to the current vertex buffer (PERFORM_UPDATE, source and destination the same buffer, the
+ persistent scratch from CreateBlas), then of the TLAS over it. An update keeps the topology and the tree gets
+ worse the more the mesh deforms, the driver's tree can't be queried so a CPU BVH over the same triangles is refit
+ alongside: once its SAH cost drifts past rebuildThreshold (CpuRt::UpdateBvh) the BLAS is built from scratch too.
+*/
+static void UpdateAccelerationStructures(DeviceResources& dr, AppResources& ar, Application& app, RayTracingResources& rt)
+{
+	rt.blasProxyMesh.vertices.resize(app.mesh.vertices.size());
+	memcpy(rt.blasProxyMesh.vertices.data(), app.mesh.vertices.data(), app.mesh.vertices.size() * sizeof(Vertex));
+	const bool rebuild = CpuRt::UpdateBvh(rt.blasProxy, rt.blasProxyMesh, CpuRt::BvhBuildMode::Sah);
+	const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS allowUpdate = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PREFER_FAST_TRACE |
+		D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE;
+
+	D3D12_RAYTRACING_GEOMETRY_DESC geometryDesc = GetBlasGeometryDesc(ar, app);
+
+	D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC buildDesc = {};
+	buildDesc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL;
+	buildDesc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+	buildDesc.Inputs.pGeometryDescs = &geometryDesc;
+	buildDesc.Inputs.NumDescs = 1;
+	buildDesc.Inputs.Flags = rebuild ? allowUpdate : allowUpdate | D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE;
+	buildDesc.SourceAccelerationStructureData = rebuild ? 0 : rt.BLAS.pResult->GetGPUVirtualAddress();
+	buildDesc.ScratchAccelerationStructureData = rt.BLAS.pScratch->GetGPUVirtualAddress();
+	buildDesc.DestAccelerationStructureData = rt.BLAS.pResult->GetGPUVirtualAddress();
+	dr.cmdList[0]->BuildRaytracingAccelerationStructure(&buildDesc, 0, nullptr);
+
+	D3D12_RESOURCE_BARRIER uavBarrier;
+	uavBarrier.Type = D3D12_RESOURCE_BARRIER_TYPE_UAV;
+	uavBarrier.UAV.pResource = rt.BLAS.pResult;
+	uavBarrier.Flags = D3D12_RESOURCE_BARRIER_FLAG_NONE;
+	dr.cmdList[0]->ResourceBarrier(1, &uavBarrier);
+
+	buildDesc = {};
+	buildDesc.Inputs.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL;
+	buildDesc.Inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+	buildDesc.Inputs.InstanceDescs = rt.TLAS.pInstanceDesc->GetGPUVirtualAddress();
+	buildDesc.Inputs.NumDescs = 1;
+	buildDesc.Inputs.Flags = allowUpdate | D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE;
+	buildDesc.SourceAccelerationStructureData = rt.TLAS.pResult->GetGPUVirtualAddress();
+	buildDesc.ScratchAccelerationStructureData = rt.TLAS.pScratch->GetGPUVirtualAddress();
+	buildDesc.DestAccelerationStructureData = rt.TLAS.pResult->GetGPUVirtualAddress();
+	dr.cmdList[0]->BuildRaytracingAccelerationStructure(&buildDesc, 0, nullptr);
+
+	uavBarrier.UAV.pResource = rt.TLAS.pResult;
+	dr.cmdList[0]->ResourceBarrier(1, &uavBarrier);
+
+	rt.blasDirty = false;
+}
+
 static void CreateDXROutputTexture(DeviceResources& dr, AppResources& ar, RayTracingResources& rt)
 {
 	//Note texture format should match that of swapchain as later we will copy this texture to swapchain for presenting it hence, we init it as copy resource
@@ -1286,76 +1537,90 @@ static void CreateRootSignature(DeviceResources& dr, D3D12_ROOT_SIGNATURE_DESC&
 // This heap holds desc for resources of ray tracing
 static void CreateRTDescriptorHeap(DeviceResources& dr, AppResources& ar, RayTracingResources& rt, Application& app)
 {
-	// Describe the CBV/SRV/UAV heap
-	// Need 4 entries:
+	// Describe the CBV/SRV/UAV heap, one descriptor table per frame so the texture SRV can change without a GPU wait
+	// Each table needs 6 entries:
 	// 1 UAV for the RT output
 	// 1 SRV for the Scene BVH
 	// 1 SRV for the index buffer
 	// 1 SRV for the vertex buffer
+	// 1 SRV for the blue noise tile
+	// 1 SRV for the material texture
 
 	D3D12_DESCRIPTOR_HEAP_DESC heapDesc = {};
-	heapDesc.NumDescriptors = 4;
+	ar.descriptorTableSize = gTextureDescriptorIndex + 1;
+	heapDesc.NumDescriptors = ar.descriptorTableSize * gFrameCount;
 	heapDesc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV;
 	heapDesc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE;
 
 	ThrowIfFailed(dr.device->CreateDescriptorHeap(&heapDesc, IID_PPV_ARGS(&ar.descriptorHeap)), L"Failed to create RT descriptor heap");
 
-	D3D12_CPU_DESCRIPTOR_HANDLE handle = ar.descriptorHeap->GetCPUDescriptorHandleForHeapStart();
 	UINT handleIncrement = dr.device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
 #if NAME_D3D_RESOURCES
 	ar.descriptorHeap->SetName(L"DXR Descriptor Heap");
 #endif
 
-	// Create the DXR output buffer UAV
-	D3D12_UNORDERED_ACCESS_VIEW_DESC uavDesc = {};
-	uavDesc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2D;
-	dr.device->CreateUnorderedAccessView(dr.DXROutput, nullptr, &uavDesc, handle);
-
-	// Create the DXR Top Level Acceleration Structure SRV
-	D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc;
-	srvDesc.Format = DXGI_FORMAT_UNKNOWN;
-	srvDesc.ViewDimension = D3D12_SRV_DIMENSION_RAYTRACING_ACCELERATION_STRUCTURE;
-	srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
-	srvDesc.RaytracingAccelerationStructure.Location = rt.TLAS.pResult->GetGPUVirtualAddress();
-
-	handle.ptr += handleIncrement;
-	dr.device->CreateShaderResourceView(nullptr, &srvDesc, handle);
-
-	D3D12_SHADER_RESOURCE_VIEW_DESC indexSRVDesc;
-	indexSRVDesc.ViewDimension = D3D12_SRV_DIMENSION_BUFFER;
-	indexSRVDesc.Format = DXGI_FORMAT_R32_TYPELESS;
-	indexSRVDesc.Buffer.Flags = D3D12_BUFFER_SRV_FLAG_RAW;
-	indexSRVDesc.Buffer.StructureByteStride = 0;
-	indexSRVDesc.Buffer.FirstElement = 0;
-	indexSRVDesc.Buffer.NumElements = (static_cast<UINT>(app.mesh.indices.size()) * sizeof(UINT)) / sizeof(float);
-	indexSRVDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
-
-	handle.ptr += handleIncrement;
-	dr.device->CreateShaderResourceView(ar.indexBuffer, &indexSRVDesc, handle);
-
-	// Create the vertex buffer SRV
-	D3D12_SHADER_RESOURCE_VIEW_DESC vertexSRVDesc;
-	vertexSRVDesc.ViewDimension = D3D12_SRV_DIMENSION_BUFFER;
-	vertexSRVDesc.Format = DXGI_FORMAT_UNKNOWN;
-	vertexSRVDesc.Buffer.Flags = D3D12_BUFFER_SRV_FLAG_NONE;
-	vertexSRVDesc.Buffer.StructureByteStride = sizeof(app.mesh.vertices[0]);
-	vertexSRVDesc.Buffer.FirstElement = 0;
-	vertexSRVDesc.Buffer.NumElements = app.mesh.vertices.size();
-	vertexSRVDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
-
-	handle.ptr += handleIncrement;
-	dr.device->CreateShaderResourceView(ar.vertexBuffer, &vertexSRVDesc, handle);
-
-	// Create the material texture SRV
-	/*D3D12_SHADER_RESOURCE_VIEW_DESC textureSRVDesc = {};
-	textureSRVDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
-	textureSRVDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
-	textureSRVDesc.Texture2D.MipLevels = 1;
-	textureSRVDesc.Texture2D.MostDetailedMip = 0;
-	textureSRVDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
-
-	handle.ptr += handleIncrement;
-	dr.device->CreateShaderResourceView(ar.texture, &textureSRVDesc, handle);*/
+	for (UINT frame = 0; frame < gFrameCount; frame++)
+	{
+		D3D12_CPU_DESCRIPTOR_HANDLE handle = ar.descriptorHeap->GetCPUDescriptorHandleForHeapStart();
+		handle.ptr += frame * ar.descriptorTableSize * handleIncrement;
+
+		// Create the DXR output buffer UAV
+		D3D12_UNORDERED_ACCESS_VIEW_DESC uavDesc = {};
+		uavDesc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2D;
+		dr.device->CreateUnorderedAccessView(dr.DXROutput, nullptr, &uavDesc, handle);
+
+		// Create the DXR Top Level Acceleration Structure SRV
+		D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc;
+		srvDesc.Format = DXGI_FORMAT_UNKNOWN;
+		srvDesc.ViewDimension = D3D12_SRV_DIMENSION_RAYTRACING_ACCELERATION_STRUCTURE;
+		srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+		srvDesc.RaytracingAccelerationStructure.Location = rt.TLAS.pResult->GetGPUVirtualAddress();
+
+		handle.ptr += handleIncrement;
+		dr.device->CreateShaderResourceView(nullptr, &srvDesc, handle);
+
+		D3D12_SHADER_RESOURCE_VIEW_DESC indexSRVDesc;
+		indexSRVDesc.ViewDimension = D3D12_SRV_DIMENSION_BUFFER;
+		indexSRVDesc.Format = DXGI_FORMAT_R32_TYPELESS;
+		indexSRVDesc.Buffer.Flags = D3D12_BUFFER_SRV_FLAG_RAW;
+		indexSRVDesc.Buffer.StructureByteStride = 0;
+		indexSRVDesc.Buffer.FirstElement = 0;
+		indexSRVDesc.Buffer.NumElements = (static_cast<UINT>(app.mesh.indices.size()) * sizeof(UINT)) / sizeof(float);
+		indexSRVDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+
+		handle.ptr += handleIncrement;
+		dr.device->CreateShaderResourceView(ar.indexBuffer, &indexSRVDesc, handle);
+
+		// Create the vertex buffer SRV
+		D3D12_SHADER_RESOURCE_VIEW_DESC vertexSRVDesc;
+		vertexSRVDesc.ViewDimension = D3D12_SRV_DIMENSION_BUFFER;
+		vertexSRVDesc.Format = DXGI_FORMAT_UNKNOWN;
+		vertexSRVDesc.Buffer.Flags = D3D12_BUFFER_SRV_FLAG_NONE;
+		vertexSRVDesc.Buffer.StructureByteStride = sizeof(app.mesh.vertices[0]);
+		vertexSRVDesc.Buffer.FirstElement = 0;
+		vertexSRVDesc.Buffer.NumElements = app.mesh.vertices.size();
+		vertexSRVDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+
+		handle.ptr += handleIncrement;
+		dr.device->CreateShaderResourceView(ar.vertexBuffer, &vertexSRVDesc, handle);
+
+		// Create the blue noise tile SRV
+		D3D12_SHADER_RESOURCE_VIEW_DESC blueNoiseSRVDesc;
+		blueNoiseSRVDesc.ViewDimension = D3D12_SRV_DIMENSION_BUFFER;
+		blueNoiseSRVDesc.Format = DXGI_FORMAT_UNKNOWN;
+		blueNoiseSRVDesc.Buffer.Flags = D3D12_BUFFER_SRV_FLAG_NONE;
+		blueNoiseSRVDesc.Buffer.StructureByteStride = sizeof(UINT);
+		blueNoiseSRVDesc.Buffer.FirstElement = 0;
+		blueNoiseSRVDesc.Buffer.NumElements = static_cast<UINT>(CpuRt::BlueNoiseTile().size());
+		blueNoiseSRVDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+
+		handle.ptr += handleIncrement;
+		dr.device->CreateShaderResourceView(ar.blueNoiseBuffer, &blueNoiseSRVDesc, handle);
+
+		// Create the material texture SRV
+		handle.ptr += handleIncrement;
+		CreateTextureSRV(dr, ar, frame);
+	}
 }
 
 static void CreateRayGenProgram(DeviceResources& dr, RayTracingResources& rt, Application& app)
@@ -1372,6 +1637,8 @@ static void CreateRayGenProgram(DeviceResources& dr, RayTracingResources& rt, Ap
 		 1 SRV for the Scene BVH
 		 1 SRV for the index buffer
 		 1 SRV for the vertex buffer
+		 1 SRV for the blue noise tile
+		 1 SRV for the material texture
 	*/
 
 	D3D12_DESCRIPTOR_RANGE ranges[2];
@@ -1383,7 +1650,7 @@ static void CreateRayGenProgram(DeviceResources& dr, RayTracingResources& rt, Ap
 	ranges[0].OffsetInDescriptorsFromTableStart = 0;
 
 	ranges[1].BaseShaderRegister = 0;
-	ranges[1].NumDescriptors = 3;
+	ranges[1].NumDescriptors = 5;
 	ranges[1].RegisterSpace = 0;
 	ranges[1].RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_SRV;
 	ranges[1].OffsetInDescriptorsFromTableStart = 1;
@@ -1454,7 +1721,7 @@ static void CreateRTPipelineStateObject(DeviceResources& dr, AppResources& ar, R
 {
 	// Need 10 subobjects:
 	// 1 for RGS program
-	// 1 for Miss program
+	// 1 for Miss program (Miss and ShadowMiss)
 	// 1 for CHS program
 	// 1 for Hit Group
 	// 2 for RayGen Root Signature (root-signature and association)
@@ -1485,18 +1752,21 @@ static void CreateRTPipelineStateObject(DeviceResources& dr, AppResources& ar, R
 		subobjects[index++] = rgs;
 	}
 
-	//Miss program Subobject
+	//Miss program Subobject, the library holds the shadow ray miss shader too
 	{
-		D3D12_EXPORT_DESC msExportDesc = {};
-		msExportDesc.Name = L"Miss_5";
-		msExportDesc.ExportToRename = L"Miss";
-		msExportDesc.Flags = D3D12_EXPORT_FLAG_NONE;
+		D3D12_EXPORT_DESC msExportDescs[2] = {};
+		msExportDescs[0].Name = L"Miss_5";
+		msExportDescs[0].ExportToRename = L"Miss";
+		msExportDescs[0].Flags = D3D12_EXPORT_FLAG_NONE;
+		msExportDescs[1].Name = L"ShadowMiss_6";
+		msExportDescs[1].ExportToRename = L"ShadowMiss";
+		msExportDescs[1].Flags = D3D12_EXPORT_FLAG_NONE;
 
 		D3D12_DXIL_LIBRARY_DESC	msLibDesc = {};
 		msLibDesc.DXILLibrary.BytecodeLength = rt.missProg.blob->GetBufferSize();
 		msLibDesc.DXILLibrary.pShaderBytecode = rt.missProg.blob->GetBufferPointer();
-		msLibDesc.NumExports = 1;
-		msLibDesc.pExports = &msExportDesc;
+		msLibDesc.NumExports = _countof(msExportDescs);
+		msLibDesc.pExports = msExportDescs;
 
 		D3D12_STATE_SUBOBJECT ms = {};
 		ms.Type = D3D12_STATE_SUBOBJECT_TYPE_DXIL_LIBRARY;
@@ -1543,7 +1813,7 @@ static void CreateRTPipelineStateObject(DeviceResources& dr, AppResources& ar, R
 	{
 		
 		D3D12_RAYTRACING_SHADER_CONFIG shaderDesc = {};
-		shaderDesc.MaxPayloadSizeInBytes = sizeof(XMFLOAT4);	// RGB + HitT
+		shaderDesc.MaxPayloadSizeInBytes = sizeof(XMFLOAT4) + sizeof(XMFLOAT2);	// RGB + HitT, light sample
 		shaderDesc.MaxAttributeSizeInBytes = sizeof(XMFLOAT2); //bary
 
 		D3D12_STATE_SUBOBJECT shaderConfigObject = {};
@@ -1551,7 +1821,7 @@ static void CreateRTPipelineStateObject(DeviceResources& dr, AppResources& ar, R
 		shaderConfigObject.pDesc = &shaderDesc;
 		subobjects[index++] = shaderConfigObject;
 
-		const WCHAR* shaderExports[] = { L"RayGen_12", L"Miss_5", L"HitGroup" };
+		const WCHAR* shaderExports[] = { L"RayGen_12", L"Miss_5", L"ShadowMiss_6", L"HitGroup" };
 
 		// Add a state subobject for the association between shaders and the payload
 		D3D12_SUBOBJECT_TO_EXPORTS_ASSOCIATION shaderPayloadAssociation = {};
@@ -1573,7 +1843,7 @@ static void CreateRTPipelineStateObject(DeviceResources& dr, AppResources& ar, R
 		rayGenRootSigObject.pDesc = &rt.rayGenProg.pRootSignature;
 		subobjects[index++] = rayGenRootSigObject;
 
-		const WCHAR* rootSigExports[] = { L"RayGen_12", L"HitGroup", L"Miss_5" };
+		const WCHAR* rootSigExports[] = { L"RayGen_12", L"HitGroup", L"Miss_5", L"ShadowMiss_6" };
 		D3D12_SUBOBJECT_TO_EXPORTS_ASSOCIATION rayGenShaderRootSigAssociation = {};
 		rayGenShaderRootSigAssociation.NumExports = _countof(rootSigExports);
 		rayGenShaderRootSigAssociation.pExports = rootSigExports;
@@ -1596,7 +1866,7 @@ static void CreateRTPipelineStateObject(DeviceResources& dr, AppResources& ar, R
 	//Ray tracing config max depth etc
 	{
 		D3D12_RAYTRACING_PIPELINE_CONFIG pipelineConfig = {};
-		pipelineConfig.MaxTraceRecursionDepth = 1;
+		pipelineConfig.MaxTraceRecursionDepth = 2;		// ClosestHit traces the shadow ray
 
 		D3D12_STATE_SUBOBJECT pipelineConfigObject = {};
 		pipelineConfigObject.Type = D3D12_STATE_SUBOBJECT_TYPE_RAYTRACING_PIPELINE_CONFIG;
@@ -1627,7 +1897,9 @@ static void CreateShaderTable(DeviceResources& dr, AppResources& ar, RayTracingR
 	The Shader Table layout is as follows:
 		Entry 0 - Ray Generation shader
 		Entry 1 - Miss shader
-		Entry 2 - Closest Hit shader
+		Entry 2 - Shadow Miss shader (miss index 1)
+		Entry 3 - Closest Hit shader
+	once per frame in flight, the copies differ only in the descriptor table their records point at.
 	All shader records in the Shader Table must have the same size, so shader record size will be based on the largest required entry.
 	The ray generation program requires the largest entry: 
 		32 bytes - D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES 
@@ -1643,8 +1915,8 @@ static void CreateShaderTable(DeviceResources& dr, AppResources& ar, RayTracingR
 	rt.shaderTableRecordSize += 8;							// CBV/SRV/UAV descriptor table
 	rt.shaderTableRecordSize = ALIGN(D3D12_RAYTRACING_SHADER_RECORD_BYTE_ALIGNMENT, rt.shaderTableRecordSize);
 
-	shaderTableSize = (rt.shaderTableRecordSize * 3);		// 3 shader records in the table
-	shaderTableSize = ALIGN(D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT, shaderTableSize);
+	rt.shaderTableFrameSize = ALIGN(D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT, rt.shaderTableRecordSize * 4);	// 4 shader records per frame
+	shaderTableSize = rt.shaderTableFrameSize * gFrameCount;
 
 
 	UINT64 buffSize = shaderTableSize;
@@ -1657,21 +1929,33 @@ static void CreateShaderTable(DeviceResources& dr, AppResources& ar, RayTracingR
 	rt.shaderTable->SetName(L"DXR Shader Table");
 #endif
 
-	uint8_t* pData;
-	ThrowIfFailed(rt.shaderTable->Map(0, nullptr, (void**)&pData), L"Failed to map shader table buffer");
-
-	//Record 0 : Ray gen Id and heap pointer
-	memcpy(pData, rt.rtpsoInfo->GetShaderIdentifier(L"RayGen_12"), shaderIdSize);
-	*reinterpret_cast<D3D12_GPU_DESCRIPTOR_HANDLE*>(pData + shaderIdSize) = ar.descriptorHeap->GetGPUDescriptorHandleForHeapStart();
-	pData += rt.shaderTableRecordSize;
-	
-	//Record 1 : Miss shader id
-	memcpy(pData, rt.rtpsoInfo->GetShaderIdentifier(L"Miss_5"), shaderIdSize);
-	pData += rt.shaderTableRecordSize;
+	uint8_t* pMapped;
+	ThrowIfFailed(rt.shaderTable->Map(0, nullptr, (void**)&pMapped), L"Failed to map shader table buffer");
 
-	//Record 2 : HitGroup id and heap pointer
-	memcpy(pData, rt.rtpsoInfo->GetShaderIdentifier(L"HitGroup"), shaderIdSize);
-	*reinterpret_cast<D3D12_GPU_DESCRIPTOR_HANDLE*>(pData + shaderIdSize) = ar.descriptorHeap->GetGPUDescriptorHandleForHeapStart();
+	const UINT handleIncrement = dr.device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+	for (UINT frame = 0; frame < gFrameCount; frame++)
+	{
+		uint8_t* pData = pMapped + frame * rt.shaderTableFrameSize;
+		D3D12_GPU_DESCRIPTOR_HANDLE table = ar.descriptorHeap->GetGPUDescriptorHandleForHeapStart();
+		table.ptr += frame * ar.descriptorTableSize * handleIncrement;
+
+		//Record 0 : Ray gen Id and this frame's descriptor table
+		memcpy(pData, rt.rtpsoInfo->GetShaderIdentifier(L"RayGen_12"), shaderIdSize);
+		*reinterpret_cast<D3D12_GPU_DESCRIPTOR_HANDLE*>(pData + shaderIdSize) = table;
+		pData += rt.shaderTableRecordSize;
+
+		//Record 1 : Miss shader id
+		memcpy(pData, rt.rtpsoInfo->GetShaderIdentifier(L"Miss_5"), shaderIdSize);
+		pData += rt.shaderTableRecordSize;
+
+		//Record 2 : Shadow miss shader id
+		memcpy(pData, rt.rtpsoInfo->GetShaderIdentifier(L"ShadowMiss_6"), shaderIdSize);
+		pData += rt.shaderTableRecordSize;
+
+		//Record 3 : HitGroup id and this frame's descriptor table
+		memcpy(pData, rt.rtpsoInfo->GetShaderIdentifier(L"HitGroup"), shaderIdSize);
+		*reinterpret_cast<D3D12_GPU_DESCRIPTOR_HANDLE*>(pData + shaderIdSize) = table;
+	}
 
 	rt.shaderTable->Unmap(0, nullptr);
 }
@@ -1726,16 +2010,17 @@ static void BuildCommandList(DeviceResources& dr, AppResources& ar, RayTracingRe
 	ID3D12DescriptorHeap* ppHeaps[] = { ar.descriptorHeap };
 	dr.cmdList[0]->SetDescriptorHeaps(_countof(ppHeaps), ppHeaps);
 	
-	// Dispatch rays
+	// Dispatch rays, with this frame's copy of the shader records
+	const D3D12_GPU_VIRTUAL_ADDRESS shaderTable = rt.shaderTable->GetGPUVirtualAddress() + dr.frameIndex * rt.shaderTableFrameSize;
 	D3D12_DISPATCH_RAYS_DESC desc = {};
-	desc.RayGenerationShaderRecord.StartAddress = rt.shaderTable->GetGPUVirtualAddress();
+	desc.RayGenerationShaderRecord.StartAddress = shaderTable;
 	desc.RayGenerationShaderRecord.SizeInBytes = rt.shaderTableRecordSize;
 
-	desc.MissShaderTable.StartAddress = rt.shaderTable->GetGPUVirtualAddress() + rt.shaderTableRecordSize;
-	desc.MissShaderTable.SizeInBytes = rt.shaderTableRecordSize;		// Only a single Miss program entry
+	desc.MissShaderTable.StartAddress = shaderTable + rt.shaderTableRecordSize;
+	desc.MissShaderTable.SizeInBytes = rt.shaderTableRecordSize * 2;	// Miss and ShadowMiss
 	desc.MissShaderTable.StrideInBytes = rt.shaderTableRecordSize;
 
-	desc.HitGroupTable.StartAddress = rt.shaderTable->GetGPUVirtualAddress() + (rt.shaderTableRecordSize * 2);
+	desc.HitGroupTable.StartAddress = shaderTable + (rt.shaderTableRecordSize * 3);
 	desc.HitGroupTable.SizeInBytes = rt.shaderTableRecordSize;			// Only a single Hit program entry
 	desc.HitGroupTable.StrideInBytes = rt.shaderTableRecordSize;
 
@@ -1772,6 +2057,20 @@ static void BuildCommandList(DeviceResources& dr, AppResources& ar, RayTracingRe
  ------------------------------Function Definitions------------------------------------
 */
 
+/*
+ One ray per pixel through its center and the point light by default. The sampling demo (gAppState.samplingDemo) takes
+ 4 jittered camera rays per pixel and soft shadows from a square light, blue noise keeps the error of so few samples
+ at high frequencies.
+*/
+static void SetSampling(SceneConstantBuffer& scene)
+{
+	const bool demo = gAppState.samplingDemo;
+	scene.samplesPerPixel = demo ? 4 : 1;
+	scene.sampler = demo ? CpuRt::gSamplerBlueNoise : CpuRt::gSamplerCenter;
+	scene.samplerSeed = 0;
+	scene.lightSize = demo ? 0.25f : 0.0f;
+}
+
 void Application::InitializeSceneParams()
 {
 	auto frameIndex = dr.frameIndex;
@@ -1815,6 +2114,9 @@ void Application::InitializeSceneParams()
         ar.sceneParams[frameIndex].lightDiffuseColor = XMLoadFloat4(&lightDiffuseColor);
     }
 
+	// Setup sampling
+	SetSampling(ar.sceneParams[frameIndex]);
+
 	for (auto& sceneCB : ar.sceneParams)
     {
         sceneCB = ar.sceneParams[frameIndex];
@@ -1896,7 +2198,10 @@ void Application::Init(UINT width, UINT height, BOOL vsync, std::string meshFile
 	CreateRTVBackbuffers(dr, ar);
 	CreateVertexBuffer(dr, ar, *this);
 	CreateIndexBuffer(dr, ar, *this);
-	//CreateTexture(dr, ar, *this);
+	CreateBlueNoiseBuffer(dr, ar);
+	// The streamed mip chain when a texture pack was built (kepler-headless pack), the loose image otherwise
+	if (std::filesystem::exists(gTexturePackPath)) CreateTextureFromPack(dr, ar, *this, gTexturePackPath);
+	else CreateTexture(dr, ar, *this);
 	CreateSceneParamsConstBuffer(dr, ar);
 	CreateCubeParamsConstBuffer(dr, ar, *this);
 
@@ -1923,6 +2228,9 @@ void Application::Init(UINT width, UINT height, BOOL vsync, std::string meshFile
 
 void Application::Render()
 {
+	StreamTextureMips(dr, ar);
+	if (ar.textureSRVMinLod[dr.frameIndex] != ar.textureMinLod) CreateTextureSRV(dr, ar, dr.frameIndex);
+	if (rt.blasDirty) UpdateAccelerationStructures(dr, ar, *this, rt);
 	BuildCommandList(dr, ar, rt);
 	Present(dr);
 	MoveToNextFrame(dr);
@@ -1956,6 +2264,27 @@ void Application::Update()
         const XMVECTOR& prevLightPosition =  ar.sceneParams[prevFrameIndex].lightPosition;
         ar.sceneParams[frameIndex].lightPosition = XMVector3Transform(prevLightPosition, rotate);
     }
+
+	SetSampling(ar.sceneParams[frameIndex]);
+
+	// Twist the mesh about the Y axis, back and forth every 6 seconds, the BLAS is refit to it
+	if (gMeshTwist != 0.0f)
+	{
+		const float twist = gMeshTwist * sinf(XM_2PI * static_cast<float>(ar.timer.GetTotalSeconds()) / 6.0f);
+		for (size_t i = 0; i < mesh.vertices.size(); i++)
+		{
+			const Vertex& rest = ar.restVertices[i];
+			const XMMATRIX rotate = XMMatrixRotationY(twist * rest.position.y);
+			XMStoreFloat3(&mesh.vertices[i].position, XMVector3TransformCoord(XMLoadFloat3(&rest.position), rotate));
+
+			// Normals take the inverse transpose of the twist's Jacobian J = R (I + twist a e_y^T), a = (z, 0, -x):
+			// J^-T = R (I - twist e_y a^T), a shear of the rest normal's y before the rotation (det J = 1)
+			const float shear = twist * (rest.position.z * rest.normal.x - rest.position.x * rest.normal.z);
+			const XMVECTOR normal = XMVectorSet(rest.normal.x, rest.normal.y - shear, rest.normal.z, 0.0f);
+			XMStoreFloat3(&mesh.vertices[i].normal, XMVector3Normalize(XMVector3TransformNormal(normal, rotate)));
+		}
+		UpdateVertexBuffer(dr, ar, *this, rt);
+	}
 }
 
 LRESULT CALLBACK WindowProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) 
@@ -1969,6 +2298,7 @@ LRESULT CALLBACK WindowProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lPara
             break;
 		case WM_KEYUP:
 			if (wParam == VK_ESCAPE) PostQuitMessage(0);
+			if (wParam == 'S') gAppState.samplingDemo = !gAppState.samplingDemo;
 			break;
         case WM_DESTROY:
             PostQuitMessage( 0 );
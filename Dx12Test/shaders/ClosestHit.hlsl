@@ -22,9 +22,17 @@ void ClosestHit(inout HitInfo payload, in BuiltInTriangleIntersectionAttributes
         Vertices[indices[2]].normal 
     };
 
-	float3 triangleNormal = HitAttribute(vertexNormals, attrib);
+	float3 triangleNormal = HitAttribute(vertexNormals, attrib.barycentrics);
+	triangleNormal = normalize(mul(triangleNormal, (float3x3)WorldToObject3x4()));	// inverse transpose, instances may scale non-uniformly
 
-    float4 diffuseColor = CalculateDiffuseLighting(hitPosition, triangleNormal);
-    float4 color = g_sceneCB.lightAmbientColor + diffuseColor;
-    payload.ShadedColorAndHitT = color; //float4(color.rgb, RayTCurrent());
+    float4 diffuseColor = CalculateDiffuseLighting(g_sceneCB, hitPosition, triangleNormal);
+
+    // Only surfaces facing the light need to know whether it is blocked, towards the point of RayGen's light sample
+    float lightVisibility = 1.0f;
+    if (any(diffuseColor.rgb > 0.0f) && TraceShadowRay(hitPosition, LightSamplePosition(g_sceneCB, payload.lightSample.x, payload.lightSample.y)))
+    {
+        lightVisibility = 0.0f;
+    }
+
+    payload.ShadedColorAndHitT = CombineLighting(g_sceneCB, diffuseColor, lightVisibility);
 }
\ No newline at end of file
@@ -1,39 +1,24 @@
 
-typedef float3 XMFLOAT3;
-typedef float4 XMFLOAT4;
-typedef float4 XMVECTOR;
-typedef float4x4 XMMATRIX;
-typedef uint UINT;
+// SceneConstantBuffer, CubeConstantBuffer, Vertex and the shading math, shared with the app and the CPU tracer
+#include "Shading.h"
+
+// Pixel jitter and light sample generators, shared with the CPU tracer
+#include "Sampling.h"
 
-//ToDo put this in common head between app and shader
 struct HitInfo
 {
 	float4 ShadedColorAndHitT;
+	float2 lightSample;			// RayGen's light sample for the shadow ray of ClosestHit
 };
 
-struct Attributes 
-{
-	float2 uv;
-};
-
-struct SceneConstantBuffer
-{
-    float4x4 projectionToWorld;
-    float4 cameraPosition;
-    float4 lightPosition;
-    float4 lightAmbientColor;
-    float4 lightDiffuseColor;
-};
-
-struct CubeConstantBuffer
+struct ShadowHitInfo
 {
-    XMFLOAT4 albedo;
+	bool isOccluded;
 };
 
-struct Vertex
+struct Attributes 
 {
-    XMFLOAT3 position;
-    XMFLOAT3 normal;
+	float2 uv;
 };
 
 // ---[ Resources ]---
@@ -41,6 +26,8 @@ RWTexture2D<float4> RTOutput				: register(u0);
 RaytracingAccelerationStructure SceneBVH	: register(t0, space0);
 ByteAddressBuffer Indices					: register(t1, space0);
 StructuredBuffer<Vertex> Vertices			: register(t2, space0);
+StructuredBuffer<uint> BlueNoise			: register(t3, space0);		// gBlueNoiseTileSize^2 rotations, row major
+Texture2D<float4> MaterialTexture			: register(t4, space0);		// ResourceMinLODClamp follows the mips streamed in so far
 
 // ---[ Constant Buffers ]---
 ConstantBuffer<SceneConstantBuffer> g_sceneCB : register(b0, space1);
@@ -49,36 +36,49 @@ ConstantBuffer<CubeConstantBuffer> g_cubeCB : register(b1, space1);
 // ---[ Helper Functions ]---
 
 
-inline void GenerateCameraRay(uint2 index, out float3 origin, out float3 direction)
+// 'jitter' in [0, 1)^2 is the sample position in the pixel, (0.5, 0.5) its center
+inline void GenerateCameraRay(uint2 index, float2 jitter, out float3 origin, out float3 direction)
 {
-    float2 xy = index + 0.5f; // center in the middle of the pixel.
-    float2 screenPos = xy / DispatchRaysDimensions().xy * 2.0 - 1.0;
-
-    // Invert Y for DirectX-style coordinates.
-    screenPos.y = -screenPos.y;
-
-    // Unproject the pixel coordinate into a ray.
-    float4 world = mul(g_sceneCB.projectionToWorld, float4(screenPos, 0, 1));
-
-    world.xyz /= world.w;
     origin = g_sceneCB.cameraPosition.xyz;
-    direction = normalize(world.xyz - origin);
+    direction = CameraRayDirection(g_sceneCB, index.x + jitter.x - 0.5f, index.y + jitter.y - 0.5f, DispatchRaysDimensions().x, DispatchRaysDimensions().y);
 }
 
-float3 HitAttribute(float3 vertexAttribute[3], BuiltInTriangleIntersectionAttributes attr)
+// Dimension 'dimension' of sample 'sampleIndex' of this pixel from the sampler g_sceneCB.sampler picks
+float PixelSample(uint pixelSeed, uint sampleIndex, uint dimension)
 {
-    return vertexAttribute[0] +
-        attr.barycentrics.x * (vertexAttribute[1] - vertexAttribute[0]) +
-        attr.barycentrics.y * (vertexAttribute[2] - vertexAttribute[0]);
+    uint2 index = DispatchRaysIndex().xy;
+    uint blueNoise = 0;
+    if (g_sceneCB.sampler == gSamplerBlueNoise) blueNoise = BlueNoise[BlueNoiseTexel(index.x, index.y, dimension)];
+    return PixelSampleDimension(g_sceneCB.sampler, pixelSeed, sampleIndex, dimension, blueNoise);
 }
 
-float4 CalculateDiffuseLighting(float3 hitPosition, float3 normal)
+// Occlusion query towards 'target': the first hit ends the search and no closest hit shader runs, only ShadowMiss
+// (miss index 1) touches the payload
+bool TraceShadowRay(float3 origin, float3 target)
 {
-    float3 pixelToLight = normalize(g_sceneCB.lightPosition.xyz - hitPosition);
-
-    float fNDotL = max(0.0f, dot(pixelToLight, normal));
-
-    return float4(1.0f, 1.0f, 1.0f, 1.0f) * g_sceneCB.lightDiffuseColor * fNDotL;
+    float3 toTarget = target - origin;
+    float distance = length(toTarget);
+
+    RayDesc ray;
+    ray.Origin = origin;
+    ray.Direction = toTarget / distance;
+    ray.TMin = 0.001f;
+    ray.TMax = distance;
+
+    ShadowHitInfo payload;
+    payload.isOccluded = true;
+
+    TraceRay(
+        SceneBVH,
+        RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH | RAY_FLAG_SKIP_CLOSEST_HIT_SHADER | RAY_FLAG_FORCE_OPAQUE,
+        ~0,
+        0,
+        1,
+        1,
+        ray,
+        payload);
+
+    return payload.isOccluded;
 }
 
 float3 HitWorldPosition()
@@ -6,4 +6,10 @@
 void Miss(inout HitInfo payload)
 {
     payload.ShadedColorAndHitT = float4(0.0f, 0.2f, 0.4f, 1.0f);
-}
\ No newline at end of file
+}
+
+[shader("miss")]
+void ShadowMiss(inout ShadowHitInfo payload)
+{
+    payload.isOccluded = false;
+}
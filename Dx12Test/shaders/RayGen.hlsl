@@ -5,31 +5,43 @@
 [shader("raygeneration")]
 void RayGen()
 {
-	float3 rayDir;
-    float3 origin;
-    
-    GenerateCameraRay(DispatchRaysIndex().xy, origin, rayDir);
-	
-	// Setup the ray
-	RayDesc ray;
-	ray.Origin = origin;
-	ray.Direction = rayDir;
-	ray.TMin = 0.001f;
-	ray.TMax = 10000.f;	
-
-	// Trace the ray
-	HitInfo payload;
-	payload.ShadedColorAndHitT = float4(0.f, 0.f, 0.f, 0.f);
-
-	TraceRay(
-		SceneBVH,
-		RAY_FLAG_CULL_BACK_FACING_TRIANGLES,
-		~0,
-		0,
-		1,
-		0,
-		ray,
-		payload);
-
-	RTOutput[DispatchRaysIndex().xy] = payload.ShadedColorAndHitT; //float4(payload.ShadedColorAndHitT.rgb, 1.f);
+	uint2 index = DispatchRaysIndex().xy;
+	uint samples = max(1u, g_sceneCB.samplesPerPixel);
+	uint pixelSeed = PixelSeed(g_sceneCB.samplerSeed, index.x, index.y);
+	float4 color = float4(0.f, 0.f, 0.f, 0.f);
+
+	for (uint sampleIndex = 0; sampleIndex < samples; sampleIndex++)
+	{
+		float3 rayDir;
+		float3 origin;
+
+		float2 jitter = float2(PixelSample(pixelSeed, sampleIndex, 0), PixelSample(pixelSeed, sampleIndex, 1));
+		GenerateCameraRay(index, jitter, origin, rayDir);
+
+		// Setup the ray
+		RayDesc ray;
+		ray.Origin = origin;
+		ray.Direction = rayDir;
+		ray.TMin = 0.001f;
+		ray.TMax = 10000.f;
+
+		// Trace the ray
+		HitInfo payload;
+		payload.ShadedColorAndHitT = float4(0.f, 0.f, 0.f, 0.f);
+		payload.lightSample = float2(PixelSample(pixelSeed, sampleIndex, 2), PixelSample(pixelSeed, sampleIndex, 3));
+
+		TraceRay(
+			SceneBVH,
+			RAY_FLAG_CULL_BACK_FACING_TRIANGLES,
+			~0,
+			0,
+			1,
+			0,
+			ray,
+			payload);
+
+		color += payload.ShadedColorAndHitT;
+	}
+
+	RTOutput[index] = color * (1.0f / float(samples));
 }
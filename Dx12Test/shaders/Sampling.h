@@ -0,0 +1,168 @@
+/*
+ ------------------------------Shared Sampling------------------------------------
+ Sample generators for pixel jitter and light samples, written once for RayGen.hlsl and the CPU tracer
+ (CpuSampling.h) like Shading.h, in the same language subset plus 'reversebits' (CpuSampling.h provides it in C++).
+ All integer arithmetic, a sample is a 32 bit fixed point fraction until ToUnitFloat, so both sides produce the
+ same bits. Samplers, SceneConstantBuffer::sampler:
+	gSamplerCenter      the pixel center and the light center, the one sample the shaders took before
+	gSamplerRandom      PCG hash per (pixel, sample, dimension), white noise: the baseline
+	gSamplerSobol       Owen scrambled Sobol (Burley 2020, "Practical Hash-based Owen Scrambling"): the sample order
+	                    is shuffled and every dimension scrambled per pixel, the first 2^k samples of any two
+	                    dimensions stay stratified into 2^k elementary intervals of every shape
+	gSamplerLattice     rank-1 lattice sequence (radical inverse of the index times a generating vector, Cools, Kuo &
+	                    Nuyens 2006), Cranley-Patterson rotated by a hash of the pixel
+	gSamplerBlueNoise   the same lattice rotated by a 64x64 blue noise tile (Ulichney 1993, void and cluster) instead,
+	                    neighbouring pixels get rotations far apart, so error at low sample counts is high frequency
+ Dimensions: 0, 1 pixel jitter, 2, 3 light sample. Tables are literals because HLSL has no constant evaluation,
+ CpuSampling.h checks gSobolDirections against the direction numbers at compile time and generates the blue noise
+ tile, which main.cpp uploads for RayGen.hlsl.
+
+ Include after Shading.h (UINT). No include guard, the functions are only compiled by dxc and where SHADING_CPU is
+ defined.
+*/
+
+#if !defined(__cplusplus) || defined(SHADING_CPU)
+
+#ifdef __cplusplus
+#define SAMPLING_FN inline
+#define SAMPLING_TABLE constexpr
+#else
+#define SAMPLING_FN
+#define SAMPLING_TABLE static const
+#endif
+
+SAMPLING_TABLE UINT gSamplerCenter = 0;
+SAMPLING_TABLE UINT gSamplerRandom = 1;
+SAMPLING_TABLE UINT gSamplerSobol = 2;
+SAMPLING_TABLE UINT gSamplerLattice = 3;
+SAMPLING_TABLE UINT gSamplerBlueNoise = 4;
+
+SAMPLING_TABLE UINT gSamplingDimensions = 4;
+SAMPLING_TABLE UINT gBlueNoiseTileSize = 64;
+
+// Joe & Kuo 2008 direction numbers (new-joe-kuo-6.21201), 32 per dimension, bit 31 is the first
+SAMPLING_TABLE UINT gSobolDirections[128] =
+{
+	// dimension 0: van der Corput
+	0x80000000u, 0x40000000u, 0x20000000u, 0x10000000u, 0x08000000u, 0x04000000u, 0x02000000u, 0x01000000u,
+	0x00800000u, 0x00400000u, 0x00200000u, 0x00100000u, 0x00080000u, 0x00040000u, 0x00020000u, 0x00010000u,
+	0x00008000u, 0x00004000u, 0x00002000u, 0x00001000u, 0x00000800u, 0x00000400u, 0x00000200u, 0x00000100u,
+	0x00000080u, 0x00000040u, 0x00000020u, 0x00000010u, 0x00000008u, 0x00000004u, 0x00000002u, 0x00000001u,
+	// dimension 1: x + 1
+	0x80000000u, 0xc0000000u, 0xa0000000u, 0xf0000000u, 0x88000000u, 0xcc000000u, 0xaa000000u, 0xff000000u,
+	0x80800000u, 0xc0c00000u, 0xa0a00000u, 0xf0f00000u, 0x88880000u, 0xcccc0000u, 0xaaaa0000u, 0xffff0000u,
+	0x80008000u, 0xc000c000u, 0xa000a000u, 0xf000f000u, 0x88008800u, 0xcc00cc00u, 0xaa00aa00u, 0xff00ff00u,
+	0x80808080u, 0xc0c0c0c0u, 0xa0a0a0a0u, 0xf0f0f0f0u, 0x88888888u, 0xccccccccu, 0xaaaaaaaau, 0xffffffffu,
+	// dimension 2: x^2 + x + 1
+	0x80000000u, 0xc0000000u, 0x60000000u, 0x90000000u, 0xe8000000u, 0x5c000000u, 0x8e000000u, 0xc5000000u,
+	0x68800000u, 0x9cc00000u, 0xee600000u, 0x55900000u, 0x80680000u, 0xc09c0000u, 0x60ee0000u, 0x90550000u,
+	0xe8808000u, 0x5cc0c000u, 0x8e606000u, 0xc5909000u, 0x6868e800u, 0x9c9c5c00u, 0xeeee8e00u, 0x5555c500u,
+	0x8000e880u, 0xc0005cc0u, 0x60008e60u, 0x9000c590u, 0xe8006868u, 0x5c009c9cu, 0x8e00eeeeu, 0xc5005555u,
+	// dimension 3: x^3 + x + 1
+	0x80000000u, 0xc0000000u, 0x20000000u, 0x50000000u, 0xf8000000u, 0x74000000u, 0xa2000000u, 0x93000000u,
+	0xd8800000u, 0x25400000u, 0x59e00000u, 0xe6d00000u, 0x78080000u, 0xb40c0000u, 0x82020000u, 0xc3050000u,
+	0x208f8000u, 0x51474000u, 0xfbea2000u, 0x75d93000u, 0xa0858800u, 0x914e5400u, 0xdbe79e00u, 0x25db6d00u,
+	0x58800080u, 0xe54000c0u, 0x79e00020u, 0xb6d00050u, 0x800800f8u, 0xc00c0074u, 0x200200a2u, 0x50050093u
+};
+
+// Generating vector of an extensible rank-1 lattice in base 2 (lattice-39102-1024-1048576.3600, Cools, Kuo & Nuyens)
+SAMPLING_TABLE UINT gLatticeGenerator[4] = { 1u, 182667u, 469891u, 498753u };
+
+// Jarzynski & Olano 2020, "Hash Functions for GPU Rendering": PCG as a hash
+SAMPLING_FN UINT SamplingHash(UINT v)
+{
+	UINT state = v * 747796405u + 2891336453u;
+	UINT word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+SAMPLING_FN UINT HashCombine(UINT seed, UINT v)
+{
+	return SamplingHash(seed + SamplingHash(v));
+}
+
+// Seed of pixel (x, y), 'seed' is SceneConstantBuffer::samplerSeed
+SAMPLING_FN UINT PixelSeed(UINT seed, UINT x, UINT y)
+{
+	return HashCombine(HashCombine(seed, x), y);
+}
+
+// [0, 1) from a 32 bit fraction, the 24 bits a float holds
+SAMPLING_FN float ToUnitFloat(UINT x)
+{
+	return float(x >> 8u) * (1.0f / 16777216.0f);
+}
+
+// Dimension 'dimension' of Sobol point 'index', as a 32 bit fraction
+SAMPLING_FN UINT SobolSample(UINT index, UINT dimension)
+{
+	UINT x = 0u;
+	for (UINT bit = 0u; index != 0u; bit++)
+	{
+		if ((index & 1u) != 0u) x ^= gSobolDirections[dimension * 32u + bit];
+		index >>= 1u;
+	}
+	return x;
+}
+
+// Burley 2020: a hash in which every bit only depends on itself and the bits below, on the reversed fraction that
+// flips each bit depending on the bits above it, which is Owen's nested uniform scramble
+SAMPLING_FN UINT LaineKarrasPermutation(UINT x, UINT seed)
+{
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+SAMPLING_FN UINT NestedUniformScramble(UINT x, UINT seed)
+{
+	return reversebits(LaineKarrasPermutation(reversebits(x), seed));
+}
+
+// Dimension 'dimension' of lattice point 'index': frac(radical inverse(index) * generator), exact in 32 bit
+// fixed point
+SAMPLING_FN UINT LatticeSample(UINT index, UINT dimension)
+{
+	return reversebits(index) * gLatticeGenerator[dimension];
+}
+
+// Toroidal offsets per dimension, so the dimensions of a pixel read different blue noise texels
+SAMPLING_FN UINT BlueNoiseTexel(UINT x, UINT y, UINT dimension)
+{
+	UINT mask = gBlueNoiseTileSize - 1u;
+	return ((y + dimension * 41u) & mask) * gBlueNoiseTileSize + ((x + dimension * 23u) & mask);
+}
+
+/*
+ Dimension 'dimension' of sample 'sampleIndex' of the pixel with PixelSeed 'pixelSeed', in [0, 1). 'blueNoise' is
+ the pixel's blue noise tile texel BlueNoiseTexel(x, y, dimension), only read by gSamplerBlueNoise.
+*/
+SAMPLING_FN float PixelSampleDimension(UINT sampler, UINT pixelSeed, UINT sampleIndex, UINT dimension, UINT blueNoise)
+{
+	if (sampler == gSamplerRandom)
+	{
+		return ToUnitFloat(HashCombine(HashCombine(pixelSeed, sampleIndex), dimension));
+	}
+	if (sampler == gSamplerSobol)
+	{
+		UINT index = NestedUniformScramble(sampleIndex, pixelSeed);
+		return ToUnitFloat(NestedUniformScramble(SobolSample(index, dimension), HashCombine(pixelSeed, dimension)));
+	}
+	if (sampler == gSamplerLattice)
+	{
+		return ToUnitFloat(LatticeSample(sampleIndex, dimension) + HashCombine(pixelSeed, dimension));
+	}
+	if (sampler == gSamplerBlueNoise)
+	{
+		return ToUnitFloat(LatticeSample(sampleIndex, dimension) + blueNoise);
+	}
+	return 0.5f;
+}
+
+#undef SAMPLING_FN
+#undef SAMPLING_TABLE
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ ------------------------------Shared Shading------------------------------------
+ Layouts and shading math written once for both sides: dxc compiles it through Common.hlsl, the app (main.cpp)
+ takes the constant buffer and vertex layouts from it, and the CPU ray tracer (CpuShading.h) the layouts and the
+ functions, so CPU renders run the shaders' arithmetic instead of a copy that drifts.
+
+ Written in the subset both languages share:
+	XM* types          HLSL typedefs below, DirectXMath in the app, the CpuMath.h types on the CPU path
+	REAL, REAL2..4     float..float4 in HLSL. In C++ the functions are templates over 'real', one float (the
+	                   scalar tracer) or SimdFloat<W> (W hits per call, every component a SIMD register)
+	MAKE_REAL3/4       float3(...) / float4(...), constants and constant buffer values go to all lanes
+	SHADING_IN(T)      read-only struct argument, 'in T' / 'const T&'
+ No swizzles, no out parameters, no intrinsics besides dot, normalize, max and mul. C++ callers name 'real'
+ explicitly, e.g. CalculateDiffuseLighting<float>(...).
+
+ No include guard: main.cpp includes it at global scope and CpuScene.h inside namespace CpuRt. The functions
+ are only compiled by dxc and where SHADING_CPU is defined (CpuShading.h provides the types they need).
+*/
+
+#ifndef __cplusplus
+typedef float3 XMFLOAT3;
+typedef float4 XMFLOAT4;
+typedef float4 XMVECTOR;
+typedef float4x4 XMMATRIX;
+typedef uint UINT;
+#endif
+
+struct SceneConstantBuffer
+{
+	XMMATRIX projectionToWorld;
+	XMVECTOR cameraPosition;
+	XMVECTOR lightPosition;
+	XMVECTOR lightAmbientColor;
+	XMVECTOR lightDiffuseColor;
+	UINT samplesPerPixel;		// camera rays per pixel, averaged, 0 is 1
+	UINT sampler;				// gSamplerCenter, ... (Sampling.h)
+	UINT samplerSeed;			// scrambles and rotations per pixel derive from it
+	float lightSize;			// half size of the square light, 0 is the point light with hard shadows
+};
+
+struct CubeConstantBuffer
+{
+	XMFLOAT4 albedo;
+};
+
+struct Vertex
+{
+	XMFLOAT3 position;
+	XMFLOAT3 normal;
+};
+
+#if !defined(__cplusplus) || defined(SHADING_CPU)
+
+#ifdef __cplusplus
+#define SHADING_FN template<typename real> inline
+#define SHADING_IN(type) const type&
+#define REAL real
+#define REAL2 typename ShadingTypes<real>::Float2
+#define REAL3 typename ShadingTypes<real>::Float3
+#define REAL4 typename ShadingTypes<real>::Float4
+#define MAKE_REAL3(x, y, z) REAL3{ Lanes<real>::From(x), Lanes<real>::From(y), Lanes<real>::From(z) }
+#define MAKE_REAL4(x, y, z, w) REAL4{ Lanes<real>::From(x), Lanes<real>::From(y), Lanes<real>::From(z), Lanes<real>::From(w) }
+#else
+#define SHADING_FN
+#define SHADING_IN(type) in type
+#define REAL float
+#define REAL2 float2
+#define REAL3 float3
+#define REAL4 float4
+#define MAKE_REAL3(x, y, z) float3(x, y, z)
+#define MAKE_REAL4(x, y, z, w) float4(x, y, z, w)
+#endif
+
+// Direction of the camera ray through the center of pixel (x, y) of a width x height dispatch, it starts at
+// scene.cameraPosition
+SHADING_FN REAL3 CameraRayDirection(SHADING_IN(SceneConstantBuffer) scene, REAL x, REAL y, float width, float height)
+{
+	// center in the middle of the pixel
+	REAL screenX = (x + 0.5f) / width * 2.0f - 1.0f;
+	REAL screenY = (y + 0.5f) / height * 2.0f - 1.0f;
+
+	// Invert Y for DirectX-style coordinates
+	screenY = -screenY;
+
+	// Unproject the pixel coordinate into a ray, mul(projectionToWorld, v) in HLSL is v * XMMATRIX in C++
+	REAL4 world = mul(scene.projectionToWorld, MAKE_REAL4(screenX, screenY, 0.0f, 1.0f));
+
+	REAL3 worldPos = MAKE_REAL3(world.x, world.y, world.z) * (1.0f / world.w);
+	return normalize(worldPos - MAKE_REAL3(scene.cameraPosition.x, scene.cameraPosition.y, scene.cameraPosition.z));
+}
+
+// Vertex attribute at the hit, 'barycentrics' are the weights of vertex 1 and 2 (BuiltInTriangleIntersectionAttributes)
+SHADING_FN REAL3 HitAttribute(REAL3 vertexAttribute[3], REAL2 barycentrics)
+{
+	return vertexAttribute[0] +
+		barycentrics.x * (vertexAttribute[1] - vertexAttribute[0]) +
+		barycentrics.y * (vertexAttribute[2] - vertexAttribute[0]);
+}
+
+SHADING_FN REAL4 CalculateDiffuseLighting(SHADING_IN(SceneConstantBuffer) scene, REAL3 hitPosition, REAL3 normal)
+{
+	REAL3 pixelToLight = normalize(MAKE_REAL3(scene.lightPosition.x, scene.lightPosition.y, scene.lightPosition.z) - hitPosition);
+
+	REAL fNDotL = max(0.0f, dot(pixelToLight, normal));
+
+	return MAKE_REAL4(1.0f, 1.0f, 1.0f, 1.0f) *
+		MAKE_REAL4(scene.lightDiffuseColor.x, scene.lightDiffuseColor.y, scene.lightDiffuseColor.z, scene.lightDiffuseColor.w) * fNDotL;
+}
+
+// Where the shadow ray of light sample (u, v) in [0, 1)^2 goes: the light is a square of half size scene.lightSize
+// around lightPosition in the xz plane, the center for (0.5, 0.5)
+SHADING_FN REAL3 LightSamplePosition(SHADING_IN(SceneConstantBuffer) scene, REAL u, REAL v)
+{
+	return MAKE_REAL3((u * 2.0f - 1.0f) * scene.lightSize + scene.lightPosition.x, scene.lightPosition.y,
+		(v * 2.0f - 1.0f) * scene.lightSize + scene.lightPosition.z);
+}
+
+// Ambient plus the diffuse term, 'lightVisibility' is 0 where the shadow ray found an occluder and 1 elsewhere
+SHADING_FN REAL4 CombineLighting(SHADING_IN(SceneConstantBuffer) scene, REAL4 diffuseColor, REAL lightVisibility)
+{
+	return MAKE_REAL4(scene.lightAmbientColor.x, scene.lightAmbientColor.y, scene.lightAmbientColor.z, scene.lightAmbientColor.w) +
+		diffuseColor * lightVisibility;
+}
+
+#undef SHADING_FN
+#undef SHADING_IN
+#undef REAL
+#undef REAL2
+#undef REAL3
+#undef REAL4
+#undef MAKE_REAL3
+#undef MAKE_REAL4
+
+#endif